@@ -0,0 +1,922 @@
+#include "lex.h"
+#include "parse.h"
+#include "lower.h"
+#include "optimize.h"
+#include "code.h"
+#include "emit.h"
+#include "run.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct buffer {
+    size_t size, allocated;
+    uint8_t *data;
+};
+
+static void append(struct buffer *const buf, const char *const str)
+{
+    const size_t len = strlen(str);
+
+    if (buf->size + len > buf->allocated) {
+        buf->allocated = (buf->size + len) * 2;
+
+        if (!(buf->data = realloc(buf->data, buf->allocated))) {
+            perror("realloc"), exit(EXIT_FAILURE);
+        }
+    }
+
+    memcpy(buf->data + buf->size, str, len);
+    buf->size += len;
+}
+
+/* a script dominated by comment banners, indentation and string literals */
+static struct buffer comment_heavy(const size_t target_size)
+{
+    struct buffer buf = {0};
+
+    while (buf.size < target_size) {
+        append(&buf, "/*****************************************************\n");
+
+        for (int line = 0; line < 8; ++line) {
+            append(&buf, " * This block is generated, do not edit it by hand.\n");
+        }
+
+        append(&buf, " *****************************************************/\n");
+
+        for (int line = 0; line < 16; ++line) {
+            append(&buf, "                if (counter % 7 == 3) {\n");
+            append(&buf, "                    // a comment describing the line below\n");
+            append(&buf, "                    print \"the counter is now at \" counter;\n");
+            append(&buf, "                }\n");
+        }
+    }
+
+    return buf;
+}
+
+static void bench_lex(void)
+{
+    static const char *const names[] = {
+        [LEX_SCAN_NONE] = "none",
+        [LEX_SCAN_SCALAR] = "scalar",
+        [LEX_SCAN_SSE2] = "sse2",
+        [LEX_SCAN_AVX2] = "avx2",
+    };
+
+    const struct buffer buf = comment_heavy(64 << 20);
+
+    for (int level = LEX_SCAN_NONE; level <= LEX_SCAN_AVX2; ++level) {
+        if (lex_scan(level) != level) {
+            printf("lex/%-8s unsupported\n", names[level]);
+            continue;
+        }
+
+        struct tokens tokens;
+        const double start = now();
+
+        if (lex(buf.data, buf.size, 0, &tokens)) {
+            fputs("lex failed\n", stderr), exit(EXIT_FAILURE);
+        }
+
+        const double elapsed = now() - start;
+        destroy_tokens(&tokens);
+
+        printf("lex/%-8s %8.1f MB/s  (%zu bytes)\n", names[level],
+            buf.size / elapsed / 1e6, buf.size);
+    }
+
+    lex_scan(LEX_SCAN_AVX2);
+
+    for (size_t nthreads = 1; nthreads <= 16; nthreads *= 2) {
+        struct tokens tokens;
+        const double start = now();
+
+        if (lex_parallel(buf.data, buf.size, 0, nthreads, &tokens)) {
+            fputs("lex failed\n", stderr), exit(EXIT_FAILURE);
+        }
+
+        const double elapsed = now() - start;
+        destroy_tokens(&tokens);
+
+        printf("lex/-j%-6zu %8.1f MB/s\n", nthreads,
+            buf.size / elapsed / 1e6);
+    }
+
+    /* compare with a stream that keeps trivia in 24-byte pointer pairs */
+    struct tokens trivia, tokens;
+
+    if (lex(buf.data, buf.size, LEX_KEEP_TRIVIA, &trivia) ||
+        lex(buf.data, buf.size, 0, &tokens)) {
+        fputs("lex failed\n", stderr), exit(EXIT_FAILURE);
+    }
+
+    const size_t aos_bytes = trivia.size * 3 * sizeof(void *);
+    const size_t soa_bytes = tokens.size *
+        (sizeof(*tokens.tk) + sizeof(*tokens.beg) + sizeof(*tokens.len));
+
+    printf("lex/memory   %zu tokens in %.1f MB, %zu without trivia in "
+        "%.1f MB (%.1fx)\n", trivia.size, aos_bytes / 1e6, tokens.size,
+        soa_bytes / 1e6, (double) aos_bytes / soa_bytes);
+
+    destroy_tokens(&trivia);
+    destroy_tokens(&tokens);
+
+    free(buf.data);
+}
+
+static void appendf(struct buffer *const buf, const char *const fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void appendf(struct buffer *const buf, const char *const fmt, ...)
+{
+    char str[256];
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(str, sizeof(str), fmt, args);
+    va_end(args);
+
+    append(buf, str);
+}
+
+/* many short top-level statements, as in a long generated script */
+static struct buffer flat_program(const size_t target_size)
+{
+    struct buffer buf = {0};
+
+    for (int idx = 0; buf.size < target_size; ++idx) {
+        appendf(&buf, "a%d = (b + %d) * c[%d] - (d > 3 ? e : -f);\n",
+            idx % 97, idx, idx % 13);
+        appendf(&buf, "if (a%d < %d) { g = g + 1; } elif (g) { g = 0; } "
+            "else { print g; }\n", idx % 97, idx);
+        append(&buf, "do { h = h - 1; } while (h > 0);\n");
+    }
+
+    return buf;
+}
+
+static void bench_parse(void)
+{
+    const struct buffer buf = flat_program(32 << 20);
+    struct tokens tokens;
+
+    if (lex(buf.data, buf.size, 0, &tokens)) {
+        fputs("lex failed\n", stderr), exit(EXIT_FAILURE);
+    }
+
+    for (size_t nthreads = 1; nthreads <= 16; nthreads *= 2) {
+        const double start = now();
+        const struct node root = parse_parallel(&tokens, nthreads);
+        const double elapsed = now() - start;
+
+        if (parse_error(root)) {
+            fputs("parse failed\n", stderr), exit(EXIT_FAILURE);
+        }
+
+        printf("parse/-j%-4zu %8.1f Mtokens/s  (%zu tokens)\n", nthreads,
+            tokens.size / elapsed / 1e6, tokens.size);
+
+        destroy_tree(root);
+    }
+
+    destroy_tokens(&tokens);
+    free(buf.data);
+}
+
+static uint64_t random_state = 1;
+
+/* xorshift64*, so that every run makes the same edits */
+static uint32_t random_below(const uint32_t bound)
+{
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return (random_state * 0x2545f4914f6cdd1dull >> 32) % bound;
+}
+
+/* a copy of the input with [beg, end) replaced by the string */
+static struct buffer edited(const struct buffer *const buf, const size_t beg,
+    const size_t end, const char *const str, struct edit *const edit)
+{
+    const size_t len = strlen(str);
+    struct buffer copy = { .size = buf->size - (end - beg) + len };
+
+    if (!(copy.data = malloc(copy.allocated = copy.size))) {
+        perror("malloc"), exit(EXIT_FAILURE);
+    }
+
+    memcpy(copy.data, buf->data, beg);
+    memcpy(copy.data + beg, str, len);
+    memcpy(copy.data + beg + len, buf->data + end, buf->size - end);
+
+    *edit = (struct edit) { beg, end, beg + len };
+    return copy;
+}
+
+static int is_digit(const uint8_t byte)
+{
+    return byte >= '0' && byte <= '9';
+}
+
+/* the offset just past the next newline at or after the offset, or 0 */
+static size_t next_line(const struct buffer *const buf, size_t offset)
+{
+    while (offset < buf->size && buf->data[offset] != '\n') {
+        offset++;
+    }
+
+    return offset < buf->size ? offset + 1 : 0;
+}
+
+/*
+    Edits the input at a random place. Most edits change a number, or add or
+    remove a line, which keeps the program valid. The others insert a snippet
+    that breaks the lexer or the parser, and the next edit removes it again.
+*/
+static struct buffer random_edit(const struct buffer *const buf,
+    size_t *const broken_beg, size_t *const broken_end,
+    struct edit *const edit)
+{
+    static const char *const snippets[] = { "(", "{", "/*", "\"", "?", "$" };
+
+    if (*broken_end) {
+        const size_t beg = *broken_beg, end = *broken_end;
+        *broken_beg = *broken_end = 0;
+        return edited(buf, beg, end, "", edit);
+    }
+
+    const uint32_t kind = random_below(10);
+    size_t beg = random_below(buf->size), end;
+
+    if (kind < 6) {
+        while (beg < buf->size && !is_digit(buf->data[beg])) {
+            beg++;
+        }
+
+        for (beg = beg < buf->size ? beg : 0; !is_digit(buf->data[beg]); ) {
+            beg++;
+        }
+
+        for (end = beg; end < buf->size && is_digit(buf->data[end]); ) {
+            end++;
+        }
+
+        char number[16];
+        snprintf(number, sizeof(number), "%u", random_below(100000));
+        return edited(buf, beg, end, number, edit);
+    } else if (kind < 7) {
+        beg = next_line(buf, beg);
+        return edited(buf, beg, beg, "x = 1;\n", edit);
+    } else if (kind < 8) {
+        beg = next_line(buf, beg);
+        end = next_line(buf, beg) ?: buf->size;
+        return edited(buf, beg, end, "", edit);
+    }
+
+    const char *const snippet = snippets[random_below(sizeof(snippets) /
+        sizeof(*snippets))];
+
+    *broken_beg = beg;
+    *broken_end = beg + strlen(snippet);
+    return edited(buf, beg, beg, snippet, edit);
+}
+
+static int same_tokens(const struct tokens *const left,
+    const struct tokens *const right)
+{
+    return left->input == right->input && left->size == right->size &&
+        !memcmp(left->tk, right->tk, left->size * sizeof(*left->tk)) &&
+        !memcmp(left->beg, right->beg, left->size * sizeof(*left->beg)) &&
+        !memcmp(left->len, right->len, left->size * sizeof(*left->len));
+}
+
+/* the same nodes, with leaves at the same place of the same input */
+static int same_tree(const struct node *const left,
+    const struct node *const right)
+{
+    if (left->nchildren != right->nchildren) {
+        return 0;
+    } else if (!left->nchildren) {
+        return left->token.tk == right->token.tk &&
+            left->token.beg == right->token.beg &&
+            left->token.len == right->token.len;
+    } else if (left->nt != right->nt) {
+        return 0;
+    }
+
+    for (uint32_t child = 0; child < left->nchildren; ++child) {
+        if (!same_tree(left->children[child], right->children[child])) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+    Edits programs of growing size at random, and compares the tokens and
+    the tree that relex() and reparse() make of each edit with those that
+    lex() and parse() make of the whole edited program.
+*/
+static void bench_edit(void)
+{
+    static const struct {
+        const char *name;
+        size_t size;
+        int nedits;
+    } inputs[] = {
+        { "64k", 64 << 10, 1000 },
+        { "1m", 1 << 20, 100 },
+        { "16m", 16 << 20, 10 },
+    };
+
+    for (size_t idx = 0; idx < sizeof(inputs) / sizeof(*inputs); ++idx) {
+        struct buffer buf = flat_program(inputs[idx].size);
+        struct tokens tokens;
+
+        if (lex(buf.data, buf.size, 0, &tokens)) {
+            fputs("lex failed\n", stderr), exit(EXIT_FAILURE);
+        }
+
+        struct node root = parse(&tokens);
+        size_t broken_beg = 0, broken_end = 0;
+        double incremental[2] = {0}, full = 0;
+        int nvalid = 0;
+
+        for (int nedit = 0; nedit < inputs[idx].nedits; ++nedit) {
+            struct edit edit;
+            const struct buffer next = random_edit(&buf, &broken_beg,
+                &broken_end, &edit);
+
+            /* an invalid program before or after the edit is parsed again */
+            const int was_valid = !parse_error(root);
+            double start = now();
+            root = reparse(&tokens, root, next.data, next.size, &edit);
+            const int valid = was_valid && !parse_error(root);
+            incremental[valid] += now() - start;
+            nvalid += valid;
+
+            struct tokens fresh;
+            start = now();
+            const int lex_error = lex(next.data, next.size, 0, &fresh);
+            const struct node fresh_root = lex_error ?
+                (struct node) { .token = { .tk = PARSE_REJECT } } :
+                parse(&fresh);
+            full += now() - start;
+
+            if (!same_tokens(&tokens, &fresh) ||
+                !same_tree(&root, &fresh_root)) {
+                fputs("reparse differs from parse\n", stderr);
+                exit(EXIT_FAILURE);
+            }
+
+            if (!parse_error(fresh_root)) {
+                destroy_tree(fresh_root);
+            }
+
+            destroy_tokens(&fresh);
+            free(buf.data);
+            buf = next;
+        }
+
+        const int nedits = inputs[idx].nedits;
+
+        printf("edit/%-4s parse %8.1f us, reparse %8.1f us (%.1fx), "
+            "%8.1f us with errors  (%zu bytes)\n", inputs[idx].name,
+            full / nedits * 1e6, incremental[1] / nvalid * 1e6,
+            full / nedits / (incremental[1] / nvalid),
+            incremental[0] / (nedits - nvalid) * 1e6, buf.size);
+
+        if (!parse_error(root)) {
+            destroy_tree(root);
+        }
+
+        destroy_tokens(&tokens);
+        free(buf.data);
+    }
+}
+
+/* a loop over flat arithmetic, which is nested only a few levels deep */
+static struct buffer shallow_program(void)
+{
+    struct buffer buf = {0};
+
+    append(&buf, "i = 0; s = 0;\n");
+    append(&buf, "while (i < 1000000) {\n");
+    append(&buf, "    s = s + i % 7 * 3 - (i / 5 > 2 ? 1 : 0);\n");
+    append(&buf, "    if (s > 100000) { s = s - 100000; }\n");
+    append(&buf, "    i = i + 1;\n");
+    append(&buf, "}\n");
+
+    return buf;
+}
+
+/* a loop over an expression and an "if" that are both nested "depth" deep */
+static struct buffer deep_program(const int depth)
+{
+    struct buffer buf = {0};
+
+    append(&buf, "i = 0; s = 0;\n");
+    appendf(&buf, "while (i < %d) {\n", 4000000 / depth);
+    append(&buf, "    s = ");
+
+    for (int level = 0; level < depth; ++level) {
+        append(&buf, "i - (");
+    }
+
+    append(&buf, "s");
+
+    for (int level = 0; level < depth; ++level) {
+        append(&buf, ")");
+    }
+
+    append(&buf, ";\n    ");
+
+    for (int level = 0; level < depth; ++level) {
+        append(&buf, "if (i) { ");
+    }
+
+    append(&buf, "s = s + 1;");
+
+    for (int level = 0; level < depth; ++level) {
+        append(&buf, " }");
+    }
+
+    append(&buf, "\n    i = i + 1;\n}\n");
+    return buf;
+}
+
+/* a loop that reads and writes "nvars" different variables */
+static struct buffer vars_program(const int nvars)
+{
+    struct buffer buf = {0};
+
+    append(&buf, "i = 0;\n");
+
+    for (int var = 0; var < nvars; ++var) {
+        appendf(&buf, "v%d = %d;\n", var, var);
+    }
+
+    appendf(&buf, "while (i < %d) {\n", 4000000 / nvars);
+
+    for (int var = 0; var < nvars; ++var) {
+        appendf(&buf, "    v%d = v%d + i %% 3;\n", var, (var + 1) % nvars);
+    }
+
+    append(&buf, "    i = i + 1;\n}\n");
+    return buf;
+}
+
+/* lexes, parses and lowers a whole program, which must be valid */
+static void lower_program(const struct buffer *const buf,
+    struct tokens *const tokens, struct ast *const ast)
+{
+    if (lex(buf->data, buf->size, 0, tokens)) {
+        fputs("lex failed\n", stderr), exit(EXIT_FAILURE);
+    }
+
+    const struct node root = parse(tokens);
+
+    if (parse_error(root) || lower(&root, buf->data, SIZE_MAX, NULL, ast)) {
+        fputs("parse failed\n", stderr), exit(EXIT_FAILURE);
+    }
+
+    destroy_tree(root);
+}
+
+static void bench_run(void)
+{
+    static const struct {
+        const char *name;
+        int depth, nvars;
+    } programs[] = {
+        { "shallow", 0, 0 },
+        { "deep/100", 100, 0 },
+        { "deep/2000", 2000, 0 },
+        { "vars/10", 0, 10 },
+        { "vars/120", 0, 120 },
+        { "vars/1000", 0, 1000 },
+    };
+
+    for (size_t idx = 0; idx < sizeof(programs) / sizeof(*programs); ++idx) {
+        const struct buffer buf = programs[idx].nvars ?
+            vars_program(programs[idx].nvars) : programs[idx].depth ?
+            deep_program(programs[idx].depth) : shallow_program();
+
+        struct tokens tokens;
+        struct ast ast;
+        lower_program(&buf, &tokens, &ast);
+
+        double start = now();
+        run_recursive(&ast);
+        const double recursive = now() - start;
+
+        start = now();
+
+        if (run(&ast)) {
+            fputs("run failed\n", stderr), exit(EXIT_FAILURE);
+        }
+
+        const double iterative = now() - start;
+        struct code code;
+
+        start = now();
+
+        if (compile_code(&ast, &code) || run_code(&ast, &code)) {
+            fputs("run failed\n", stderr), exit(EXIT_FAILURE);
+        }
+
+        const double bytecode = now() - start;
+        destroy_code(&code);
+
+        printf("run/%-10s recursive %7.1f ms, frames %7.1f ms (%.2fx), "
+            "vm %7.1f ms (%.2fx), depth %u\n", programs[idx].name,
+            recursive * 1e3, iterative * 1e3, recursive / iterative,
+            bytecode * 1e3, recursive / bytecode, ast.depth);
+
+        destroy_ast(&ast);
+        destroy_tokens(&tokens);
+        free(buf.data);
+    }
+}
+
+/* fizzbuzz, counting instead of printing */
+static struct buffer fizzbuzz_program(void)
+{
+    struct buffer buf = {0};
+
+    append(&buf, "n = 1; fizz = 0; buzz = 0; fizzbuzz = 0; other = 0;\n");
+    append(&buf, "while (n <= 3000000) {\n");
+    append(&buf, "    if (n % 3 == 0 && n % 5 == 0) {\n");
+    append(&buf, "        fizzbuzz = fizzbuzz + 1;\n");
+    append(&buf, "    } elif (n % 5 == 0) {\n");
+    append(&buf, "        fizz = fizz + 1;\n");
+    append(&buf, "    } elif (n % 3 == 0) {\n");
+    append(&buf, "        buzz = buzz + 1;\n");
+    append(&buf, "    } else {\n");
+    append(&buf, "        other = other + n % 7;\n");
+    append(&buf, "    }\n");
+    append(&buf, "    n = n + 1;\n");
+    append(&buf, "}\n");
+
+    return buf;
+}
+
+/* fills an array, and then sums products of its elements over and over */
+static struct buffer array_program(void)
+{
+    struct buffer buf = {0};
+
+    append(&buf, "n = 0;\n");
+    append(&buf, "while (n < 1000) { a[n] = n * 7 % 13; n = n + 1; }\n");
+    append(&buf, "round = 0; sum = 0;\n");
+    append(&buf, "while (round < 3000) {\n");
+    append(&buf, "    i = 0;\n");
+    append(&buf, "    while (i < 1000) {\n");
+    append(&buf, "        sum = sum + a[i] * a[999 - i] % 11;\n");
+    append(&buf, "        i = i + 1;\n");
+    append(&buf, "    }\n");
+    append(&buf, "    round = round + 1;\n");
+    append(&buf, "}\n");
+
+    return buf;
+}
+
+/* recomputes the index of the element of a grid, over and over */
+static struct buffer grid_program(void)
+{
+    struct buffer buf = {0};
+
+    append(&buf, "w = 100; round = 0; sum = 0;\n");
+    append(&buf, "while (round < 300) {\n");
+    append(&buf, "    i = 0;\n");
+    append(&buf, "    while (i < 100) {\n");
+    append(&buf, "        j = 0;\n");
+    append(&buf, "        while (j < w) {\n");
+    append(&buf, "            g[i * w + j] = i * w + j + round;\n");
+    append(&buf, "            sum = sum + (i * w + j) % 7 +\n");
+    append(&buf, "                (i * w + j) % 5;\n");
+    append(&buf, "            j = j + 1;\n");
+    append(&buf, "        }\n");
+    append(&buf, "        i = i + 1;\n");
+    append(&buf, "    }\n");
+    append(&buf, "    round = round + 1;\n");
+    append(&buf, "}\n");
+
+    return buf;
+}
+
+/* strides through an array, with a product of the counter and an invariant */
+static struct buffer stride_program(void)
+{
+    struct buffer buf = {0};
+
+    append(&buf, "n = 20000; k = 3; round = 0; sum = 0;\n");
+    append(&buf, "while (round < 100) {\n");
+    append(&buf, "    i = 0;\n");
+    append(&buf, "    while (i < n) {\n");
+    append(&buf, "        a[i * 4] = i * 4 + k * (k + round);\n");
+    append(&buf, "        if (a[i * 4] % 3) { sum = sum + i * 4 / 3; }\n");
+    append(&buf, "        sum = sum + i * 4 % 10;\n");
+    append(&buf, "        i = i + 1;\n");
+    append(&buf, "    }\n");
+    append(&buf, "    round = round + 1;\n");
+    append(&buf, "}\n");
+
+    return buf;
+}
+
+/* a state machine, which picks the arm for its state with a chain of elifs */
+static struct buffer state_program(void)
+{
+    struct buffer buf = {0};
+
+    append(&buf, "state = 0; n = 0; sum = 0;\n");
+    append(&buf, "while (n < 2000000) {\n");
+    append(&buf, "    if (state == 0) { sum = sum + 1; state = 3; }\n");
+    append(&buf, "    elif (state == 1) { sum = sum + 2; state = 4; }\n");
+    append(&buf, "    elif (state == 2) { sum = sum - 1; state = 7; }\n");
+    append(&buf, "    elif (state == 3) { sum = sum + 3; state = 5; }\n");
+    append(&buf, "    elif (state == 4) { sum = sum * 3; state = 2; }\n");
+    append(&buf, "    elif (state == 5) { sum = sum % 1000; state = 6; }\n");
+    append(&buf, "    elif (state == 6) { sum = sum + n; state = 1; }\n");
+    append(&buf, "    else { sum = sum - 2; state = 0; }\n");
+    append(&buf, "    n = n + 1;\n");
+    append(&buf, "}\n");
+
+    return buf;
+}
+
+/* fills an array and reads back its neighbours, over and over */
+static struct buffer bounds_program(void)
+{
+    struct buffer buf = {0};
+
+    append(&buf, "n = 1000; round = 0; sum = 0;\n");
+    append(&buf, "while (round < 2000) {\n");
+    append(&buf, "    i = 0;\n");
+    append(&buf, "    while (i < n) { b[i] = i * round % 17; i = i + 1; }\n");
+    append(&buf, "    i = 1;\n");
+    append(&buf, "    while (i < n) {\n");
+    append(&buf, "        sum = sum + b[i] - b[i - 1];\n");
+    append(&buf, "        i = i + 1;\n");
+    append(&buf, "    }\n");
+    append(&buf, "    round = round + 1;\n");
+    append(&buf, "}\n");
+
+    return buf;
+}
+
+/* sums in loops that only step their counters, one of them a do loop */
+static struct buffer count_program(void)
+{
+    struct buffer buf = {0};
+
+    append(&buf, "n = 2000; round = 0; sum = 0;\n");
+    append(&buf, "while (round < 2000) {\n");
+    append(&buf, "    i = 0;\n");
+    append(&buf, "    while (i < n) { sum = sum + round; i = i + 1; }\n");
+    append(&buf, "    j = 1;\n");
+    append(&buf, "    do { sum = sum - j; j = j + 2; } while (j <= n);\n");
+    append(&buf, "    round = round + 1;\n");
+    append(&buf, "}\n");
+
+    return buf;
+}
+
+/* runs the programs on the VM as they are lowered, and once optimized */
+static void bench_optimize(void)
+{
+    static const struct {
+        const char *name;
+        struct buffer (*program)(void);
+    } programs[] = {
+        { "fizzbuzz", fizzbuzz_program },
+        { "array", array_program },
+        { "grid", grid_program },
+        { "stride", stride_program },
+        { "state", state_program },
+        { "bounds", bounds_program },
+        { "count", count_program },
+    };
+
+    for (size_t idx = 0; idx < sizeof(programs) / sizeof(*programs); ++idx) {
+        const struct buffer buf = programs[idx].program();
+        double times[2];
+
+        for (int optimized = 0; optimized < 2; ++optimized) {
+            struct tokens tokens;
+            struct ast ast;
+            struct code code;
+            lower_program(&buf, &tokens, &ast);
+
+            if (optimized && optimize(&ast)) {
+                fputs("optimize failed\n", stderr), exit(EXIT_FAILURE);
+            }
+
+            const double start = now();
+
+            if (compile_code(&ast, &code) || run_code(&ast, &code)) {
+                fputs("run failed\n", stderr), exit(EXIT_FAILURE);
+            }
+
+            times[optimized] = now() - start;
+            destroy_code(&code);
+            destroy_ast(&ast);
+            destroy_tokens(&tokens);
+        }
+
+        printf("optimize/%-9s vm %7.1f ms, optimized %7.1f ms (%.2fx)\n",
+            programs[idx].name, times[0] * 1e3, times[1] * 1e3,
+            times[0] / times[1]);
+
+        free(buf.data);
+    }
+}
+
+static void bench_jit(void)
+{
+    static const struct {
+        const char *name;
+        struct buffer (*program)(void);
+    } programs[] = {
+        { "fizzbuzz", fizzbuzz_program },
+        { "array", array_program },
+    };
+
+    for (size_t idx = 0; idx < sizeof(programs) / sizeof(*programs); ++idx) {
+        const struct buffer buf = programs[idx].program();
+        struct tokens tokens;
+        struct ast ast;
+        struct code code;
+        lower_program(&buf, &tokens, &ast);
+
+        if (compile_code(&ast, &code)) {
+            fputs("compile failed\n", stderr), exit(EXIT_FAILURE);
+        }
+
+        double start = now();
+
+        if (run(&ast)) {
+            fputs("run failed\n", stderr), exit(EXIT_FAILURE);
+        }
+
+        const double tree = now() - start;
+        start = now();
+
+        if (run_code(&ast, &code)) {
+            fputs("run failed\n", stderr), exit(EXIT_FAILURE);
+        }
+
+        const double bytecode = now() - start;
+        start = now();
+        const int jit_error = run_jit(&ast, &code);
+        const double native = now() - start;
+
+        if (jit_error == RUN_UNSUPPORTED) {
+            printf("jit/%-9s unsupported\n", programs[idx].name);
+        } else if (jit_error) {
+            fputs("run failed\n", stderr), exit(EXIT_FAILURE);
+        } else {
+            printf("jit/%-9s tree %7.1f ms, vm %7.1f ms (%.2fx), "
+                "jit %7.1f ms (%.2fx)\n", programs[idx].name, tree * 1e3,
+                bytecode * 1e3, tree / bytecode, native * 1e3,
+                tree / native);
+        }
+
+        destroy_code(&code);
+        destroy_ast(&ast);
+        destroy_tokens(&tokens);
+        free(buf.data);
+    }
+}
+
+/* the program as C, built with the C compiler, against the VM */
+static void bench_emit(void)
+{
+    static const struct {
+        const char *name;
+        struct buffer (*program)(void);
+
+        /* printed, so that the C compiler cannot drop the whole program */
+        const char *result;
+    } programs[] = {
+        { "fizzbuzz", fizzbuzz_program, "print other;\n" },
+        { "array", array_program, "print sum;\n" },
+    };
+
+    /* what the programs print is of no interest */
+    const int null = open("/dev/null", O_WRONLY), out = dup(STDOUT_FILENO);
+
+    if (null < 0 || out < 0) {
+        perror("open"), exit(EXIT_FAILURE);
+    }
+
+    for (size_t idx = 0; idx < sizeof(programs) / sizeof(*programs); ++idx) {
+        struct buffer buf = programs[idx].program();
+        append(&buf, programs[idx].result);
+
+        struct tokens tokens;
+        struct ast ast;
+        struct code code;
+        lower_program(&buf, &tokens, &ast);
+
+        char source[] = "/tmp/bench-emit-XXXXXX", command[128];
+        const int fd = mkstemp(source);
+        FILE *const file = fd < 0 ? NULL : fdopen(fd, "w");
+
+        if (!file || emit_c(&ast, file) || fclose(file)) {
+            fputs("emit failed\n", stderr), exit(EXIT_FAILURE);
+        }
+
+        double start = now();
+        snprintf(command, sizeof(command), "cc -O2 -w -x c -o %s.out %s",
+            source, source);
+        const int cc_error = system(command);
+        const double build = now() - start;
+
+        if (cc_error) {
+            printf("emit/%-8s no C compiler\n", programs[idx].name);
+        } else {
+            fflush(stdout);
+            dup2(null, STDOUT_FILENO);
+            start = now();
+
+            if (compile_code(&ast, &code) || run_code(&ast, &code)) {
+                fputs("run failed\n", stderr), exit(EXIT_FAILURE);
+            }
+
+            const double bytecode = now() - start;
+            destroy_code(&code);
+
+            snprintf(command, sizeof(command), "%s.out", source);
+            fflush(stdout);
+            start = now();
+
+            if (system(command)) {
+                fputs("run failed\n", stderr), exit(EXIT_FAILURE);
+            }
+
+            const double native = now() - start;
+            dup2(out, STDOUT_FILENO);
+
+            printf("emit/%-8s vm %7.1f ms, c %7.1f ms (%.2fx), "
+                "cc %7.1f ms\n", programs[idx].name, bytecode * 1e3,
+                native * 1e3, bytecode / native, build * 1e3);
+
+            unlink(command);
+        }
+
+        unlink(source);
+        destroy_ast(&ast);
+        destroy_tokens(&tokens);
+        free(buf.data);
+    }
+
+    close(null);
+    close(out);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct {
+        const char *name;
+        void (*func)(void);
+    } benches[] = {
+        { "lex", bench_lex },
+        { "parse", bench_parse },
+        { "edit", bench_edit },
+        { "run", bench_run },
+        { "jit", bench_jit },
+        { "emit", bench_emit },
+        { "optimize", bench_optimize },
+    };
+
+    for (size_t idx = 0; idx < sizeof(benches) / sizeof(*benches); ++idx) {
+        int selected = argc < 2;
+
+        for (int arg = 1; arg < argc; ++arg) {
+            selected |= !strcmp(argv[arg], benches[idx].name);
+        }
+
+        if (selected) {
+            benches[idx].func();
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
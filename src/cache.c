@@ -0,0 +1,194 @@
+#include "cache.h"
+#include "lower.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* bumped whenever the nodes of the lowered program change */
+#define CACHE_VERSION 6
+
+struct header {
+    char magic[8];
+    uint32_t version;
+    uint32_t node_size;
+
+    /* the source that the program was lowered from */
+    uint64_t hash;
+    uint64_t input_size;
+
+    /* the fields of the lowered program, followed by its nodes */
+    uint32_t size;
+    uint32_t root;
+    uint32_t depth;
+    uint32_t nvars;
+    uint32_t ntemps;
+};
+
+static const char magic[8] = "interp\0\1";
+
+_Static_assert(sizeof(struct header) % _Alignof(struct ast_node) == 0,
+    "the nodes must be aligned right after the header");
+
+/* a fast hash for telling sources apart, which is not meant to be secure */
+static uint64_t hash_input(const uint8_t *const input, const size_t size)
+{
+    uint64_t hash = 0x9e3779b97f4a7c15 ^ size;
+    size_t idx = 0;
+
+    for (;;) {
+        uint64_t word = 0;
+        const size_t len = size - idx < 8 ? size - idx : 8;
+        memcpy(&word, &input[idx], len);
+
+        word *= 0x87c37b91114253d5;
+        word ^= word >> 31;
+        hash = (hash ^ word) * 0x4cf5ad432745937f;
+        hash = hash << 27 | hash >> 37;
+
+        if ((idx += 8) >= size) {
+            break;
+        }
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccd;
+    return hash ^ hash >> 33;
+}
+
+void cache_open(struct cache *const cache, const char *const dir,
+    const uint8_t *const input, const size_t size)
+{
+    *cache = (struct cache) {
+        .dir = dir,
+        .hash = hash_input(input, size),
+        .input = input,
+        .size = size,
+    };
+}
+
+static void cache_path(const struct cache *const cache, char *const path,
+    const char *const suffix)
+{
+    snprintf(path, PATH_MAX, "%s/%016llx%s", cache->dir,
+        (unsigned long long) cache->hash, suffix);
+}
+
+int cache_load(struct cache *const cache, struct ast *const ast)
+{
+    char path[PATH_MAX];
+    struct stat statbuf;
+    cache_path(cache, path, ".ast");
+
+    const int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return CACHE_MISS;
+    }
+
+    if (fstat(fd, &statbuf) < 0 || statbuf.st_size < sizeof(struct header)) {
+        return close(fd), CACHE_MISS;
+    }
+
+    const size_t map_size = statbuf.st_size;
+    void *const map = mmap(0, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return CACHE_MISS;
+    }
+
+    const struct header *const header = map;
+
+    if (memcmp(header->magic, magic, sizeof(magic)) ||
+        header->version != CACHE_VERSION ||
+        header->node_size != sizeof(struct ast_node) ||
+        header->hash != cache->hash ||
+        header->input_size != cache->size ||
+        map_size != sizeof(struct header) +
+            (size_t) header->size * sizeof(struct ast_node)) {
+
+        return munmap(map, map_size), CACHE_MISS;
+    }
+
+    *ast = (struct ast) {
+        .input = cache->input,
+        .size = header->size,
+        .nodes = (struct ast_node *) (header + 1),
+        .root = header->root,
+        .depth = header->depth,
+        .nvars = header->nvars,
+        .ntemps = header->ntemps,
+    };
+
+    cache->map = map;
+    cache->map_size = map_size;
+    return CACHE_HIT;
+}
+
+static int write_all(const int fd, const void *const data, const size_t size)
+{
+    for (size_t done = 0; done < size; ) {
+        const ssize_t written = write(fd, (const char *) data + done,
+            size - done);
+
+        if (written < 0) {
+            return -1;
+        }
+
+        done += written;
+    }
+
+    return 0;
+}
+
+int cache_store(const struct cache *const cache, const struct ast *const ast)
+{
+    char path[PATH_MAX], tmp_path[PATH_MAX], suffix[32];
+
+    struct header header = {
+        .version = CACHE_VERSION,
+        .node_size = sizeof(struct ast_node),
+        .hash = cache->hash,
+        .input_size = cache->size,
+        .size = ast->size,
+        .root = ast->root,
+        .depth = ast->depth,
+        .nvars = ast->nvars,
+        .ntemps = ast->ntemps,
+    };
+
+    memcpy(header.magic, magic, sizeof(magic));
+
+    /* written to a file of its own first, so that no one maps half of it */
+    snprintf(suffix, sizeof(suffix), ".%ld.tmp", (long) getpid());
+    cache_path(cache, tmp_path, suffix);
+    cache_path(cache, path, ".ast");
+
+    const int fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    const int write_error = write_all(fd, &header, sizeof(header)) ||
+        write_all(fd, ast->nodes, ast->size * sizeof(struct ast_node));
+
+    if ((close(fd) < 0) | write_error || rename(tmp_path, path) < 0) {
+        return unlink(tmp_path), -1;
+    }
+
+    return 0;
+}
+
+void cache_close(struct cache *const cache)
+{
+    if (cache->map) {
+        munmap(cache->map, cache->map_size);
+        cache->map = NULL;
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct ast;
+
+/*
+    Lowered programs are cached in files that are named after a hash of the
+    source, so a cached program is never used for an edited source. The nodes
+    refer to each other and to the source by index and offset only, so the
+    file is used where it is mapped, without touching any of the nodes.
+*/
+struct cache {
+    const char *dir;
+    uint64_t hash;
+
+    /* the source of the program */
+    const uint8_t *input;
+    size_t size;
+
+    /* the mapped file, once loaded */
+    void *map;
+    size_t map_size;
+};
+
+void cache_open(struct cache *, const char *dir, const uint8_t *, size_t);
+
+/*
+    Maps the cached program of the source, which stays mapped until the cache
+    is closed. The lowered program refers to the source, like after lower().
+*/
+int cache_load(struct cache *, struct ast *);
+
+enum {
+    CACHE_HIT,
+    CACHE_MISS,
+};
+
+/* writes the lowered program of the source, returns 0 on success */
+int cache_store(const struct cache *, const struct ast *);
+
+void cache_close(struct cache *);
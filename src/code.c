@@ -0,0 +1,561 @@
+#include "code.h"
+#include "lex.h"
+#include "lower.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+/*
+    The target of a jump that is patched later. Jumps to the same target are
+    chained through their targets until then, and this ends the chain.
+*/
+#define NO_JUMP UINT32_MAX
+
+/*
+    Like the interpreter, the compiler keeps a frame for every node that it is
+    in the middle of, instead of recursing, and each frame is at one of the
+    following steps.
+*/
+enum {
+    STEP_BLOCK,
+    STEP_ASSIGN,
+    STEP_ASSIGN_INDEX,
+    STEP_ASSIGN_VALUE,
+    STEP_PRINT,
+    STEP_PRINT_VALUE,
+    STEP_IF,
+    STEP_IF_COND,
+    STEP_IF_BODY,
+    STEP_IF_ELSE,
+    STEP_SWITCH,
+    STEP_SWITCH_VALUE,
+    STEP_SWITCH_ARM,
+    STEP_WHILE,
+    STEP_WHILE_BODY,
+    STEP_WHILE_COND,
+    STEP_COUNTED_COND,
+    STEP_COUNTED_BODY,
+    STEP_DOWHILE,
+    STEP_DOWHILE_BODY,
+    STEP_DOWHILE_COND,
+    STEP_INDEX,
+    STEP_INDEX_VALUE,
+    STEP_UNOP,
+    STEP_UNOP_VALUE,
+    STEP_BINOP,
+    STEP_BINOP_LEFT,
+    STEP_BINOP_RIGHT,
+    STEP_BINOP_BOOL,
+    STEP_TERNARY,
+    STEP_TERNARY_COND,
+    STEP_TERNARY_TRUE,
+    STEP_TERNARY_FALSE,
+    STEP_BOUNDS,
+    STEP_BOUNDS_FIRST,
+    STEP_BOUNDS_LAST,
+    STEP_LAZY,
+};
+
+static const uint8_t first_step[] = {
+    [AST_BLOCK] = STEP_BLOCK,
+    [AST_ASSIGN] = STEP_ASSIGN,
+    [AST_PRINT] = STEP_PRINT,
+    [AST_IF] = STEP_IF,
+    [AST_SWITCH] = STEP_SWITCH,
+    [AST_WHILE] = STEP_WHILE,
+    [AST_DOWHILE] = STEP_DOWHILE,
+    [AST_INDEX] = STEP_INDEX,
+    [AST_UNOP] = STEP_UNOP,
+    [AST_BINOP] = STEP_BINOP,
+    [AST_TERNARY] = STEP_TERNARY,
+    [AST_BOUNDS] = STEP_BOUNDS,
+    [AST_LAZY] = STEP_LAZY,
+};
+
+struct frame {
+    uint32_t node;
+    uint32_t step;
+
+    /*
+        The next statement of a block, or where a loop jumps back to, or the
+        next Case of a Switch whose Block is to be compiled.
+    */
+    uint32_t next;
+
+    /* the jump to be patched once its target is compiled */
+    uint32_t jump;
+
+    /* the jumps from the arms of an If or a Switch to its end */
+    uint32_t ends;
+};
+
+struct compiling {
+    const struct ast_node *nodes;
+    struct code *code;
+    bool nomem;
+};
+
+/* returns the index of the instruction, or 0 if out of memory */
+static uint32_t emit(struct compiling *const ctx, const uint32_t op,
+    const uint32_t arg)
+{
+    struct code *const code = ctx->code;
+
+    if (code->size == code->allocated) {
+        const uint32_t allocated = code->allocated ? code->allocated * 2 : 64;
+
+        struct insn *const tmp = realloc(code->insns,
+            allocated * sizeof(struct insn));
+
+        if (!tmp) {
+            return ctx->nomem = true, 0;
+        }
+
+        code->insns = tmp;
+        code->allocated = allocated;
+    }
+
+    code->insns[code->size] = (struct insn) { .op = op, .arg = arg };
+    return code->size++;
+}
+
+/* steps the counter of the Count node, and jumps back while it holds */
+static void emit_count(struct compiling *const ctx, const uint32_t idx,
+    const uint32_t back)
+{
+    const struct ast_node *const count = &ctx->nodes[idx];
+    const struct ast_node *const bound = &ctx->nodes[count->b];
+
+    emit(ctx, bound->kind == AST_CONST ? OP_COUNT_CONST : OP_COUNT, count->a);
+    emit(ctx, count->c, back);
+    emit(ctx, count->op == TK_LTHN ? OP_LT : OP_LE, bound->a);
+}
+
+/* points the jump, and the jumps chained to it, to the next instruction */
+static void patch(struct compiling *const ctx, uint32_t jump)
+{
+    while (jump != NO_JUMP && !ctx->nomem) {
+        const uint32_t next = ctx->code->insns[jump].arg;
+        ctx->code->insns[jump].arg = ctx->code->size;
+        jump = next;
+    }
+}
+
+static uint8_t binop_code(const tk_t op)
+{
+    switch (op) {
+    case TK_PLUS:
+        return OP_ADD;
+
+    case TK_MINS:
+        return OP_SUB;
+
+    case TK_MULT:
+        return OP_MUL;
+
+    case TK_DIVI:
+        return OP_DIV;
+
+    case TK_MODU:
+        return OP_MOD;
+
+    case TK_EQUL:
+        return OP_EQ;
+
+    case TK_NEQL:
+        return OP_NE;
+
+    case TK_LTHN:
+        return OP_LT;
+
+    case TK_GTHN:
+        return OP_GT;
+
+    case TK_LTEQ:
+        return OP_LE;
+
+    case TK_GTEQ:
+        return OP_GE;
+
+    default:
+        abort();
+    }
+}
+
+/* saves the value of the node, if it is reused, leaving it on the stack */
+static inline void save(struct compiling *const ctx,
+    const struct ast_node *const node)
+{
+    if (node->aux) {
+        emit(ctx, OP_SAVE, node->aux - 1);
+    }
+}
+
+static inline void enter(const struct compiling *const ctx,
+    struct frame *const frame, const uint32_t node)
+{
+    *frame = (struct frame) {
+        .node = node,
+        .step = first_step[ctx->nodes[node].kind],
+        .jump = NO_JUMP,
+        .ends = NO_JUMP,
+    };
+}
+
+/*
+    Continues the frame at the given step once the node is compiled. Constants,
+    variables and temporaries are compiled right away, and other nodes get a
+    frame of their own, which is returned as the new top of the stack.
+*/
+static inline struct frame *descend(struct compiling *const ctx,
+    struct frame *const top, const uint32_t child, const uint32_t step)
+{
+    const struct ast_node *const node = &ctx->nodes[child];
+    top->step = step;
+
+    if (node->kind == AST_CONST) {
+        return emit(ctx, OP_CONST, node->a), top;
+    } else if (node->kind == AST_VAR) {
+        return emit(ctx, OP_VAR, node->a), top;
+    } else if (node->kind == AST_TEMP) {
+        return emit(ctx, OP_TEMP, node->a), top;
+    }
+
+    enter(ctx, top + 1, child);
+    return top + 1;
+}
+
+/* compiles the node, and everything in it, with the given number of frames */
+static int compile_node(struct compiling *const ctx, const uint32_t root,
+    const size_t nframes)
+{
+    struct frame *const frames = malloc(nframes * sizeof(struct frame));
+    struct frame *top;
+
+    if (!frames) {
+        return CODE_NOMEM;
+    }
+
+    enter(ctx, top = frames, root);
+
+    while (!ctx->nomem) {
+        const struct ast_node *const node = &ctx->nodes[top->node];
+
+        switch (top->step) {
+        case STEP_BLOCK:
+            if (top->next < node->b) {
+                enter(ctx, top + 1, node->a + top->next++);
+                ++top;
+                continue;
+            }
+            break;
+
+        case STEP_ASSIGN:
+            if (ctx->nodes[node->a].kind == AST_INDEX) {
+                top = descend(ctx, top, ctx->nodes[node->a].c,
+                    STEP_ASSIGN_INDEX);
+                continue;
+            }
+
+            /* the second word is patched to go past the store */
+            emit(ctx, OP_SLOT, ctx->nodes[node->a].a);
+            top->jump = emit(ctx, OP_HALT, NO_JUMP);
+            top = descend(ctx, top, node->b, STEP_ASSIGN_VALUE);
+            continue;
+
+        case STEP_ASSIGN_INDEX:
+            if (ctx->nodes[node->a].aux & AST_INDEX_UNCHECKED) {
+                emit(ctx, OP_SLOT_ELEMENT, ctx->nodes[node->a].a);
+            } else {
+                emit(ctx, OP_SLOT_INDEX, ctx->nodes[node->a].a);
+                top->jump = emit(ctx, OP_HALT, NO_JUMP);
+            }
+
+            top = descend(ctx, top, node->b, STEP_ASSIGN_VALUE);
+            continue;
+
+        case STEP_ASSIGN_VALUE:
+            emit(ctx, OP_STORE, 0);
+            patch(ctx, top->jump);
+            break;
+
+        case STEP_PRINT:
+            top = descend(ctx, top, node->a, STEP_PRINT_VALUE);
+            continue;
+
+        case STEP_PRINT_VALUE:
+            emit(ctx, OP_PRINT, top->node);
+            break;
+
+        case STEP_IF:
+            top = descend(ctx, top, node->a, STEP_IF_COND);
+            continue;
+
+        case STEP_IF_COND:
+            top->jump = emit(ctx, OP_JUMP_UNLESS, NO_JUMP);
+            top = descend(ctx, top, node->b, STEP_IF_BODY);
+            continue;
+
+        case STEP_IF_BODY:
+            if (!node->c) {
+                patch(ctx, top->jump);
+                patch(ctx, top->ends);
+                break;
+            }
+
+            top->ends = emit(ctx, OP_JUMP, top->ends);
+            patch(ctx, top->jump);
+
+            /* the next arm is compiled in the same frame */
+            if (ctx->nodes[node->c].kind == AST_IF) {
+                top->node = node->c;
+                top = descend(ctx, top, ctx->nodes[node->c].a, STEP_IF_COND);
+            } else {
+                top = descend(ctx, top, node->c, STEP_IF_ELSE);
+            }
+            continue;
+
+        case STEP_IF_ELSE:
+            patch(ctx, top->ends);
+            break;
+
+        case STEP_SWITCH:
+            top = descend(ctx, top, node->a, STEP_SWITCH_VALUE);
+            continue;
+
+        case STEP_SWITCH_VALUE:
+            top->jump = emit(ctx, node->op == AST_SWITCH_DENSE ?
+                OP_SWITCH_DENSE : OP_SWITCH, node->c);
+
+            for (uint32_t arm = 0; arm <= node->c; ++arm) {
+                emit(ctx, ctx->nodes[node->b + arm].a, NO_JUMP);
+            }
+
+            top->step = STEP_SWITCH_ARM;
+            continue;
+
+        case STEP_SWITCH_ARM: {
+            /* the Blocks are compiled in order, each jumping to the end */
+            const struct ast_node *const cases = &ctx->nodes[node->b];
+            const bool after = top->next && cases[top->next - 1].b;
+
+            while (top->next <= node->c && !cases[top->next].b) {
+                ++top->next;
+            }
+
+            if (top->next <= node->c && !ctx->nomem) {
+                if (after) {
+                    top->ends = emit(ctx, OP_JUMP, top->ends);
+                }
+
+                ctx->code->insns[top->jump + 1 + top->next].arg =
+                    ctx->code->size;
+                top = descend(ctx, top, cases[top->next++].b,
+                    STEP_SWITCH_ARM);
+                continue;
+            }
+
+            patch(ctx, top->ends);
+
+            if (ctx->nomem) {
+                break;
+            }
+
+            /* the Cases with no Block go where any other value does */
+            struct insn *const table = &ctx->code->insns[top->jump + 1];
+
+            if (!cases[node->c].b) {
+                table[node->c].arg = ctx->code->size;
+            }
+
+            for (uint32_t arm = 0; arm < node->c; ++arm) {
+                if (!cases[arm].b) {
+                    table[arm].arg = table[node->c].arg;
+                }
+            }
+        } break;
+
+        case STEP_WHILE:
+            /* the Count goes after the body, and the condition before it */
+            if (node->c) {
+                top = descend(ctx, top, node->a, STEP_COUNTED_COND);
+                continue;
+            }
+
+            /* the condition goes after the body, which it jumps back to */
+            top->jump = emit(ctx, OP_JUMP, NO_JUMP);
+            top->next = ctx->code->size;
+            top = descend(ctx, top, node->b, STEP_WHILE_BODY);
+            continue;
+
+        case STEP_WHILE_BODY:
+            patch(ctx, top->jump);
+            top = descend(ctx, top, node->a, STEP_WHILE_COND);
+            continue;
+
+        case STEP_WHILE_COND:
+        case STEP_DOWHILE_COND:
+            emit(ctx, OP_JUMP_IF, top->next);
+            break;
+
+        case STEP_COUNTED_COND:
+            top->jump = emit(ctx, OP_JUMP_UNLESS, NO_JUMP);
+            top->next = ctx->code->size;
+            top = descend(ctx, top, node->b, STEP_COUNTED_BODY);
+            continue;
+
+        case STEP_COUNTED_BODY:
+            emit_count(ctx, node->c, top->next);
+            patch(ctx, top->jump);
+            break;
+
+        case STEP_DOWHILE:
+            top->next = ctx->code->size;
+            top = descend(ctx, top, node->a, STEP_DOWHILE_BODY);
+            continue;
+
+        case STEP_DOWHILE_BODY:
+            if (ctx->nodes[node->b].kind == AST_COUNT) {
+                emit_count(ctx, node->b, top->next);
+                break;
+            }
+
+            top = descend(ctx, top, node->b, STEP_DOWHILE_COND);
+            continue;
+
+        case STEP_INDEX:
+            top = descend(ctx, top, node->c, STEP_INDEX_VALUE);
+            continue;
+
+        case STEP_INDEX_VALUE:
+            emit(ctx, node->aux & AST_INDEX_UNCHECKED ? OP_ELEMENT : OP_INDEX,
+                node->a);
+            break;
+
+        case STEP_UNOP:
+            top = descend(ctx, top, node->a, STEP_UNOP_VALUE);
+            continue;
+
+        case STEP_UNOP_VALUE:
+            emit(ctx, node->op == TK_MINS ? OP_NEG : OP_NOT, 0);
+            save(ctx, node);
+            break;
+
+        case STEP_BINOP:
+            top = descend(ctx, top, node->a, STEP_BINOP_LEFT);
+            continue;
+
+        case STEP_BINOP_LEFT:
+            /* the left operand is the value if it decides the outcome */
+            if (node->op == TK_CONJ || node->op == TK_DISJ) {
+                const uint32_t op = node->op == TK_CONJ ? OP_AND : OP_OR;
+                top->jump = emit(ctx, op, NO_JUMP);
+                top = descend(ctx, top, node->b, STEP_BINOP_BOOL);
+            } else {
+                top = descend(ctx, top, node->b, STEP_BINOP_RIGHT);
+            }
+            continue;
+
+        case STEP_BINOP_RIGHT:
+            emit(ctx, binop_code(node->op), 0);
+            save(ctx, node);
+            break;
+
+        case STEP_BINOP_BOOL:
+            emit(ctx, OP_BOOL, 0);
+            patch(ctx, top->jump);
+
+            /* after the jump, so that the left operand is saved too */
+            save(ctx, node);
+            break;
+
+        case STEP_TERNARY:
+            top = descend(ctx, top, node->a, STEP_TERNARY_COND);
+            continue;
+
+        case STEP_TERNARY_COND:
+            top->jump = emit(ctx, OP_JUMP_UNLESS, NO_JUMP);
+            top = descend(ctx, top, node->b, STEP_TERNARY_TRUE);
+            continue;
+
+        case STEP_TERNARY_TRUE: {
+            const uint32_t end = emit(ctx, OP_JUMP, NO_JUMP);
+            patch(ctx, top->jump);
+            top->jump = end;
+            top = descend(ctx, top, node->c, STEP_TERNARY_FALSE);
+        } continue;
+
+        case STEP_TERNARY_FALSE:
+            patch(ctx, top->jump);
+            break;
+
+        case STEP_BOUNDS:
+            top = descend(ctx, top, node->b, STEP_BOUNDS_FIRST);
+            continue;
+
+        case STEP_BOUNDS_FIRST:
+            top = descend(ctx, top, node->c, STEP_BOUNDS_LAST);
+            continue;
+
+        case STEP_BOUNDS_LAST:
+            emit(ctx, OP_BOUNDS, top->node);
+            break;
+
+        case STEP_LAZY:
+            emit(ctx, OP_LAZY, top->node);
+            break;
+
+        default:
+            abort();
+        }
+
+        /* the frame is done */
+        if (top-- == frames) {
+            break;
+        }
+    }
+
+    free(frames);
+    return ctx->nomem ? CODE_NOMEM : CODE_OK;
+}
+
+int compile_code(const struct ast *const ast, struct code *const code)
+{
+    struct compiling ctx = { .nodes = ast->nodes, .code = code };
+    *code = (struct code) {0};
+
+    const int error = compile_node(&ctx, ast->root, ast->depth);
+    emit(&ctx, OP_HALT, 0);
+
+    if (error || ctx.nomem) {
+        return destroy_code(code), CODE_NOMEM;
+    }
+
+    return CODE_OK;
+}
+
+int compile_block(const struct ast *const ast, const uint32_t block,
+    const uint32_t resume, struct code *const code, uint32_t *const start)
+{
+    struct compiling ctx = { .nodes = ast->nodes, .code = code };
+    const uint32_t size = code->size;
+
+    const int error = compile_node(&ctx, block, ast->depth);
+    emit(&ctx, OP_JUMP, resume);
+
+    /* the code compiled so far is left as it was */
+    if (error || ctx.nomem) {
+        return code->size = size, CODE_NOMEM;
+    }
+
+    *start = size;
+    return CODE_OK;
+}
+
+void destroy_code(struct code *const code)
+{
+    free(code->insns);
+    code->insns = NULL;
+    code->size = 0;
+    code->allocated = 0;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct ast;
+
+/*
+    The bytecode is compiled from the lowered program, for a machine with a
+    stack of values. Every statement leaves the stack as it found it, and
+    jumps refer to the index of the instruction that they jump to.
+*/
+enum {
+    OP_HALT,
+
+    /* values */
+    OP_CONST,       /* pushes arg */
+    OP_VAR,         /* pushes variable arg */
+    OP_TEMP,        /* pushes temporary arg */
+    OP_INDEX,       /* pops the index, pushes that element of variable arg */
+    OP_ELEMENT,     /* the same, for an index whose bounds were checked */
+    OP_NEG,
+    OP_NOT,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_MOD,
+    OP_EQ,
+    OP_NE,
+    OP_LT,
+    OP_GT,
+    OP_LE,
+    OP_GE,
+    OP_BOOL,        /* turns the top of the stack into 0 or 1 */
+    OP_SAVE,        /* copies the top of the stack into temporary arg */
+    OP_BOUNDS,      /* pops the last and first index, checks Bounds node arg */
+
+    /* jumps */
+    OP_JUMP,
+    OP_JUMP_IF,     /* pops the top, jumps if it is not 0 */
+    OP_JUMP_UNLESS, /* pops the top, jumps if it is 0 */
+    OP_AND,         /* jumps if the top is 0, pops it otherwise */
+    OP_OR,          /* turns the top into 1 and jumps if it is not 0, or pops */
+    OP_SWITCH,      /* pops the top, jumps to its Case in the sorted table */
+    OP_SWITCH_DENSE,/* pops the top, jumps to its Case at its offset */
+
+    /* statements */
+    OP_SLOT,        /* finds the element 0 that variable arg is assigned */
+    OP_SLOT_INDEX,  /* pops the index, finds that element of variable arg */
+    OP_SLOT_ELEMENT,/* the same, for an index whose bounds were checked */
+    OP_STORE,       /* pops the value into the element found */
+    OP_PRINT,       /* pops the value, prints it for the Print node arg */
+    OP_LAZY,        /* lowers and compiles the Lazy node arg, then runs it */
+
+    /* loops */
+    OP_COUNT,       /* steps counter arg, jumps while below a variable */
+    OP_COUNT_CONST, /* the same, while below a constant */
+};
+
+/*
+    The slot instructions take two words, and the arg of the second one is
+    where to jump if the assignment has no effect, which skips the value and
+    the store. OP_SLOT_ELEMENT takes one, as it always has an effect.
+
+    The count instructions take three words, for the Count of a loop. The
+    second one has the step as its op and where to jump back to as its arg,
+    and the third one has OP_LT or OP_LE as its op and the bound as its arg.
+
+    The switch instructions are followed by a table of arg + 1 words, one for
+    each Case of the Switch, with the constant as their op and where to jump
+    as their arg, and the last one for any other value. The constants of a
+    dense table are every one from the first up, so that the Case for a
+    value is the word at its offset from the first constant.
+*/
+struct insn {
+    uint32_t op;
+    uint32_t arg;
+};
+
+struct code {
+    uint32_t size, allocated;
+    struct insn *insns;
+};
+
+/* compiles the whole program, which is run from the first instruction */
+int compile_code(const struct ast *, struct code *);
+
+/*
+    Compiles the Block that a Lazy node was lowered to, followed by a jump
+    back to the given instruction, and returns the index of the first
+    instruction in "start".
+*/
+int compile_block(const struct ast *, uint32_t, uint32_t, struct code *,
+    uint32_t *start);
+
+enum {
+    CODE_OK,
+    CODE_NOMEM,
+};
+
+void destroy_code(struct code *);
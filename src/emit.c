@@ -0,0 +1,848 @@
+#include "emit.h"
+#include "lex.h"
+#include "lower.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+
+/*
+    The runtime at the top of every unit, which mirrors the variable store of
+    the interpreter, warnings and all. The arithmetic goes through unsigned
+    integers, so that it wraps around like it does in the interpreter, instead
+    of being undefined. A remainder by zero and a division that overflows
+    raise SIGFPE, where the interpreter traps, as C leaves them undefined.
+*/
+static const char runtime[] =
+    "#include <stdio.h>\n"
+    "#include <stdlib.h>\n"
+    "#include <stdbool.h>\n"
+    "#include <limits.h>\n"
+    "#include <signal.h>\n"
+    "\n"
+    "struct var {\n"
+    "    bool defined;\n"
+    "    int first;\n"
+    "    size_t array_size;\n"
+    "    int *values;\n"
+    "};\n"
+    "\n"
+    "static inline int undefined(void)\n"
+    "{\n"
+    "    return fprintf(stderr, "
+        "\"warn: access to undefined variable\\n\"), 0;\n"
+    "}\n"
+    "\n"
+    "static inline int var_value(const struct var *const var)\n"
+    "{\n"
+    "    return var->defined ? var->first : undefined();\n"
+    "}\n"
+    "\n"
+    "static inline int index_value(const struct var *const var,\n"
+    "    const int idx)\n"
+    "{\n"
+    "    if (idx < 0) {\n"
+    "        return fprintf(stderr, \"warn: negative array offset\\n\"), 0;\n"
+    "    }\n"
+    "\n"
+    "    if (!var->defined) {\n"
+    "        return fprintf(stderr, "
+        "\"warn: access to undefined array\\n\"), 0;\n"
+    "    }\n"
+    "\n"
+    "    if ((size_t) idx < var->array_size) {\n"
+    "        return idx ? var->values[idx] : var->first;\n"
+    "    } else {\n"
+    "        return fprintf(stderr, \"warn: out of bounds array access\\n\"), "
+        "0;\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "static inline int *find_slot(struct var *const var, const int idx,\n"
+    "    bool *const created)\n"
+    "{\n"
+    "    *created = false;\n"
+    "\n"
+    "    if (var->defined) {\n"
+    "        if (!var->array_size) {\n"
+    "            fprintf(stderr, "
+        "\"warn: a previous reallocation has failed, \"\n"
+    "                \"assignment has no effect\\n\");\n"
+    "\n"
+    "            return NULL;\n"
+    "        }\n"
+    "\n"
+    "        if (idx >= 0 && (size_t) idx < var->array_size) {\n"
+    "            return idx ? &var->values[idx] : &var->first;\n"
+    "        } else if (idx >= 0) {\n"
+    "            const size_t new_size = (idx + 1) * 2;\n"
+    "            int *const tmp = realloc(var->values, "
+        "new_size * sizeof(int));\n"
+    "\n"
+    "            if (!tmp) {\n"
+    "                free(var->values);\n"
+    "                var->first = 0;\n"
+    "                var->array_size = 0;\n"
+    "                var->values = NULL;\n"
+    "                perror(\"realloc\");\n"
+    "                return NULL;\n"
+    "            }\n"
+    "\n"
+    "            var->values = tmp;\n"
+    "            var->array_size = new_size;\n"
+    "            return &var->values[idx];\n"
+    "        } else {\n"
+    "            fprintf(stderr, \"warn: negative array offset\\n\");\n"
+    "            return NULL;\n"
+    "        }\n"
+    "    }\n"
+    "\n"
+    "    if (idx < 0) {\n"
+    "        fprintf(stderr, \"warn: negative array offset\\n\");\n"
+    "        return NULL;\n"
+    "    }\n"
+    "\n"
+    "    if (!idx) {\n"
+    "        var->array_size = 1;\n"
+    "        *created = true;\n"
+    "        return &var->first;\n"
+    "    }\n"
+    "\n"
+    "    var->values = malloc((idx + 1) * sizeof(int));\n"
+    "\n"
+    "    if (!var->values) {\n"
+    "        perror(\"malloc\");\n"
+    "        return NULL;\n"
+    "    }\n"
+    "\n"
+    "    var->first = 0;\n"
+    "    var->array_size = idx + 1;\n"
+    "    *created = true;\n"
+    "    return &var->values[idx];\n"
+    "}\n"
+    "\n"
+    "static inline int *element(struct var *const var, const int idx)\n"
+    "{\n"
+    "    return idx ? &var->values[idx] : &var->first;\n"
+    "}\n"
+    "\n"
+    "static inline int bounds(struct var *const var, const int first,\n"
+    "    const int last, const bool grow, const size_t step)\n"
+    "{\n"
+    "    if (first > last) {\n"
+    "        return 1;\n"
+    "    } else if (first < 0) {\n"
+    "        return 0;\n"
+    "    } else if (!grow) {\n"
+    "        return var->defined && (size_t) last < var->array_size;\n"
+    "    } else if ((var->defined && !var->array_size) || "
+        "first >= INT_MAX / 2) {\n"
+    "        return 0;\n"
+    "    }\n"
+    "\n"
+    "    size_t size = var->defined ? var->array_size : "
+        "(size_t) first + 1;\n"
+    "    size_t idx = var->defined ? (size_t) first : first + step;\n"
+    "\n"
+    "    while (idx <= (size_t) last) {\n"
+    "        if (idx < size) {\n"
+    "            idx += (size - idx + step - 1) / step * step;\n"
+    "        } else if (idx >= INT_MAX / 2) {\n"
+    "            return 0;\n"
+    "        } else {\n"
+    "            size = (idx + 1) * 2;\n"
+    "        }\n"
+    "    }\n"
+    "\n"
+    "    if (var->defined) {\n"
+    "        if (size > var->array_size) {\n"
+    "            int *const tmp = realloc(var->values, "
+        "size * sizeof(int));\n"
+    "\n"
+    "            if (!tmp) {\n"
+    "                return 0;\n"
+    "            }\n"
+    "\n"
+    "            var->values = tmp;\n"
+    "            var->array_size = size;\n"
+    "        }\n"
+    "\n"
+    "        return 1;\n"
+    "    }\n"
+    "\n"
+    "    if (size > 1 && !(var->values = malloc(size * sizeof(int)))) {\n"
+    "        return 0;\n"
+    "    }\n"
+    "\n"
+    "    var->first = first ? 0 : var->first;\n"
+    "    var->defined = true;\n"
+    "    var->array_size = size;\n"
+    "    return 1;\n"
+    "}\n"
+    "\n"
+    "static inline int add(const int left, const int right)\n"
+    "{\n"
+    "    return (int) ((unsigned) left + (unsigned) right);\n"
+    "}\n"
+    "\n"
+    "static inline int sub(const int left, const int right)\n"
+    "{\n"
+    "    return (int) ((unsigned) left - (unsigned) right);\n"
+    "}\n"
+    "\n"
+    "static inline int mul(const int left, const int right)\n"
+    "{\n"
+    "    return (int) ((unsigned) left * (unsigned) right);\n"
+    "}\n"
+    "\n"
+    "static inline int count(struct var *const var, const int step)\n"
+    "{\n"
+    "    if (var->array_size) {\n"
+    "        var->first = add(var->first, step);\n"
+    "    } else {\n"
+    "        fprintf(stderr, \"warn: a previous reallocation has failed, \"\n"
+    "            \"assignment has no effect\\n\");\n"
+    "    }\n"
+    "\n"
+    "    return var->first;\n"
+    "}\n"
+    "\n"
+    "static inline int divide(const int left, const int right)\n"
+    "{\n"
+    "    if (left == INT_MIN && right == -1) {\n"
+    "        raise(SIGFPE);\n"
+    "    }\n"
+    "\n"
+    "    if (right) {\n"
+    "        return left / right;\n"
+    "    } else {\n"
+    "        fprintf(stderr, "
+        "\"warn: prevented attempt to divide by zero\\n\");\n"
+    "        return 0;\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "static inline int mod(const int left, const int right)\n"
+    "{\n"
+    "    if (!right || (left == INT_MIN && right == -1)) {\n"
+    "        raise(SIGFPE);\n"
+    "    }\n"
+    "\n"
+    "    return left % right;\n"
+    "}\n"
+    "\n"
+    "static inline int neg(const int operand)\n"
+    "{\n"
+    "    return (int) -(unsigned) operand;\n"
+    "}\n"
+    "\n"
+    "static inline void print_string(const int len, const char *const str,\n"
+    "    const int value)\n"
+    "{\n"
+    "    printf(\"%.*s%d\\n\", len, str, value);\n"
+    "}\n"
+    "\n"
+    "static inline void print_value(const int value)\n"
+    "{\n"
+    "    printf(\"%d\\n\", value);\n"
+    "}\n";
+
+/* the deepest indentation, so that deeply nested programs stay small */
+#define MAX_INDENT 16
+
+/*
+    Like the interpreter, the emitter keeps a frame for every node that it is
+    in the middle of, instead of recursing, and each frame is at one of the
+    following steps.
+*/
+enum {
+    STEP_BLOCK,
+    STEP_ASSIGN,
+    STEP_ASSIGN_INDEX,
+    STEP_ASSIGN_ELEMENT,
+    STEP_ASSIGN_VALUE,
+    STEP_PRINT,
+    STEP_PRINT_VALUE,
+    STEP_IF,
+    STEP_IF_COND,
+    STEP_IF_BODY,
+    STEP_IF_ELSE,
+    STEP_SWITCH,
+    STEP_SWITCH_VALUE,
+    STEP_SWITCH_ARM,
+    STEP_WHILE,
+    STEP_WHILE_COND,
+    STEP_WHILE_BODY,
+    STEP_DOWHILE,
+    STEP_DOWHILE_BODY,
+    STEP_DOWHILE_COND,
+    STEP_INDEX,
+    STEP_INDEX_VALUE,
+    STEP_UNOP,
+    STEP_UNOP_VALUE,
+    STEP_BINOP,
+    STEP_BINOP_LEFT,
+    STEP_BINOP_RIGHT,
+    STEP_TERNARY,
+    STEP_TERNARY_COND,
+    STEP_TERNARY_TRUE,
+    STEP_TERNARY_FALSE,
+    STEP_BOUNDS,
+    STEP_BOUNDS_FIRST,
+    STEP_BOUNDS_LAST,
+    STEP_COUNT,
+    STEP_COUNT_BOUND,
+};
+
+static const uint8_t first_step[] = {
+    [AST_BLOCK] = STEP_BLOCK,
+    [AST_ASSIGN] = STEP_ASSIGN,
+    [AST_PRINT] = STEP_PRINT,
+    [AST_IF] = STEP_IF,
+    [AST_SWITCH] = STEP_SWITCH,
+    [AST_WHILE] = STEP_WHILE,
+    [AST_DOWHILE] = STEP_DOWHILE,
+    [AST_INDEX] = STEP_INDEX,
+    [AST_UNOP] = STEP_UNOP,
+    [AST_BINOP] = STEP_BINOP,
+    [AST_TERNARY] = STEP_TERNARY,
+    [AST_BOUNDS] = STEP_BOUNDS,
+    [AST_COUNT] = STEP_COUNT,
+};
+
+/* how a binary operator is written, around its operands */
+static const struct {
+    const char *prefix, *infix, *suffix;
+} binops[TK_COUNT] = {
+    [TK_PLUS] = { "add(", ", ", ")" },
+    [TK_MINS] = { "sub(", ", ", ")" },
+    [TK_MULT] = { "mul(", ", ", ")" },
+    [TK_DIVI] = { "divide(", ", ", ")" },
+    [TK_MODU] = { "mod(", ", ", ")" },
+    [TK_EQUL] = { "(", " == ", ")" },
+    [TK_NEQL] = { "(", " != ", ")" },
+    [TK_LTHN] = { "(", " < ", ")" },
+    [TK_GTHN] = { "(", " > ", ")" },
+    [TK_LTEQ] = { "(", " <= ", ")" },
+    [TK_GTEQ] = { "(", " >= ", ")" },
+    [TK_CONJ] = { "(", " && ", ")" },
+    [TK_DISJ] = { "(", " || ", ")" },
+};
+
+struct frame {
+    uint32_t node;
+    uint32_t step;
+
+    /* the next statement of a block, or the next Case of a Switch */
+    uint32_t next;
+};
+
+struct emission {
+    const struct ast_node *nodes;
+    const uint8_t *input;
+    FILE *out;
+
+    /* whether each variable is ever indexed, which keeps it out of locals */
+    bool *indexed;
+
+    uint32_t indent;
+};
+
+static void emit_indent(const struct emission *const ctx)
+{
+    const uint32_t indent = ctx->indent < MAX_INDENT ?
+        ctx->indent : MAX_INDENT;
+
+    fprintf(ctx->out, "%*s", (int) indent * 4, "");
+}
+
+static void emit_const(const struct emission *const ctx, const int value)
+{
+    if (value == INT_MIN) {
+        fprintf(ctx->out, "(-%d - 1)", INT_MAX);
+    } else if (value < 0) {
+        fprintf(ctx->out, "(%d)", value);
+    } else {
+        fprintf(ctx->out, "%d", value);
+    }
+}
+
+/* a string literal, with anything that C could read otherwise escaped */
+static void emit_string(const struct emission *const ctx,
+    const uint8_t *const beg, const size_t len)
+{
+    fputc('"', ctx->out);
+
+    for (size_t idx = 0; idx < len; ++idx) {
+        if ((beg[idx] >= 'a' && beg[idx] <= 'z') ||
+            (beg[idx] >= 'A' && beg[idx] <= 'Z') ||
+            (beg[idx] >= '0' && beg[idx] <= '9') ||
+            (beg[idx] && strchr(" !#$%&'()*+,-./:;<=>@[]^_`{|}~", beg[idx]))) {
+
+            fputc(beg[idx], ctx->out);
+        } else {
+            fprintf(ctx->out, "\\%03o", beg[idx]);
+        }
+    }
+
+    fputc('"', ctx->out);
+}
+
+static inline void enter(const struct emission *const ctx,
+    struct frame *const frame, const uint32_t node)
+{
+    *frame = (struct frame) {
+        .node = node,
+        .step = first_step[ctx->nodes[node].kind],
+    };
+}
+
+/*
+    Continues the frame at the given step once the node is emitted. Constants,
+    variables and temporaries are emitted right away, and other nodes get a
+    frame of their own, which is returned as the new top of the stack.
+*/
+static inline struct frame *descend(const struct emission *const ctx,
+    struct frame *const top, const uint32_t child, const uint32_t step)
+{
+    const struct ast_node *const node = &ctx->nodes[child];
+    top->step = step;
+
+    if (node->kind == AST_CONST) {
+        return emit_const(ctx, node->a), top;
+    } else if (node->kind == AST_VAR && ctx->indexed[node->a]) {
+        return fprintf(ctx->out, "var_value(&vars[%u])", node->a), top;
+    } else if (node->kind == AST_VAR) {
+        fprintf(ctx->out, "(d%u ? v%u : undefined())", node->a, node->a);
+        return top;
+    } else if (node->kind == AST_TEMP) {
+        return fprintf(ctx->out, "r[%u]", node->a), top;
+    }
+
+    enter(ctx, top + 1, child);
+    return top + 1;
+}
+
+/*
+    Whether the operands are evaluated into a temporary first, as C leaves the
+    order of evaluation open, and only a constant cannot warn. The operands
+    are also kept in order when one saves a value that the other reuses.
+*/
+static bool sequenced(const struct emission *const ctx,
+    const struct ast_node *const binop)
+{
+    return binop->op != TK_CONJ && binop->op != TK_DISJ &&
+        ctx->nodes[binop->a].kind != AST_CONST &&
+        ctx->nodes[binop->b].kind != AST_CONST;
+}
+
+static int emit_main(struct emission *const ctx, const uint32_t root,
+    const size_t nframes)
+{
+    struct frame *const frames = malloc(nframes * sizeof(struct frame));
+    struct frame *top;
+    FILE *const out = ctx->out;
+
+    if (!frames) {
+        return EMIT_NOMEM;
+    }
+
+    enter(ctx, top = frames, root);
+
+    for (;;) {
+        const struct ast_node *const node = &ctx->nodes[top->node];
+
+        switch (top->step) {
+        case STEP_BLOCK:
+            /* the top-level block is the body of main() */
+            if (!top->next && top != frames) {
+                fputs("{\n", out);
+                ctx->indent++;
+            }
+
+            if (top->next < node->b) {
+                emit_indent(ctx);
+                enter(ctx, top + 1, node->a + top->next++);
+                ++top;
+                continue;
+            }
+
+            if (top != frames) {
+                ctx->indent--;
+                emit_indent(ctx);
+                fputc('}', out);
+            }
+            break;
+
+        case STEP_ASSIGN: {
+            const struct ast_node *const target = &ctx->nodes[node->a];
+
+            if (!ctx->indexed[target->a]) {
+                fprintf(out, "v%u = ", target->a);
+                top = descend(ctx, top, node->b, STEP_ASSIGN_VALUE);
+                continue;
+            }
+
+            /* the index goes first, and the element is always there */
+            if (target->aux & AST_INDEX_UNCHECKED) {
+                fprintf(out, "slot = element(&vars[%u], ", target->a);
+                top = descend(ctx, top, target->c, STEP_ASSIGN_ELEMENT);
+                continue;
+            }
+
+            fprintf(out, "if ((slot = find_slot(&vars[%u], ", target->a);
+
+            if (target->kind == AST_INDEX) {
+                top = descend(ctx, top, target->c, STEP_ASSIGN_INDEX);
+                continue;
+            }
+
+            fputc('0', out);
+        } /* fallthrough */
+
+        case STEP_ASSIGN_INDEX:
+            fputs(", &created))) {\n", out);
+            ctx->indent++;
+            emit_indent(ctx);
+            fputs("*slot = ", out);
+            top = descend(ctx, top, node->b, STEP_ASSIGN_VALUE);
+            continue;
+
+        case STEP_ASSIGN_ELEMENT:
+            fputs(");\n", out);
+            emit_indent(ctx);
+            fputs("*slot = ", out);
+            top = descend(ctx, top, node->b, STEP_ASSIGN_VALUE);
+            continue;
+
+        case STEP_ASSIGN_VALUE: {
+            /* a new variable is only defined once the value is evaluated */
+            const uint32_t var = ctx->nodes[node->a].a;
+
+            if (!ctx->indexed[var]) {
+                fprintf(out, "; d%u = true;\n", var);
+                break;
+            } else if (ctx->nodes[node->a].aux & AST_INDEX_UNCHECKED) {
+                fputs(";\n", out);
+                break;
+            }
+
+            fputs(";\n", out);
+            emit_indent(ctx);
+            fprintf(out, "vars[%u].defined |= created;\n", var);
+            ctx->indent--;
+            emit_indent(ctx);
+            fputs("}\n", out);
+        } break;
+
+        case STEP_PRINT:
+            if (node->aux & AST_PRINT_STRING) {
+                fprintf(out, "print_string(%u, ", node->c);
+                emit_string(ctx, ctx->input + node->b, node->c);
+                fputs(", ", out);
+            } else {
+                fputs("print_value(", out);
+            }
+
+            top = descend(ctx, top, node->a, STEP_PRINT_VALUE);
+            continue;
+
+        case STEP_PRINT_VALUE:
+            fputs(");\n", out);
+            break;
+
+        case STEP_IF:
+            fputs("if (", out);
+            top = descend(ctx, top, node->a, STEP_IF_COND);
+            continue;
+
+        case STEP_IF_COND:
+            fputs(") ", out);
+            top = descend(ctx, top, node->b, STEP_IF_BODY);
+            continue;
+
+        case STEP_IF_BODY:
+            if (!node->c) {
+                fputc('\n', out);
+                break;
+            }
+
+            fputs(" else ", out);
+
+            /* the next arm is emitted in the same frame */
+            if (ctx->nodes[node->c].kind == AST_IF) {
+                top->node = node->c;
+                fputs("if (", out);
+                top = descend(ctx, top, ctx->nodes[node->c].a, STEP_IF_COND);
+            } else {
+                top = descend(ctx, top, node->c, STEP_IF_ELSE);
+            }
+            continue;
+
+        case STEP_IF_ELSE:
+            fputc('\n', out);
+            break;
+
+        case STEP_SWITCH:
+            fputs("switch (", out);
+            top = descend(ctx, top, node->a, STEP_SWITCH_VALUE);
+            continue;
+
+        case STEP_SWITCH_VALUE:
+            fputs(") {\n", out);
+            top->step = STEP_SWITCH_ARM;
+            continue;
+
+        case STEP_SWITCH_ARM: {
+            /* the Cases with no Block are left to the default */
+            const struct ast_node *const cases = &ctx->nodes[node->b];
+
+            if (top->next && cases[top->next - 1].b) {
+                fputs(" break;\n", out);
+            }
+
+            while (top->next <= node->c && !cases[top->next].b) {
+                ++top->next;
+            }
+
+            emit_indent(ctx);
+
+            if (top->next > node->c) {
+                fputs("}\n", out);
+                break;
+            }
+
+            if (top->next < node->c) {
+                fputs("case ", out);
+                emit_const(ctx, (int) cases[top->next].a);
+                fputs(": ", out);
+            } else {
+                fputs("default: ", out);
+            }
+
+            top = descend(ctx, top, cases[top->next++].b, STEP_SWITCH_ARM);
+        } continue;
+
+        /* a counted loop checks its condition once, and then counts */
+        case STEP_WHILE:
+            fputs(node->c ? "if (" : "while (", out);
+            top = descend(ctx, top, node->a, STEP_WHILE_COND);
+            continue;
+
+        case STEP_WHILE_COND:
+            fputs(node->c ? ") do " : ") ", out);
+            top = descend(ctx, top, node->b, STEP_WHILE_BODY);
+            continue;
+
+        case STEP_WHILE_BODY:
+            if (!node->c) {
+                fputc('\n', out);
+                break;
+            }
+
+            fputs(" while (", out);
+            top = descend(ctx, top, node->c, STEP_DOWHILE_COND);
+            continue;
+
+        case STEP_DOWHILE:
+            fputs("do ", out);
+            top = descend(ctx, top, node->a, STEP_DOWHILE_BODY);
+            continue;
+
+        case STEP_DOWHILE_BODY:
+            fputs(" while (", out);
+            top = descend(ctx, top, node->b, STEP_DOWHILE_COND);
+            continue;
+
+        case STEP_DOWHILE_COND:
+            fputs(");\n", out);
+            break;
+
+        case STEP_INDEX:
+            fprintf(out, node->aux & AST_INDEX_UNCHECKED ?
+                "*element(&vars[%u], " : "index_value(&vars[%u], ", node->a);
+            top = descend(ctx, top, node->c, STEP_INDEX_VALUE);
+            continue;
+
+        case STEP_INDEX_VALUE:
+            fputc(')', out);
+            break;
+
+        case STEP_UNOP_VALUE:
+            fputs(node->aux ? "))" : ")", out);
+            break;
+
+        case STEP_UNOP:
+            /* a value that is reused is saved into its temporary */
+            if (node->aux) {
+                fprintf(out, "(r[%u] = ", node->aux - 1);
+            }
+
+            fputs(node->op == TK_MINS ? "neg(" : "!(", out);
+            top = descend(ctx, top, node->a, STEP_UNOP_VALUE);
+            continue;
+
+        case STEP_BINOP:
+            if (node->aux) {
+                fprintf(out, "(r[%u] = ", node->aux - 1);
+            }
+
+            /* each nested operator has a temporary of its own, by depth */
+            if (sequenced(ctx, node)) {
+                fprintf(out, "(t[%zu] = ", (size_t) (top - frames));
+            } else {
+                fputs(binops[node->op].prefix, out);
+            }
+
+            top = descend(ctx, top, node->a, STEP_BINOP_LEFT);
+            continue;
+
+        case STEP_BINOP_LEFT:
+            if (sequenced(ctx, node)) {
+                fprintf(out, ", %st[%zu]", binops[node->op].prefix,
+                    (size_t) (top - frames));
+            }
+
+            fputs(binops[node->op].infix, out);
+            top = descend(ctx, top, node->b, STEP_BINOP_RIGHT);
+            continue;
+
+        case STEP_BINOP_RIGHT:
+            fputs(binops[node->op].suffix, out);
+
+            if (sequenced(ctx, node)) {
+                fputc(')', out);
+            }
+
+            if (node->aux) {
+                fputc(')', out);
+            }
+            break;
+
+        case STEP_TERNARY:
+            fputc('(', out);
+            top = descend(ctx, top, node->a, STEP_TERNARY_COND);
+            continue;
+
+        case STEP_TERNARY_COND:
+            fputs(" ? ", out);
+            top = descend(ctx, top, node->b, STEP_TERNARY_TRUE);
+            continue;
+
+        case STEP_TERNARY_TRUE:
+            fputs(" : ", out);
+            top = descend(ctx, top, node->c, STEP_TERNARY_FALSE);
+            continue;
+
+        case STEP_TERNARY_FALSE:
+            fputc(')', out);
+            break;
+
+        /* the indices read variables that are defined, so neither warns */
+        case STEP_BOUNDS:
+            fprintf(out, "bounds(&vars[%u], ", node->a);
+            top = descend(ctx, top, node->b, STEP_BOUNDS_FIRST);
+            continue;
+
+        case STEP_BOUNDS_FIRST:
+            fputs(", ", out);
+            top = descend(ctx, top, node->c, STEP_BOUNDS_LAST);
+            continue;
+
+        case STEP_BOUNDS_LAST:
+            fprintf(out, ", %d, %d)", node->op == AST_BOUNDS_GROW, node->aux);
+            break;
+
+        /* the counter is defined, so only a failed reallocation warns */
+        case STEP_COUNT:
+            if (ctx->indexed[node->a]) {
+                fprintf(out, "(count(&vars[%u], %u)", node->a, node->c);
+            } else {
+                fprintf(out, "((v%u = add(v%u, %u))", node->a, node->a,
+                    node->c);
+            }
+
+            fputs(node->op == TK_LTHN ? " < " : " <= ", out);
+            top = descend(ctx, top, node->b, STEP_COUNT_BOUND);
+            continue;
+
+        case STEP_COUNT_BOUND:
+            fputc(')', out);
+            break;
+
+        default:
+            abort();
+        }
+
+        /* the frame is done */
+        if (top-- == frames) {
+            break;
+        }
+    }
+
+    free(frames);
+    return EMIT_OK;
+}
+
+int emit_c(const struct ast *const ast, FILE *const out)
+{
+    struct emission ctx = {
+        .nodes = ast->nodes,
+        .input = ast->input,
+        .out = out,
+        .indexed = calloc(ast->nvars ?: 1, sizeof(bool)),
+        .indent = 1,
+    };
+
+    if (!ctx.indexed) {
+        return EMIT_NOMEM;
+    }
+
+    bool indexes = false, sequences = false;
+
+    for (uint32_t idx = 0; idx < ast->size; ++idx) {
+        const struct ast_node *const node = &ast->nodes[idx];
+
+        if (node->kind == AST_INDEX || node->kind == AST_BOUNDS) {
+            indexes = ctx.indexed[node->a] = true;
+        } else if (node->kind == AST_BINOP && sequenced(&ctx, node)) {
+            sequences = true;
+        }
+    }
+
+    fputs(runtime, out);
+
+    if (indexes) {
+        fprintf(out, "\nstatic struct var vars[%u];\n", ast->nvars);
+    }
+
+    fputs("\nint main(void)\n{\n", out);
+
+    /* only what the program needs, as C compilers warn about the rest */
+    if (indexes) {
+        fputs("    int *slot;\n    bool created;\n", out);
+    }
+
+    if (sequences) {
+        fprintf(out, "    int t[%u];\n", ast->depth);
+    }
+
+    if (ast->ntemps) {
+        fprintf(out, "    int r[%u];\n", ast->ntemps);
+    }
+
+    for (uint32_t var = 0; var < ast->nvars; ++var) {
+        if (!ctx.indexed[var]) {
+            fprintf(out, "    int v%u = 0;\n    bool d%u = false;\n", var, var);
+        }
+    }
+
+    fputc('\n', out);
+    const int error = emit_main(&ctx, ast->root, ast->depth);
+    fputs("\n    return 0;\n}\n", out);
+
+    free(ctx.indexed);
+    return error;
+}
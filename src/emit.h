@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdio.h>
+
+struct ast;
+
+/*
+    Writes a C translation unit that does what the lowered program does, with
+    the same output and the same warnings, and that needs nothing but the C
+    library. Variables that are never indexed become locals of main(), and the
+    others entries of a static array, which the runtime at the top of the unit
+    handles like the interpreter does. The program must have been lowered as a
+    whole, without the tokens of a lazy parse.
+*/
+int emit_c(const struct ast *, FILE *);
+
+enum {
+    EMIT_OK,
+    EMIT_NOMEM,
+};
@@ -0,0 +1,1121 @@
+#include "jit.h"
+#include "code.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__)
+
+/*
+    Every value on the stack of the bytecode has a place of its own in the
+    array that the machine code is given, as the depth of the stack at each
+    instruction is known. The value on top stays in eax instead, so most
+    instructions never touch the array. The other registers that are used
+    throughout are callee-saved:
+
+        rbx  the variables
+        r12  the values
+        r13  the element that the assignment being run stores into
+        r14  whether the assignment creates its variable
+        r15  the temporaries
+*/
+#define UNKNOWN_DEPTH UINT32_MAX
+
+/* a rel32 field, to be pointed at the instruction of the bytecode */
+struct fixup {
+    size_t at;
+    uint32_t target;
+
+    /* what it is relative to, which is the end of the field for a jump */
+    size_t from;
+};
+
+struct translation {
+    const struct jit_env *env;
+    bool nomem;
+
+    size_t size, allocated;
+    uint8_t *bytes;
+
+    size_t nfixups, fixups_allocated;
+    struct fixup *fixups;
+
+    /* the native offset and the depth of the stack of every instruction */
+    uint32_t *offsets;
+    uint32_t *depths;
+};
+
+static void emit(struct translation *const tr, const void *const bytes,
+    const size_t len)
+{
+    if (tr->size + len > tr->allocated) {
+        size_t allocated = tr->allocated ?: 4096;
+
+        while (tr->size + len > allocated) {
+            allocated *= 2;
+        }
+
+        uint8_t *const tmp = realloc(tr->bytes, allocated);
+
+        if (!tmp) {
+            tr->nomem = true;
+            return;
+        }
+
+        tr->bytes = tmp;
+        tr->allocated = allocated;
+    }
+
+    memcpy(tr->bytes + tr->size, bytes, len);
+    tr->size += len;
+}
+
+#define EMIT(tr, ...) \
+    emit(tr, (const uint8_t[]) { __VA_ARGS__ }, \
+        sizeof((const uint8_t[]) { __VA_ARGS__ }))
+
+static void emit32(struct translation *const tr, const uint32_t value)
+{
+    EMIT(tr, value, value >> 8, value >> 16, value >> 24);
+}
+
+static void emit64(struct translation *const tr, const uint64_t value)
+{
+    emit32(tr, value);
+    emit32(tr, value >> 32);
+}
+
+/* returns where the rel32 field that follows is, to be patched later */
+static size_t emit_rel32(struct translation *const tr)
+{
+    const size_t at = tr->size;
+    emit32(tr, 0);
+    return at;
+}
+
+/* points the rel32 field at the next byte to be emitted */
+static void patch_here(struct translation *const tr, const size_t at)
+{
+    if (!tr->nomem) {
+        const uint32_t rel = tr->size - (at + 4);
+        memcpy(tr->bytes + at, &rel, 4);
+    }
+}
+
+/* the offset of the instruction of the bytecode from the given byte */
+static void emit_offset(struct translation *const tr, const uint32_t target,
+    const size_t from)
+{
+    if (tr->nfixups == tr->fixups_allocated) {
+        const size_t allocated = tr->fixups_allocated ?
+            tr->fixups_allocated * 2 : 64;
+
+        struct fixup *const tmp = realloc(tr->fixups,
+            allocated * sizeof(struct fixup));
+
+        if (!tmp) {
+            tr->nomem = true;
+            return;
+        }
+
+        tr->fixups = tmp;
+        tr->fixups_allocated = allocated;
+    }
+
+    tr->fixups[tr->nfixups++] = (struct fixup) {
+        .at = emit_rel32(tr),
+        .target = target,
+        .from = from,
+    };
+}
+
+static void jump_to(struct translation *const tr, const uint32_t target)
+{
+    emit_offset(tr, target, tr->size + 4);
+}
+
+/* jmp to the instruction of the bytecode */
+static void emit_jmp(struct translation *const tr, const uint32_t target)
+{
+    EMIT(tr, 0xe9);
+    jump_to(tr, target);
+}
+
+/* jcc to the instruction of the bytecode, with cc as in 0f 8x */
+static void emit_jcc(struct translation *const tr, const uint8_t cc,
+    const uint32_t target)
+{
+    EMIT(tr, 0x0f, 0x80 | cc);
+    jump_to(tr, target);
+}
+
+enum {
+    CC_AE = 0x3,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_L = 0xc,
+    CC_GE = 0xd,
+    CC_LE = 0xe,
+    CC_G = 0xf,
+};
+
+/* jcc over code that is emitted next, returns the rel32 field to patch */
+static size_t emit_jcc_forward(struct translation *const tr, const uint8_t cc)
+{
+    EMIT(tr, 0x0f, 0x80 | cc);
+    return emit_rel32(tr);
+}
+
+static size_t emit_jmp_forward(struct translation *const tr)
+{
+    EMIT(tr, 0xe9);
+    return emit_rel32(tr);
+}
+
+/* mov rax, func; call rax */
+static void emit_call(struct translation *const tr, const void *const func)
+{
+    EMIT(tr, 0x48, 0xb8);
+    emit64(tr, (uintptr_t) func);
+    EMIT(tr, 0xff, 0xd0);
+}
+
+/* the ModRM byte and disp32 of [rbx + disp] */
+static void emit_var_field(struct translation *const tr, const uint8_t reg,
+    const uint32_t var, const size_t offset)
+{
+    EMIT(tr, 0x80 | reg << 3 | 3);
+    emit32(tr, var * tr->env->var_size + offset);
+}
+
+/* the value at the given depth, in [r12 + disp] */
+static void emit_value(struct translation *const tr, const uint8_t op,
+    const uint32_t depth)
+{
+    EMIT(tr, 0x41, op, 0x84, 0x24);
+    emit32(tr, depth * sizeof(int));
+}
+
+/* mov [r12 + ...], eax, for when another value goes on top */
+static void spill(struct translation *const tr, const uint32_t depth)
+{
+    if (depth) {
+        emit_value(tr, 0x89, depth - 1);
+    }
+}
+
+/* mov eax, [r12 + ...], for when the value on top is taken off */
+static void reload(struct translation *const tr, const uint32_t depth)
+{
+    if (depth > 1) {
+        emit_value(tr, 0x8b, depth - 2);
+    }
+}
+
+/*
+    Evaluates the variable into eax, or leaves it to the interpreter when it is
+    not defined yet.
+*/
+static void emit_var(struct translation *const tr, const uint32_t var)
+{
+    const struct jit_env *const env = tr->env;
+
+    /* cmp byte [rbx + defined], 0; je slow */
+    EMIT(tr, 0x80);
+    emit_var_field(tr, 7, var, env->defined_offset);
+    EMIT(tr, 0x00);
+    const size_t slow = emit_jcc_forward(tr, CC_E);
+
+    /* mov eax, [rbx + first]; jmp done */
+    EMIT(tr, 0x8b);
+    emit_var_field(tr, 0, var, env->first_offset);
+    const size_t done = emit_jmp_forward(tr);
+
+    /* mov edi, var; call eval_var */
+    patch_here(tr, slow);
+    EMIT(tr, 0xbf);
+    emit32(tr, var);
+    emit_call(tr, env->eval_var);
+    patch_here(tr, done);
+}
+
+/*
+    Checks that the index in eax is within the variable, and zero-extends it
+    to rax, returns the rel32 field of the jump to take otherwise.
+*/
+static size_t emit_bounds(struct translation *const tr, const uint32_t var,
+    size_t *const undefined)
+{
+    const struct jit_env *const env = tr->env;
+
+    /* cmp byte [rbx + defined], 0; je slow */
+    EMIT(tr, 0x80);
+    emit_var_field(tr, 7, var, env->defined_offset);
+    EMIT(tr, 0x00);
+    *undefined = emit_jcc_forward(tr, CC_E);
+
+    /* mov eax, eax; cmp rax, [rbx + array_size]; jae slow */
+    EMIT(tr, 0x89, 0xc0, 0x48, 0x3b);
+    emit_var_field(tr, 0, var, env->array_size_offset);
+    return emit_jcc_forward(tr, CC_AE);
+}
+
+/* loads the element at the index in eax into eax, like index_value() */
+static void emit_index(struct translation *const tr, const uint32_t var)
+{
+    const struct jit_env *const env = tr->env;
+    size_t undefined;
+    const size_t outside = emit_bounds(tr, var, &undefined);
+
+    /* test eax, eax; jne values */
+    EMIT(tr, 0x85, 0xc0);
+    const size_t values = emit_jcc_forward(tr, CC_NE);
+
+    /* mov eax, [rbx + first]; jmp done */
+    EMIT(tr, 0x8b);
+    emit_var_field(tr, 0, var, env->first_offset);
+    const size_t first_done = emit_jmp_forward(tr);
+
+    /* mov rcx, [rbx + values]; mov eax, [rcx + rax * 4]; jmp done */
+    patch_here(tr, values);
+    EMIT(tr, 0x48, 0x8b);
+    emit_var_field(tr, 1, var, env->values_offset);
+    EMIT(tr, 0x8b, 0x04, 0x81);
+    const size_t values_done = emit_jmp_forward(tr);
+
+    /* mov esi, eax; mov edi, var; call index_value */
+    patch_here(tr, undefined);
+    patch_here(tr, outside);
+    EMIT(tr, 0x89, 0xc6, 0xbf);
+    emit32(tr, var);
+    emit_call(tr, env->index_value);
+
+    patch_here(tr, first_done);
+    patch_here(tr, values_done);
+}
+
+/*
+    Loads the element at the index in eax, whose bounds were checked, into
+    eax, or points r13 at it for an assignment, which never creates its
+    variable.
+*/
+static void emit_element(struct translation *const tr, const uint32_t var,
+    const bool slot)
+{
+    const struct jit_env *const env = tr->env;
+
+    /* mov eax, eax; test eax, eax; jne values */
+    EMIT(tr, 0x89, 0xc0, 0x85, 0xc0);
+    const size_t values = emit_jcc_forward(tr, CC_NE);
+
+    /* lea r13, [rbx + first] or mov eax, [rbx + first]; jmp done */
+    if (slot) {
+        EMIT(tr, 0x4c, 0x8d);
+        emit_var_field(tr, 5, var, env->first_offset);
+    } else {
+        EMIT(tr, 0x8b);
+        emit_var_field(tr, 0, var, env->first_offset);
+    }
+
+    const size_t done = emit_jmp_forward(tr);
+
+    /* mov rcx, [rbx + values]; lea r13 or mov eax, [rcx + rax * 4] */
+    patch_here(tr, values);
+    EMIT(tr, 0x48, 0x8b);
+    emit_var_field(tr, 1, var, env->values_offset);
+
+    if (slot) {
+        EMIT(tr, 0x4c, 0x8d, 0x2c, 0x81);
+    } else {
+        EMIT(tr, 0x8b, 0x04, 0x81);
+    }
+
+    patch_here(tr, done);
+
+    if (slot) {
+        /* xor r14d, r14d */
+        EMIT(tr, 0x45, 0x31, 0xf6);
+    }
+}
+
+/*
+    Points r13 at the element that the assignment stores into, and r14d at
+    whether it creates the variable. The index is in eax for an Index. If the
+    assignment has no effect, it jumps to the given instruction instead.
+*/
+static void emit_slot(struct translation *const tr, const uint32_t var,
+    const bool indexed, const uint32_t skip)
+{
+    const struct jit_env *const env = tr->env;
+    size_t undefined, outside, values = 0;
+
+    if (indexed) {
+        outside = emit_bounds(tr, var, &undefined);
+
+        /* test eax, eax; jne values */
+        EMIT(tr, 0x85, 0xc0);
+        values = emit_jcc_forward(tr, CC_NE);
+    } else {
+        /* cmp byte [rbx + defined], 0; je slow */
+        EMIT(tr, 0x80);
+        emit_var_field(tr, 7, var, env->defined_offset);
+        EMIT(tr, 0x00);
+        undefined = emit_jcc_forward(tr, CC_E);
+
+        /* cmp qword [rbx + array_size], 0; je slow */
+        EMIT(tr, 0x48, 0x83);
+        emit_var_field(tr, 7, var, env->array_size_offset);
+        EMIT(tr, 0x00);
+        outside = emit_jcc_forward(tr, CC_E);
+    }
+
+    /* lea r13, [rbx + first]; jmp found */
+    EMIT(tr, 0x4c, 0x8d);
+    emit_var_field(tr, 5, var, env->first_offset);
+    const size_t first_found = emit_jmp_forward(tr);
+    size_t values_found = 0;
+
+    if (indexed) {
+        /* mov rcx, [rbx + values]; lea r13, [rcx + rax * 4]; jmp found */
+        patch_here(tr, values);
+        EMIT(tr, 0x48, 0x8b);
+        emit_var_field(tr, 1, var, env->values_offset);
+        EMIT(tr, 0x4c, 0x8d, 0x2c, 0x81);
+        values_found = emit_jmp_forward(tr);
+    }
+
+    /* mov esi, eax or xor esi, esi; mov edi, var; mov rdx, rsp */
+    patch_here(tr, undefined);
+    patch_here(tr, outside);
+
+    if (indexed) {
+        EMIT(tr, 0x89, 0xc6);
+    } else {
+        EMIT(tr, 0x31, 0xf6);
+    }
+
+    EMIT(tr, 0xbf);
+    emit32(tr, var);
+    EMIT(tr, 0x48, 0x89, 0xe2);
+
+    /* call find_slot; test rax, rax; je skip */
+    emit_call(tr, env->find_slot);
+    EMIT(tr, 0x48, 0x85, 0xc0);
+    emit_jcc(tr, CC_E, skip);
+
+    /* mov r13, rax; movzx r14d, byte [rsp]; jmp done */
+    EMIT(tr, 0x49, 0x89, 0xc5, 0x44, 0x0f, 0xb6, 0x34, 0x24);
+    const size_t done = emit_jmp_forward(tr);
+
+    /* xor r14d, r14d */
+    patch_here(tr, first_found);
+
+    if (indexed) {
+        patch_here(tr, values_found);
+    }
+
+    EMIT(tr, 0x45, 0x31, 0xf6);
+    patch_here(tr, done);
+}
+
+/*
+    Steps the counter of a Count in place, or leaves it to the interpreter
+    when it cannot be assigned, and jumps back while it is below the bound,
+    which is a defined variable or a constant.
+*/
+static void emit_count(struct translation *const tr,
+    const struct insn *const insn)
+{
+    const struct jit_env *const env = tr->env;
+
+    /* cmp qword [rbx + array_size], 0; je slow */
+    EMIT(tr, 0x48, 0x83);
+    emit_var_field(tr, 7, insn->arg, env->array_size_offset);
+    EMIT(tr, 0x00);
+    const size_t slow = emit_jcc_forward(tr, CC_E);
+
+    /* mov eax, [rbx + first]; add eax, step; mov [rbx + first], eax */
+    EMIT(tr, 0x8b);
+    emit_var_field(tr, 0, insn->arg, env->first_offset);
+    EMIT(tr, 0x05);
+    emit32(tr, insn[1].op);
+    EMIT(tr, 0x89);
+    emit_var_field(tr, 0, insn->arg, env->first_offset);
+    const size_t stepped = emit_jmp_forward(tr);
+
+    /* mov edi, var; mov esi, step; call count */
+    patch_here(tr, slow);
+    EMIT(tr, 0xbf);
+    emit32(tr, insn->arg);
+    EMIT(tr, 0xbe);
+    emit32(tr, insn[1].op);
+    emit_call(tr, env->count);
+    patch_here(tr, stepped);
+
+    /* cmp eax, bound or cmp eax, [rbx + first]; jl or jle back */
+    if (insn->op == OP_COUNT_CONST) {
+        EMIT(tr, 0x3d);
+        emit32(tr, insn[2].arg);
+    } else {
+        EMIT(tr, 0x3b);
+        emit_var_field(tr, 0, insn[2].arg, env->first_offset);
+    }
+
+    emit_jcc(tr, insn[2].op == OP_LT ? CC_L : CC_LE, insn[1].arg);
+}
+
+/* stores eax into the element of the assignment, defining a new variable */
+static void emit_store(struct translation *const tr, const uint32_t var)
+{
+    /* mov [r13], eax; test r14d, r14d; je done */
+    EMIT(tr, 0x41, 0x89, 0x45, 0x00, 0x45, 0x85, 0xf6);
+    const size_t done = emit_jcc_forward(tr, CC_E);
+
+    /* mov byte [rbx + defined], 1 */
+    EMIT(tr, 0xc6);
+    emit_var_field(tr, 0, var, tr->env->defined_offset);
+    EMIT(tr, 0x01);
+    patch_here(tr, done);
+}
+
+/* divides the value below by the one on top, warning about zero like C */
+static void emit_divide(struct translation *const tr, const uint32_t depth,
+    const bool remainder)
+{
+    /* mov ecx, eax; mov eax, [r12 + ...] */
+    EMIT(tr, 0x89, 0xc1);
+    emit_value(tr, 0x8b, depth - 2);
+
+    if (!remainder) {
+        /* test ecx, ecx; jne divide; mov edi, eax; xor esi, esi */
+        EMIT(tr, 0x85, 0xc9);
+        const size_t divide = emit_jcc_forward(tr, CC_NE);
+        EMIT(tr, 0x89, 0xc7, 0x31, 0xf6);
+
+        /* call divide, which warns; jmp done */
+        emit_call(tr, tr->env->divide);
+        const size_t done = emit_jmp_forward(tr);
+
+        /* cdq; idiv ecx */
+        patch_here(tr, divide);
+        EMIT(tr, 0x99, 0xf7, 0xf9);
+        patch_here(tr, done);
+    } else {
+        /* cdq; idiv ecx; mov eax, edx */
+        EMIT(tr, 0x99, 0xf7, 0xf9, 0x89, 0xd0);
+    }
+}
+
+/*
+    Divides the value below by the constant on top, which is at least 2, by a
+    multiplication and a shift instead of idiv, which is much slower. With l
+    the bits that the divisor takes, the value times 2^(31 + l) / divisor,
+    rounded up, and shifted back right rounds down, so 1 is added for a
+    negative value to round toward 0 like idiv. None of it can overflow.
+*/
+static void emit_divide_by(struct translation *const tr, const uint32_t depth,
+    const int divisor, const bool remainder)
+{
+    uint32_t bits = 0;
+
+    while ((1ull << bits) < (uint64_t) divisor) {
+        ++bits;
+    }
+
+    /* mov eax, [r12 + ...]; movsxd rcx, eax; mov rdx, magic */
+    emit_value(tr, 0x8b, depth - 2);
+    EMIT(tr, 0x48, 0x63, 0xc8, 0x48, 0xba);
+    emit64(tr, (1ull << (31 + bits)) / divisor + 1);
+
+    /* imul rdx, rcx; sar rdx, 31 + bits */
+    EMIT(tr, 0x48, 0x0f, 0xaf, 0xd1, 0x48, 0xc1, 0xfa, 31 + bits);
+
+    /* mov eax, ecx; shr eax, 31; add eax, edx */
+    EMIT(tr, 0x89, 0xc8, 0xc1, 0xe8, 0x1f, 0x01, 0xd0);
+
+    if (remainder) {
+        /* imul eax, eax, divisor; sub ecx, eax; mov eax, ecx */
+        EMIT(tr, 0x69, 0xc0);
+        emit32(tr, divisor);
+        EMIT(tr, 0x29, 0xc1, 0x89, 0xc8);
+    }
+}
+
+static void emit_compare(struct translation *const tr, const uint32_t depth,
+    const uint8_t cc)
+{
+    /* cmp [r12 + ...], eax; setcc al; movzx eax, al */
+    emit_value(tr, 0x39, depth - 2);
+    EMIT(tr, 0x0f, 0x90 | cc, 0xc0, 0x0f, 0xb6, 0xc0);
+}
+
+/*
+    Jumps through the dense table of the switch instruction, with the value
+    in eax, to a table of offsets from where it is in the machine code.
+*/
+static void emit_table(struct translation *const tr,
+    const struct insn *const table, const uint32_t count)
+{
+    /* sub eax, first; cmp eax, count; jae default */
+    EMIT(tr, 0x2d);
+    emit32(tr, table[0].op);
+    EMIT(tr, 0x3d);
+    emit32(tr, count);
+    emit_jcc(tr, CC_AE, table[count].arg);
+
+    /* lea rcx, [rip + 9]; movsxd rax, [rcx + rax * 4]; add rax, rcx; jmp rax */
+    EMIT(tr, 0x48, 0x8d, 0x0d);
+    emit32(tr, 9);
+    EMIT(tr, 0x48, 0x63, 0x04, 0x81, 0x48, 0x01, 0xc8, 0xff, 0xe0);
+
+    const size_t from = tr->size;
+
+    for (uint32_t arm = 0; arm < count; ++arm) {
+        emit_offset(tr, table[arm].arg, from);
+    }
+}
+
+/* the most ranges that a binary search is in the middle of, at any depth */
+#define MAX_RANGES 64
+
+/* a range of Cases left to search, and the jump to it, if any */
+struct range {
+    uint32_t low, high;
+    bool jumped;
+    size_t jump;
+};
+
+/* the fewest Cases that are searched by halves instead of one by one */
+#define MIN_SEARCH 5
+
+/*
+    Jumps through the sorted table of the switch instruction, with the value
+    in eax, by a binary search that is unrolled into compares and jumps.
+*/
+static void emit_search(struct translation *const tr,
+    const struct insn *const table, const uint32_t count)
+{
+    struct range ranges[MAX_RANGES] = { { .high = count } };
+    uint32_t nranges = 1;
+
+    while (nranges && !tr->nomem) {
+        const struct range range = ranges[--nranges];
+        const uint32_t low = range.low, high = range.high;
+
+        if (range.jumped) {
+            patch_here(tr, range.jump);
+        }
+
+        if (high - low < MIN_SEARCH) {
+            /* cmp eax, constant; je target, for each; jmp default */
+            for (uint32_t arm = low; arm < high; ++arm) {
+                EMIT(tr, 0x3d);
+                emit32(tr, table[arm].op);
+                emit_jcc(tr, CC_E, table[arm].arg);
+            }
+
+            emit_jmp(tr, table[count].arg);
+            continue;
+        }
+
+        /* cmp eax, constant; je target; jl lower half, or the upper half */
+        const uint32_t middle = low + (high - low) / 2;
+        EMIT(tr, 0x3d);
+        emit32(tr, table[middle].op);
+        emit_jcc(tr, CC_E, table[middle].arg);
+
+        ranges[nranges++] = (struct range) {
+            .low = low,
+            .high = middle,
+            .jumped = true,
+            .jump = emit_jcc_forward(tr, CC_L),
+        };
+
+        ranges[nranges++] = (struct range) { .low = middle + 1, .high = high };
+    }
+}
+
+/* the number of values that the instruction takes and then leaves */
+static void stack_effect(const uint32_t op, uint32_t *const pops,
+    uint32_t *const pushes)
+{
+    switch (op) {
+    case OP_CONST:
+    case OP_VAR:
+    case OP_TEMP:
+        *pops = 0, *pushes = 1;
+        return;
+
+    case OP_INDEX:
+    case OP_ELEMENT:
+    case OP_NEG:
+    case OP_NOT:
+    case OP_BOOL:
+    case OP_SAVE:
+        *pops = 1, *pushes = 1;
+        return;
+
+    case OP_JUMP_IF:
+    case OP_JUMP_UNLESS:
+    case OP_SWITCH:
+    case OP_SWITCH_DENSE:
+    case OP_SLOT_INDEX:
+    case OP_SLOT_ELEMENT:
+    case OP_STORE:
+    case OP_PRINT:
+        *pops = 1, *pushes = 0;
+        return;
+
+    case OP_AND:
+    case OP_OR:
+        /* as on the way past the jump, which keeps the value on top */
+        *pops = 1, *pushes = 0;
+        return;
+
+    case OP_HALT:
+    case OP_JUMP:
+    case OP_SLOT:
+    case OP_LAZY:
+    case OP_COUNT:
+    case OP_COUNT_CONST:
+        *pops = 0, *pushes = 0;
+        return;
+
+    default:
+        *pops = 2, *pushes = 1;
+        return;
+    }
+}
+
+/* records the depth at a target, returns false if it does not agree */
+static bool reach(struct translation *const tr, const uint32_t target,
+    const uint32_t depth)
+{
+    if (tr->depths[target] == UNKNOWN_DEPTH) {
+        tr->depths[target] = depth;
+    }
+
+    return tr->depths[target] == depth;
+}
+
+static int translate(struct translation *const tr,
+    const struct code *const code)
+{
+    const struct insn *const insns = code->insns;
+    uint32_t depth = 0, slot_var = 0;
+    bool falls_through = true;
+
+    /* push rbx; push r12; push r13; push r14; push r15; sub rsp, 16 */
+    EMIT(tr, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);
+    EMIT(tr, 0x48, 0x83, 0xec, 0x10);
+
+    /* mov r12, rdi; mov rbx, vars; mov r15, temps */
+    EMIT(tr, 0x49, 0x89, 0xfc, 0x48, 0xbb);
+    emit64(tr, (uintptr_t) tr->env->vars);
+    EMIT(tr, 0x49, 0xbf);
+    emit64(tr, (uintptr_t) tr->env->temps);
+
+    for (uint32_t idx = 0; idx < code->size && !tr->nomem; ++idx) {
+        const struct insn *const insn = &insns[idx];
+        const bool joined = tr->depths[idx] != UNKNOWN_DEPTH;
+        uint32_t pops, pushes;
+
+        /* statements start with nothing on the stack, like loop bodies */
+        if (!falls_through) {
+            depth = tr->depths[idx] == UNKNOWN_DEPTH ? 0 : tr->depths[idx];
+            tr->depths[idx] = depth;
+        } else if (!reach(tr, idx, depth)) {
+            return JIT_UNSUPPORTED;
+        }
+
+        stack_effect(insn->op, &pops, &pushes);
+
+        if (depth < pops) {
+            return JIT_UNSUPPORTED;
+        }
+
+        tr->offsets[idx] = tr->size;
+        falls_through = true;
+
+        switch (insn->op) {
+        case OP_HALT:
+            /* add rsp, 16; pop r15; pop r14; pop r13; pop r12; pop rbx; ret */
+            EMIT(tr, 0x48, 0x83, 0xc4, 0x10);
+            EMIT(tr, 0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b);
+            EMIT(tr, 0xc3);
+            falls_through = false;
+            break;
+
+        case OP_CONST:
+            /* mov eax, value */
+            spill(tr, depth);
+            EMIT(tr, 0xb8);
+            emit32(tr, insn->arg);
+            break;
+
+        case OP_VAR:
+            spill(tr, depth);
+            emit_var(tr, insn->arg);
+            break;
+
+        case OP_TEMP:
+            /* mov eax, [r15 + ...] */
+            spill(tr, depth);
+            EMIT(tr, 0x41, 0x8b, 0x87);
+            emit32(tr, insn->arg * sizeof(int));
+            break;
+
+        case OP_INDEX:
+            emit_index(tr, insn->arg);
+            break;
+
+        case OP_ELEMENT:
+            emit_element(tr, insn->arg, false);
+            break;
+
+        case OP_NEG:
+            /* neg eax */
+            EMIT(tr, 0xf7, 0xd8);
+            break;
+
+        case OP_NOT:
+            /* test eax, eax; sete al; movzx eax, al */
+            EMIT(tr, 0x85, 0xc0, 0x0f, 0x94, 0xc0, 0x0f, 0xb6, 0xc0);
+            break;
+
+        case OP_BOOL:
+            /* test eax, eax; setne al; movzx eax, al */
+            EMIT(tr, 0x85, 0xc0, 0x0f, 0x95, 0xc0, 0x0f, 0xb6, 0xc0);
+            break;
+
+        case OP_SAVE:
+            /* mov [r15 + ...], eax */
+            EMIT(tr, 0x41, 0x89, 0x87);
+            emit32(tr, insn->arg * sizeof(int));
+            break;
+
+        case OP_BOUNDS:
+            /* mov edx, eax; mov eax, [r12 + ...]; mov esi, eax */
+            EMIT(tr, 0x89, 0xc2);
+            emit_value(tr, 0x8b, depth - 2);
+            EMIT(tr, 0x89, 0xc6);
+
+            /* mov edi, node; call bounds */
+            EMIT(tr, 0xbf);
+            emit32(tr, insn->arg);
+            emit_call(tr, tr->env->bounds);
+            break;
+
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+            /* mov ecx, eax; mov eax, [r12 + ...] */
+            EMIT(tr, 0x89, 0xc1);
+            emit_value(tr, 0x8b, depth - 2);
+
+            if (insn->op == OP_ADD) {
+                EMIT(tr, 0x01, 0xc8);
+            } else if (insn->op == OP_SUB) {
+                EMIT(tr, 0x29, 0xc8);
+            } else {
+                EMIT(tr, 0x0f, 0xaf, 0xc1);
+            }
+            break;
+
+        case OP_DIV:
+        case OP_MOD:
+            /* the constant is known unless a jump lands in between */
+            if (idx && insns[idx - 1].op == OP_CONST && !joined &&
+                (int) insns[idx - 1].arg >= 2) {
+
+                emit_divide_by(tr, depth, insns[idx - 1].arg,
+                    insn->op == OP_MOD);
+            } else {
+                emit_divide(tr, depth, insn->op == OP_MOD);
+            }
+            break;
+
+        case OP_EQ:
+            emit_compare(tr, depth, CC_E);
+            break;
+
+        case OP_NE:
+            emit_compare(tr, depth, CC_NE);
+            break;
+
+        case OP_LT:
+            emit_compare(tr, depth, CC_L);
+            break;
+
+        case OP_GT:
+            emit_compare(tr, depth, CC_G);
+            break;
+
+        case OP_LE:
+            emit_compare(tr, depth, CC_LE);
+            break;
+
+        case OP_GE:
+            emit_compare(tr, depth, CC_GE);
+            break;
+
+        case OP_JUMP:
+            if (!reach(tr, insn->arg, depth)) {
+                return JIT_UNSUPPORTED;
+            }
+
+            emit_jmp(tr, insn->arg);
+            falls_through = false;
+            break;
+
+        case OP_JUMP_IF:
+        case OP_JUMP_UNLESS:
+            if (!reach(tr, insn->arg, depth - 1)) {
+                return JIT_UNSUPPORTED;
+            }
+
+            /* test eax, eax, and the value below to eax, which keeps flags */
+            EMIT(tr, 0x85, 0xc0);
+            reload(tr, depth);
+            emit_jcc(tr, insn->op == OP_JUMP_IF ? CC_NE : CC_E, insn->arg);
+            break;
+
+        case OP_AND:
+            if (!reach(tr, insn->arg, depth)) {
+                return JIT_UNSUPPORTED;
+            }
+
+            /* test eax, eax; je target, with the 0 on top */
+            EMIT(tr, 0x85, 0xc0);
+            emit_jcc(tr, CC_E, insn->arg);
+            reload(tr, depth);
+            break;
+
+        case OP_OR: {
+            if (!reach(tr, insn->arg, depth)) {
+                return JIT_UNSUPPORTED;
+            }
+
+            /* test eax, eax; je next; mov eax, 1; jmp target */
+            EMIT(tr, 0x85, 0xc0);
+            const size_t next = emit_jcc_forward(tr, CC_E);
+            EMIT(tr, 0xb8);
+            emit32(tr, 1);
+            emit_jmp(tr, insn->arg);
+            patch_here(tr, next);
+            reload(tr, depth);
+        } break;
+
+        case OP_SWITCH:
+        case OP_SWITCH_DENSE: {
+            const struct insn *const table = &insns[idx + 1];
+
+            /* a switch is a statement, so nothing is left below */
+            if (depth != 1) {
+                return JIT_UNSUPPORTED;
+            }
+
+            for (uint32_t arm = 0; arm <= insn->arg; ++arm) {
+                if (!reach(tr, table[arm].arg, depth - 1)) {
+                    return JIT_UNSUPPORTED;
+                }
+            }
+
+            if (insn->op == OP_SWITCH_DENSE) {
+                emit_table(tr, table, insn->arg);
+            } else {
+                emit_search(tr, table, insn->arg);
+            }
+
+            /* the table is not made of instructions of their own */
+            for (uint32_t arm = 0; arm <= insn->arg; ++arm) {
+                tr->offsets[++idx] = tr->size;
+            }
+
+            falls_through = false;
+        } continue;
+
+        case OP_SLOT:
+        case OP_SLOT_INDEX: {
+            const bool indexed = insn->op == OP_SLOT_INDEX;
+            const uint32_t skip = insns[idx + 1].arg;
+
+            /* an assignment is a statement, so nothing is left below */
+            if (depth != indexed || !reach(tr, skip, 0)) {
+                return JIT_UNSUPPORTED;
+            }
+
+            emit_slot(tr, slot_var = insn->arg, indexed, skip);
+
+            /* the second word is not an instruction of its own */
+            tr->offsets[++idx] = tr->size;
+            depth = 0;
+        } continue;
+
+        case OP_SLOT_ELEMENT:
+            if (depth != 1) {
+                return JIT_UNSUPPORTED;
+            }
+
+            emit_element(tr, slot_var = insn->arg, true);
+            break;
+
+        case OP_STORE:
+            emit_store(tr, slot_var);
+            break;
+
+        case OP_COUNT:
+        case OP_COUNT_CONST:
+            /* a loop jumps back to its body, with nothing on the stack */
+            if (depth || !reach(tr, insns[idx + 1].arg, 0)) {
+                return JIT_UNSUPPORTED;
+            }
+
+            emit_count(tr, insn);
+
+            /* the other words are not instructions of their own */
+            tr->offsets[++idx] = tr->size;
+            tr->offsets[++idx] = tr->size;
+            continue;
+
+        case OP_PRINT:
+            /* mov esi, eax; mov edi, node; call print */
+            EMIT(tr, 0x89, 0xc6, 0xbf);
+            emit32(tr, insn->arg);
+            emit_call(tr, tr->env->print);
+            reload(tr, depth);
+            break;
+
+        default:
+            return JIT_UNSUPPORTED;
+        }
+
+        depth = depth - pops + pushes;
+    }
+
+    if (tr->nomem) {
+        return JIT_NOMEM;
+    }
+
+    for (size_t fixup = 0; fixup < tr->nfixups; ++fixup) {
+        const struct fixup *const fx = &tr->fixups[fixup];
+        const uint32_t rel = tr->offsets[fx->target] - fx->from;
+        memcpy(tr->bytes + fx->at, &rel, 4);
+    }
+
+    return JIT_OK;
+}
+
+/* whether the fields of every variable are within reach of a disp32 */
+static bool vars_in_reach(const struct code *const code,
+    const struct jit_env *const env)
+{
+    for (uint32_t idx = 0; idx < code->size; ++idx) {
+        switch (code->insns[idx].op) {
+        case OP_SWITCH:
+        case OP_SWITCH_DENSE:
+            /* the table that follows holds constants instead */
+            idx += code->insns[idx].arg + 1;
+            break;
+
+        case OP_COUNT:
+            /* the step and the bound follow, and the bound is a variable */
+            if ((uint64_t) code->insns[idx + 2].arg * env->var_size >
+                INT32_MAX - env->var_size) {
+
+                return false;
+            }
+            /* fallthrough */
+
+        case OP_COUNT_CONST:
+            if ((uint64_t) code->insns[idx].arg * env->var_size >
+                INT32_MAX - env->var_size) {
+
+                return false;
+            }
+
+            idx += 2;
+            break;
+
+        case OP_VAR:
+        case OP_INDEX:
+        case OP_ELEMENT:
+        case OP_SLOT:
+        case OP_SLOT_INDEX:
+        case OP_SLOT_ELEMENT:
+            if ((uint64_t) code->insns[idx].arg * env->var_size >
+                INT32_MAX - env->var_size) {
+
+                return false;
+            }
+            break;
+        }
+    }
+
+    return true;
+}
+
+int jit_compile(const struct code *const code,
+    const struct jit_env *const env, struct jit *const jit)
+{
+    struct translation tr = { .env = env };
+    *jit = (struct jit) {0};
+
+    if (!vars_in_reach(code, env)) {
+        return JIT_UNSUPPORTED;
+    }
+
+    tr.offsets = malloc(code->size * sizeof(uint32_t));
+    tr.depths = malloc(code->size * sizeof(uint32_t));
+    int error = JIT_NOMEM;
+
+    if (tr.offsets && tr.depths) {
+        memset(tr.depths, 0xff, code->size * sizeof(uint32_t));
+        error = translate(&tr, code);
+    }
+
+    if (!error) {
+        void *const map = mmap(NULL, tr.size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        /* the machine code is never writable and executable at once */
+        if (map == MAP_FAILED) {
+            error = JIT_NOMEM;
+        } else if (memcpy(map, tr.bytes, tr.size),
+            mprotect(map, tr.size, PROT_READ | PROT_EXEC) < 0) {
+
+            munmap(map, tr.size);
+            error = JIT_UNSUPPORTED;
+        } else {
+            jit->map = map;
+            jit->map_size = tr.size;
+            jit->entry = (void (*)(int *)) map;
+        }
+    }
+
+    free(tr.bytes);
+    free(tr.fixups);
+    free(tr.offsets);
+    free(tr.depths);
+    return error;
+}
+
+#else
+
+int jit_compile(const struct code *const code,
+    const struct jit_env *const env, struct jit *const jit)
+{
+    *jit = (struct jit) {0};
+    return JIT_UNSUPPORTED;
+}
+
+#endif
+
+void jit_free(struct jit *const jit)
+{
+    if (jit->map) {
+        munmap(jit->map, jit->map_size);
+        jit->map = NULL;
+    }
+}
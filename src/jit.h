@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+struct code;
+
+/*
+    What the machine code needs from the interpreter: where the variables and
+    the temporaries are and where the fields of a variable lie, and the
+    functions that it calls for anything but the common case, which warn just
+    like the interpreter does.
+*/
+struct jit_env {
+    void *vars;
+    size_t var_size;
+    size_t defined_offset, first_offset, array_size_offset, values_offset;
+    int *temps;
+
+    int (*eval_var)(uint32_t);
+    int (*index_value)(uint32_t, int);
+    int *(*find_slot)(uint32_t, int, bool *);
+    int (*bounds)(uint32_t, int, int);
+    int (*count)(uint32_t, int);
+    int (*divide)(int, int);
+    void (*print)(uint32_t, int);
+};
+
+struct jit {
+    void *map;
+    size_t map_size;
+
+    /* runs the program, with room for as many values as it is nested deep */
+    void (*entry)(int *values);
+};
+
+/*
+    Translates the bytecode of a whole program to x86-64 machine code, which
+    refers to the variables where they are at the time. Programs with blocks
+    that are still to be lowered are not supported, nor is any other machine.
+*/
+int jit_compile(const struct code *, const struct jit_env *, struct jit *);
+
+enum {
+    JIT_OK,
+    JIT_NOMEM,
+    JIT_UNSUPPORTED,
+};
+
+void jit_free(struct jit *);
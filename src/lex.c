@@ -2,6 +2,12 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 enum {
     STS_ACCEPT,
@@ -269,120 +275,882 @@ static sts_t (*const token_funcs[TK_COUNT])(const uint8_t, uint8_t *const) = {
     tk_coln,
 };
 
-static inline int push_token(struct token **const tokens,
-    size_t *const ntokens, size_t *const allocated, const tk_t token,
-    const uint8_t *const beg, const uint8_t *const end)
+/*
+    Scanners used to skip over long runs of bytes on which the DFA stays in the
+    same state (whitespace, comment bodies and string literal bodies). Each one
+    returns the first byte in [beg, end) which is (if "until" is set) or is not
+    (if "until" is clear) one of the four bytes in "set".
+*/
+typedef const uint8_t *scan_func_t(const uint8_t *, const uint8_t *,
+    const uint8_t *, int);
+
+static const uint8_t *scan_scalar(const uint8_t *beg, const uint8_t *const end,
+    const uint8_t *const set, const int until)
+{
+    while (beg < end) {
+        const uint8_t c = *beg;
+        const int member = c == set[0] || c == set[1] ||
+            c == set[2] || c == set[3];
+
+        if (member == until) {
+            break;
+        }
+
+        beg++;
+    }
+
+    return beg;
+}
+
+#ifdef __SSE2__
+static const uint8_t *scan_sse2(const uint8_t *beg, const uint8_t *const end,
+    const uint8_t *const set, const int until)
+{
+    const __m128i s0 = _mm_set1_epi8(set[0]), s1 = _mm_set1_epi8(set[1]);
+    const __m128i s2 = _mm_set1_epi8(set[2]), s3 = _mm_set1_epi8(set[3]);
+    const uint32_t flip = until ? 0 : 0xffff;
+
+    for (; end - beg >= 16; beg += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i *) beg);
+
+        const __m128i eq = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, s0), _mm_cmpeq_epi8(v, s1)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, s2), _mm_cmpeq_epi8(v, s3)));
+
+        const uint32_t mask = _mm_movemask_epi8(eq) ^ flip;
+
+        if (mask) {
+            return beg + __builtin_ctz(mask);
+        }
+    }
+
+    return scan_scalar(beg, end, set, until);
+}
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+__attribute__((target("avx2")))
+static const uint8_t *scan_avx2(const uint8_t *beg, const uint8_t *const end,
+    const uint8_t *const set, const int until)
+{
+    const __m256i s0 = _mm256_set1_epi8(set[0]), s1 = _mm256_set1_epi8(set[1]);
+    const __m256i s2 = _mm256_set1_epi8(set[2]), s3 = _mm256_set1_epi8(set[3]);
+    const uint32_t flip = until ? 0 : 0xffffffff;
+
+    for (; end - beg >= 32; beg += 32) {
+        const __m256i v = _mm256_loadu_si256((const __m256i *) beg);
+
+        const __m256i eq = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, s0), _mm256_cmpeq_epi8(v, s1)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, s2),
+                _mm256_cmpeq_epi8(v, s3)));
+
+        const uint32_t mask = (uint32_t) _mm256_movemask_epi8(eq) ^ flip;
+
+        if (mask) {
+            return beg + __builtin_ctz(mask);
+        }
+    }
+
+    return scan_scalar(beg, end, set, until);
+}
+#define HAVE_SCAN_AVX2
+#endif
+
+/*
+    The token functions above are never called while lexing. Instead, they are
+    run in lockstep over every possible input byte once, at startup, and the
+    reachable combinations of their states are recorded as the states of a
+    single DFA (the classic subset construction). Bytes that behave the same
+    in every DFA state are then folded into a single byte class, so that the
+    transition table stays small enough to live in L1.
+
+    States which loop back to themselves on all but at most four bytes (the
+    inside of comments and string literals), or on at most four bytes (runs
+    of whitespace), are marked so that the lexer can hand them to a scanner.
+*/
+#define DFA_MAX_STATES  256
+#define DFA_MAX_CLASSES 64
+#define DFA_DEAD        0
+#define DFA_START       1
+#define DFA_NENTRIES    3
+
+static struct {
+    /* number of DFA states (including the dead state) and of byte classes */
+    size_t nstates, nclasses;
+
+    /* maps an input byte to its class */
+    uint8_t classes[256];
+
+    /* the transition table, indexed by state and byte class */
+    uint8_t next[DFA_MAX_STATES][DFA_MAX_CLASSES];
+
+    /* the token accepted in each state, TK_COUNT if none */
+    tk_t accept[DFA_MAX_STATES];
+
+    /* the scan mode of each state and the bytes that it stops at or skips */
+    uint8_t scan[DFA_MAX_STATES];
+    uint8_t scan_set[DFA_MAX_STATES][4];
+
+    /* the scanner in effect, NULL to step through every byte */
+    scan_func_t *scanner;
+    int scan_level;
+
+    /* the states inside a block comment, a line comment and a string */
+    uint8_t entries[DFA_NENTRIES];
+} dfa = { .scan_level = -1 };
+
+static pthread_once_t dfa_once = PTHREAD_ONCE_INIT;
+
+enum {
+    SCAN_NONE,
+    SCAN_WHILE,
+    SCAN_UNTIL,
+};
+
+struct dfa_state {
+    uint8_t states[TK_COUNT];
+    sts_t statuses[TK_COUNT];
+};
+
+static size_t dfa_intern(struct dfa_state *const set,
+    const struct dfa_state *const state)
+{
+    for (size_t idx = 0; idx < dfa.nstates; ++idx) {
+        if (!memcmp(&set[idx], state, sizeof(struct dfa_state))) {
+            return idx;
+        }
+    }
+
+    if (dfa.nstates == DFA_MAX_STATES) {
+        abort();
+    }
+
+    set[dfa.nstates] = *state;
+    dfa.accept[dfa.nstates] = TK_COUNT;
+
+    for (tk_t tk = 0; tk < TK_COUNT; ++tk) {
+        if (state->statuses[tk] == STS_ACCEPT) {
+            dfa.accept[dfa.nstates] = tk;
+        }
+    }
+
+    return dfa.nstates++;
+}
+
+static void dfa_build(void)
 {
-    if (*ntokens >= *allocated) {
-        *allocated = (*allocated ?: 1) * 8;
+    static struct dfa_state set[DFA_MAX_STATES];
+    static uint8_t next[DFA_MAX_STATES][256];
+    struct dfa_state state = {{0}};
+
+    for (tk_t tk = 0; tk < TK_COUNT; ++tk) {
+        state.statuses[tk] = STS_REJECT;
+    }
+
+    dfa_intern(set, &state);
+
+    for (tk_t tk = 0; tk < TK_COUNT; ++tk) {
+        state.statuses[tk] = STS_HUNGRY;
+    }
+
+    dfa_intern(set, &state);
+
+    for (size_t idx = DFA_START; idx < dfa.nstates; ++idx) {
+        for (size_t c = 0; c < 256; ++c) {
+            state = set[idx];
+
+            for (tk_t tk = 0; tk < TK_COUNT; ++tk) {
+                if (state.statuses[tk] != STS_REJECT) {
+                    state.statuses[tk] = token_funcs[tk](c, &state.states[tk]);
+                }
+            }
+
+            next[idx][c] = dfa_intern(set, &state);
+        }
+    }
+
+    for (size_t c = 0; c < 256; ++c) {
+        size_t cls;
+
+        for (cls = 0; cls < dfa.nclasses; ++cls) {
+            size_t repr = 0, idx;
+
+            while (dfa.classes[repr] != cls) {
+                ++repr;
+            }
+
+            for (idx = DFA_START; idx < dfa.nstates; ++idx) {
+                if (next[idx][c] != next[idx][repr]) {
+                    break;
+                }
+            }
+
+            if (idx == dfa.nstates) {
+                break;
+            }
+        }
+
+        if (cls == dfa.nclasses && dfa.nclasses++ == DFA_MAX_CLASSES) {
+            abort();
+        }
+
+        dfa.classes[c] = cls;
 
-        struct token *const tmp =
-            realloc(*tokens, *allocated * sizeof(struct token));
+        for (size_t idx = DFA_START; idx < dfa.nstates; ++idx) {
+            dfa.next[idx][cls] = next[idx][c];
+        }
+    }
+
+    for (size_t idx = DFA_START; idx < dfa.nstates; ++idx) {
+        uint8_t loops[256], exits[256];
+        size_t nloops = 0, nexits = 0;
 
-        if (!tmp) {
-            return free(*tokens), *tokens = NULL, LEX_NOMEM;
+        for (size_t c = 0; c < 256; ++c) {
+            if (next[idx][c] == idx) {
+                loops[nloops++] = c;
+            } else {
+                exits[nexits++] = c;
+            }
         }
 
-        *tokens = tmp;
+        if (nloops && nloops <= 4) {
+            dfa.scan[idx] = SCAN_WHILE;
+            memcpy(dfa.scan_set[idx], loops, nloops);
+            memset(dfa.scan_set[idx] + nloops, loops[0], 4 - nloops);
+        } else if (nexits && nexits <= 4) {
+            dfa.scan[idx] = SCAN_UNTIL;
+            memcpy(dfa.scan_set[idx], exits, nexits);
+            memset(dfa.scan_set[idx] + nexits, exits[0], 4 - nexits);
+        }
     }
 
-    (*tokens)[(*ntokens)++] = (struct token) {
-        .beg = beg,
-        .end = end,
-        .tk = token
+    static const char *const entry_prefixes[DFA_NENTRIES] = {
+        "/*", "//", "\"",
     };
 
-    return LEX_OK;
+    for (size_t entry = 0; entry < DFA_NENTRIES; ++entry) {
+        uint8_t state = DFA_START;
+
+        for (const char *c = entry_prefixes[entry]; *c; ++c) {
+            state = dfa.next[state][dfa.classes[(uint8_t) *c]];
+        }
+
+        dfa.entries[entry] = state;
+    }
+
+    if (dfa.scan_level < 0) {
+        lex_scan(LEX_SCAN_AVX2);
+    }
 }
 
-int lex(const uint8_t *const input, const size_t size,
-    struct token **const tokens, size_t *const ntokens)
+int lex_scan(const int level)
 {
-    static struct {
-        sts_t prev, curr;
-    } statuses[TK_COUNT] = {
-        [0 ... TK_COUNT - 1] = { STS_HUNGRY, STS_REJECT }
+    static scan_func_t *const scanners[] = {
+        [LEX_SCAN_NONE] = NULL,
+        [LEX_SCAN_SCALAR] = scan_scalar,
+        #ifdef __SSE2__
+        [LEX_SCAN_SSE2] = scan_sse2,
+        #endif
+        #ifdef HAVE_SCAN_AVX2
+        [LEX_SCAN_AVX2] = scan_avx2,
+        #endif
     };
 
-    uint8_t states[TK_COUNT] = {0};
+    int best = level;
+
+    #ifdef HAVE_SCAN_AVX2
+    if (best == LEX_SCAN_AVX2 && !__builtin_cpu_supports("avx2")) {
+        best = LEX_SCAN_SSE2;
+    }
+    #endif
+
+    while (best > LEX_SCAN_SCALAR && !scanners[best]) {
+        --best;
+    }
+
+    dfa.scanner = scanners[best];
+    dfa.scan_level = best;
+    return best;
+}
+
+/*
+    Consumes the longest token starting at "beg" in the given DFA state and
+    returns its end. The accepted token is stored in "tk", or TK_COUNT if the
+    longest prefix is not a token.
+*/
+static inline const uint8_t *dfa_munch(const uint8_t *const beg,
+    const uint8_t *const end, uint8_t state, tk_t *const tk)
+{
+    const uint8_t *curr = beg;
+
+    while (curr < end) {
+        const uint8_t next = dfa.next[state][dfa.classes[*curr]];
+
+        if (next == DFA_DEAD) {
+            break;
+        }
+
+        if (next == state && dfa.scan[state] && dfa.scanner) {
+            /* the second byte of a run, let the scanner find its end */
+            curr = dfa.scanner(curr + 1, end, dfa.scan_set[state],
+                dfa.scan[state] == SCAN_UNTIL);
+
+            continue;
+        }
+
+        state = next, curr++;
+    }
+
+    *tk = dfa.accept[state];
+    return curr;
+}
+
+static int reserve_tokens(struct tokens *const tokens, const size_t count)
+{
+    size_t allocated = tokens->allocated ?: 1;
+
+    while (allocated - tokens->size < count) {
+        allocated *= 8;
+    }
+
+    if (allocated == tokens->allocated) {
+        return LEX_OK;
+    }
+
+    tk_t *const tk_tmp = realloc(tokens->tk, allocated * sizeof(tk_t));
+
+    if (!tk_tmp) {
+        return LEX_NOMEM;
+    }
+
+    tokens->tk = tk_tmp;
+
+    uint32_t *const beg_tmp =
+        realloc(tokens->beg, allocated * sizeof(uint32_t));
+
+    if (!beg_tmp) {
+        return LEX_NOMEM;
+    }
+
+    tokens->beg = beg_tmp;
+
+    uint32_t *const len_tmp =
+        realloc(tokens->len, allocated * sizeof(uint32_t));
+
+    if (!len_tmp) {
+        return LEX_NOMEM;
+    }
+
+    tokens->len = len_tmp;
+    tokens->allocated = allocated;
+    return LEX_OK;
+}
+
+static inline int push_token(struct tokens *const tokens, const tk_t tk,
+    const uint32_t beg, const uint32_t len)
+{
+    if (tokens->size >= tokens->allocated && reserve_tokens(tokens, 1)) {
+        return LEX_NOMEM;
+    }
+
+    tokens->tk[tokens->size] = tk;
+    tokens->beg[tokens->size] = beg;
+    tokens->len[tokens->size] = len;
+    tokens->size++;
+    return LEX_OK;
+}
+
+static void shrink_tokens(struct tokens *const tokens)
+{
+    tk_t *const tk_tmp = realloc(tokens->tk, tokens->size * sizeof(tk_t));
+    uint32_t *const beg_tmp =
+        realloc(tokens->beg, tokens->size * sizeof(uint32_t));
+    uint32_t *const len_tmp =
+        realloc(tokens->len, tokens->size * sizeof(uint32_t));
+
+    tokens->tk = tk_tmp ?: tokens->tk;
+    tokens->beg = beg_tmp ?: tokens->beg;
+    tokens->len = len_tmp ?: tokens->len;
+    tokens->allocated = tk_tmp && beg_tmp && len_tmp ?
+        tokens->size : tokens->allocated;
+}
 
-    const uint8_t *prefix_beg = input, *prefix_end = input;
+int lex(const uint8_t *const input, const size_t size, const int flags,
+    struct tokens *const tokens)
+{
+    const uint8_t *prefix_beg = input, *prefix_end;
+    const uint8_t *const input_end = input + size;
+    const int keep_trivia = flags & LEX_KEEP_TRIVIA;
     tk_t accepted_token;
-    size_t allocated = 0;
-    *tokens = NULL, *ntokens = 0;
+
+    *tokens = (struct tokens) {
+        .input = input,
+        .flags = flags,
+    };
+
+    if (size > UINT32_MAX) {
+        return LEX_TOO_LARGE;
+    }
+
+    pthread_once(&dfa_once, dfa_build);
 
     #define PUSH_OR_NOMEM(tk, beg, end) \
-        if (push_token(tokens, ntokens, &allocated, (tk), (beg), (end))) { \
-            return LEX_NOMEM; \
+        if (push_token(tokens, (tk), (beg) - input, (end) - (beg))) { \
+            return destroy_tokens(tokens), LEX_NOMEM; \
         }
 
-    #define foreach_tk \
-        for (tk_t tk = 0; tk < TK_COUNT; ++tk)
+    PUSH_OR_NOMEM(TK_FBEG, input, input);
+
+    do {
+        prefix_end =
+            dfa_munch(prefix_beg, input_end, DFA_START, &accepted_token);
+
+        if (accepted_token == TK_COUNT) {
+            /* mid-input, the offending character is part of the token */
+            PUSH_OR_NOMEM(accepted_token, prefix_beg,
+                prefix_end + (prefix_end < input_end));
+
+            return shrink_tokens(tokens), LEX_UNKNOWN_TOKEN;
+        }
+
+        if (keep_trivia || !TK_IS_TRIVIA(accepted_token)) {
+            PUSH_OR_NOMEM(accepted_token, prefix_beg, prefix_end);
+        }
 
-    PUSH_OR_NOMEM(TK_FBEG, NULL, NULL);
+        prefix_beg = prefix_end;
+    } while (prefix_end < input_end);
 
-    while (prefix_end < input + size) {
-        int did_accept = 0;
+    PUSH_OR_NOMEM(TK_FEND, input, input);
+    return shrink_tokens(tokens), LEX_OK;
 
-        foreach_tk {
-            if (statuses[tk].prev != STS_REJECT) {
-                statuses[tk].curr = token_funcs[tk](*prefix_end, &states[tk]);
+    #undef PUSH_OR_NOMEM
+}
+
+void destroy_tokens(struct tokens *const tokens)
+{
+    free(tokens->tk);
+    free(tokens->beg);
+    free(tokens->len);
+
+    *tokens = (struct tokens) {
+        .input = tokens->input,
+        .flags = tokens->flags,
+    };
+}
+
+/* the first of the tokens [lo, hi) which starts at or after "offset" */
+static size_t lower_bound(const struct tokens *const tokens,
+    size_t lo, size_t hi, const uint32_t offset)
+{
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+
+        if (tokens->beg[mid] < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+size_t find_token(const struct tokens *const tokens, const size_t offset)
+{
+    const size_t last = tokens->size - 1;
+    const size_t hi =
+        tokens->size && tokens->tk[last] == TK_FEND ? last : last + 1;
+
+    return offset > UINT32_MAX ? hi : lower_bound(tokens, 1, hi, offset);
+}
+
+/*
+    Relexing starts at the end of the last token which ended before the edit
+    (the byte after a token is the one that made the lexer stop, so that token
+    could have grown into the edit), and stops as soon as a token ends after
+    the edit at a place where one of the old tokens started.
+*/
+int relex(const uint8_t *const input, const size_t size,
+    const struct edit *const edit, struct tokens *const tokens,
+    struct damage *const damage)
+{
+    const int keep_trivia = tokens->flags & LEX_KEEP_TRIVIA;
+    const ptrdiff_t delta = edit->new_end - edit->old_end;
+
+    if (size > UINT32_MAX) {
+        return destroy_tokens(tokens), LEX_TOO_LARGE;
+    }
+
+    if (!size || !tokens->size || tokens->tk[tokens->size - 1] != TK_FEND) {
+        *damage = (struct damage) { 0, UINT32_MAX, UINT32_MAX };
+        return destroy_tokens(tokens), lex(input, size, tokens->flags, tokens);
+    }
+
+    pthread_once(&dfa_once, dfa_build);
+
+    /* tokens [1, kept) precede the edit, tokens [resync, last) follow it */
+    const size_t last = tokens->size - 1;
+    size_t kept = 1, hi = last;
+
+    while (kept < hi) {
+        const size_t mid = kept + (hi - kept) / 2;
+
+        if (tokens->beg[mid] + tokens->len[mid] < edit->beg) {
+            kept = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    const uint32_t from = kept > 1 ?
+        tokens->beg[kept - 1] + tokens->len[kept - 1] : 0;
+
+    const uint8_t *prefix_beg = input + from, *prefix_end;
+    const uint8_t *const input_end = input + size;
+    struct tokens fresh = { .input = input };
+    size_t resync = last;
+    tk_t accepted_token;
+    int error = LEX_OK;
+
+    while (prefix_beg < input_end) {
+        const size_t offset = prefix_beg - input;
+
+        if (offset >= edit->new_end) {
+            const size_t idx = lower_bound(tokens, kept, last, offset - delta);
+
+            if (idx < last && tokens->beg[idx] == offset - delta) {
+                resync = idx;
+                break;
             }
+        }
 
-            if (statuses[tk].curr != STS_REJECT) {
-                did_accept = 1;
+        prefix_end = dfa_munch(prefix_beg, input_end, DFA_START,
+            &accepted_token);
+
+        if (accepted_token == TK_COUNT) {
+            prefix_end += prefix_end < input_end;
+            error = LEX_UNKNOWN_TOKEN;
+        }
+
+        if (error || keep_trivia || !TK_IS_TRIVIA(accepted_token)) {
+            if (push_token(&fresh, accepted_token,
+                prefix_beg - input, prefix_end - prefix_beg)) {
+
+                destroy_tokens(&fresh), destroy_tokens(tokens);
+                return LEX_NOMEM;
             }
         }
 
-        if (did_accept) {
-            prefix_end++;
+        if (error) {
+            break;
+        }
+
+        prefix_beg = prefix_end;
+    }
+
+    *damage = (struct damage) {
+        .beg = from,
+        .old_end = resync < last ? tokens->beg[resync] : UINT32_MAX,
+        .new_end = resync < last ? tokens->beg[resync] + delta : UINT32_MAX,
+    };
+
+    /* splice the fresh tokens between the kept ones and the shifted suffix */
+    const size_t suffix = error ? 0 : tokens->size - resync;
+    const size_t size_after = kept + fresh.size + suffix;
+
+    const size_t moved_to = kept + fresh.size;
+
+    if (size_after > tokens->size &&
+        reserve_tokens(tokens, size_after - tokens->size)) {
+
+        return destroy_tokens(&fresh), destroy_tokens(tokens), LEX_NOMEM;
+    }
+
+    memmove(&tokens->tk[moved_to], &tokens->tk[resync], suffix * sizeof(tk_t));
+    memmove(&tokens->beg[moved_to], &tokens->beg[resync],
+        suffix * sizeof(uint32_t));
+    memmove(&tokens->len[moved_to], &tokens->len[resync],
+        suffix * sizeof(uint32_t));
+
+    if (fresh.size) {
+        memcpy(&tokens->tk[kept], fresh.tk, fresh.size * sizeof(tk_t));
+        memcpy(&tokens->beg[kept], fresh.beg, fresh.size * sizeof(uint32_t));
+        memcpy(&tokens->len[kept], fresh.len, fresh.size * sizeof(uint32_t));
+    }
+
+    for (size_t idx = moved_to; idx + 1 < size_after; ++idx) {
+        tokens->beg[idx] += delta;
+    }
+
+    tokens->size = size_after;
+    tokens->input = input;
+    destroy_tokens(&fresh);
+    return error;
+}
+
+/*
+    The parallel lexer splits the input into one chunk per thread. Each thread
+    lexes its chunk from the first byte of the chunk, as if a token began
+    there, and keeps going until the first token which starts past the chunk.
+    Since a token stream is fully determined by the offset it starts at, the
+    tokens of a chunk can be spliced in from the first one which starts where
+    the previous chunk's last token ended.
+
+    A chunk which begins inside a comment or a string literal is lexed from
+    the wrong place, and may never line up with the previous chunk. For these
+    cases, each thread also finds where the token would end had the chunk
+    begun in each of those states, and lexes from there until it lines up with
+    the main run (giving up after LEX_RESYNC_MAX bytes, since at most one of
+    them can be right). Whatever is still misaligned is lexed sequentially
+    while the chunks are stitched together.
+*/
+#define LEX_CHUNK_MIN  (1 << 16)
+#define LEX_RESYNC_MAX (1 << 16)
+
+struct lex_run {
+    struct tokens tokens;
+    uint32_t end;
+};
+
+struct lex_chunk {
+    const uint8_t *input, *input_end;
+    uint32_t beg, end;
+    int flags, error;
+    size_t nruns;
+    struct lex_run runs[1 + DFA_NENTRIES];
+};
+
+/* binary search for the token which starts at "offset" */
+static size_t find_start(const struct tokens *const tokens,
+    const uint32_t offset)
+{
+    const size_t idx = lower_bound(tokens, 0, tokens->size, offset);
+    return idx < tokens->size && tokens->beg[idx] == offset ? idx : SIZE_MAX;
+}
+
+static int lex_run(const struct lex_chunk *const chunk,
+    struct lex_run *const run, const uint32_t from,
+    const struct tokens *const resync)
+{
+    const uint8_t *const input = chunk->input;
+    const uint8_t *prefix_beg = input + from, *prefix_end;
+    const uint8_t *const stop = resync && chunk->end - from > LEX_RESYNC_MAX ?
+        input + from + LEX_RESYNC_MAX : input + chunk->end;
+    const int keep_trivia = chunk->flags & LEX_KEEP_TRIVIA;
+    tk_t accepted_token;
+
+    run->tokens = (struct tokens) {
+        .input = input,
+    };
 
-            foreach_tk {
-                statuses[tk].prev = statuses[tk].curr;
+    while (prefix_beg < chunk->input_end && prefix_beg < stop) {
+        if (resync && find_start(resync, prefix_beg - input) != SIZE_MAX) {
+            break;
+        }
+
+        prefix_end = dfa_munch(prefix_beg, chunk->input_end, DFA_START,
+            &accepted_token);
+
+        if (accepted_token == TK_COUNT) {
+            prefix_end += prefix_end < chunk->input_end;
+        }
+
+        if (accepted_token == TK_COUNT ||
+            keep_trivia || !TK_IS_TRIVIA(accepted_token)) {
+
+            if (push_token(&run->tokens, accepted_token,
+                prefix_beg - input, prefix_end - prefix_beg)) {
+
+                return LEX_NOMEM;
             }
+        }
+
+        prefix_beg = prefix_end;
+    }
+
+    run->end = prefix_beg - input;
+    return LEX_OK;
+}
+
+static void *lex_chunk(void *const arg)
+{
+    struct lex_chunk *const chunk = arg;
+    const struct tokens *const main_run = &chunk->runs[0].tokens;
+    chunk->nruns = 1;
+
+    if ((chunk->error = lex_run(chunk, &chunk->runs[0], chunk->beg, NULL))) {
+        return NULL;
+    }
+
+    for (size_t entry = 0; entry < DFA_NENTRIES; ++entry) {
+        tk_t accepted_token;
+
+        const uint32_t from = dfa_munch(chunk->input + chunk->beg,
+            chunk->input_end, dfa.entries[entry], &accepted_token) -
+            chunk->input;
+
+        if (from == chunk->beg || from >= chunk->end ||
+            find_start(main_run, from) != SIZE_MAX) {
+            continue;
+        }
+
+        struct lex_run *const run = &chunk->runs[chunk->nruns++];
+
+        if ((chunk->error = lex_run(chunk, run, from, main_run))) {
+            return NULL;
+        }
+    }
+
+    return NULL;
+}
+
+static int append_tokens(struct tokens *const tokens,
+    const struct tokens *const from, const size_t idx, int *const unknown)
+{
+    const tk_t *const bad = memchr(&from->tk[idx], TK_COUNT, from->size - idx);
+    const size_t count =
+        (bad ? (size_t) (bad - from->tk) + 1 : from->size) - idx;
+
+    if (reserve_tokens(tokens, count)) {
+        return LEX_NOMEM;
+    }
+
+    const size_t to = tokens->size;
+    memcpy(&tokens->tk[to], &from->tk[idx], count * sizeof(tk_t));
+    memcpy(&tokens->beg[to], &from->beg[idx], count * sizeof(uint32_t));
+    memcpy(&tokens->len[to], &from->len[idx], count * sizeof(uint32_t));
+    tokens->size += count;
+
+    *unknown = bad != NULL;
+    return LEX_OK;
+}
+
+int lex_parallel(const uint8_t *const input, const size_t size,
+    const int flags, const size_t nthreads, struct tokens *const tokens)
+{
+    if (nthreads < 2 || size < nthreads * LEX_CHUNK_MIN || size > UINT32_MAX) {
+        return lex(input, size, flags, tokens);
+    }
+
+    pthread_once(&dfa_once, dfa_build);
+
+    struct lex_chunk *const chunks = calloc(nthreads, sizeof(struct lex_chunk));
+    pthread_t *const threads = calloc(nthreads, sizeof(pthread_t));
+    int *const started = calloc(nthreads, sizeof(int));
+    int error = LEX_OK, unknown = 0;
+    uint32_t at = 0;
+
+    *tokens = (struct tokens) {
+        .input = input,
+        .flags = flags,
+    };
+
+    if (!chunks || !threads || !started) {
+        return free(chunks), free(threads), free(started), LEX_NOMEM;
+    }
+
+    for (size_t idx = 0; idx < nthreads; ++idx) {
+        chunks[idx] = (struct lex_chunk) {
+            .input = input,
+            .input_end = input + size,
+            .beg = size / nthreads * idx,
+            .end = idx == nthreads - 1 ? size : size / nthreads * (idx + 1),
+            .flags = flags,
+        };
+
+        if (idx) {
+            started[idx] =
+                !pthread_create(&threads[idx], NULL, lex_chunk, &chunks[idx]);
+        }
+    }
+
+    lex_chunk(&chunks[0]);
+
+    for (size_t idx = 1; idx < nthreads; ++idx) {
+        if (started[idx]) {
+            pthread_join(threads[idx], NULL);
         } else {
-            accepted_token = TK_COUNT;
+            lex_chunk(&chunks[idx]);
+        }
+    }
+
+    #define OR_NOMEM(expr) \
+        if ((expr)) { \
+            error = LEX_NOMEM; \
+            goto out; \
+        }
+
+    size_t total = 2;
 
-            foreach_tk {
-                if (statuses[tk].prev == STS_ACCEPT) {
-                    accepted_token = tk;
+    for (size_t idx = 0; idx < nthreads; ++idx) {
+        total += chunks[idx].runs[0].tokens.size;
+    }
+
+    OR_NOMEM(reserve_tokens(tokens, total));
+    OR_NOMEM(push_token(tokens, TK_FBEG, 0, 0));
+
+    for (size_t idx = 0; idx < nthreads && !unknown; ++idx) {
+        const struct lex_chunk *const chunk = &chunks[idx];
+        OR_NOMEM(chunk->error);
+
+        while (at < chunk->end && !unknown) {
+            size_t run_idx, token_idx = SIZE_MAX;
+
+            for (run_idx = 0; run_idx < chunk->nruns; ++run_idx) {
+                token_idx = find_start(&chunk->runs[run_idx].tokens, at);
+
+                if (token_idx != SIZE_MAX) {
+                    break;
                 }
+            }
 
-                statuses[tk].prev = STS_HUNGRY;
-                statuses[tk].curr = STS_REJECT;
+            if (token_idx != SIZE_MAX) {
+                const struct lex_run *const run = &chunk->runs[run_idx];
+                OR_NOMEM(append_tokens(tokens, &run->tokens, token_idx,
+                    &unknown));
+                at = run->end;
+                continue;
             }
 
-            PUSH_OR_NOMEM(accepted_token, prefix_beg, prefix_end);
+            /* no run lines up with the previous chunk, lex a single token */
+            tk_t accepted_token;
+
+            const uint8_t *const prefix_end = dfa_munch(input + at,
+                input + size, DFA_START, &accepted_token);
 
-            if (accepted_token == TK_COUNT) {
-                (*tokens)[*ntokens - 1].end++;
-                return LEX_UNKNOWN_TOKEN;
+            const uint32_t end = prefix_end - input +
+                (accepted_token == TK_COUNT && prefix_end < input + size);
+
+            if (accepted_token == TK_COUNT ||
+                (flags & LEX_KEEP_TRIVIA) || !TK_IS_TRIVIA(accepted_token)) {
+
+                OR_NOMEM(push_token(tokens, accepted_token, at, end - at));
             }
 
-            prefix_beg = prefix_end;
+            unknown = accepted_token == TK_COUNT;
+            at = end;
         }
     }
 
-    accepted_token = TK_COUNT;
+    if (!unknown) {
+        OR_NOMEM(push_token(tokens, TK_FEND, 0, 0));
+    }
 
-    foreach_tk {
-        if (statuses[tk].curr == STS_ACCEPT) {
-            accepted_token = tk;
-        }
+    #undef OR_NOMEM
 
-        statuses[tk].prev = STS_HUNGRY;
-        statuses[tk].curr = STS_REJECT;
+    out:
+    for (size_t idx = 0; idx < nthreads; ++idx) {
+        for (size_t run_idx = 0; run_idx < chunks[idx].nruns; ++run_idx) {
+            destroy_tokens(&chunks[idx].runs[run_idx].tokens);
+        }
     }
 
-    PUSH_OR_NOMEM(accepted_token, prefix_beg, prefix_end);
+    free(chunks), free(threads), free(started);
 
-    if (accepted_token == TK_COUNT) {
-        return LEX_UNKNOWN_TOKEN;
+    if (error) {
+        return destroy_tokens(tokens), error;
     }
 
-    PUSH_OR_NOMEM(TK_FEND, NULL, NULL);
-    return LEX_OK;
-
-    #undef PUSH_OR_NOMEM
-    #undef foreach_tk
+    return shrink_tokens(tokens), unknown ? LEX_UNKNOWN_TOKEN : LEX_OK;
 }
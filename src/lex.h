@@ -56,15 +56,99 @@ enum {
 
 typedef uint8_t tk_t;
 
+#define TK_IS_TRIVIA(tk) ((tk) == TK_WSPC || (tk) == TK_LCOM || (tk) == TK_BCOM)
+
+/* a single token, as referenced by the leaves of the parse tree */
 struct token {
-    const uint8_t *beg, *end;
+    const uint8_t *beg;
+    uint32_t len;
     tk_t tk;
 };
 
-int lex(const uint8_t *, size_t, struct token **, size_t *);
+/* the token stream produced by the lexer, stored as struct-of-arrays */
+struct tokens {
+    /* the input which the token offsets are relative to */
+    const uint8_t *input;
+    size_t size, allocated;
+    int flags;
+
+    tk_t *tk;
+    uint32_t *beg, *len;
+};
+
+static inline struct token token_at(const struct tokens *const tokens,
+    const size_t idx)
+{
+    return (struct token) {
+        .beg = tokens->input + tokens->beg[idx],
+        .len = tokens->len[idx],
+        .tk = tokens->tk[idx],
+    };
+}
+
+/*
+    Whitespace and comments are dropped from the stream, unless
+    LEX_KEEP_TRIVIA is passed in the flags.
+*/
+int lex(const uint8_t *, size_t, int, struct tokens *);
+void destroy_tokens(struct tokens *);
+
+/*
+    Returns the index of the first token which starts at or after the given
+    offset, or that of the TK_FEND token if there is none.
+*/
+size_t find_token(const struct tokens *, size_t);
+
+/* the bytes [beg, old_end) of an input were replaced by [beg, new_end) */
+struct edit {
+    size_t beg, old_end, new_end;
+};
+
+/*
+    The tokens which started in [beg, old_end) of the old input were replaced
+    by tokens which start in [beg, new_end) of the new one. Both ends are
+    UINT32_MAX if relexing went on until the end of the input.
+*/
+struct damage {
+    uint32_t beg, old_end, new_end;
+};
+
+/*
+    Updates the tokens produced by lex() for an input to those of the edited
+    input, relexing only from the edit until the tokens line up again. The
+    tokens after that are still moved and shifted one by one, so the time is
+    linear in their number.
+*/
+int relex(const uint8_t *, size_t, const struct edit *, struct tokens *,
+    struct damage *);
+
+/*
+    Same as lex(), but the input is split into chunks which are lexed on the
+    given number of threads. Produces exactly the same tokens.
+*/
+int lex_parallel(const uint8_t *, size_t, int, size_t, struct tokens *);
+
+enum {
+    LEX_KEEP_TRIVIA = 1 << 0,
+};
+
+/*
+    Selects the routine used to skip over runs of whitespace and the bodies of
+    comments and string literals. The best available level not above the one
+    requested is used and returned. Defaults to the best one supported.
+*/
+int lex_scan(int);
+
+enum {
+    LEX_SCAN_NONE,
+    LEX_SCAN_SCALAR,
+    LEX_SCAN_SSE2,
+    LEX_SCAN_AVX2,
+};
 
 enum {
     LEX_OK,
     LEX_NOMEM,
     LEX_UNKNOWN_TOKEN,
+    LEX_TOO_LARGE,
 };
@@ -0,0 +1,669 @@
+#include "lower.h"
+#include "parse.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+/*
+    The lowering walks the parse tree once and drops everything that only
+    matters to the grammar: the Stmt, Expr and Pexp wrappers, the unary plus,
+    the keywords and the punctuation. The statements of a block are stored
+    next to each other, and every other node is stored before its operands, in
+    the order in which the interpreter visits them.
+
+    The walk keeps the parse nodes that are still to be lowered on a stack of
+    its own instead of recursing, so that the nesting of the input is limited
+    only by the maximum depth that the caller allows.
+*/
+enum {
+    WORK_BLOCK,     /* a block of statements */
+    WORK_STMT,      /* the inner node of a Stmt */
+    WORK_ARM,       /* an arm of a Ctrl that starts with a Cond */
+    WORK_TARGET,    /* the target of an assignment, a Name or an Aexp */
+    WORK_EXPR,      /* an Expr */
+};
+
+enum {
+    FIELD_NONE,
+    FIELD_A,
+    FIELD_B,
+    FIELD_C,
+};
+
+struct work {
+    uint8_t kind;
+
+    /*
+        The field of node "at" that refers to the lowered node, which is
+        allocated once the work is done. Statements are allocated along with
+        their block, so with FIELD_NONE, "at" is the lowered node itself.
+    */
+    uint8_t field;
+    uint32_t at;
+
+    /* the nesting depth, with the top-level block at 1 */
+    uint32_t depth;
+
+    /* the number of statements of a block, or the index of an arm */
+    uint32_t count;
+
+    union {
+        const struct node *node;
+        struct node *const *stmts;
+    };
+};
+
+struct lowering {
+    struct ast *ast;
+    bool nomem;
+
+    size_t size, allocated;
+    struct work *works;
+};
+
+/* returns the index of the first node, or 0 if out of memory */
+static uint32_t alloc_nodes(struct lowering *const ctx, const uint32_t count)
+{
+    struct ast *const ast = ctx->ast;
+
+    if (ast->size + count > ast->allocated) {
+        uint32_t allocated = ast->allocated ?: 64;
+
+        while (ast->size + count > allocated) {
+            allocated *= 2;
+        }
+
+        struct ast_node *const tmp = realloc(ast->nodes,
+            allocated * sizeof(struct ast_node));
+
+        if (!tmp) {
+            return ctx->nomem = true, 0;
+        }
+
+        ast->nodes = tmp;
+        ast->allocated = allocated;
+    }
+
+    const uint32_t first = ast->size;
+    ast->size += count;
+    return first;
+}
+
+static void push_work(struct lowering *const ctx, const struct work work)
+{
+    if (ctx->size == ctx->allocated) {
+        const size_t allocated = ctx->allocated ? ctx->allocated * 2 : 64;
+
+        struct work *const tmp = realloc(ctx->works,
+            allocated * sizeof(struct work));
+
+        if (!tmp) {
+            ctx->nomem = true;
+            return;
+        }
+
+        ctx->works = tmp;
+        ctx->allocated = allocated;
+    }
+
+    ctx->works[ctx->size++] = work;
+}
+
+/* returns the index of the node that the work is lowered to */
+static uint32_t place(struct lowering *const ctx, const struct work *const work)
+{
+    if (work->field == FIELD_NONE) {
+        return work->at;
+    }
+
+    const uint32_t idx = alloc_nodes(ctx, 1);
+    struct ast_node *const parent = &ctx->ast->nodes[work->at];
+
+    switch (work->field) {
+    case FIELD_A:
+        parent->a = idx;
+        break;
+
+    case FIELD_B:
+        parent->b = idx;
+        break;
+
+    case FIELD_C:
+        parent->c = idx;
+        break;
+    }
+
+    return idx;
+}
+
+static inline uint32_t offset_of(const struct lowering *const ctx,
+    const struct token *const token)
+{
+    return token->beg - ctx->ast->input;
+}
+
+static void push_expr(struct lowering *const ctx, const struct node *const expr,
+    const uint32_t at, const uint8_t field, const uint32_t depth)
+{
+    push_work(ctx, (struct work) {
+        .kind = WORK_EXPR,
+        .field = field,
+        .at = at,
+        .depth = depth,
+        .node = expr,
+    });
+}
+
+static void push_block(struct lowering *const ctx,
+    struct node *const *const stmts, const size_t count,
+    const uint32_t at, const uint8_t field, const uint32_t depth)
+{
+    push_work(ctx, (struct work) {
+        .kind = WORK_BLOCK,
+        .field = field,
+        .at = at,
+        .depth = depth,
+        .count = count,
+        .stmts = stmts,
+    });
+}
+
+/*
+    The symbols are the entries of a hash table with open addressing, which
+    is never more than half full. An entry with no name is free.
+*/
+struct symbol {
+    uint32_t hash;
+    uint32_t offset, len;
+    uint32_t var;
+};
+
+static uint32_t hash_name(const uint8_t *const name, const uint32_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    for (uint32_t idx = 0; idx < len; ++idx) {
+        hash = (hash ^ name[idx]) * 16777619u;
+    }
+
+    return hash;
+}
+
+static bool grow_symbols(struct ast *const ast)
+{
+    const uint32_t allocated = ast->symbols_allocated ?
+        ast->symbols_allocated * 2 : 64;
+
+    struct symbol *const symbols = calloc(allocated, sizeof(struct symbol));
+
+    if (!symbols) {
+        return false;
+    }
+
+    for (uint32_t old = 0; old < ast->symbols_allocated; ++old) {
+        const struct symbol *const symbol = &ast->symbols[old];
+
+        if (symbol->len) {
+            uint32_t idx = symbol->hash & (allocated - 1);
+
+            while (symbols[idx].len) {
+                idx = (idx + 1) & (allocated - 1);
+            }
+
+            symbols[idx] = *symbol;
+        }
+    }
+
+    free(ast->symbols);
+    ast->symbols = symbols;
+    ast->symbols_allocated = allocated;
+    return true;
+}
+
+/* returns the variable of the name, which is a new one for a new name */
+static uint32_t intern(struct lowering *const ctx,
+    const struct token *const name)
+{
+    struct ast *const ast = ctx->ast;
+
+    if ((ast->nvars + 1) * 2 > ast->symbols_allocated && !grow_symbols(ast)) {
+        return ctx->nomem = true, 0;
+    }
+
+    const uint32_t hash = hash_name(name->beg, name->len);
+    const uint32_t mask = ast->symbols_allocated - 1;
+
+    for (uint32_t idx = hash & mask; ; idx = (idx + 1) & mask) {
+        struct symbol *const symbol = &ast->symbols[idx];
+
+        if (!symbol->len) {
+            *symbol = (struct symbol) {
+                .hash = hash,
+                .offset = offset_of(ctx, name),
+                .len = name->len,
+                .var = ast->nvars++,
+            };
+
+            return symbol->var;
+        }
+
+        if (symbol->hash == hash && symbol->len == name->len &&
+            !memcmp(ast->input + symbol->offset, name->beg, name->len)) {
+
+            return symbol->var;
+        }
+    }
+}
+
+static uint32_t lower_nmbr(const struct node *const nmbr)
+{
+    const uint8_t *const beg = nmbr->token.beg;
+    const ptrdiff_t len = nmbr->token.len;
+    uint32_t result = 0, mult = 1;
+
+    for (ptrdiff_t idx = len - 1; idx >= 0; --idx, mult *= 10) {
+        result += mult * (beg[idx] - '0');
+    }
+
+    return result;
+}
+
+static void lower_block(struct lowering *const ctx,
+    const struct work *const work)
+{
+    const uint32_t idx = place(ctx, work);
+
+    if (ctx->nomem) {
+        return;
+    }
+
+    /* a lazy parse leaves large blocks empty, with their braces far apart */
+    const struct lazy *const lazy = ctx->ast->lazy;
+
+    if (lazy && !work->count && work->stmts[-1]->token.tk == TK_LBRC) {
+        const struct token *const lbrc = &work->stmts[-1]->token;
+        const struct token *const rbrc = &work->stmts[0]->token;
+        const uint32_t body = offset_of(ctx, lbrc) + lbrc->len;
+
+        if (offset_of(ctx, rbrc) - body >= PARSE_LAZY_MIN) {
+            ctx->ast->nodes[idx] = (struct ast_node) {
+                .kind = AST_LAZY,
+                .a = find_token(&lazy->tokens, offset_of(ctx, lbrc)),
+                .c = work->depth,
+            };
+
+            return;
+        }
+    }
+
+    const uint32_t first = alloc_nodes(ctx, work->count);
+
+    if (ctx->nomem) {
+        return;
+    }
+
+    ctx->ast->nodes[idx] = (struct ast_node) {
+        .kind = AST_BLOCK,
+        .a = first,
+        .b = work->count,
+    };
+
+    for (size_t stmt_idx = work->count; stmt_idx-- > 0; ) {
+        push_work(ctx, (struct work) {
+            .kind = WORK_STMT,
+            .at = first + stmt_idx,
+            .depth = work->depth + 1,
+            .node = work->stmts[stmt_idx]->children[0],
+        });
+    }
+}
+
+static void lower_stmt(struct lowering *const ctx,
+    const struct work *const work)
+{
+    const struct node *const stmt = work->node;
+    const uint32_t idx = work->at, depth = work->depth + 1;
+    struct ast_node *const node = &ctx->ast->nodes[idx];
+
+    switch (stmt->nt) {
+    case NT_Assn:
+        *node = (struct ast_node) { .kind = AST_ASSIGN };
+        push_expr(ctx, stmt->children[2], idx, FIELD_B, depth);
+
+        push_work(ctx, (struct work) {
+            .kind = WORK_TARGET,
+            .field = FIELD_A,
+            .at = idx,
+            .depth = depth,
+            .node = stmt->children[0],
+        });
+        break;
+
+    case NT_Prnt: {
+        const bool has_string = stmt->nchildren == 4;
+        const struct node *const strl = stmt->children[1];
+
+        *node = (struct ast_node) {
+            .kind = AST_PRINT,
+            .aux = has_string ? AST_PRINT_STRING : 0,
+            .b = has_string ? offset_of(ctx, &strl->token) + 1 : 0,
+            .c = has_string ? strl->token.len - 2 : 0,
+        };
+
+        push_expr(ctx, stmt->children[has_string + 1], idx, FIELD_A, depth);
+    } break;
+
+    case NT_Ctrl: {
+        const struct node *const inner = stmt->children[0];
+
+        switch (inner->nt) {
+        case NT_Cond:
+            /* the arms follow each other, so they are as deep as the Ctrl */
+            push_work(ctx, (struct work) {
+                .kind = WORK_ARM,
+                .at = idx,
+                .depth = work->depth,
+                .node = stmt,
+            });
+            break;
+
+        case NT_Dowh:
+            *node = (struct ast_node) { .kind = AST_DOWHILE };
+
+            push_expr(ctx, inner->children[inner->nchildren - 2],
+                idx, FIELD_B, depth);
+
+            push_block(ctx, &inner->children[2], inner->nchildren - 6,
+                idx, FIELD_A, depth);
+            break;
+
+        case NT_Whil:
+            *node = (struct ast_node) { .kind = AST_WHILE };
+
+            push_block(ctx, &inner->children[3], inner->nchildren - 4,
+                idx, FIELD_B, depth);
+
+            push_expr(ctx, inner->children[1], idx, FIELD_A, depth);
+            break;
+
+        default:
+            abort();
+        }
+    } break;
+
+    default:
+        abort();
+    }
+}
+
+/* the Cond and every Elif become an If, linked to the next one */
+static void lower_arm(struct lowering *const ctx, const struct work *const work)
+{
+    const struct node *const ctrl = work->node;
+    const struct node *const arm = ctrl->children[work->count];
+    const uint32_t depth = work->depth + 1;
+
+    if (arm->nt == NT_Else) {
+        push_block(ctx, &arm->children[2], arm->nchildren - 3,
+            work->at, work->field, depth);
+
+        return;
+    }
+
+    const uint32_t idx = place(ctx, work);
+
+    if (ctx->nomem) {
+        return;
+    }
+
+    ctx->ast->nodes[idx] = (struct ast_node) { .kind = AST_IF };
+
+    if (work->count + 1 < ctrl->nchildren) {
+        push_work(ctx, (struct work) {
+            .kind = WORK_ARM,
+            .field = FIELD_C,
+            .at = idx,
+            .depth = work->depth,
+            .count = work->count + 1,
+            .node = ctrl,
+        });
+    }
+
+    push_block(ctx, &arm->children[3], arm->nchildren - 4,
+        idx, FIELD_B, depth);
+
+    push_expr(ctx, arm->children[1], idx, FIELD_A, depth);
+}
+
+static void lower_expr(struct lowering *const ctx,
+    const struct work *const work)
+{
+    const struct node *expr = work->node, *inner = expr;
+    const uint32_t depth = work->depth + 1;
+
+    if (work->kind == WORK_TARGET) {
+        /* a Name, or an Aexp, which is handled as an Expr would be */
+        if (!inner->nchildren) {
+            const uint32_t idx = place(ctx, work);
+
+            if (ctx->nomem) {
+                return;
+            }
+
+            const uint32_t var = intern(ctx, &inner->token);
+
+            if (ctx->nomem) {
+                return;
+            }
+
+            ctx->ast->nodes[idx] = (struct ast_node) {
+                .kind = AST_VAR,
+                .a = var,
+            };
+
+            return;
+        }
+    } else {
+        /* look through parentheses and unary pluses */
+        for (;;) {
+            inner = expr->children[0];
+
+            if (inner->nt == NT_Pexp) {
+                expr = inner->children[1];
+            } else if (inner->nt == NT_Uexp &&
+                inner->children[0]->token.tk == TK_PLUS) {
+
+                expr = inner->children[1];
+            } else {
+                break;
+            }
+        }
+    }
+
+    const uint32_t idx = place(ctx, work);
+
+    if (ctx->nomem) {
+        return;
+    }
+
+    struct ast_node *const node = &ctx->ast->nodes[idx];
+
+    switch (inner->nt) {
+    case NT_Atom: {
+        const struct node *const atom = inner->children[0];
+
+        if (atom->token.tk == TK_NAME) {
+            const uint32_t var = intern(ctx, &atom->token);
+
+            if (ctx->nomem) {
+                return;
+            }
+
+            *node = (struct ast_node) {
+                .kind = AST_VAR,
+                .a = var,
+            };
+        } else {
+            *node = (struct ast_node) {
+                .kind = AST_CONST,
+                .a = lower_nmbr(atom),
+            };
+        }
+    } break;
+
+    case NT_Bexp:
+        *node = (struct ast_node) {
+            .kind = AST_BINOP,
+            .op = inner->children[1]->token.tk,
+        };
+
+        push_expr(ctx, inner->children[2], idx, FIELD_B, depth);
+        push_expr(ctx, inner->children[0], idx, FIELD_A, depth);
+        break;
+
+    case NT_Uexp:
+        *node = (struct ast_node) {
+            .kind = AST_UNOP,
+            .op = inner->children[0]->token.tk,
+        };
+
+        push_expr(ctx, inner->children[1], idx, FIELD_A, depth);
+        break;
+
+    case NT_Texp:
+        *node = (struct ast_node) { .kind = AST_TERNARY };
+        push_expr(ctx, inner->children[4], idx, FIELD_C, depth);
+        push_expr(ctx, inner->children[2], idx, FIELD_B, depth);
+        push_expr(ctx, inner->children[0], idx, FIELD_A, depth);
+        break;
+
+    case NT_Aexp: {
+        const uint32_t var = intern(ctx, &inner->children[0]->token);
+
+        if (ctx->nomem) {
+            return;
+        }
+
+        *node = (struct ast_node) {
+            .kind = AST_INDEX,
+            .a = var,
+        };
+
+        push_expr(ctx, inner->children[2], idx, FIELD_C, depth);
+    } break;
+
+    default:
+        abort();
+    }
+}
+
+/* lowers the work on the stack, returns one of LOWER_* */
+static int lower_works(struct lowering *const ctx)
+{
+    struct ast *const ast = ctx->ast;
+    bool too_deep = false;
+
+    while (ctx->size && !ctx->nomem) {
+        const struct work work = ctx->works[--ctx->size];
+
+        if (work.depth > ast->max_depth) {
+            too_deep = true;
+            break;
+        }
+
+        if (work.depth > ast->depth) {
+            ast->depth = work.depth;
+        }
+
+        switch (work.kind) {
+        case WORK_BLOCK:
+            lower_block(ctx, &work);
+            break;
+
+        case WORK_STMT:
+            lower_stmt(ctx, &work);
+            break;
+
+        case WORK_ARM:
+            lower_arm(ctx, &work);
+            break;
+
+        case WORK_TARGET:
+        case WORK_EXPR:
+            lower_expr(ctx, &work);
+            break;
+        }
+    }
+
+    free(ctx->works);
+    return ctx->nomem ? LOWER_NOMEM : too_deep ? LOWER_TOO_DEEP : LOWER_OK;
+}
+
+int lower(const struct node *const unit, const uint8_t *const input,
+    const size_t max_depth, const struct lazy *const lazy,
+    struct ast *const ast)
+{
+    *ast = (struct ast) {
+        .input = input,
+        .lazy = lazy,
+        .max_depth = max_depth,
+    };
+
+    struct lowering ctx = { .ast = ast };
+
+    /* node 0 is allocated too, so that no other node has the index 0 */
+    alloc_nodes(&ctx, 1);
+    ast->root = alloc_nodes(&ctx, 1);
+
+    if (!ctx.nomem) {
+        ast->nodes[0] = (struct ast_node) { .kind = AST_NONE };
+
+        push_block(&ctx, &unit->children[1], unit->nchildren - 2,
+            ast->root, FIELD_NONE, 1);
+    }
+
+    const int error = lower_works(&ctx);
+
+    if (error) {
+        destroy_ast(ast);
+    }
+
+    return error;
+}
+
+int lower_lazy(struct ast *const ast, const uint32_t idx)
+{
+    const struct ast_node lazy = ast->nodes[idx];
+    const struct node unit = parse_block(ast->lazy, lazy.a);
+
+    /* the block was checked along with the rest of the input */
+    if (parse_error(unit)) {
+        if (parse_error(unit) != PARSE_NOMEM) {
+            abort();
+        }
+
+        return LOWER_NOMEM;
+    }
+
+    struct lowering ctx = { .ast = ast };
+
+    push_block(&ctx, &unit.children[1], unit.nchildren - 2,
+        idx, FIELD_NONE, lazy.c);
+
+    const int error = lower_works(&ctx);
+    destroy_tree(unit);
+    return error;
+}
+
+void destroy_ast(struct ast *const ast)
+{
+    free(ast->nodes);
+    ast->nodes = NULL;
+    ast->size = 0;
+    ast->allocated = 0;
+
+    free(ast->symbols);
+    ast->symbols = NULL;
+    ast->symbols_allocated = 0;
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct node;
+struct lazy;
+struct symbol;
+
+/*
+    The lowered program is a single array of fixed-size nodes, which refer to
+    each other by their index in the array. Index 0 is never a valid node, so
+    it stands for "none". String literals are kept as byte offsets into the
+    input, and names are resolved to the index of their variable, so the array
+    itself contains no pointers.
+*/
+enum {
+    AST_NONE,
+
+    /* statements */
+    AST_BLOCK,      /* a = first statement, b = number of statements */
+    AST_ASSIGN,     /* a = Var or Index node, b = value */
+    AST_PRINT,      /* a = value, b = string offset, c = string length */
+    AST_IF,         /* a = condition, b = Block, c = next If, Block or none */
+    AST_WHILE,      /* a = condition, b = Block, c = Count or none */
+    AST_DOWHILE,    /* a = Block, b = condition */
+    AST_LAZY,       /* a = "{" token, c = depth */
+    AST_SWITCH,     /* a = value, b = first Case, c = number of Cases */
+    AST_CASE,       /* a = constant, b = Block or none */
+
+    /* expressions */
+    AST_CONST,      /* a = value */
+    AST_VAR,        /* a = variable */
+    AST_INDEX,      /* a = variable, c = index */
+    AST_UNOP,       /* op = operator token, a = operand */
+    AST_BINOP,      /* op = operator token, a = left, b = right */
+    AST_TERNARY,    /* a = condition, b = value if true, c = value if false */
+    AST_TEMP,       /* a = temporary whose value is reused */
+    AST_BOUNDS,     /* a = variable, b = first index, c = last index */
+    AST_COUNT,      /* op = < or <=, a = counter, b = bound, c = step */
+};
+
+/* AST_PRINT nodes with a string literal have this flag set in aux */
+#define AST_PRINT_STRING 1
+
+/*
+    AST_UNOP and AST_BINOP nodes whose value is reused later have the
+    temporary it is saved into, plus 1, in aux. The Temp nodes that read it
+    always run after the node, with no loop or branch in between.
+*/
+
+/*
+    The optimizer turns If chains that compare one value against constants
+    into an AST_SWITCH, which runs the Block of the Case for the value. Its
+    Cases follow each other, sorted by their constants, and one more Case
+    after them holds the Block that runs for any other value, if any. With
+    AST_SWITCH_DENSE set in op, the Cases are every constant from the first
+    to the last, so the Case for a value is found by its offset instead of
+    by a binary search, and those with no Block of their own run the last.
+*/
+#define AST_SWITCH_DENSE 1
+
+/*
+    The optimizer runs a loop whose indices it can bound without checking
+    them, when an AST_BOUNDS node before the loop finds that every element
+    from the first index to the last one is there. Those AST_INDEX nodes
+    have AST_INDEX_UNCHECKED set in aux. With AST_BOUNDS_GROW set in op,
+    the Bounds node grows the variable first, to just what storing into
+    every aux-th element from the first to the last one would, and then
+    the loop stores into them without growing it.
+*/
+#define AST_INDEX_UNCHECKED 1
+#define AST_BOUNDS_GROW 1
+
+/*
+    The optimizer counts the trips of a loop that steps a variable up by a
+    constant at the end of its body, for as long as it is below a Const or
+    a Var that the loop never assigns, both defined. An AST_COUNT node then
+    steps the counter, as its assignment would, and compares it with the
+    bound, in place of the assignment and the condition: as the condition
+    of a DoWhile, or in c of a While, which still checks its condition
+    before the first trip. With AST_COUNT_HIDDEN set in aux, the loop never
+    reads the counter otherwise, so it can be stepped once the loop is done.
+*/
+#define AST_COUNT_HIDDEN 1
+
+struct ast_node {
+    uint8_t kind;
+    uint8_t op;
+    uint16_t aux;
+    uint32_t a, b, c;
+};
+
+/* returns the offset of the Case whose Block the Switch node runs */
+static inline uint32_t switch_case(const struct ast_node *const nodes,
+    const struct ast_node *const node, const int value)
+{
+    const struct ast_node *const cases = &nodes[node->b];
+
+    if (node->op == AST_SWITCH_DENSE) {
+        const uint32_t offset = (uint32_t) value - cases->a;
+        return offset < node->c && cases[offset].b ? offset : node->c;
+    }
+
+    uint32_t low = 0, high = node->c;
+
+    while (low < high) {
+        const uint32_t middle = low + (high - low) / 2;
+
+        if ((int) cases[middle].a < value) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low < node->c && (int) cases[low].a == value ? low : node->c;
+}
+
+struct ast {
+    /* the input which the names and string literals are offsets into */
+    const uint8_t *input;
+
+    uint32_t size, allocated;
+    struct ast_node *nodes;
+
+    /* the Block of top-level statements */
+    uint32_t root;
+
+    /*
+        The deepest nesting of nodes, with the top-level block at depth 1. The
+        interpreter needs no more than this many frames to run the program.
+    */
+    uint32_t depth;
+
+    /*
+        The number of distinct names, which are the variables. The names are
+        interned in a hash table, which is kept for the blocks that are
+        lowered later, so that they resolve the names to the same variables.
+    */
+    uint32_t nvars, symbols_allocated;
+    struct symbol *symbols;
+
+    /* the number of temporaries that reused values are saved into */
+    uint32_t ntemps;
+
+    /* the tokens of the blocks left to be lowered, and how deep they can go */
+    const struct lazy *lazy;
+    size_t max_depth;
+};
+
+/*
+    Lowers the tree of a Unit, parsed from the given input, unless it is
+    nested deeper than the given maximum. The tree can be destroyed
+    afterwards, but the input must stay around while the lowered program is in
+    use.
+
+    Given the tokens of a lazy parse, the blocks that parse_lazy() left empty
+    are lowered to Lazy nodes, which lower_lazy() replaces with their Block
+    later on. The tokens must stay around until then.
+*/
+int lower(const struct node *, const uint8_t *, size_t, const struct lazy *,
+    struct ast *);
+
+enum {
+    LOWER_OK,
+    LOWER_NOMEM,
+    LOWER_TOO_DEEP,
+};
+
+/*
+    Parses the body of the Lazy node at the given index and lowers it in the
+    place of the node, appending any other nodes to the program. Blocks in
+    the body are left to be lowered later again. On error, the program can no
+    longer be run.
+*/
+int lower_lazy(struct ast *, uint32_t);
+
+void destroy_ast(struct ast *);
@@ -1,21 +1,28 @@
 #include "lex.h"
 #include "parse.h"
+#include "lower.h"
+#include "optimize.h"
+#include "code.h"
+#include "emit.h"
 #include "run.h"
+#include "trace.h"
+#include "cache.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <getopt.h>
 
-static void print_tokens(const struct token *const tokens,
-    const size_t ntokens, const int error)
+static void print_tokens(const struct tokens *const tokens, const int error)
 {
-    for (size_t i = 0, alternate = 0; i < ntokens; ++i) {
-        const struct token token = tokens[i];
+    for (size_t i = 0, alternate = 0; i < tokens->size; ++i) {
+        const struct token token = token_at(tokens, i);
 
         if (token.tk == TK_FBEG || token.tk == TK_FEND) {
             continue;
@@ -25,32 +32,295 @@ static void print_tokens(const struct token *const tokens,
             alternate++;
         }
 
-        const int len = token.end - token.beg;
+        const int len = token.len;
 
-        if (i == ntokens - 1 && error == LEX_UNKNOWN_TOKEN) {
-            printf(RED("%.*s") CYAN("< Unknown token\n"), len ?: 1, token.beg);
+        if (i == tokens->size - 1 && error == LEX_UNKNOWN_TOKEN) {
+            trace_printf(RED("%.*s") CYAN("< Unknown token\n"),
+                len ?: 1, token.beg);
         } else if (token.tk == TK_LCOM || token.tk == TK_BCOM) {
-            printf(GRAY("%.*s"), len, token.beg);
+            trace_printf(GRAY("%.*s"), len, token.beg);
         } else if (alternate % 2) {
-            printf(GREEN("%.*s"), len, token.beg);
+            trace_printf(GREEN("%.*s"), len, token.beg);
         } else {
-            printf(YELLOW("%.*s"), len, token.beg);
+            trace_printf(YELLOW("%.*s"), len, token.beg);
         }
     }
 }
 
+static void print_too_deep(const long max_depth)
+{
+    trace_printf(RED("The program is nested more than %ld levels deep.") "\n",
+        max_depth);
+}
+
+/* lexes, parses, lowers and optimizes the input, returns 0 on success */
+static int compile(const uint8_t *const input, const size_t size,
+    const int level, const long jobs, const long max_depth,
+    struct lazy *const lazy, const int optimized, struct ast *const ast)
+{
+    const int print_lexed = level >= TRACE_TOKENS;
+    int error = 1;
+
+    if (level >= TRACE_PHASES) {
+        trace_printf(WHITE("*** Lexing ***") "\n");
+    }
+
+    struct tokens tokens;
+
+    const int lex_error = lex_parallel(input, size,
+        print_lexed ? LEX_KEEP_TRIVIA : 0, jobs, &tokens);
+
+    if (print_lexed && (!lex_error || lex_error == LEX_UNKNOWN_TOKEN)) {
+        print_tokens(&tokens, lex_error);
+    } else if (lex_error == LEX_UNKNOWN_TOKEN) {
+        const struct token token = token_at(&tokens, tokens.size - 1);
+        const int len = token.len;
+        trace_printf(RED("%.*s") CYAN("< Unknown token\n"),
+            len ?: 1, token.beg);
+    } else if (lex_error == LEX_NOMEM) {
+        trace_printf(RED("The lexer could not allocate memory.") "\n");
+    } else if (lex_error == LEX_TOO_LARGE) {
+        trace_printf(RED("The input is too large for the lexer.") "\n");
+    }
+
+    if (!lex_error) {
+        if (level >= TRACE_PHASES) {
+            trace_printf(WHITE("\n*** Parsing ***") "\n");
+        }
+
+        /* a lazy parse takes over the tokens, for the blocks it leaves out */
+        const struct node root = lazy ? parse_lazy(lazy, &tokens) :
+            parse_parallel(&tokens, jobs);
+
+        /* at the full level, the trace already ends with the rejection */
+        if (parse_error(root) == PARSE_REJECT && level < TRACE_FULL) {
+            trace_printf(RED("The parser rejected the input.") "\n");
+        }
+
+        if (parse_error(root) && trace.events) {
+            trace_dump(input);
+        }
+
+        if (!parse_error(root)) {
+            const int lower_error = lower(&root, input, max_depth, lazy, ast);
+            destroy_tree(root);
+
+            if (lower_error == LOWER_NOMEM) {
+                trace_printf(RED("The lowering could not allocate memory.")
+                    "\n");
+            } else if (lower_error == LOWER_TOO_DEEP) {
+                print_too_deep(max_depth);
+            } else if (optimized && optimize(ast) == OPTIMIZE_NOMEM) {
+                trace_printf(RED("The optimizer could not allocate memory.")
+                    "\n");
+                destroy_ast(ast);
+            } else {
+                error = 0;
+            }
+        }
+    }
+
+    destroy_tokens(&tokens);
+    return error;
+}
+
+enum {
+    ENGINE_VM,
+    ENGINE_TREE,
+    ENGINE_JIT,
+};
+
+static int parse_engine(const char *const name)
+{
+    static const char *const names[] = {
+        [ENGINE_VM] = "vm",
+        [ENGINE_TREE] = "tree",
+        [ENGINE_JIT] = "jit",
+    };
+
+    for (size_t engine = 0; engine < sizeof(names) / sizeof(*names);
+        ++engine) {
+
+        if (!strcmp(name, names[engine])) {
+            return engine;
+        }
+    }
+
+    return -1;
+}
+
+/* runs the lowered program on the engine, returns 0 on success */
+static int execute(struct ast *const ast, const int engine,
+    const long max_depth)
+{
+    struct code code;
+    int run_error;
+
+    if (engine == ENGINE_TREE) {
+        run_error = run(ast);
+
+        if (trace.level >= TRACE_PHASES && run_stats.promoted) {
+            trace_printf(CYAN("%u hot loops were promoted to closures, "
+                "which ran them %llu times.") "\n", run_stats.promoted,
+                (unsigned long long) run_stats.entered);
+        }
+    } else if (compile_code(ast, &code)) {
+        trace_printf(RED("The compiler could not allocate memory.") "\n");
+        return 1;
+    } else {
+        run_error = engine == ENGINE_JIT ? run_jit(ast, &code) :
+            RUN_UNSUPPORTED;
+
+        if (run_error == RUN_UNSUPPORTED) {
+            if (engine == ENGINE_JIT && trace.level >= TRACE_PHASES) {
+                trace_printf(CYAN("The JIT does not support the program, "
+                    "so it runs on the VM.") "\n");
+                trace_flush();
+            }
+
+            run_error = run_code(ast, &code);
+        }
+
+        destroy_code(&code);
+    }
+
+    if (run_error == RUN_NOMEM) {
+        trace_printf(RED("The interpreter could not allocate memory.") "\n");
+    } else if (run_error == RUN_TOO_DEEP) {
+        print_too_deep(max_depth);
+    }
+
+    return run_error != RUN_OK;
+}
+
+static int parse_level(const char *const name)
+{
+    static const char *const names[] = { "off", "phases", "tokens", "full" };
+
+    for (size_t level = 0; level < sizeof(names) / sizeof(*names); ++level) {
+        if (!strcmp(name, names[level])) {
+            return level;
+        }
+    }
+
+    return -1;
+}
+
 int main(int argc, char **argv)
 {
     int fd;
     size_t size;
     struct stat statbuf;
     int exit_status = EXIT_FAILURE;
+    int level = TRACE_OFF;
+    long jobs = 1;
+    long ring_size = 0;
+    long max_depth = 100000;
+    const char *cache_dir = NULL;
+    struct lazy lazy = {0};
+    int lazy_parse = 0;
+    int engine = ENGINE_VM;
+    int emit = 0;
+    int optimized = 1;
+
+    static const struct option long_options[] = {
+        { "engine", required_argument, NULL, 'e' },
+        { "emit-c", no_argument, NULL, 'E' },
+        { 0 },
+    };
+
+    for (int opt; (opt = getopt_long(argc, argv, "t:r:j:d:c:lO:", long_options,
+        NULL)) != -1; ) {
+
+        switch (opt) {
+        case 't':
+            if ((level = parse_level(optarg)) < 0) {
+                goto usage;
+            }
+            break;
+
+        case 'r': {
+            char *end;
+            ring_size = strtol(optarg, &end, 10);
 
-    if (argc != 2) {
-        return fprintf(stderr, "Usage: %s <file>\n", argv[0]), exit_status;
+            if (*end || ring_size < 0) {
+                goto usage;
+            }
+        } break;
+
+        case 'j': {
+            char *end;
+            jobs = strtol(optarg, &end, 10);
+
+            if (*end || jobs < 1) {
+                goto usage;
+            }
+        } break;
+
+        case 'd': {
+            char *end;
+            max_depth = strtol(optarg, &end, 10);
+
+            if (*end || max_depth < 1) {
+                goto usage;
+            }
+        } break;
+
+        case 'c':
+            cache_dir = optarg;
+            break;
+
+        case 'l':
+            lazy_parse = 1;
+            break;
+
+        case 'O':
+            if (strcmp(optarg, "0") && strcmp(optarg, "1")) {
+                goto usage;
+            }
+
+            optimized = *optarg == '1';
+            break;
+
+        case 'e':
+            if ((engine = parse_engine(optarg)) < 0) {
+                goto usage;
+            }
+            break;
+
+        case 'E':
+            emit = 1;
+            break;
+
+        default:
+            goto usage;
+        }
     }
 
-    if ((fd = open(argv[1], O_RDONLY)) < 0) {
+    if (optind != argc - 1) {
+        usage:
+        fprintf(stderr, "Usage: %s [-t LEVEL] [-r N] [-j N] [-d N] [-c DIR] "
+            "[-l] [-O N] [--engine=vm|tree|jit] [--emit-c] <file>\n",
+            argv[0]);
+        fprintf(stderr, "  -t LEVEL  off (default), phases, tokens or full\n");
+        fprintf(stderr, "  -r N      dump the last N parser events on error\n");
+        fprintf(stderr, "  -j N      lex and parse on N threads\n");
+        fprintf(stderr, "  -d N      allow nesting N levels deep (100000)\n");
+        fprintf(stderr, "  -c DIR    cache the lowered program in DIR\n");
+        fprintf(stderr, "  -l        parse large blocks once they are run\n");
+        fprintf(stderr, "  -O N      optimize the program (1, the default), "
+            "or not (0)\n");
+        fprintf(stderr, "  --engine  run bytecode (vm, the default), walk the "
+            "tree, or run x86-64\n");
+        fprintf(stderr, "            code where supported (jit)\n");
+        fprintf(stderr, "  --emit-c  write the program as C instead of "
+            "running it\n");
+        return exit_status;
+    }
+
+    const char *const path = argv[optind];
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
         return perror("open"), exit_status;
     }
 
@@ -59,7 +329,7 @@ int main(int argc, char **argv)
     }
 
     if ((size = statbuf.st_size) == 0) {
-        fprintf(stderr, "‘%s‘: file is empty\n", argv[1]);
+        fprintf(stderr, "‘%s‘: file is empty\n", path);
         return close(fd), exit_status;
     }
 
@@ -69,30 +339,77 @@ int main(int argc, char **argv)
         return perror("mmap"), close(fd), exit_status;
     }
 
-    puts(WHITE("*** Lexing ***"));
-    struct token *tokens;
-    size_t ntokens;
-    const int lex_error = lex(mapped, size, &tokens, &ntokens);
+    if (trace_open(level, stdout, ring_size) < 0) {
+        fprintf(stderr, "Could not allocate the trace ring buffer.\n");
+        return munmap((uint8_t *const) mapped, size), close(fd), exit_status;
+    }
 
-    if (!lex_error || lex_error == LEX_UNKNOWN_TOKEN) {
-        print_tokens(tokens, ntokens, lex_error);
-    } else if (lex_error == LEX_NOMEM) {
-        puts(RED("The lexer could not allocate memory."));
+    struct cache cache = {0};
+    struct ast ast;
+    int error = 0;
+
+    /* the cache only holds optimized programs */
+    cache_dir = optimized ? cache_dir : NULL;
+
+    if (cache_dir) {
+        cache_open(&cache, cache_dir, mapped, size);
     }
 
-    if (!lex_error) {
-        puts(WHITE("\n*** Parsing ***"));
-        const struct node root = parse(tokens, ntokens);
+    /* the tokens and the parse stack can only be traced from the source */
+    if (cache_dir && level < TRACE_TOKENS &&
+        cache_load(&cache, &ast) == CACHE_HIT) {
 
-        if (!parse_error(root)) {
-            puts(WHITE("\n*** Running ***"));
-            run(&root);
-            destroy_tree(root);
+        if (level >= TRACE_PHASES) {
+            trace_printf(WHITE("*** Loading from the cache ***") "\n");
+        }
+
+        if (ast.depth > max_depth) {
+            print_too_deep(max_depth);
+            error = 1;
+        }
+    } else {
+        /*
+            The parse stack is traced in one go, before the program prints, and
+            the whole program is needed to write it as C.
+        */
+        lazy_parse &= level < TRACE_FULL && !emit;
+
+        error = compile(mapped, size, level, jobs, max_depth,
+            lazy_parse ? &lazy : NULL, optimized, &ast);
+
+        /* a lazily lowered program is not complete, so it is not cached */
+        if (!error && cache_dir && !lazy_parse &&
+            cache_store(&cache, &ast) < 0 && level >= TRACE_PHASES) {
+
+            trace_printf(RED("The program could not be cached in %s.") "\n",
+                cache_dir);
+        }
+    }
+
+    if (!error) {
+        if (level >= TRACE_PHASES && emit) {
+            trace_printf(WHITE("\n*** Emitting C ***") "\n");
+        } else if (level >= TRACE_PHASES) {
+            trace_printf(WHITE("\n*** Running ***") "\n");
+        }
+
+        /* the program, or the C, prints on its own */
+        trace_flush();
+
+        if (emit && emit_c(&ast, stdout)) {
+            trace_printf(RED("The emitter could not allocate memory.") "\n");
+        } else if (emit || !execute(&ast, engine, max_depth)) {
             exit_status = EXIT_SUCCESS;
         }
+
+        if (!cache.map) {
+            destroy_ast(&ast);
+        }
     }
 
-    free(tokens);
+    destroy_lazy(&lazy);
+    cache_close(&cache);
+    trace_close();
     munmap((uint8_t *const) mapped, size);
     close(fd);
     return exit_status;
@@ -0,0 +1,2227 @@
+#include "optimize.h"
+#include "lex.h"
+#include "lower.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+
+/*
+    Folds the binary operator, and returns false instead if it would warn or
+    trap when it runs. The arithmetic wraps around, like it does when it runs.
+*/
+static bool fold_binop(const tk_t op, const int left, const int right,
+    int *const value)
+{
+    switch (op) {
+    case TK_PLUS:
+        *value = (int) ((unsigned) left + (unsigned) right);
+        return true;
+
+    case TK_MINS:
+        *value = (int) ((unsigned) left - (unsigned) right);
+        return true;
+
+    case TK_MULT:
+        *value = (int) ((unsigned) left * (unsigned) right);
+        return true;
+
+    case TK_DIVI:
+    case TK_MODU:
+        /* a division by zero warns, and one that overflows traps */
+        if (!right || (left == INT_MIN && right == -1)) {
+            return false;
+        }
+
+        *value = op == TK_DIVI ? left / right : left % right;
+        return true;
+
+    case TK_EQUL:
+        *value = left == right;
+        return true;
+
+    case TK_NEQL:
+        *value = left != right;
+        return true;
+
+    case TK_LTHN:
+        *value = left < right;
+        return true;
+
+    case TK_GTHN:
+        *value = left > right;
+        return true;
+
+    case TK_LTEQ:
+        *value = left <= right;
+        return true;
+
+    case TK_GTEQ:
+        *value = left >= right;
+        return true;
+
+    case TK_CONJ:
+        *value = left && right;
+        return true;
+
+    case TK_DISJ:
+        *value = left || right;
+        return true;
+
+    default:
+        abort();
+    }
+}
+
+/* whether the expression is always 0 or 1 */
+static bool is_boolean(const struct ast_node *const node)
+{
+    if (node->kind == AST_UNOP) {
+        return node->op == TK_NEGA;
+    } else if (node->kind != AST_BINOP) {
+        return false;
+    }
+
+    switch (node->op) {
+    case TK_EQUL:
+    case TK_NEQL:
+    case TK_LTHN:
+    case TK_GTHN:
+    case TK_LTEQ:
+    case TK_GTEQ:
+    case TK_CONJ:
+    case TK_DISJ:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+static inline bool is_empty(const struct ast_node *const node)
+{
+    return node->kind == AST_BLOCK && !node->b;
+}
+
+static inline struct ast_node make_const(const int value)
+{
+    return (struct ast_node) { .kind = AST_CONST, .a = value };
+}
+
+/*
+    Keeps the statements of the block that do anything, in order. A block with
+    a single statement, in the place of a statement, is replaced by it.
+*/
+static void optimize_block(struct ast_node *const nodes,
+    struct ast_node *const block)
+{
+    uint32_t kept = 0;
+
+    for (uint32_t stmt = 0; stmt < block->b; ++stmt) {
+        const struct ast_node *node = &nodes[block->a + stmt];
+
+        while (node->kind == AST_BLOCK && node->b == 1) {
+            node = &nodes[node->a];
+        }
+
+        /* the nodes of the statement all come after those of the block */
+        if (!is_empty(node)) {
+            nodes[block->a + kept++] = *node;
+        }
+    }
+
+    block->b = kept;
+}
+
+/*
+    Replaces && and || by a comparison with 0, once one of the operands is
+    known not to decide the outcome. The operand must be evaluated all the
+    same, as it can warn, but only whether it is 0 matters.
+*/
+static void optimize_logic(struct ast_node *const nodes,
+    struct ast_node *const node)
+{
+    const struct ast_node *const left = &nodes[node->a];
+    const struct ast_node *const right = &nodes[node->b];
+    const bool conj = node->op == TK_CONJ;
+
+    if (left->kind == AST_CONST && (conj ? !left->a : left->a)) {
+        *node = make_const(!conj);
+    } else if (left->kind == AST_CONST && is_boolean(right)) {
+        *node = *right;
+    } else if (left->kind == AST_CONST) {
+        /* the constant is no longer needed, so it becomes the 0 */
+        nodes[node->a] = make_const(0);
+        *node = (struct ast_node) {
+            .kind = AST_BINOP,
+            .op = TK_NEQL,
+            .a = node->b,
+            .b = node->a,
+        };
+    } else if (right->kind == AST_CONST && (conj ? right->a : !right->a)) {
+        if (is_boolean(left)) {
+            *node = *left;
+        } else {
+            nodes[node->b] = make_const(0);
+            node->op = TK_NEQL;
+        }
+    }
+}
+
+static void optimize_binop(struct ast_node *const nodes,
+    struct ast_node *const node)
+{
+    const struct ast_node *const left = &nodes[node->a];
+    const struct ast_node *const right = &nodes[node->b];
+    int value;
+
+    if (left->kind == AST_CONST && right->kind == AST_CONST &&
+        fold_binop(node->op, left->a, right->a, &value)) {
+
+        *node = make_const(value);
+    } else if (node->op == TK_CONJ || node->op == TK_DISJ) {
+        optimize_logic(nodes, node);
+    } else if (right->kind == AST_CONST &&
+        ((!right->a && (node->op == TK_PLUS || node->op == TK_MINS)) ||
+        (right->a == 1 && (node->op == TK_MULT || node->op == TK_DIVI)))) {
+
+        /* x + 0, x - 0, x * 1 and x / 1 are x */
+        *node = *left;
+    } else if (left->kind == AST_CONST &&
+        ((!left->a && node->op == TK_PLUS) ||
+        (left->a == 1 && node->op == TK_MULT))) {
+
+        *node = *right;
+    }
+}
+
+static void optimize_node(struct ast_node *const nodes, const uint32_t idx)
+{
+    struct ast_node *const node = &nodes[idx];
+
+    switch (node->kind) {
+    case AST_BLOCK:
+        optimize_block(nodes, node);
+        break;
+
+    case AST_IF: {
+        const struct ast_node *const cond = &nodes[node->a];
+
+        /* the arm that runs, if any, takes the place of the If */
+        if (cond->kind == AST_CONST && cond->a) {
+            *node = nodes[node->b];
+        } else if (cond->kind == AST_CONST && node->c) {
+            *node = nodes[node->c];
+        } else if (cond->kind == AST_CONST) {
+            *node = (struct ast_node) { .kind = AST_BLOCK };
+        } else if (node->c && is_empty(&nodes[node->c])) {
+            node->c = 0;
+        }
+    } break;
+
+    case AST_WHILE:
+        if (nodes[node->a].kind == AST_CONST && !nodes[node->a].a) {
+            *node = (struct ast_node) { .kind = AST_BLOCK };
+        }
+        break;
+
+    case AST_DOWHILE:
+        if (nodes[node->b].kind == AST_CONST && !nodes[node->b].a) {
+            *node = nodes[node->a];
+        }
+        break;
+
+    case AST_UNOP: {
+        const struct ast_node *const operand = &nodes[node->a];
+
+        if (operand->kind == AST_CONST) {
+            *node = make_const(node->op == TK_MINS ?
+                (int) -(unsigned) operand->a : !operand->a);
+        } else if (operand->kind == AST_UNOP && operand->op == node->op &&
+            (node->op == TK_MINS || is_boolean(&nodes[operand->a]))) {
+
+            /* - - x is x, and so is ! ! x if x is 0 or 1 */
+            *node = nodes[operand->a];
+        }
+    } break;
+
+    case AST_BINOP:
+        optimize_binop(nodes, node);
+        break;
+
+    case AST_TERNARY:
+        if (nodes[node->a].kind == AST_CONST) {
+            *node = nodes[nodes[node->a].a ? node->b : node->c];
+        }
+        break;
+    }
+}
+
+/* the most temporaries that a run of statements can use, as aux is 16 bits */
+#define MAX_TEMPS UINT16_MAX
+
+/* what the nodes that are bound to have the same value have in common */
+struct value {
+    uint8_t kind, op;
+
+    /* the value numbers of the operands, or the constant, or the variable */
+    uint32_t a, b;
+
+    /* the node that computes the value first in the run, if any */
+    uint32_t run;
+    uint32_t def;
+
+    /*
+        The loop in which the value was last seen, the run of statements in
+        it, how many runs it was seen in, and the variable that keeps it,
+        plus 1, if any.
+    */
+    uint32_t loop;
+    uint32_t seen;
+    uint32_t count;
+    uint32_t var;
+};
+
+struct variable {
+    /* whether it is defined for sure, so that reading it does not warn */
+    bool defined;
+
+    /* how many times it was assigned so far, which tells its values apart */
+    uint32_t version;
+
+    /* the last loop that assigns it, and how many times it does */
+    uint32_t loop;
+    uint32_t assignments;
+
+    /*
+        If it is an induction variable of the loop, the position of the
+        statement that steps it in the body, plus 1, and the step.
+    */
+    uint32_t increment;
+    int step;
+
+    /*
+        The last loop whose bounds were checked that uses it, the range of
+        offsets from its induction variable that the loop indexes it at, and
+        what else the loop does with it: whether it reads it any other way,
+        whether it assigns it anywhere but at one offset at the top level of
+        the body, whether it assigns an element whose index is not bounded,
+        and whether the loop checks its bounds before it runs.
+    */
+    uint32_t ranged;
+    int low, high;
+    bool read, scattered, unbounded, guarded;
+};
+
+/* a statement that goes into the body of the loop, after another */
+struct update {
+    uint32_t after;
+    struct ast_node stmt;
+};
+
+struct frame {
+    uint32_t block;
+    uint32_t next;
+
+    /* the size of the log of defined variables when the block was entered */
+    uint32_t mark;
+
+    /* whether the block may not run, and the condition to visit after it */
+    bool scoped;
+    uint32_t cond;
+
+    /* how many loops the block is in */
+    uint32_t depth;
+};
+
+struct optimizing {
+    struct ast *ast;
+    struct ast_node *nodes;
+
+    /*
+        The value numbers, interned in a hash table with open addressing,
+        which holds the value number + 1 or 0 for a free bucket.
+    */
+    uint32_t nvalues, values_allocated;
+    struct value *values;
+    uint32_t table_size;
+    uint32_t *table;
+
+    /* the value number + 1 of the nodes of the statement, or 0 if none */
+    uint32_t *numbers;
+
+    /*
+        The variables, including those that the loops are optimized with. The
+        variables that become defined are logged, to forget them after the
+        block that defined them if it may not run.
+    */
+    struct variable *vars;
+    uint32_t nvars, vars_allocated;
+    uint32_t log_size, log_allocated;
+    uint32_t *log;
+
+    /* the nodes left to visit, with the flags below */
+    uint32_t work_size, work_allocated;
+    uint32_t *work;
+
+    uint32_t nframes, frames_allocated;
+    struct frame *frames;
+
+    /*
+        The loops optimized so far, the last one and its copy whose bounds
+        were checked before it, if any, the runs of statements that they were
+        scanned into, and the nodes of the loop, with the run of each. The
+        statements that go before the loop are pending.
+    */
+    uint32_t loops;
+    uint32_t hoisted, unchecked;
+    uint32_t runs;
+    uint32_t scan_size, scan_allocated;
+    uint32_t *scan;
+    uint32_t npending, pending_allocated;
+    struct ast_node *pending;
+    uint32_t nupdates, updates_allocated;
+    struct update *updates;
+
+    /* the run of statements, and the temporaries it uses so far */
+    uint32_t run;
+    uint32_t temps;
+
+    uint32_t ntemps;
+
+    /* how much deeper the loops whose bounds are checked nest the program */
+    uint32_t deeper;
+    bool nomem;
+};
+
+/* how many loops a loop may be in, for it to be optimized */
+#define MAX_LOOP_DEPTH 16
+
+/* the node may not run even when the statement does */
+#define VISIT_CONDITIONAL 1
+
+/* the operands of the node were visited */
+#define VISIT_LEAVING 2
+
+/* makes room for the item at the given index, returns false if out of memory */
+static bool reserve(struct optimizing *const ctx, void *const items,
+    uint32_t *const allocated, const uint32_t size, const size_t item_size)
+{
+    if (size < *allocated) {
+        return true;
+    }
+
+    const uint32_t new_allocated = *allocated ? *allocated * 2 : 64;
+    void *const tmp = realloc(*(void **) items, new_allocated * item_size);
+
+    if (!tmp) {
+        return ctx->nomem = true, false;
+    }
+
+    *(void **) items = tmp;
+    *allocated = new_allocated;
+    return true;
+}
+
+static inline void push_work(struct optimizing *const ctx, const uint32_t idx,
+    const uint32_t flags)
+{
+    if (reserve(ctx, &ctx->work, &ctx->work_allocated, ctx->work_size + 1,
+        sizeof(uint32_t))) {
+
+        ctx->work[ctx->work_size++] = idx;
+        ctx->work[ctx->work_size++] = flags;
+    }
+}
+
+static uint32_t hash_value(const struct value *const value)
+{
+    uint64_t hash = (uint64_t) value->kind << 8 | value->op;
+    hash = (hash ^ value->a) * 0x9e3779b97f4a7c15;
+    hash = (hash ^ value->b) * 0x9e3779b97f4a7c15;
+    return hash >> 32;
+}
+
+static bool same_key(const struct value *const x, const struct value *const y)
+{
+    return x->kind == y->kind && x->op == y->op && x->a == y->a &&
+        x->b == y->b;
+}
+
+static bool grow_table(struct optimizing *const ctx)
+{
+    const uint32_t table_size = ctx->table_size ? ctx->table_size * 2 : 256;
+    uint32_t *const table = calloc(table_size, sizeof(uint32_t));
+
+    if (!table) {
+        return ctx->nomem = true, false;
+    }
+
+    for (uint32_t number = 0; number < ctx->nvalues; ++number) {
+        uint32_t bucket = hash_value(&ctx->values[number]) & (table_size - 1);
+
+        while (table[bucket]) {
+            bucket = (bucket + 1) & (table_size - 1);
+        }
+
+        table[bucket] = number + 1;
+    }
+
+    free(ctx->table);
+    ctx->table = table;
+    ctx->table_size = table_size;
+    return true;
+}
+
+/* returns the value number + 1 of the key, or 0 if out of memory */
+static uint32_t intern(struct optimizing *const ctx, const uint8_t kind,
+    const uint8_t op, const uint32_t a, const uint32_t b)
+{
+    const struct value key = { .kind = kind, .op = op, .a = a, .b = b };
+
+    if ((ctx->nvalues + 1) * 2 > ctx->table_size && !grow_table(ctx)) {
+        return 0;
+    }
+
+    uint32_t bucket = hash_value(&key) & (ctx->table_size - 1);
+
+    for (; ctx->table[bucket]; bucket = (bucket + 1) & (ctx->table_size - 1)) {
+        if (same_key(&ctx->values[ctx->table[bucket] - 1], &key)) {
+            return ctx->table[bucket];
+        }
+    }
+
+    if (!reserve(ctx, &ctx->values, &ctx->values_allocated, ctx->nvalues,
+        sizeof(struct value))) {
+
+        return 0;
+    }
+
+    ctx->values[ctx->nvalues] = key;
+    return ctx->table[bucket] = ++ctx->nvalues;
+}
+
+/*
+    Whether the operator can neither warn nor trap, given the value number of
+    its right operand. Dividing by a constant other than 0 is fine, as a
+    division that overflows traps the first time around already.
+*/
+static bool is_pure(const struct optimizing *const ctx, const tk_t op,
+    const uint32_t right)
+{
+    if (op != TK_DIVI && op != TK_MODU) {
+        return true;
+    }
+
+    const struct value *const value = &ctx->values[right - 1];
+    return value->kind == AST_CONST && value->a;
+}
+
+static bool is_commutative(const tk_t op)
+{
+    return op == TK_PLUS || op == TK_MULT || op == TK_EQUL || op == TK_NEQL;
+}
+
+static uint32_t intern_binop(struct optimizing *const ctx, const tk_t op,
+    uint32_t left, uint32_t right)
+{
+    /* a + b has the same value as b + a, as neither warns */
+    if (is_commutative(op) && left > right) {
+        const uint32_t swap = left;
+        left = right;
+        right = swap;
+    }
+
+    return intern(ctx, AST_BINOP, op, left, right);
+}
+
+/* gives the expression, and every expression in it, its value number */
+static void number_expression(struct optimizing *const ctx,
+    const uint32_t root)
+{
+    struct ast_node *const nodes = ctx->nodes;
+
+    /* the operands are gathered after the operators, and numbered before */
+    ctx->work_size = 0;
+    push_work(ctx, root, 0);
+
+    for (uint32_t item = 0; item < ctx->work_size && !ctx->nomem; item += 2) {
+        const struct ast_node *const node = &nodes[ctx->work[item]];
+
+        switch (node->kind) {
+        case AST_INDEX:
+            push_work(ctx, node->c, 0);
+            break;
+
+        case AST_TERNARY:
+            push_work(ctx, node->c, 0);
+            /* fallthrough */
+
+        case AST_BINOP:
+            push_work(ctx, node->b, 0);
+            /* fallthrough */
+
+        case AST_UNOP:
+            push_work(ctx, node->a, 0);
+            break;
+        }
+    }
+
+    for (uint32_t item = ctx->work_size; item && !ctx->nomem; item -= 2) {
+        const uint32_t idx = ctx->work[item - 2];
+        const struct ast_node *const node = &nodes[idx];
+        uint32_t left = 0, right = 0;
+        uint32_t number = 0;
+
+        switch (node->kind) {
+        case AST_CONST:
+            number = intern(ctx, AST_CONST, 0, node->a, 0);
+            break;
+
+        case AST_VAR:
+            if (ctx->vars[node->a].defined) {
+                number = intern(ctx, AST_VAR, 0, node->a,
+                    ctx->vars[node->a].version);
+            }
+            break;
+
+        case AST_UNOP:
+            if ((left = ctx->numbers[node->a])) {
+                number = intern(ctx, AST_UNOP, node->op, left, 0);
+            }
+            break;
+
+        case AST_BINOP:
+            left = ctx->numbers[node->a];
+            right = ctx->numbers[node->b];
+
+            if (left && right && is_pure(ctx, node->op, right)) {
+                number = intern_binop(ctx, node->op, left, right);
+            }
+            break;
+        }
+
+        ctx->numbers[idx] = number;
+    }
+}
+
+/*
+    Replaces the expressions of the statement whose value was computed before
+    in the run by Temp nodes, and remembers the others that could be reused.
+    The expressions are visited in the order that they run, and only those
+    that run whenever the statement does can be reused.
+*/
+static void eliminate_expression(struct optimizing *const ctx,
+    const uint32_t root, const uint32_t root_flags)
+{
+    struct ast_node *const nodes = ctx->nodes;
+
+    number_expression(ctx, root);
+    ctx->work_size = 0;
+    push_work(ctx, root, root_flags);
+
+    while (ctx->work_size && !ctx->nomem) {
+        const uint32_t flags = ctx->work[--ctx->work_size];
+        const uint32_t idx = ctx->work[--ctx->work_size];
+        struct ast_node *const node = &nodes[idx];
+        const uint32_t number = ctx->numbers[idx];
+        struct value *const value = number ? &ctx->values[number - 1] : NULL;
+
+        if (flags & VISIT_LEAVING) {
+            if (value->run != ctx->run || !value->def) {
+                value->run = ctx->run;
+                value->def = idx;
+            }
+
+            continue;
+        }
+
+        if (value && value->run == ctx->run && value->def &&
+            (nodes[value->def].aux || ctx->temps < MAX_TEMPS)) {
+
+            struct ast_node *const def = &nodes[value->def];
+
+            if (!def->aux) {
+                def->aux = ++ctx->temps;
+
+                if (ctx->temps > ctx->ntemps) {
+                    ctx->ntemps = ctx->temps;
+                }
+            }
+
+            *node = (struct ast_node) { .kind = AST_TEMP, .a = def->aux - 1 };
+            continue;
+        }
+
+        const uint32_t inner = flags & VISIT_CONDITIONAL;
+
+        if (value && !inner &&
+            (node->kind == AST_UNOP || node->kind == AST_BINOP)) {
+
+            push_work(ctx, idx, VISIT_LEAVING);
+        }
+
+        /* pushed in reverse, so that they are visited in order */
+        switch (node->kind) {
+        case AST_INDEX:
+            push_work(ctx, node->c, inner);
+            break;
+
+        case AST_UNOP:
+            push_work(ctx, node->a, inner);
+            break;
+
+        case AST_BINOP:
+            push_work(ctx, node->b, node->op == TK_CONJ ||
+                node->op == TK_DISJ ? VISIT_CONDITIONAL : inner);
+            push_work(ctx, node->a, inner);
+            break;
+
+        case AST_TERNARY:
+            push_work(ctx, node->c, VISIT_CONDITIONAL);
+            push_work(ctx, node->b, VISIT_CONDITIONAL);
+            push_work(ctx, node->a, inner);
+            break;
+        }
+    }
+}
+
+/* starts another run, as what ran before may not have when the next runs */
+static inline void end_run(struct optimizing *const ctx)
+{
+    ++ctx->run;
+    ctx->temps = 0;
+}
+
+static void enter_block(struct optimizing *const ctx, const uint32_t block,
+    const bool scoped, const uint32_t cond)
+{
+    end_run(ctx);
+
+    if (reserve(ctx, &ctx->frames, &ctx->frames_allocated, ctx->nframes,
+        sizeof(struct frame))) {
+
+        ctx->frames[ctx->nframes] = (struct frame) {
+            .block = block,
+            .mark = ctx->log_size,
+            .scoped = scoped,
+            .cond = cond,
+            .depth = ctx->nframes ? ctx->frames[ctx->nframes - 1].depth : 0,
+        };
+
+        ctx->nframes++;
+    }
+}
+
+static void assigned(struct optimizing *const ctx,
+    const struct ast_node *const target)
+{
+    struct variable *const var = &ctx->vars[target->a];
+    ++var->version;
+
+    /* a plain assignment always defines the variable, unlike an indexed one */
+    if (target->kind == AST_VAR && !var->defined &&
+        reserve(ctx, &ctx->log, &ctx->log_allocated, ctx->log_size,
+        sizeof(uint32_t))) {
+
+        var->defined = true;
+        ctx->log[ctx->log_size++] = target->a;
+    }
+}
+
+static uint32_t append_nodes(struct optimizing *, uint32_t);
+
+/* the fewest arms that an If is turned into a Switch with */
+#define MIN_CASES 4
+
+/*
+    Returns the operand that the condition compares to a constant for
+    equality, with the constant in "constant", or 0 if it is no such thing.
+*/
+static uint32_t compared(const struct ast_node *const nodes,
+    const uint32_t cond, uint32_t *const constant)
+{
+    const struct ast_node *const node = &nodes[cond];
+
+    if (node->kind != AST_BINOP || node->op != TK_EQUL) {
+        return 0;
+    } else if (nodes[node->b].kind == AST_CONST) {
+        return *constant = nodes[node->b].a, node->a;
+    } else if (nodes[node->a].kind == AST_CONST) {
+        return *constant = nodes[node->a].a, node->b;
+    }
+
+    return 0;
+}
+
+static int compare_cases(const void *const x, const void *const y)
+{
+    const int left = ((const struct ast_node *) x)->a;
+    const int right = ((const struct ast_node *) y)->a;
+    return (left > right) - (left < right);
+}
+
+/*
+    Turns the If at the given index into a Switch, if each of its conditions
+    compares the same value to a different constant, and the value can
+    neither warn nor trap, so that computing it once does the same as
+    computing it for every arm. Returns whether it did.
+*/
+static bool make_switch(struct optimizing *const ctx, const uint32_t idx)
+{
+    const struct ast_node *arm = &ctx->nodes[idx];
+    uint32_t value = 0, constant, count = 0;
+    int64_t low = INT64_MAX, high = INT64_MIN;
+
+    for (; arm->kind == AST_IF; arm = &ctx->nodes[arm->c]) {
+        const uint32_t operand = compared(ctx->nodes, arm->a, &constant);
+
+        if (!operand) {
+            return false;
+        }
+
+        number_expression(ctx, operand);
+
+        if (!ctx->numbers[operand] || (value &&
+            ctx->numbers[operand] != ctx->numbers[value])) {
+
+            return false;
+        }
+
+        value = value ?: operand;
+        low = (int) constant < low ? (int) constant : low;
+        high = (int) constant > high ? (int) constant : high;
+        ++count;
+
+        if (!arm->c) {
+            break;
+        }
+    }
+
+    if (count < MIN_CASES || ctx->nomem) {
+        return false;
+    }
+
+    /* a dense table has every constant in between, and is at most half empty */
+    const bool dense = high - low < 2 * (int64_t) count;
+    const uint32_t size = dense ? high - low + 1 : count;
+    const uint32_t first = append_nodes(ctx, size + 1);
+
+    if (!first) {
+        return false;
+    }
+
+    struct ast_node *const nodes = ctx->nodes;
+    struct ast_node *const cases = &nodes[first];
+    bool distinct = true;
+
+    for (uint32_t next = 0; next <= size; ++next) {
+        cases[next] = (struct ast_node) {
+            .kind = AST_CASE,
+            .a = dense ? low + next : 0,
+        };
+    }
+
+    for (uint32_t next = 0, arm = idx; ; arm = nodes[arm].c) {
+        if (nodes[arm].kind != AST_IF) {
+            cases[size].b = arm;
+            break;
+        }
+
+        compared(nodes, nodes[arm].a, &constant);
+        struct ast_node *const item = dense ?
+            &cases[(int) constant - low] : &cases[next++];
+
+        distinct &= !item->b;
+        item->a = constant;
+        item->b = nodes[arm].b;
+
+        if (!nodes[arm].c) {
+            break;
+        }
+    }
+
+    if (!dense) {
+        qsort(cases, size, sizeof(struct ast_node), compare_cases);
+
+        for (uint32_t next = 1; next < size; ++next) {
+            distinct &= cases[next].a != cases[next - 1].a;
+        }
+    }
+
+    /* a constant that is compared twice leaves the If as it is */
+    if (!distinct) {
+        ctx->ast->size = first;
+        return false;
+    }
+
+    nodes[idx] = (struct ast_node) {
+        .kind = AST_SWITCH,
+        .op = dense ? AST_SWITCH_DENSE : 0,
+        .a = value,
+        .b = first,
+        .c = size,
+    };
+
+    return true;
+}
+
+static void eliminate_statement(struct optimizing *const ctx,
+    const uint32_t idx)
+{
+    const struct ast_node *node = &ctx->nodes[idx];
+
+    /* the nodes may move when the Cases are appended */
+    if (node->kind == AST_IF && make_switch(ctx, idx)) {
+        node = &ctx->nodes[idx];
+    }
+
+    switch (node->kind) {
+    case AST_ASSIGN: {
+        const struct ast_node *const target = &ctx->nodes[node->a];
+
+        /*
+            The value is not evaluated if the element cannot be assigned, as
+            when the index is negative. A name can always be assigned, unless
+            it ran out of memory before.
+        */
+        if (target->kind == AST_INDEX) {
+            eliminate_expression(ctx, target->c, 0);
+            eliminate_expression(ctx, node->b, VISIT_CONDITIONAL);
+        } else {
+            eliminate_expression(ctx, node->b, 0);
+        }
+
+        assigned(ctx, target);
+    } break;
+
+    case AST_PRINT:
+        eliminate_expression(ctx, node->a, 0);
+        break;
+
+    case AST_IF:
+        /* the first condition always runs, the others are like && */
+        eliminate_expression(ctx, node->a, 0);
+
+        for (const struct ast_node *arm = node; arm->kind == AST_IF;
+            arm = &ctx->nodes[arm->c]) {
+
+            if (arm != node) {
+                eliminate_expression(ctx, arm->a, VISIT_CONDITIONAL);
+            }
+
+            if (!arm->c) {
+                break;
+            }
+        }
+
+        for (const struct ast_node *arm = node; ; arm = &ctx->nodes[arm->c]) {
+            if (arm->kind != AST_IF) {
+                enter_block(ctx, arm - ctx->nodes, true, 0);
+                break;
+            }
+
+            enter_block(ctx, arm->b, true, 0);
+
+            if (!arm->c) {
+                break;
+            }
+        }
+        break;
+
+    case AST_SWITCH:
+        /* the value always runs, and the arms are like those of an If */
+        eliminate_expression(ctx, node->a, 0);
+
+        for (uint32_t arm = 0; arm <= node->c; ++arm) {
+            const uint32_t block = ctx->nodes[node->b + arm].b;
+
+            if (block) {
+                enter_block(ctx, block, true, 0);
+            }
+        }
+        break;
+
+    case AST_WHILE:
+        /* the condition also runs after the body, so it is a run of its own */
+        end_run(ctx);
+        eliminate_expression(ctx, node->a, 0);
+        enter_block(ctx, node->b, true, 0);
+        ctx->frames[ctx->nframes - 1].depth += !ctx->nomem;
+        break;
+
+    case AST_DOWHILE:
+        enter_block(ctx, node->a, false, node->b);
+        ctx->frames[ctx->nframes - 1].depth += !ctx->nomem;
+        break;
+
+    case AST_BLOCK:
+        enter_block(ctx, idx, false, 0);
+        break;
+
+    default:
+        end_run(ctx);
+        break;
+    }
+}
+
+/* appends nodes to the program, returns the first one or 0 if out of memory */
+static uint32_t append_nodes(struct optimizing *const ctx,
+    const uint32_t count)
+{
+    struct ast *const ast = ctx->ast;
+
+    if (ast->size + count > ast->allocated) {
+        uint32_t allocated = ast->allocated ?: 64;
+
+        while (ast->size + count > allocated) {
+            allocated *= 2;
+        }
+
+        struct ast_node *const nodes = realloc(ast->nodes,
+            allocated * sizeof(struct ast_node));
+
+        if (!nodes) {
+            return ctx->nomem = true, 0;
+        }
+
+        ast->nodes = ctx->nodes = nodes;
+        ast->allocated = allocated;
+
+        /* the value numbers go along with the nodes */
+        uint32_t *const numbers = realloc(ctx->numbers,
+            allocated * sizeof(uint32_t));
+
+        if (!numbers) {
+            return ctx->nomem = true, 0;
+        }
+
+        ctx->numbers = numbers;
+    }
+
+    const uint32_t first = ast->size;
+    ast->size += count;
+    return first;
+}
+
+static uint32_t add_node(struct optimizing *const ctx,
+    const struct ast_node node)
+{
+    const uint32_t idx = append_nodes(ctx, 1);
+
+    if (idx) {
+        ctx->nodes[idx] = node;
+    }
+
+    return idx;
+}
+
+static inline struct ast_node make_var(const uint32_t var)
+{
+    return (struct ast_node) { .kind = AST_VAR, .a = var };
+}
+
+/* an assignment of the value to the variable, whose target is appended */
+static struct ast_node make_assign(struct optimizing *const ctx,
+    const uint32_t var, const uint32_t value)
+{
+    return (struct ast_node) {
+        .kind = AST_ASSIGN,
+        .a = add_node(ctx, make_var(var)),
+        .b = value,
+    };
+}
+
+/* adds a variable that the program knows nothing of, to keep a value in */
+static uint32_t new_var(struct optimizing *const ctx)
+{
+    if (!reserve(ctx, &ctx->vars, &ctx->vars_allocated, ctx->nvars,
+        sizeof(struct variable))) {
+
+        return 0;
+    }
+
+    ctx->vars[ctx->nvars] = (struct variable) {0};
+    ctx->ast->nvars++;
+    return ctx->nvars++;
+}
+
+static inline void push_pending(struct optimizing *const ctx,
+    const struct ast_node stmt)
+{
+    if (reserve(ctx, &ctx->pending, &ctx->pending_allocated, ctx->npending,
+        sizeof(struct ast_node))) {
+
+        ctx->pending[ctx->npending++] = stmt;
+    }
+}
+
+/*
+    Inserts the statements into the block, before the one at the given
+    position. The statements of a block are contiguous, so they are all
+    moved to the end of the program.
+*/
+static void insert_statements(struct optimizing *const ctx,
+    const uint32_t block, const uint32_t pos,
+    const struct ast_node *const stmts, const uint32_t count)
+{
+    const uint32_t first = append_nodes(ctx, ctx->nodes[block].b + count);
+
+    if (!first) {
+        return;
+    }
+
+    struct ast_node *const nodes = ctx->nodes;
+    struct ast_node *const node = &nodes[block];
+
+    memcpy(&nodes[first], &nodes[node->a], pos * sizeof(struct ast_node));
+    memcpy(&nodes[first + pos], stmts, count * sizeof(struct ast_node));
+    memcpy(&nodes[first + pos + count], &nodes[node->a + pos],
+        (node->b - pos) * sizeof(struct ast_node));
+
+    node->a = first;
+    node->b += count;
+}
+
+static inline uint32_t loop_cond(const struct ast_node *const loop)
+{
+    return loop->kind == AST_WHILE ? loop->a : loop->b;
+}
+
+static inline uint32_t loop_body(const struct ast_node *const loop)
+{
+    return loop->kind == AST_WHILE ? loop->b : loop->a;
+}
+
+/* whether the statement ends the run of statements that it is in */
+static inline bool branches(const struct ast_node *const stmt)
+{
+    return stmt->kind != AST_ASSIGN && stmt->kind != AST_PRINT;
+}
+
+/*
+    Lists the nodes of the loop in the order that they run, each before its
+    operands, along with the run of statements that it is in, as far as the
+    elimination of common subexpressions goes. Nodes that only run on some
+    condition are in a run of their own. Counts how many times the loop
+    assigns each variable on the way. Returns false if the loop has blocks
+    that are not lowered yet, which could assign anything.
+*/
+static bool scan_loop(struct optimizing *const ctx, const uint32_t loop)
+{
+    ctx->scan_size = ctx->work_size = 0;
+    push_work(ctx, loop_body(&ctx->nodes[loop]), ++ctx->runs);
+    push_work(ctx, loop_cond(&ctx->nodes[loop]), ++ctx->runs);
+
+    while (ctx->work_size && !ctx->nomem) {
+        const uint32_t run = ctx->work[--ctx->work_size];
+        const uint32_t idx = ctx->work[--ctx->work_size];
+        const struct ast_node *const node = &ctx->nodes[idx];
+
+        if (reserve(ctx, &ctx->scan, &ctx->scan_allocated, ctx->scan_size + 1,
+            sizeof(uint32_t))) {
+
+            ctx->scan[ctx->scan_size++] = idx;
+            ctx->scan[ctx->scan_size++] = run;
+        }
+
+        /* pushed in reverse, so that they are listed in order */
+        switch (node->kind) {
+        case AST_LAZY:
+            return false;
+
+        case AST_BLOCK: {
+            uint32_t next = ctx->runs + 1;
+
+            for (uint32_t stmt = 0; stmt < node->b; ++stmt) {
+                next += branches(&ctx->nodes[node->a + stmt]);
+            }
+
+            ctx->runs = next;
+
+            for (uint32_t stmt = node->b; stmt-- > 0; ) {
+                next -= branches(&ctx->nodes[node->a + stmt]);
+                push_work(ctx, node->a + stmt, next);
+            }
+        } break;
+
+        case AST_ASSIGN: {
+            const struct ast_node *const target = &ctx->nodes[node->a];
+            struct variable *const var = &ctx->vars[target->a];
+
+            if (var->loop != ctx->loops) {
+                var->loop = ctx->loops;
+                var->assignments = 0;
+                var->increment = 0;
+            }
+
+            ++var->assignments;
+
+            /* a plain target is not read, so it is left out */
+            if (target->kind == AST_INDEX) {
+                push_work(ctx, node->b, ++ctx->runs);
+                push_work(ctx, node->a, run);
+            } else {
+                push_work(ctx, node->b, run);
+            }
+        } break;
+
+        case AST_IF:
+            if (node->c) {
+                push_work(ctx, node->c, ++ctx->runs);
+            }
+
+            push_work(ctx, node->b, ++ctx->runs);
+            push_work(ctx, node->a, run);
+            break;
+
+        case AST_SWITCH:
+            for (uint32_t arm = node->c + 1; arm-- > 0; ) {
+                const uint32_t block = ctx->nodes[node->b + arm].b;
+
+                if (block) {
+                    push_work(ctx, block, ++ctx->runs);
+                }
+            }
+
+            push_work(ctx, node->a, run);
+            break;
+
+        case AST_WHILE:
+        case AST_DOWHILE:
+            push_work(ctx, node->b, ++ctx->runs);
+            push_work(ctx, node->a, ++ctx->runs);
+            break;
+
+        case AST_BINOP:
+            push_work(ctx, node->b, node->op == TK_CONJ ||
+                node->op == TK_DISJ ? ++ctx->runs : run);
+            /* fallthrough */
+
+        case AST_PRINT:
+        case AST_UNOP:
+            push_work(ctx, node->a, run);
+            break;
+
+        case AST_TERNARY:
+            push_work(ctx, node->c, ++ctx->runs);
+            push_work(ctx, node->b, ++ctx->runs);
+            push_work(ctx, node->a, run);
+            break;
+
+        case AST_INDEX:
+            push_work(ctx, node->c, run);
+            break;
+        }
+    }
+
+    return !ctx->nomem;
+}
+
+/*
+    Whether the statement steps a variable by a constant, as in i = i + 1,
+    and the loop assigns the variable nowhere else, which makes it an
+    induction variable. Its step is returned as well.
+*/
+static bool is_increment(const struct optimizing *const ctx,
+    const struct ast_node *const stmt, uint32_t *const var, int *const step)
+{
+    const struct ast_node *const nodes = ctx->nodes;
+
+    if (stmt->kind != AST_ASSIGN || nodes[stmt->a].kind != AST_VAR ||
+        nodes[stmt->b].kind != AST_BINOP) {
+
+        return false;
+    }
+
+    const struct ast_node *const value = &nodes[stmt->b];
+    const struct ast_node *left = &nodes[value->a];
+    const struct ast_node *right = &nodes[value->b];
+
+    if (value->op == TK_PLUS && left->kind == AST_CONST) {
+        const struct ast_node *const swap = left;
+        left = right;
+        right = swap;
+    } else if (value->op != TK_PLUS && value->op != TK_MINS) {
+        return false;
+    }
+
+    *var = nodes[stmt->a].a;
+    *step = value->op == TK_PLUS ? (int) right->a : (int) -right->a;
+
+    return left->kind == AST_VAR && left->a == *var &&
+        right->kind == AST_CONST && ctx->vars[*var].assignments == 1 &&
+        ctx->vars[*var].defined;
+}
+
+/*
+    Finds an induction variable times a constant in the node, and returns
+    the variable and the constant, or false if it is something else.
+*/
+static bool is_product(const struct optimizing *const ctx,
+    const struct ast_node *const node, uint32_t *const var,
+    int *const factor)
+{
+    if (node->kind != AST_BINOP || node->op != TK_MULT) {
+        return false;
+    }
+
+    const struct ast_node *left = &ctx->nodes[node->a];
+    const struct ast_node *right = &ctx->nodes[node->b];
+
+    if (left->kind == AST_CONST) {
+        const struct ast_node *const swap = left;
+        left = right;
+        right = swap;
+    }
+
+    if (left->kind != AST_VAR || right->kind != AST_CONST ||
+        ctx->vars[left->a].loop != ctx->loops ||
+        !ctx->vars[left->a].increment) {
+
+        return false;
+    }
+
+    *var = left->a;
+    *factor = right->a;
+    return true;
+}
+
+/*
+    The fewest runs of statements that compute a product for it to be worth
+    a variable of its own, which takes an assignment each time around.
+*/
+#define MIN_RUNS 3
+
+/*
+    Replaces the products of an induction variable by a constant, that the
+    loop computes in enough runs of statements, by a variable of their own.
+    It is set to the product before the loop, and stepped along with the
+    induction variable, so that an addition takes the place of the
+    multiplications.
+*/
+static void reduce_strength(struct optimizing *const ctx, const uint32_t loop)
+{
+    const uint32_t body = loop_body(&ctx->nodes[loop]);
+    bool inductions = false;
+
+    for (uint32_t stmt = 0; stmt < ctx->nodes[body].b; ++stmt) {
+        uint32_t var;
+        int step;
+
+        if (is_increment(ctx, &ctx->nodes[ctx->nodes[body].a + stmt], &var,
+            &step)) {
+
+            ctx->vars[var].increment = stmt + 1;
+            ctx->vars[var].step = step;
+            inductions = true;
+        }
+    }
+
+    if (!inductions) {
+        return;
+    }
+
+    /*
+        Counts the runs of statements that compute each product, as it is
+        only computed once in each. The runs are listed one after the other,
+        except for those in between that only run on some condition.
+    */
+    for (uint32_t item = 0; item < ctx->scan_size && !ctx->nomem;
+        item += 2) {
+
+        const uint32_t idx = ctx->scan[item];
+        const uint32_t run = ctx->scan[item + 1];
+        uint32_t var, number = 0;
+        int factor;
+
+        if (is_product(ctx, &ctx->nodes[idx], &var, &factor)) {
+            number = intern_binop(ctx, TK_MULT,
+                intern(ctx, AST_VAR, 0, var, ctx->vars[var].version),
+                intern(ctx, AST_CONST, 0, factor, 0));
+        }
+
+        if (number) {
+            struct value *const value = &ctx->values[number - 1];
+
+            if (value->loop != ctx->loops) {
+                value->loop = ctx->loops;
+                value->count = 0;
+                value->var = 0;
+            }
+
+            if (!value->count || value->seen != run) {
+                value->seen = run;
+                ++value->count;
+            }
+        }
+
+        ctx->numbers[idx] = number;
+    }
+
+    for (uint32_t item = 0; item < ctx->scan_size && !ctx->nomem;
+        item += 2) {
+
+        const uint32_t idx = ctx->scan[item];
+
+        if (!ctx->numbers[idx]) {
+            continue;
+        }
+
+        struct value *const value = &ctx->values[ctx->numbers[idx] - 1];
+
+        if (value->count < MIN_RUNS) {
+            continue;
+        }
+
+        if (!value->var) {
+            uint32_t var;
+            int factor;
+            is_product(ctx, &ctx->nodes[idx], &var, &factor);
+
+            const uint32_t product = new_var(ctx);
+            const struct variable induction = ctx->vars[var];
+            const int step = (int) ((unsigned) induction.step * factor);
+
+            push_pending(ctx, make_assign(ctx, product,
+                add_node(ctx, (struct ast_node) {
+                    .kind = AST_BINOP,
+                    .op = TK_MULT,
+                    .a = add_node(ctx, make_var(var)),
+                    .b = add_node(ctx, make_const(factor)),
+                })));
+
+            /* the product is stepped right after the induction variable */
+            if (reserve(ctx, &ctx->updates, &ctx->updates_allocated,
+                ctx->nupdates, sizeof(struct update))) {
+
+                ctx->updates[ctx->nupdates++] = (struct update) {
+                    .after = induction.increment - 1,
+                    .stmt = make_assign(ctx, product,
+                        add_node(ctx, (struct ast_node) {
+                            .kind = AST_BINOP,
+                            .op = TK_PLUS,
+                            .a = add_node(ctx, make_var(product)),
+                            .b = add_node(ctx, make_const(step)),
+                        })),
+                };
+            }
+
+            if (ctx->nomem) {
+                return;
+            }
+
+            ctx->vars[product].loop = ctx->loops;
+            ctx->vars[product].assignments = 1;
+            value->var = product + 1;
+        }
+
+        ctx->nodes[idx] = make_var(value->var - 1);
+    }
+}
+
+/*
+    Whether the operator can be computed before the loop, even though the
+    loop may never compute it. Unlike reusing its value, this rules out
+    dividing by -1, which traps the first time around if it ever does.
+*/
+static bool can_hoist(const struct optimizing *const ctx, const tk_t op,
+    const uint32_t right)
+{
+    return is_pure(ctx, op, right) && ((op != TK_DIVI && op != TK_MODU) ||
+        (int) ctx->values[right - 1].a != -1);
+}
+
+/* computes the expression into a variable before the loop, and reads that */
+static void hoist(struct optimizing *const ctx, const uint32_t idx)
+{
+    struct value *const value = &ctx->values[ctx->numbers[idx] - 1];
+
+    if (value->loop != ctx->loops || !value->var) {
+        const uint32_t var = new_var(ctx);
+        push_pending(ctx, make_assign(ctx, var,
+            add_node(ctx, ctx->nodes[idx])));
+
+        value->loop = ctx->loops;
+        value->var = var + 1;
+    }
+
+    if (!ctx->nomem) {
+        ctx->nodes[idx] = make_var(value->var - 1);
+    }
+}
+
+/* marks an operand whose operator is hoisted, so that it goes along with it */
+#define COVERED UINT32_MAX
+
+/*
+    Hoists the expressions of the loop whose operands it never assigns out of
+    it. Only those that can neither warn nor trap are hoisted, as the loop
+    may not run them at all.
+*/
+static void hoist_invariants(struct optimizing *const ctx)
+{
+    for (uint32_t item = ctx->scan_size; item && !ctx->nomem; item -= 2) {
+        const uint32_t idx = ctx->scan[item - 2];
+        const struct ast_node *const node = &ctx->nodes[idx];
+        const struct variable *var;
+        uint32_t left, right;
+        uint32_t number = 0;
+
+        switch (node->kind) {
+        case AST_CONST:
+            number = intern(ctx, AST_CONST, 0, node->a, 0);
+            break;
+
+        case AST_VAR:
+            var = &ctx->vars[node->a];
+
+            if (var->loop != ctx->loops && var->defined) {
+                number = intern(ctx, AST_VAR, 0, node->a, var->version);
+            }
+            break;
+
+        case AST_UNOP:
+            if ((left = ctx->numbers[node->a])) {
+                number = intern(ctx, AST_UNOP, node->op, left, 0);
+            }
+            break;
+
+        case AST_BINOP:
+            left = ctx->numbers[node->a];
+            right = ctx->numbers[node->b];
+
+            if (left && right && can_hoist(ctx, node->op, right)) {
+                number = intern_binop(ctx, node->op, left, right);
+            }
+            break;
+        }
+
+        ctx->numbers[idx] = number;
+    }
+
+    /* the outermost operators are hoisted, along with their operands */
+    for (uint32_t item = 0; item < ctx->scan_size && !ctx->nomem;
+        item += 2) {
+
+        const uint32_t idx = ctx->scan[item];
+        const struct ast_node *const node = &ctx->nodes[idx];
+        const uint32_t number = ctx->numbers[idx];
+
+        if (!number || (node->kind != AST_UNOP && node->kind != AST_BINOP)) {
+            continue;
+        }
+
+        ctx->numbers[node->a] = COVERED;
+
+        if (node->kind == AST_BINOP) {
+            ctx->numbers[node->b] = COVERED;
+        }
+
+        if (number != COVERED) {
+            hoist(ctx, idx);
+        }
+    }
+}
+
+/* the furthest offset from the induction variable, and the largest step */
+#define MAX_OFFSET UINT16_MAX
+
+/*
+    Whether the index is the induction variable plus or minus a constant,
+    which is returned as the offset.
+*/
+static bool is_offset(const struct optimizing *const ctx, const uint32_t idx,
+    const uint32_t induction, int *const offset)
+{
+    const struct ast_node *const node = &ctx->nodes[idx];
+
+    if (node->kind == AST_VAR) {
+        *offset = 0;
+        return node->a == induction;
+    } else if (node->kind != AST_BINOP ||
+        (node->op != TK_PLUS && node->op != TK_MINS)) {
+
+        return false;
+    }
+
+    const struct ast_node *left = &ctx->nodes[node->a];
+    const struct ast_node *right = &ctx->nodes[node->b];
+
+    if (node->op == TK_PLUS && left->kind == AST_CONST) {
+        const struct ast_node *const swap = left;
+        left = right;
+        right = swap;
+    }
+
+    if (left->kind != AST_VAR || left->a != induction ||
+        right->kind != AST_CONST || (int) right->a < -MAX_OFFSET ||
+        (int) right->a > MAX_OFFSET) {
+
+        return false;
+    }
+
+    *offset = node->op == TK_PLUS ? (int) right->a : -(int) right->a;
+    return true;
+}
+
+/*
+    Whether the loop runs while an induction variable that it steps up is
+    below a bound that it never assigns, as in i < n or i <= n. Returns the
+    variable, the node of the bound, and how far from the bound it runs,
+    which is -1 or 0.
+*/
+static bool is_bounded(const struct optimizing *const ctx,
+    const uint32_t cond, uint32_t *const induction, uint32_t *const bound,
+    int *const reach)
+{
+    const struct ast_node *const node = &ctx->nodes[cond];
+
+    if (node->kind != AST_BINOP) {
+        return false;
+    }
+
+    if (node->op == TK_LTHN || node->op == TK_LTEQ) {
+        *induction = node->a;
+        *bound = node->b;
+    } else if (node->op == TK_GTHN || node->op == TK_GTEQ) {
+        *induction = node->b;
+        *bound = node->a;
+    } else {
+        return false;
+    }
+
+    *reach = node->op == TK_LTEQ || node->op == TK_GTEQ ? 0 : -1;
+
+    const struct ast_node *const var = &ctx->nodes[*induction];
+    const struct ast_node *const limit = &ctx->nodes[*bound];
+
+    if (var->kind != AST_VAR || (limit->kind != AST_CONST &&
+        (limit->kind != AST_VAR || ctx->vars[limit->a].loop == ctx->loops ||
+        !ctx->vars[limit->a].defined))) {
+
+        return false;
+    }
+
+    *induction = var->a;
+    const struct variable *const entry = &ctx->vars[var->a];
+
+    return entry->loop == ctx->loops && entry->increment &&
+        entry->step > 0 && entry->step <= MAX_OFFSET;
+}
+
+/* the variable, with what the loop does with it so far */
+static struct variable *ranged(struct optimizing *const ctx,
+    const uint32_t var)
+{
+    struct variable *const entry = &ctx->vars[var];
+
+    if (entry->ranged != ctx->loops) {
+        entry->ranged = ctx->loops;
+        entry->low = INT_MAX;
+        entry->high = INT_MIN;
+        entry->read = entry->scattered = false;
+        entry->unbounded = entry->guarded = false;
+        push_work(ctx, var, 0);
+    }
+
+    return entry;
+}
+
+/* appends the node, and the && of the guard and the node if there is one */
+static uint32_t add_term(struct optimizing *const ctx, const uint32_t guard,
+    const struct ast_node term)
+{
+    const uint32_t idx = add_node(ctx, term);
+
+    return guard ? add_node(ctx, (struct ast_node) {
+        .kind = AST_BINOP,
+        .op = TK_CONJ,
+        .a = guard,
+        .b = idx,
+    }) : idx;
+}
+
+/* appends the variable or the constant plus the offset, which fits */
+static uint32_t add_offset(struct optimizing *const ctx,
+    const struct ast_node base, const int offset)
+{
+    if (base.kind == AST_CONST) {
+        return add_node(ctx, make_const((int) base.a + offset));
+    } else if (!offset) {
+        return add_node(ctx, base);
+    }
+
+    return add_node(ctx, (struct ast_node) {
+        .kind = AST_BINOP,
+        .op = TK_PLUS,
+        .a = add_node(ctx, base),
+        .b = add_node(ctx, make_const(offset)),
+    });
+}
+
+/* appends the && of the guard and the Bounds node of the array, grown or not */
+static uint32_t add_bounds(struct optimizing *const ctx, const uint32_t guard,
+    const uint32_t var, const uint32_t induction,
+    const struct ast_node limit, const int reach, const int grow)
+{
+    const struct variable *const array = &ctx->vars[var];
+
+    return add_term(ctx, guard, (struct ast_node) {
+        .kind = AST_BOUNDS,
+        .op = grow ? AST_BOUNDS_GROW : 0,
+        .aux = grow,
+        .a = var,
+        .b = add_offset(ctx, make_var(induction), array->low),
+        .c = add_offset(ctx, limit, reach + array->high),
+    });
+}
+
+/*
+    Bounds the indices of the innermost loop that runs while its induction
+    variable is below a bound, as in i < n, by the induction variable plus
+    an offset, from its value before the loop up to the bound, or one past
+    the step for those after the step. The elements that it accesses at
+    such indices are marked as unchecked, and the guard that must hold for
+    them to be there is returned, or 0 if none.
+
+    The guard bounds the induction variable so that it never wraps around,
+    and checks that every such array has the elements. An array that the
+    loop only assigns, at one offset from the top level of its body, can be
+    grown by the guard instead, like the loop would grow it, which at most
+    one array is so that no other check can fail once it is grown. An array
+    that the loop assigns at an index that is not bounded could lose its
+    elements if that fails, so its elements are always checked.
+*/
+static uint32_t check_bounds(struct optimizing *const ctx,
+    const uint32_t loop)
+{
+    const struct ast_node *const nodes = ctx->nodes;
+    uint32_t induction, bound;
+    int reach;
+
+    if (nodes[loop].kind != AST_WHILE ||
+        !is_bounded(ctx, nodes[loop].a, &induction, &bound, &reach)) {
+
+        return 0;
+    }
+
+    const struct ast_node body = nodes[nodes[loop].b];
+    const uint32_t increment = ctx->vars[induction].increment - 1;
+    const int step = ctx->vars[induction].step;
+    uint32_t stmt = 0;
+
+    ctx->work_size = 0;
+
+    for (uint32_t item = 0; item < ctx->scan_size && !ctx->nomem;
+        item += 2) {
+
+        const uint32_t idx = ctx->scan[item];
+        const struct ast_node *const node = &nodes[idx];
+        const uint32_t prev = item ? ctx->scan[item - 2] : 0;
+        int offset;
+
+        /* the statements of the body come in order, after the condition */
+        if (idx >= body.a && idx - body.a < body.b) {
+            stmt = idx - body.a;
+        }
+
+        switch (node->kind) {
+        case AST_WHILE:
+        case AST_DOWHILE:
+        case AST_SWITCH:
+        case AST_TEMP:
+            /* only the innermost loops are copied, so the copies stay few */
+            return 0;
+
+        case AST_VAR:
+            ranged(ctx, node->a)->read = true;
+            break;
+
+        case AST_ASSIGN:
+            if (nodes[node->a].kind == AST_VAR) {
+                ranged(ctx, nodes[node->a].a)->scattered = true;
+            }
+            break;
+
+        case AST_INDEX: {
+            /* the target of an assignment comes right after it */
+            const bool store = nodes[prev].kind == AST_ASSIGN &&
+                nodes[prev].a == idx;
+            struct variable *const array = ranged(ctx, node->a);
+
+            if (!is_offset(ctx, node->c, induction, &offset)) {
+                array->read |= !store;
+                array->unbounded |= store;
+                break;
+            }
+
+            offset += stmt > increment ? step : 0;
+            array->low = offset < array->low ? offset : array->low;
+            array->high = offset > array->high ? offset : array->high;
+            array->read |= !store;
+            array->scattered |= store && prev != body.a + stmt;
+        } break;
+        }
+    }
+
+    /* the induction variable itself goes up to the bound plus the step */
+    const struct ast_node limit = nodes[bound];
+    int lowest = 0, highest = step;
+    uint32_t guarded = 0, grown = 0;
+
+    for (uint32_t item = 0; item < ctx->work_size; item += 2) {
+        struct variable *const array = &ctx->vars[ctx->work[item]];
+
+        if (array->low > array->high || array->unbounded) {
+            continue;
+        }
+
+        array->guarded = true;
+        ++guarded;
+        lowest = array->low < lowest ? array->low : lowest;
+        highest = array->high > highest ? array->high : highest;
+
+        if (!grown && !array->read && !array->scattered &&
+            array->low == array->high) {
+
+            grown = ctx->work[item] + 1;
+        }
+    }
+
+    if (!guarded || ctx->nomem || (limit.kind == AST_CONST &&
+        ((int64_t) (int) limit.a + reach + highest > INT_MAX ||
+        (int64_t) (int) limit.a + reach + lowest < INT_MIN))) {
+
+        return 0;
+    }
+
+    for (uint32_t item = 0; item < ctx->scan_size; item += 2) {
+        struct ast_node *const node = &ctx->nodes[ctx->scan[item]];
+        int offset;
+
+        if (node->kind == AST_INDEX && ctx->vars[node->a].guarded &&
+            is_offset(ctx, node->c, induction, &offset)) {
+
+            node->aux |= AST_INDEX_UNCHECKED;
+        }
+    }
+
+    uint32_t guard = 0, terms = 0;
+
+    if (lowest < 0) {
+        guard = add_term(ctx, guard, (struct ast_node) {
+            .kind = AST_BINOP,
+            .op = TK_GTEQ,
+            .a = add_node(ctx, make_var(induction)),
+            .b = add_node(ctx, make_const(-lowest)),
+        });
+
+        ++terms;
+    }
+
+    if (limit.kind == AST_VAR && reach + highest > 0) {
+        guard = add_term(ctx, guard, (struct ast_node) {
+            .kind = AST_BINOP,
+            .op = TK_LTEQ,
+            .a = add_node(ctx, limit),
+            .b = add_node(ctx, make_const(INT_MAX - reach - highest)),
+        });
+
+        ++terms;
+    }
+
+    /* the array that is grown goes last, after every check that can fail */
+    for (uint32_t item = 0; item < ctx->work_size; item += 2) {
+        const uint32_t var = ctx->work[item];
+
+        if (ctx->vars[var].guarded && var + 1 != grown) {
+            guard = add_bounds(ctx, guard, var, induction, limit, reach, 0);
+        }
+    }
+
+    if (grown) {
+        guard = add_bounds(ctx, guard, grown - 1, induction, limit, reach,
+            step);
+    }
+
+    /*
+        The guard goes in the place of the loop, which goes two deeper, and
+        each of its terms is at most three deep, one below the other.
+    */
+    terms += guarded;
+    const uint32_t deeper = terms > 2 ? terms : 2;
+    ctx->deeper = deeper > ctx->deeper ? deeper : ctx->deeper;
+
+    return guard;
+}
+
+/*
+    Appends a copy of the loop, with the bounds of every element checked,
+    and returns it. The innermost loops have nothing but statements and
+    expressions in them.
+*/
+static uint32_t copy_checked(struct optimizing *const ctx,
+    const uint32_t loop)
+{
+    const uint32_t copy = append_nodes(ctx, 1);
+
+    ctx->work_size = 0;
+    push_work(ctx, loop, copy);
+
+    while (ctx->work_size && !ctx->nomem) {
+        const uint32_t dst = ctx->work[--ctx->work_size];
+        const uint32_t src = ctx->work[--ctx->work_size];
+        struct ast_node node = ctx->nodes[src];
+        uint32_t *children[3];
+        uint32_t nchildren = 0;
+
+        switch (node.kind) {
+        case AST_BLOCK: {
+            /* the statements stay together */
+            const uint32_t first = append_nodes(ctx, node.b);
+
+            for (uint32_t stmt = 0; stmt < node.b && first; ++stmt) {
+                push_work(ctx, node.a + stmt, first + stmt);
+            }
+
+            node.a = first;
+        } break;
+
+        case AST_IF:
+        case AST_TERNARY:
+            if (node.c) {
+                children[nchildren++] = &node.c;
+            }
+            /* fallthrough */
+
+        case AST_ASSIGN:
+        case AST_WHILE:
+        case AST_BINOP:
+            children[nchildren++] = &node.b;
+            /* fallthrough */
+
+        case AST_PRINT:
+        case AST_UNOP:
+            children[nchildren++] = &node.a;
+            break;
+
+        case AST_INDEX:
+            node.aux &= ~AST_INDEX_UNCHECKED;
+            children[nchildren++] = &node.c;
+            break;
+
+        case AST_CONST:
+        case AST_VAR:
+            break;
+
+        default:
+            abort();
+        }
+
+        for (uint32_t child = 0; child < nchildren; ++child) {
+            const uint32_t idx = append_nodes(ctx, 1);
+            push_work(ctx, *children[child], idx);
+            *children[child] = idx;
+        }
+
+        if (!ctx->nomem) {
+            ctx->nodes[dst] = node;
+        }
+    }
+
+    return copy;
+}
+
+/*
+    Replaces the loop at the given index by an If that runs it when the
+    guard holds, and a copy of it that checks every bound otherwise.
+*/
+static void version_loop(struct optimizing *const ctx, const uint32_t at,
+    const uint32_t guard)
+{
+    const uint32_t loop = add_node(ctx, ctx->nodes[at]);
+    const uint32_t copy = copy_checked(ctx, loop);
+    const uint32_t blocks = append_nodes(ctx, 2);
+
+    if (ctx->nomem) {
+        return;
+    }
+
+    struct ast_node *const nodes = ctx->nodes;
+    nodes[blocks] = (struct ast_node) { .kind = AST_BLOCK, .a = loop, .b = 1 };
+    nodes[blocks + 1] = (struct ast_node) {
+        .kind = AST_BLOCK,
+        .a = copy,
+        .b = 1,
+    };
+
+    nodes[at] = (struct ast_node) {
+        .kind = AST_IF,
+        .a = guard,
+        .b = blocks,
+        .c = blocks + 1,
+    };
+
+    ctx->hoisted = copy;
+    ctx->unchecked = loop;
+}
+
+/*
+    Whether the loop can count its trips: it runs while an induction variable
+    is below a bound that it never assigns, and steps the variable at the top
+    level of its body, with nothing after that reading it. Returns the Count
+    node that takes the place of the step, and the position of the step.
+*/
+static bool is_counted(const struct optimizing *const ctx,
+    const uint32_t loop, struct ast_node *const count, uint32_t *const pos)
+{
+    const struct ast_node *const nodes = ctx->nodes;
+    uint32_t induction, bound;
+    int reach;
+
+    if (!is_bounded(ctx, loop_cond(&nodes[loop]), &induction, &bound,
+        &reach)) {
+
+        return false;
+    }
+
+    /* the only assignment, which the updates may have moved since */
+    const struct ast_node *const body = &nodes[loop_body(&nodes[loop])];
+
+    for (*pos = 0; *pos < body->b; ++*pos) {
+        const struct ast_node *const stmt = &nodes[body->a + *pos];
+
+        if (stmt->kind == AST_ASSIGN && nodes[stmt->a].a == induction) {
+            break;
+        }
+    }
+
+    /*
+        The scan lists the condition first, then the statements in order,
+        each before its operands. The reads that a product was reduced from
+        are still listed, which only ever rules out more.
+    */
+    const uint32_t step = nodes[body->a + *pos].b;
+    uint32_t reads = 0, after = 0;
+    bool stepped = false;
+
+    for (uint32_t item = 0; item < ctx->scan_size; item += 2) {
+        const uint32_t idx = ctx->scan[item];
+
+        if ((nodes[idx].kind == AST_VAR || nodes[idx].kind == AST_INDEX) &&
+            nodes[idx].a == induction) {
+
+            ++reads;
+            after += stepped;
+        }
+
+        stepped |= idx == step;
+    }
+
+    /* the step reads it once, and so does the condition */
+    *count = (struct ast_node) {
+        .kind = AST_COUNT,
+        .op = reach ? TK_LTHN : TK_LTEQ,
+        .aux = reads == 2 ? AST_COUNT_HIDDEN : 0,
+        .a = induction,
+        .b = bound,
+        .c = ctx->vars[induction].step,
+    };
+
+    return after == 1;
+}
+
+/*
+    Takes the step at the given position out of the body of the loop, and
+    has the Count node step the variable after each trip instead, with a
+    bound of its own.
+*/
+static void count_trips(struct optimizing *const ctx, const uint32_t loop,
+    struct ast_node count, const uint32_t pos)
+{
+    count.b = add_node(ctx, ctx->nodes[count.b]);
+    const uint32_t idx = add_node(ctx, count);
+
+    if (ctx->nomem) {
+        return;
+    }
+
+    struct ast_node *const node = &ctx->nodes[loop];
+    struct ast_node *const body = &ctx->nodes[loop_body(node)];
+
+    memmove(&ctx->nodes[body->a + pos], &ctx->nodes[body->a + pos + 1],
+        (body->b - pos - 1) * sizeof(struct ast_node));
+    body->b--;
+
+    if (node->kind == AST_WHILE) {
+        node->c = idx;
+    } else {
+        node->b = idx;
+    }
+}
+
+/*
+    Optimizes the loop at the given position in the block. The statements
+    that compute what it hoists, or reduces the strength of, are inserted
+    before it, and the loop is marked as done so that it is only visited.
+    If its bounds can be checked before it runs, it goes in an If with its
+    copy that checks them, and both are marked as done. Last, the step of
+    its counter is taken out of its body, if it can count its trips.
+*/
+static void optimize_loop(struct optimizing *const ctx, const uint32_t block,
+    const uint32_t pos)
+{
+    const uint32_t loop = ctx->nodes[block].a + pos;
+
+    ++ctx->loops;
+    ctx->hoisted = loop;
+    ctx->unchecked = 0;
+    ctx->npending = ctx->nupdates = 0;
+
+    if (!scan_loop(ctx, loop)) {
+        return;
+    }
+
+    reduce_strength(ctx, loop);
+    hoist_invariants(ctx);
+    const uint32_t guard = check_bounds(ctx, loop);
+
+    /* the last ones first, so that the positions before them still hold */
+    const uint32_t body = loop_body(&ctx->nodes[loop]);
+
+    for (uint32_t after = ctx->nodes[body].b; after-- > 0 && !ctx->nomem; ) {
+        for (uint32_t update = 0; update < ctx->nupdates; ++update) {
+            if (ctx->updates[update].after == after) {
+                insert_statements(ctx, body, after + 1,
+                    &ctx->updates[update].stmt, 1);
+            }
+        }
+    }
+
+    if (ctx->npending && !ctx->nomem) {
+        insert_statements(ctx, block, pos, ctx->pending, ctx->npending);
+        ctx->hoisted = ctx->nodes[block].a + pos + ctx->npending;
+    }
+
+    struct ast_node count;
+    uint32_t at = 0;
+    const bool counted = is_counted(ctx, ctx->hoisted, &count, &at);
+
+    if (guard && !ctx->nomem) {
+        version_loop(ctx, ctx->hoisted, guard);
+    }
+
+    /* the copy whose bounds are checked counts its trips alike */
+    if (counted && !ctx->nomem) {
+        count_trips(ctx, ctx->hoisted, count, at);
+
+        if (ctx->unchecked) {
+            count_trips(ctx, ctx->unchecked, count, at);
+        }
+    }
+}
+
+/*
+    Eliminates the common subexpressions of each run of statements that run
+    one after the other, with no branch in between. An expression that is
+    computed again, with the same operands and no assignment to its variables
+    in between, instead reads the value that the first one saved into a
+    temporary. Expressions that may warn are never reused, such as those that
+    read a variable that is not defined for sure, or an element of an array,
+    or that divide by anything but a constant other than 0. Each loop is
+    optimized on the way, before it is visited. Returns false if out of
+    memory, which may leave the program halfway changed.
+*/
+static bool eliminate(struct ast *const ast)
+{
+    struct optimizing ctx = {
+        .ast = ast,
+        .nodes = ast->nodes,
+        .numbers = calloc(ast->allocated, sizeof(uint32_t)),
+        .vars = calloc(ast->nvars ?: 1, sizeof(struct variable)),
+        .nvars = ast->nvars,
+        .vars_allocated = ast->nvars ?: 1,
+    };
+
+    if (ctx.numbers && ctx.vars) {
+        enter_block(&ctx, ast->root, false, 0);
+    }
+
+    while (ctx.nframes && !ctx.nomem) {
+        struct frame *const frame = &ctx.frames[ctx.nframes - 1];
+
+        /* the body of a Lazy node is not lowered yet, so it is left alone */
+        if (ctx.nodes[frame->block].kind == AST_BLOCK &&
+            frame->next < ctx.nodes[frame->block].b) {
+
+            const uint32_t idx = ctx.nodes[frame->block].a + frame->next;
+            const uint8_t kind = ctx.nodes[idx].kind;
+
+            /*
+                What the loop hoists goes before it, and is visited first.
+                Each loop scans all the loops in it, so the loops that are
+                nested too deep are left as they are, which keeps that linear
+                in the size of the program.
+            */
+            if ((kind == AST_WHILE || kind == AST_DOWHILE) &&
+                idx != ctx.hoisted && idx != ctx.unchecked &&
+                frame->depth < MAX_LOOP_DEPTH) {
+
+                optimize_loop(&ctx, frame->block, frame->next);
+                continue;
+            }
+
+            ++frame->next;
+            eliminate_statement(&ctx, idx);
+            continue;
+        }
+
+        const struct frame done = *frame;
+        --ctx.nframes;
+        end_run(&ctx);
+
+        if (done.scoped) {
+            while (ctx.log_size > done.mark) {
+                ctx.vars[ctx.log[--ctx.log_size]].defined = false;
+            }
+        }
+
+        if (done.cond) {
+            eliminate_expression(&ctx, done.cond, 0);
+            end_run(&ctx);
+        }
+    }
+
+    const bool done = ctx.numbers && ctx.vars && !ctx.nomem;
+    ast->ntemps = ctx.ntemps;
+    ast->depth += ctx.deeper;
+
+    free(ctx.numbers);
+    free(ctx.vars);
+    free(ctx.values);
+    free(ctx.table);
+    free(ctx.log);
+    free(ctx.work);
+    free(ctx.frames);
+    free(ctx.scan);
+    free(ctx.pending);
+    free(ctx.updates);
+    return done;
+}
+
+int optimize(struct ast *const ast)
+{
+    /*
+        The nodes that a node refers to always come after it, so going from
+        the last node to the first optimizes the operands before the operators
+        and the statements before their blocks.
+    */
+    for (uint32_t idx = ast->size; idx-- > 1; ) {
+        optimize_node(ast->nodes, idx);
+    }
+
+    return eliminate(ast) ? OPTIMIZE_OK : OPTIMIZE_NOMEM;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+struct ast;
+
+/*
+    Simplifies the lowered program in place, before it runs. Operators whose
+    operands are constants are folded, as are the conditions of If, While and
+    ternaries, and the arms and loops that can never run are dropped. Nothing
+    that would warn or trap when it runs is folded, such as a division by
+    zero, so the program prints just the same, warnings and all. Operators
+    that are computed again, in the same run of statements, reuse the value
+    that the first one saved into a temporary instead. Loops compute the
+    expressions that they do not change once, before they run, and step the
+    multiples of their counters instead of multiplying them. An If whose
+    arms compare one value to constants becomes a Switch. Counted loops
+    that index arrays at their counter check the bounds once, before they
+    run, and skip the checks inside when they hold. They also step and
+    compare their counters with a single Count, in place of the assignment
+    and the condition. Returns 0 on success, after which the program may
+    have more nodes and variables.
+*/
+int optimize(struct ast *);
+
+enum {
+    OPTIMIZE_OK,
+    OPTIMIZE_NOMEM,
+};
@@ -1,13 +1,16 @@
 #include "parse.h"
 #include "lex.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
 
 #define RULE_RHS_LAST 7
 #define GRAMMAR_SIZE (sizeof(grammar) / sizeof(*grammar))
-#define SKIP_TOKEN(t) ((t) == TK_WSPC || (t) == TK_LCOM || (t) == TK_BCOM)
+#define SKIP_TOKEN(t) TK_IS_TRIVIA(t)
 
 #define n(_nt) { .nt = NT_##_nt, .is_tk = 0, .is_mt = 0 }
 #define m(_nt) { .nt = NT_##_nt, .is_tk = 0, .is_mt = 1 }
@@ -124,141 +127,627 @@ static const uint8_t precedence[TK_MODU - TK_EQUL + 1] = {
     4, 4, 3, 3, 3, 3, 5, 6, 2, 2, 1, 1, 1,
 };
 
+/*
+    The ternary operator binds looser than any binary operator. The rules which
+    end in an operand but are not binary operations (the unary and the ternary
+    operators) bind tighter than any operator, so they are always reduced.
+*/
+#define PREC_TIGHT 0
+#define PREC_QUES  7
+#define PREC_NONE  UINT8_MAX
+
+static uint8_t token_precedence(const tk_t tk)
+{
+    if (tk >= TK_EQUL && tk <= TK_MODU) {
+        return precedence[tk - TK_EQUL];
+    }
+
+    return tk == TK_QUES ? PREC_QUES : PREC_NONE;
+}
+
+/*
+    The grammar is not matched against the parse stack directly. Instead, it is
+    turned into LALR(1) action and goto tables once, at startup, so that the
+    parser does a constant amount of work per token.
+
+    Each m() term becomes a list non-terminal with the rules "list: (empty)"
+    and "list: list term". Reducing a list rule does not create a node, so the
+    terms of the list still end up as siblings in the tree. The if-elif-else
+    chains need no special treatment, because no statement can start with an
+    "elif" or an "else": after a Cond or an Elif, those are always shifted.
+
+    The only conflicts in the grammar are between reducing an operation and
+    shifting the operator after it. They are settled by precedence, and the
+    operator is shifted only if it binds tighter than the operation. Any other
+    conflict is a bug in the grammar, and aborts the build of the tables.
+*/
+#define LR_MAX_STATES 256
+#define LR_MAX_RULES  64
+#define LR_MAX_KERNEL 32
+#define LR_MAX_ITEMS  (LR_MAX_KERNEL + LR_MAX_RULES)
+
+/* terminals are the tokens, and TK_COUNT stands for the end of the input */
+#define LR_NTERMINALS (TK_FEND + 1)
+#define LR_NSYMBOLS   (LR_NTERMINALS + 2 * NT_COUNT + 1)
+#define LR_END        TK_COUNT
+#define LR_NT(nt)     (LR_NTERMINALS + (nt))
+#define LR_LIST(nt)   (LR_NTERMINALS + NT_COUNT + (nt))
+#define LR_START      (LR_NSYMBOLS - 1)
+
+/* the actions are 0 for a syntax error, and a shift or a reduction otherwise */
+#define LR_SHIFT(st)  ((int16_t) ((st) + 1))
+#define LR_REDUCE(r)  ((int16_t) -((r) + 1))
+#define LR_ACCEPT     LR_REDUCE(0)
+
+/* the lookahead sets are bit sets of terminals, plus one bit for nullable */
+#define LR_EMPTY      ((uint64_t) 1 << 63)
+
+typedef uint8_t sym_t;
+
+struct lr_rule {
+    /* the rule of the grammar, or NULL for the list rules and the start rule */
+    const struct rule *rule;
+    sym_t lhs, size, prec;
+    sym_t rhs[RULE_RHS_LAST + 1];
+};
+
+struct lr_item {
+    uint8_t rule, dot;
+};
+
+struct lr_state {
+    size_t nkernel;
+    struct lr_item kernel[LR_MAX_KERNEL];
+    uint64_t lookahead[LR_MAX_KERNEL];
+};
+
+struct lr_closure {
+    size_t size;
+    struct lr_item items[LR_MAX_ITEMS];
+    uint64_t lookahead[LR_MAX_ITEMS];
+};
+
 static struct {
-    size_t size, allocated;
-    struct node *nodes;
-} stack;
-
-static void print_stack(void)
-{
-    static const char *const nts[NT_COUNT] = {
-        "Unit",
-        "Stmt",
-        "Assn",
-        "Prnt",
-        "Ctrl",
-        "Cond",
-        "Elif",
-        "Else",
-        "Dowh",
-        "Whil",
-        "Atom",
-        "Expr",
-        "Pexp",
-        "Bexp",
-        "Uexp",
-        "Texp",
-        "Aexp",
-    };
+    size_t nstates, nrules;
+    struct lr_rule rules[LR_MAX_RULES];
 
-    for (size_t i = 0; i < stack.size; ++i) {
-        const struct node *const node = &stack.nodes[i];
+    /* the action table, indexed by state and terminal */
+    int16_t action[LR_MAX_STATES][LR_NTERMINALS];
 
-        if (node->nchildren) {
-            printf(YELLOW("%s "), nts[node->nt]);
-        } else if (node->token->tk == TK_FBEG) {
-            printf(GREEN("^ "));
-        } else if (node->token->tk == TK_FEND) {
-            printf(GREEN("$ "));
-        } else {
-            const ptrdiff_t len = node->token->end - node->token->beg;
-            printf(GREEN("%.*s "), (int) len, node->token->beg);
+    /* the goto table, indexed by state and symbol (0 if there is none) */
+    uint8_t next[LR_MAX_STATES][LR_NSYMBOLS];
+
+    /* the terminals that can start each symbol, and LR_EMPTY if nullable */
+    uint64_t first[LR_NSYMBOLS];
+} lr;
+
+static pthread_once_t lr_once = PTHREAD_ONCE_INIT;
+
+/* the terminals that can follow the given item, with the given lookahead */
+static uint64_t lr_first(const struct lr_rule *const rule, size_t dot,
+    const uint64_t lookahead)
+{
+    uint64_t set = 0;
+
+    for (; dot < rule->size; ++dot) {
+        set |= lr.first[rule->rhs[dot]] & ~LR_EMPTY;
+
+        if (!(lr.first[rule->rhs[dot]] & LR_EMPTY)) {
+            return set;
         }
     }
 
-    puts("");
+    return set | lookahead;
+}
+
+static void lr_closure(const struct lr_state *const state,
+    struct lr_closure *const closure)
+{
+    /* the index in the closure of each rule's initial item, plus one */
+    size_t added[LR_MAX_RULES] = {0};
+    bool changed;
+
+    closure->size = state->nkernel;
+    memcpy(closure->items, state->kernel,
+        state->nkernel * sizeof(struct lr_item));
+    memcpy(closure->lookahead, state->lookahead,
+        state->nkernel * sizeof(uint64_t));
+
+    do {
+        changed = false;
+
+        for (size_t idx = 0; idx < closure->size; ++idx) {
+            const struct lr_item item = closure->items[idx];
+            const struct lr_rule *const rule = &lr.rules[item.rule];
+
+            if (item.dot == rule->size || rule->rhs[item.dot] < LR_NTERMINALS) {
+                continue;
+            }
+
+            const uint64_t lookahead = lr_first(rule, item.dot + 1,
+                closure->lookahead[idx]);
+
+            for (size_t r = 0; r < lr.nrules; ++r) {
+                if (lr.rules[r].lhs != rule->rhs[item.dot]) {
+                    continue;
+                }
+
+                if (!added[r]) {
+                    if (closure->size == LR_MAX_ITEMS) {
+                        abort();
+                    }
+
+                    closure->items[closure->size] = (struct lr_item) { r, 0 };
+                    closure->lookahead[closure->size] = 0;
+                    added[r] = ++closure->size;
+                }
+
+                uint64_t *const target = &closure->lookahead[added[r] - 1];
+
+                if ((*target | lookahead) != *target) {
+                    *target |= lookahead;
+                    changed = true;
+                }
+            }
+        }
+    } while (changed);
 }
 
-static void destroy_node(const struct node *const node)
+static size_t lr_intern(struct lr_state *const states,
+    const struct lr_state *const state)
 {
-    if (node->nchildren) {
-        for (size_t child_idx = 0; child_idx < node->nchildren; ++child_idx) {
-            destroy_node(node->children[child_idx]);
+    for (size_t idx = 0; idx < lr.nstates; ++idx) {
+        if (states[idx].nkernel == state->nkernel && !memcmp(states[idx].kernel,
+            state->kernel, state->nkernel * sizeof(struct lr_item))) {
+
+            return idx;
         }
+    }
 
-        free(node->children[0]);
-        free(node->children);
+    if (lr.nstates == LR_MAX_STATES) {
+        abort();
     }
+
+    states[lr.nstates] = *state;
+    memset(states[lr.nstates].lookahead, 0, sizeof(state->lookahead));
+    return lr.nstates++;
 }
 
-static void deallocate_stack(void)
+/* the kernel of the state after a symbol, with its items sorted */
+static void lr_advance(const struct lr_closure *const closure, const sym_t sym,
+    struct lr_state *const state)
 {
-    free(stack.nodes);
-    stack.nodes = NULL;
-    stack.size = 0;
-    stack.allocated = 0;
+    state->nkernel = 0;
+
+    for (size_t idx = 0; idx < closure->size; ++idx) {
+        const struct lr_item item = closure->items[idx];
+        const struct lr_rule *const rule = &lr.rules[item.rule];
+
+        if (item.dot == rule->size || rule->rhs[item.dot] != sym) {
+            continue;
+        }
+
+        if (state->nkernel == LR_MAX_KERNEL) {
+            abort();
+        }
+
+        size_t pos = state->nkernel++;
+
+        for (; pos && (state->kernel[pos - 1].rule > item.rule ||
+            (state->kernel[pos - 1].rule == item.rule &&
+            state->kernel[pos - 1].dot > item.dot + 1)); --pos) {
+
+            state->kernel[pos] = state->kernel[pos - 1];
+        }
+
+        state->kernel[pos] = (struct lr_item) { item.rule, item.dot + 1 };
+    }
+}
+
+static void lr_add_reduce(const size_t state, const tk_t tk, const size_t r)
+{
+    int16_t *const action = &lr.action[state][tk];
+
+    if (*action > 0) {
+        const uint8_t tk_prec = token_precedence(tk);
+        const uint8_t rule_prec = lr.rules[r].prec;
+
+        if (tk_prec == PREC_NONE || rule_prec == PREC_NONE) {
+            abort();
+        }
+
+        if (tk_prec < rule_prec) {
+            return;
+        }
+    } else if (*action < 0) {
+        abort();
+    }
+
+    *action = LR_REDUCE(r);
 }
 
-static void destroy_stack(void)
+static void lr_add_rule(const struct lr_rule *const rule)
 {
-    for (size_t node_idx = 0; node_idx < stack.size; ++node_idx) {
-        destroy_node(&stack.nodes[node_idx]);
+    if (lr.nrules == LR_MAX_RULES) {
+        abort();
     }
 
-    deallocate_stack();
+    lr.rules[lr.nrules++] = *rule;
 }
 
-static inline int term_eq_node(
-    const struct term *const term,
-    const struct node *const node)
+static void lr_build(void)
 {
-    const int node_is_leaf = node->nchildren == 0;
+    static struct lr_state states[LR_MAX_STATES];
+    struct lr_closure closure;
+    struct lr_state state;
+    bool listed[NT_COUNT] = {0}, changed;
+
+    lr_add_rule(&(struct lr_rule) {
+        .lhs = LR_START, .size = 1, .prec = PREC_NONE,
+        .rhs = { LR_NT(NT_Unit) },
+    });
+
+    for (const struct rule *rule = grammar; rule != grammar + GRAMMAR_SIZE;
+        ++rule) {
+
+        struct lr_rule lr_rule = {
+            .rule = rule, .lhs = LR_NT(rule->lhs), .prec = PREC_NONE,
+        };
+
+        for (size_t idx = 0; idx <= RULE_RHS_LAST; ++idx) {
+            const struct term *const term = &rule->rhs[idx];
+
+            if (term->is_tk) {
+                if (term->tk != TK_COUNT) {
+                    lr_rule.rhs[lr_rule.size++] = term->tk;
+                }
+            } else if (term->is_mt) {
+                lr_rule.rhs[lr_rule.size++] = LR_LIST(term->nt);
+                listed[term->nt] = true;
+            } else {
+                lr_rule.rhs[lr_rule.size++] = LR_NT(term->nt);
+            }
+        }
+
+        const sym_t *const rhs = lr_rule.rhs;
+
+        if (rhs[lr_rule.size - 1] == LR_NT(NT_Expr)) {
+            const bool binary = lr_rule.size == 3 &&
+                rhs[0] == LR_NT(NT_Expr) &&
+                token_precedence(rhs[1]) < PREC_QUES;
+
+            lr_rule.prec = binary ? token_precedence(rhs[1]) : PREC_TIGHT;
+        }
+
+        lr_add_rule(&lr_rule);
+    }
+
+    for (nt_t nt = 0; nt < NT_COUNT; ++nt) {
+        if (listed[nt]) {
+            lr_add_rule(&(struct lr_rule) {
+                .lhs = LR_LIST(nt), .size = 0, .prec = PREC_NONE,
+            });
+
+            lr_add_rule(&(struct lr_rule) {
+                .lhs = LR_LIST(nt), .size = 2, .prec = PREC_NONE,
+                .rhs = { LR_LIST(nt), LR_NT(nt) },
+            });
+        }
+    }
+
+    for (sym_t sym = 0; sym < LR_NTERMINALS; ++sym) {
+        lr.first[sym] = (uint64_t) 1 << sym;
+    }
+
+    do {
+        changed = false;
+
+        for (size_t r = 0; r < lr.nrules; ++r) {
+            const uint64_t first = lr_first(&lr.rules[r], 0, LR_EMPTY);
+            uint64_t *const target = &lr.first[lr.rules[r].lhs];
+
+            if ((*target | first) != *target) {
+                *target |= first;
+                changed = true;
+            }
+        }
+    } while (changed);
+
+    /* the LR(0) automaton */
+    state.nkernel = 1;
+    state.kernel[0] = (struct lr_item) { 0, 0 };
+    lr_intern(states, &state);
+
+    for (size_t st = 0; st < lr.nstates; ++st) {
+        lr_closure(&states[st], &closure);
+
+        for (size_t idx = 0; idx < closure.size; ++idx) {
+            const struct lr_item item = closure.items[idx];
+            const struct lr_rule *const rule = &lr.rules[item.rule];
+
+            if (item.dot < rule->size && !lr.next[st][rule->rhs[item.dot]]) {
+                lr_advance(&closure, rule->rhs[item.dot], &state);
+                lr.next[st][rule->rhs[item.dot]] = lr_intern(states, &state);
+            }
+        }
+    }
+
+    /* the lookaheads of the kernel items, propagated until nothing changes */
+    states[0].lookahead[0] = (uint64_t) 1 << LR_END;
+
+    do {
+        changed = false;
+
+        for (size_t st = 0; st < lr.nstates; ++st) {
+            lr_closure(&states[st], &closure);
+
+            for (size_t idx = 0; idx < closure.size; ++idx) {
+                const struct lr_item item = closure.items[idx];
+                const struct lr_rule *const rule = &lr.rules[item.rule];
+
+                if (item.dot == rule->size) {
+                    continue;
+                }
 
-    if (term->is_tk == node_is_leaf) {
-        if (node_is_leaf) {
-            return term->tk == node->token->tk;
+                struct lr_state *const target =
+                    &states[lr.next[st][rule->rhs[item.dot]]];
+
+                size_t k = 0;
+
+                while (target->kernel[k].rule != item.rule ||
+                    target->kernel[k].dot != item.dot + 1) {
+
+                    ++k;
+                }
+
+                if ((target->lookahead[k] | closure.lookahead[idx]) !=
+                    target->lookahead[k]) {
+
+                    target->lookahead[k] |= closure.lookahead[idx];
+                    changed = true;
+                }
+            }
+        }
+    } while (changed);
+
+    /* the shifts first, so that the reductions can be checked against them */
+    for (size_t st = 0; st < lr.nstates; ++st) {
+        lr_closure(&states[st], &closure);
+
+        for (size_t idx = 0; idx < closure.size; ++idx) {
+            const struct lr_item item = closure.items[idx];
+            const struct lr_rule *const rule = &lr.rules[item.rule];
+
+            if (item.dot < rule->size && rule->rhs[item.dot] < LR_NTERMINALS) {
+                const sym_t sym = rule->rhs[item.dot];
+                lr.action[st][sym] = LR_SHIFT(lr.next[st][sym]);
+            }
+        }
+
+        for (size_t idx = 0; idx < closure.size; ++idx) {
+            const struct lr_item item = closure.items[idx];
+
+            if (item.dot < lr.rules[item.rule].size) {
+                continue;
+            }
+
+            for (tk_t tk = 0; tk < LR_NTERMINALS; ++tk) {
+                if (closure.lookahead[idx] & ((uint64_t) 1 << tk)) {
+                    lr_add_reduce(st, tk, item.rule);
+                }
+            }
+        }
+    }
+}
+
+/*
+    The nodes of a tree and their arrays of children are carved out of large
+    blocks, which are all freed at once together with the tree. The children
+    of the root are allocated on their own, right after a record of the arena
+    that holds the rest of the tree, so that reparse() can hand the arena over
+    to a new root without copying or walking the statements.
+*/
+#define ARENA_BLOCK_MIN (4 * 1024)
+#define ARENA_BLOCK_MAX (1024 * 1024)
+
+struct arena {
+    /* the block being filled, which links to the blocks filled before it */
+    struct block {
+        struct block *prev;
+        size_t size, used;
+        _Alignas(struct node) uint8_t data[];
+    } *block;
+};
+
+struct root {
+    struct arena arena;
+    struct node *children[];
+};
+
+#define root_of(node) \
+    ((struct root *) ((uint8_t *) (node).children - \
+        offsetof(struct root, children)))
+
+static void *arena_alloc(struct arena *const arena, size_t size)
+{
+    struct block *block = arena->block;
+    size = (size + _Alignof(struct node) - 1) & -_Alignof(struct node);
+
+    if (!block || block->size - block->used < size) {
+        const size_t grown = block ? block->size * 2 : ARENA_BLOCK_MIN;
+        const size_t block_size = grown < ARENA_BLOCK_MAX ?
+            grown : ARENA_BLOCK_MAX;
+
+        /* large arrays get a block of their own, below the one being filled */
+        const bool own = block && size > ARENA_BLOCK_MAX / 2;
+        struct block *const fresh = malloc(sizeof(struct block) +
+            (own || size > block_size ? size : block_size));
+
+        if (!fresh) {
+            return NULL;
+        }
+
+        fresh->size = own || size > block_size ? size : block_size;
+        fresh->used = 0;
+
+        if (own) {
+            fresh->prev = block->prev;
+            block->prev = fresh;
         } else {
-            return term->nt == node->nt;
+            fresh->prev = block;
+            arena->block = fresh;
         }
+
+        block = fresh;
     }
 
-    return 0;
+    void *const ptr = &block->data[block->used];
+    block->used += size;
+    return ptr;
 }
 
-static size_t match_rule(const struct rule *const rule, size_t *const at)
+/* moves all the blocks of the source arena over to the destination arena */
+static void arena_merge(struct arena *const dst, struct arena *const src)
 {
-    const struct term *prev = NULL;
-    const struct term *term = &rule->rhs[RULE_RHS_LAST];
-    ssize_t st_idx = stack.size - 1;
+    if (src->block) {
+        struct block *tail = src->block;
 
-    do {
-        if (term_eq_node(term, &stack.nodes[st_idx])) {
-            prev = term->is_mt ? term : NULL;
-            --term, --st_idx;
-        } else if (prev && term_eq_node(prev, &stack.nodes[st_idx])) {
-            --st_idx;
-        } else if (term->is_mt) {
-            prev = NULL;
-            --term;
+        while (tail->prev) {
+            tail = tail->prev;
+        }
+
+        tail->prev = dst->block;
+        dst->block = src->block;
+        src->block = NULL;
+    }
+}
+
+static void arena_free(struct arena *const arena)
+{
+    for (struct block *block = arena->block, *prev; block; block = prev) {
+        prev = block->prev;
+        free(block);
+    }
+
+    arena->block = NULL;
+}
+
+/* allocates the children of a root, followed by the child nodes themselves */
+static struct root *alloc_root(const size_t size)
+{
+    struct root *const root = malloc(sizeof(struct root) +
+        size * (sizeof(struct node *) + sizeof(struct node)));
+
+    if (root) {
+        root->arena.block = NULL;
+        struct node *const child_nodes = (struct node *) &root->children[size];
+
+        for (size_t child_idx = 0; child_idx < size; ++child_idx) {
+            root->children[child_idx] = &child_nodes[child_idx];
+        }
+    }
+
+    return root;
+}
+
+/* the parse stack of one parser, so that several parsers can run at once */
+struct stack {
+    size_t size, allocated;
+    struct node *nodes;
+
+    /* the arena for the nodes of the tree being built */
+    struct arena arena;
+
+    /* the LR states, each with the index of the first node of its symbol */
+    size_t depth, frames_allocated;
+
+    struct frame {
+        uint8_t state;
+        uint32_t at;
+    } *frames;
+
+    /* the operation that ran out of memory, if any */
+    const char *nomem;
+
+    /* the matching "}" of each "{", to leave large blocks out of the tree */
+    const uint32_t *match;
+};
+
+const char *const nt_names[NT_COUNT] = {
+    "Unit",
+    "Stmt",
+    "Assn",
+    "Prnt",
+    "Ctrl",
+    "Cond",
+    "Elif",
+    "Else",
+    "Dowh",
+    "Whil",
+    "Atom",
+    "Expr",
+    "Pexp",
+    "Bexp",
+    "Uexp",
+    "Texp",
+    "Aexp",
+};
+
+static void print_stack(const struct stack *const stack)
+{
+    for (size_t i = 0; i < stack->size; ++i) {
+        const struct node *const node = &stack->nodes[i];
+
+        if (node->nchildren) {
+            trace_printf(YELLOW("%s "), nt_names[node->nt]);
+        } else if (node->token.tk == TK_FBEG) {
+            trace_printf(GREEN("^ "));
+        } else if (node->token.tk == TK_FEND) {
+            trace_printf(GREEN("$ "));
         } else {
-            term = NULL;
-            break;
+            const int len = node->token.len;
+            trace_printf(GREEN("%.*s "), len, node->token.beg);
         }
-    } while (st_idx >= 0 && !(term->is_tk && term->tk == TK_COUNT));
+    }
 
-    const int reached_eor = term && term->is_tk && term->tk == TK_COUNT;
-    const size_t reduction_size = stack.size - st_idx - 1;
+    trace_printf("\n");
+}
+
+static void deallocate_stack(struct stack *const stack)
+{
+    free(stack->nodes);
+    stack->nodes = NULL;
+    stack->size = 0;
+    stack->allocated = 0;
+
+    free(stack->frames);
+    stack->frames = NULL;
+    stack->depth = 0;
+    stack->frames_allocated = 0;
+}
 
-    return reached_eor && reduction_size ?
-        (*at = st_idx + 1, reduction_size) : 0;
+static void destroy_stack(struct stack *const stack)
+{
+    arena_free(&stack->arena);
+    deallocate_stack(stack);
 }
 
-static inline int shift(const struct token *const token)
+static inline int shift(struct stack *const stack, const struct token token)
 {
-    if (stack.size >= stack.allocated) {
-        stack.allocated = (stack.allocated ?: 1) * 8;
+    if (stack->size >= stack->allocated) {
+        stack->allocated = (stack->allocated ?: 1) * 8;
 
-        struct node *const tmp = realloc(stack.nodes,
-            stack.allocated * sizeof(struct node));
+        struct node *const tmp = realloc(stack->nodes,
+            stack->allocated * sizeof(struct node));
 
         if (!tmp) {
             return PARSE_NOMEM;
         }
 
-        stack.nodes = tmp;
+        stack->nodes = tmp;
     }
 
-    stack.nodes[stack.size++] = (struct node) {
+    stack->nodes[stack->size++] = (struct node) {
         .nchildren = 0,
         .token = token,
     };
@@ -266,183 +755,763 @@ static inline int shift(const struct token *const token)
     return PARSE_OK;
 }
 
-static inline bool should_shift_pre(
-    const struct rule *const rule,
-    const struct token *const tokens,
-    size_t *const token_idx)
+static inline int push_frame(struct stack *const stack, const uint8_t state,
+    const size_t at)
 {
+    if (stack->depth >= stack->frames_allocated) {
+        stack->frames_allocated = (stack->frames_allocated ?: 1) * 8;
+
+        struct frame *const tmp = realloc(stack->frames,
+            stack->frames_allocated * sizeof(struct frame));
+
+        if (!tmp) {
+            return PARSE_NOMEM;
+        }
+
+        stack->frames = tmp;
+    }
+
+    stack->frames[stack->depth++] = (struct frame) {
+        .state = state,
+        .at = at,
+    };
+
+    return PARSE_OK;
+}
+
+static int reduce(struct stack *const stack, const struct rule *const rule,
+    const size_t at, const size_t size)
+{
+    struct node **children;
+
     if (rule->lhs == NT_Unit) {
-        return false;
+        /* the root takes over the arena, so this must be the last reduction */
+        struct root *const root = alloc_root(size);
+
+        if (!root) {
+            return PARSE_NOMEM;
+        }
+
+        root->arena = stack->arena;
+        stack->arena.block = NULL;
+        children = root->children;
+    } else {
+        struct node *const child_nodes = arena_alloc(&stack->arena,
+            size * (sizeof(struct node) + sizeof(struct node *)));
+
+        if (!child_nodes) {
+            return PARSE_NOMEM;
+        }
+
+        children = (struct node **) &child_nodes[size];
+
+        for (size_t child_idx = 0; child_idx < size; ++child_idx) {
+            children[child_idx] = &child_nodes[child_idx];
+        }
     }
 
-    while (SKIP_TOKEN(tokens[*token_idx].tk)) {
-        ++*token_idx;
+    for (size_t child_idx = 0; child_idx < size; ++child_idx) {
+        *children[child_idx] = stack->nodes[at + child_idx];
     }
 
-    const struct token *const ahead = &tokens[*token_idx];
+    stack->nodes[at] = (struct node) {
+        .nchildren = size,
+        .nt = rule->lhs,
+        .children = children,
+    };
+
+    stack->size = at + 1;
+    return PARSE_OK;
+}
 
-    if (rule->lhs == NT_Bexp && ahead->tk >= TK_EQUL && ahead->tk <= TK_MODU) {
-        /*
-            Check whether the operator ahead has a lower precedence. If it has,
-            let the parser shift it before applying the Bexp reduction.
-        */
-        const uint8_t p1 = precedence[rule->rhs[RULE_RHS_LAST - 1].tk - TK_EQUL];
-        const uint8_t p2 = precedence[ahead->tk - TK_EQUL];
+static const struct node
+    err_reject = { .nchildren = 0, .token = { .tk = PARSE_REJECT } },
+    err_nomem  = { .nchildren = 0, .token = { .tk = PARSE_NOMEM  } };
+
+/*
+    Returns the index of the token to go on from after the "{" at the given
+    index: the matching "}" if the block is large enough to be left out of a
+    lazy parse, and the next token otherwise.
+*/
+static inline size_t skip_block(const struct stack *const stack,
+    const struct tokens *const tokens, const size_t lbrc)
+{
+    const size_t rbrc = stack->match[lbrc];
+    const size_t body = tokens->beg[lbrc] + tokens->len[lbrc];
 
-        if (p2 < p1) {
-            return true;
+    return tokens->beg[rbrc] - body >= PARSE_LAZY_MIN ? rbrc : lbrc + 1;
+}
+
+/*
+    Runs one parser over the tokens [lo, hi], which are taken to be a TK_FBEG
+    and a TK_FEND, without reporting running out of memory.
+*/
+static struct node run_parser(struct stack *const stack,
+    const struct tokens *const tokens, const size_t lo, const size_t hi)
+{
+    #define SHIFT_OR_NOMEM(t) \
+        if (shift(stack, t)) { \
+            stack->nomem = "shift"; \
+            return destroy_stack(stack), err_nomem; \
+        }
+
+    #define REDUCE_OR_NOMEM(r, a, s) \
+        if (reduce(stack, r, a, s)) { \
+            stack->nomem = "reduce"; \
+            return destroy_stack(stack), err_nomem; \
         }
-    } else if (rule->lhs == NT_Atom && rule->rhs[RULE_RHS_LAST].tk == TK_NAME) {
-        /*
-            Do not allow the left side of an assignment or an array name to
-            escalate to Expr.
-        */
-        if (ahead->tk == TK_ASSN || ahead->tk == TK_LBRA) {
-            return true;
+
+    #define PUSH_OR_NOMEM(st, a) \
+        if (push_frame(stack, st, a)) { \
+            stack->nomem = "push"; \
+            return destroy_stack(stack), err_nomem; \
         }
-    } else if (rule->lhs == NT_Expr && rule->rhs[RULE_RHS_LAST].nt == NT_Aexp) {
-        /*
-            Do not allow an Aexp on the left side of an assignment to escalate
-            to Expr.
-        */
-        if (ahead->tk == TK_ASSN) {
-            return true;
+
+    pthread_once(&lr_once, lr_build);
+    PUSH_OR_NOMEM(0, 0);
+
+    size_t token_idx = lo;
+    tk_t ahead;
+    int16_t action;
+
+    for (;;) {
+        while (token_idx < hi && SKIP_TOKEN(tokens->tk[token_idx])) {
+            ++token_idx;
         }
+
+        ahead = token_idx < hi && token_idx != lo ? tokens->tk[token_idx] :
+            token_idx == lo ? TK_FBEG : token_idx == hi ? TK_FEND : LR_END;
+
+        action = lr.action[stack->frames[stack->depth - 1].state][ahead];
+
+        if (action > 0) {
+            struct token token = token_at(tokens, token_idx);
+            token.tk = ahead;
+
+            SHIFT_OR_NOMEM(token);
+            PUSH_OR_NOMEM(action - 1, stack->size - 1);
+
+            trace_event(TRACE_SHIFT, ahead, 0,
+                tokens->beg[token_idx], tokens->len[token_idx], stack->size);
+
+            if (trace.level >= TRACE_FULL) {
+                trace_printf(CYAN("Shift: ")), print_stack(stack);
+            }
+
+            token_idx = stack->match && ahead == TK_LBRC ?
+                skip_block(stack, tokens, token_idx) : token_idx + 1;
+        } else if (action < 0 && action != LR_ACCEPT) {
+            const struct lr_rule *const rule = &lr.rules[-action - 1];
+            stack->depth -= rule->size;
+
+            const size_t at = rule->size ?
+                stack->frames[stack->depth].at : stack->size;
+
+            /* list rules only regroup the states, the nodes stay as they are */
+            if (rule->rule) {
+                REDUCE_OR_NOMEM(rule->rule, at, stack->size - at);
+                const ptrdiff_t rule_number = rule->rule - grammar + 1;
+
+                trace_event(TRACE_REDUCE, rule->rule->lhs, rule_number,
+                    0, 0, stack->size);
+
+                if (trace.level >= TRACE_FULL) {
+                    trace_printf(ORANGE("Red%02td: "), rule_number);
+                    print_stack(stack);
+                }
+            }
+
+            const uint8_t state = stack->frames[stack->depth - 1].state;
+            PUSH_OR_NOMEM(lr.next[state][rule->lhs], at);
+        } else {
+            break;
+        }
+    }
+
+    #undef SHIFT_OR_NOMEM
+    #undef REDUCE_OR_NOMEM
+    #undef PUSH_OR_NOMEM
+
+    const int accepted = action == LR_ACCEPT && stack->size == 1 &&
+        stack->nodes[0].nchildren && stack->nodes[0].nt == NT_Unit;
+
+    if (accepted) {
+        trace_event(TRACE_ACCEPT, LR_END, 0, 0, 0, stack->size);
+    } else if (token_idx <= hi) {
+        trace_event(TRACE_REJECT, ahead, 0,
+            tokens->beg[token_idx], tokens->len[token_idx], stack->size);
+    } else {
+        trace_event(TRACE_REJECT, LR_END, 0, 0, 0, stack->size);
     }
 
-    return false;
+    if (trace.level >= TRACE_FULL) {
+        trace_printf(accepted ? GREEN("ACCEPT ") : RED("REJECT "));
+        print_stack(stack);
+    }
+
+    if (accepted) {
+        const struct node ret = stack->nodes[0];
+        return deallocate_stack(stack), ret;
+    } else {
+        return destroy_stack(stack), err_reject;
+    }
 }
 
-static inline bool should_shift_post(
-    const struct rule *const rule,
-    const struct token *const tokens,
-    size_t *const token_idx)
+static struct node report_nomem(const struct stack *const stack,
+    const struct node root)
 {
-    if (rule->lhs == NT_Unit) {
-        return false;
+    if (stack->nomem) {
+        trace_printf(RED("Out of memory on %s!") "\n", stack->nomem);
     }
 
-    while (SKIP_TOKEN(tokens[*token_idx].tk)) {
-        ++*token_idx;
+    return root;
+}
+
+struct node parse(const struct tokens *const tokens)
+{
+    struct stack stack = {0};
+    return report_nomem(&stack,
+        run_parser(&stack, tokens, 0, tokens->size - 1));
+}
+
+/*
+    Only checks that the tokens parse, which takes just the LR states, so that
+    no nodes are built for the statements that a lazy parse leaves out.
+*/
+static int recognize(struct stack *const stack,
+    const struct tokens *const tokens)
+{
+    size_t token_idx = 0;
+    int16_t action;
+
+    pthread_once(&lr_once, lr_build);
+
+    if (push_frame(stack, 0, 0)) {
+        return stack->nomem = "push", PARSE_NOMEM;
     }
 
-    const struct token *const ahead = &tokens[*token_idx];
+    for (;;) {
+        while (token_idx < tokens->size && SKIP_TOKEN(tokens->tk[token_idx])) {
+            ++token_idx;
+        }
+
+        const tk_t ahead = token_idx < tokens->size ?
+            tokens->tk[token_idx] : LR_END;
 
-    if (rule->lhs == NT_Cond || rule->lhs == NT_Elif) {
-        /* swallow the next "elif" or "else" in order to parse the whole chain */
-        if (ahead->tk == TK_ELIF || ahead->tk == TK_ELSE) {
-            return true;
+        action = lr.action[stack->frames[stack->depth - 1].state][ahead];
+
+        if (action > 0) {
+            if (push_frame(stack, action - 1, 0)) {
+                return stack->nomem = "push", PARSE_NOMEM;
+            }
+
+            ++token_idx;
+        } else if (action < 0 && action != LR_ACCEPT) {
+            const struct lr_rule *const rule = &lr.rules[-action - 1];
+            stack->depth -= rule->size;
+
+            const uint8_t state = stack->frames[stack->depth - 1].state;
+
+            if (push_frame(stack, lr.next[state][rule->lhs], 0)) {
+                return stack->nomem = "push", PARSE_NOMEM;
+            }
+        } else {
+            break;
         }
     }
 
-    return false;
+    return action == LR_ACCEPT ? PARSE_OK : PARSE_REJECT;
 }
 
-static int reduce(const struct rule *const rule,
-    const size_t at, const size_t size)
+/* pairs up the braces, which must be balanced, in a single pass */
+static uint32_t *match_braces(const struct tokens *const tokens)
 {
-    struct node *const child_nodes = malloc(size * sizeof(struct node));
+    uint32_t *const match = malloc(tokens->size * sizeof(uint32_t));
+
+    if (match) {
+        /* each open "{" refers to the one it is nested in, until closed */
+        uint32_t open = UINT32_MAX;
+
+        for (size_t token_idx = 0; token_idx < tokens->size; ++token_idx) {
+            if (tokens->tk[token_idx] == TK_LBRC) {
+                match[token_idx] = open;
+                open = token_idx;
+            } else if (tokens->tk[token_idx] == TK_RBRC) {
+                const uint32_t closed = open;
+                open = match[closed];
+                match[closed] = token_idx;
+            }
+        }
+    }
+
+    return match;
+}
 
-    if (!child_nodes) {
-        return PARSE_NOMEM;
+struct node parse_lazy(struct lazy *const lazy, struct tokens *const tokens)
+{
+    struct stack stack = {0};
+
+    *lazy = (struct lazy) { .tokens = *tokens };
+    *tokens = (struct tokens) { .input = tokens->input };
+
+    const int error = recognize(&stack, &lazy->tokens);
+    deallocate_stack(&stack);
+
+    /* a syntax error is found again by a full parse, to report it */
+    if (error == PARSE_REJECT) {
+        return parse(&lazy->tokens);
+    } else if (error == PARSE_NOMEM) {
+        return report_nomem(&stack, err_nomem);
+    } else if (!(lazy->match = match_braces(&lazy->tokens))) {
+        stack.nomem = "match";
+        return report_nomem(&stack, err_nomem);
     }
 
-    struct node *const reduce_at = &stack.nodes[at];
-    struct node **const old_children = reduce_at->children;
-    reduce_at->children = malloc(size * sizeof(struct node *)) ?: old_children;
+    stack.match = lazy->match;
+
+    return report_nomem(&stack,
+        run_parser(&stack, &lazy->tokens, 0, lazy->tokens.size - 1));
+}
+
+struct node parse_block(const struct lazy *const lazy, const size_t lbrc)
+{
+    struct stack stack = { .match = lazy->match };
+
+    return report_nomem(&stack,
+        run_parser(&stack, &lazy->tokens, lbrc, lazy->match[lbrc]));
+}
+
+void destroy_lazy(struct lazy *const lazy)
+{
+    destroy_tokens(&lazy->tokens);
+    free(lazy->match);
+    lazy->match = NULL;
+}
 
-    if (reduce_at->children == old_children) {
-        return free(child_nodes), PARSE_NOMEM;
+void destroy_tree(const struct node root)
+{
+    struct root *const tree = root_of(root);
+    arena_free(&tree->arena);
+    free(tree);
+}
+
+static const struct token *first_token(const struct node *node)
+{
+    while (node->nchildren) {
+        node = node->children[0];
     }
 
-    for (size_t child_idx = 0, st_idx = at;
-        st_idx < stack.size;
-        ++st_idx, ++child_idx) {
+    return &node->token;
+}
 
-        child_nodes[child_idx] = stack.nodes[st_idx];
-        reduce_at->children[child_idx] = &child_nodes[child_idx];
+static const struct token *last_token(const struct node *node)
+{
+    while (node->nchildren) {
+        node = node->children[node->nchildren - 1];
     }
 
-    child_nodes[0].children = old_children;
-    reduce_at->nchildren = size;
-    reduce_at->nt = rule->lhs;
-    stack.size = at + 1;
-    return PARSE_OK;
+    return &node->token;
 }
 
-struct node parse(const struct token *const tokens, const size_t ntokens)
+/* the subtrees that rebase_node() has yet to visit, shared by its calls */
+struct pending {
+    size_t allocated;
+    struct node **nodes;
+};
+
+/*
+    Points the leaves of a subtree moved from the old input to the new one.
+    Returns 0 on success, and -1 if out of memory.
+*/
+static int rebase_node(struct node *node, struct pending *const pending,
+    const uint8_t *const old_input, const uint8_t *const input,
+    const ptrdiff_t delta)
 {
-    static const struct token
-        reject = { .tk = PARSE_REJECT },
-        nomem  = { .tk = PARSE_NOMEM  };
+    size_t size = 0;
 
-    static const struct node
-        err_reject = { .nchildren = 0, .token = &reject },
-        err_nomem  = { .nchildren = 0, .token = &nomem  };
+    for (;;) {
+        while (node->nchildren) {
+            if (size + node->nchildren > pending->allocated) {
+                const size_t allocated = (size + node->nchildren) * 2;
 
-    #define SHIFT_OR_NOMEM(t) \
-        if (shift(t)) { \
-            puts(RED("Out of memory on shift!")); \
-            return destroy_stack(), err_nomem; \
+                struct node **const tmp = realloc(pending->nodes,
+                    allocated * sizeof(struct node *));
+
+                if (!tmp) {
+                    return -1;
+                }
+
+                pending->nodes = tmp;
+                pending->allocated = allocated;
+            }
+
+            for (size_t child_idx = node->nchildren; --child_idx > 0; ) {
+                pending->nodes[size++] = node->children[child_idx];
+            }
+
+            node = node->children[0];
         }
 
-    #define REDUCE_OR_NOMEM(r, a, s) \
-        if (reduce(r, a, s)) { \
-            puts(RED("Out of memory on reduce!")); \
-            return destroy_stack(), err_nomem; \
+        node->token.beg = input + (node->token.beg - old_input) + delta;
+
+        if (!size) {
+            return 0;
         }
 
-    for (size_t token_idx = 0; token_idx < ntokens; ) {
-        if (SKIP_TOKEN(tokens[token_idx].tk)) {
-            ++token_idx;
-            continue;
+        node = pending->nodes[--size];
+    }
+}
+
+/*
+    Copies the tokens [beg, end) wrapped in a TK_FBEG and a TK_FEND, so that
+    they can be parsed as a Unit of their own. Returns 0 on success, and -1 if
+    out of memory, in which case the copy must still be destroyed.
+*/
+static int wrap_tokens(const struct tokens *const tokens, const size_t beg,
+    const size_t end, struct tokens *const wrapped)
+{
+    const size_t count = end - beg;
+
+    *wrapped = (struct tokens) {
+        .input = tokens->input,
+        .size = count + 2,
+        .tk = malloc((count + 2) * sizeof(tk_t)),
+        .beg = malloc((count + 2) * sizeof(uint32_t)),
+        .len = malloc((count + 2) * sizeof(uint32_t)),
+    };
+
+    if (!wrapped->tk || !wrapped->beg || !wrapped->len) {
+        return -1;
+    }
+
+    memcpy(&wrapped->tk[1], &tokens->tk[beg], count * sizeof(tk_t));
+    memcpy(&wrapped->beg[1], &tokens->beg[beg], count * sizeof(uint32_t));
+    memcpy(&wrapped->len[1], &tokens->len[beg], count * sizeof(uint32_t));
+    wrapped->tk[0] = TK_FBEG, wrapped->tk[count + 1] = TK_FEND;
+    wrapped->beg[0] = wrapped->len[0] = 0;
+    wrapped->beg[count + 1] = wrapped->len[count + 1] = 0;
+    return 0;
+}
+
+/*
+    Top-level statements which consist only of tokens that were not relexed are
+    moved over to the new tree. The statements in between are parsed again as
+    a Unit of their own, and if that fails (for example, because the edit left
+    an "else" right after a reused "if"), the whole input is parsed again.
+*/
+struct node reparse(struct tokens *const tokens, const struct node root,
+    const uint8_t *const input, const size_t size,
+    const struct edit *const edit)
+{
+    const uint8_t *const old_input = tokens->input;
+    struct damage damage;
+    const int lex_error = relex(input, size, edit, tokens, &damage);
+
+    if (lex_error || !root.nchildren) {
+        if (root.nchildren) {
+            destroy_tree(root);
         }
 
-        SHIFT_OR_NOMEM(&tokens[token_idx++]);
-        printf(CYAN("Shift: ")), print_stack();
+        return lex_error == LEX_NOMEM ? err_nomem :
+            lex_error ? err_reject : parse(tokens);
+    }
 
-        try_reduce_again:;
-        const struct rule *rule = grammar;
+    /* statements [1, prefix) are kept as they are, [suffix, last) are moved */
+    const size_t last = root.nchildren - 1;
+    const ptrdiff_t delta = edit->new_end - edit->old_end;
+    size_t prefix = 1, suffix = last, hi = last;
 
-        do {
-            size_t reduction_at, reduction_size;
+    while (prefix < hi) {
+        const size_t mid = prefix + (hi - prefix) / 2;
+        const struct token *const token = last_token(root.children[mid]);
 
-            if ((reduction_size = match_rule(rule, &reduction_at))) {
-                const bool do_shift = should_shift_pre(rule, tokens, &token_idx);
+        if (token->beg + token->len - old_input <= damage.beg) {
+            prefix = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
 
-                if (!do_shift) {
-                    REDUCE_OR_NOMEM(rule, reduction_at, reduction_size);
-                    const ptrdiff_t rule_number = rule - grammar + 1;
-                    printf(ORANGE("Red%02td: "), rule_number), print_stack();
-                }
+    for (size_t lo = prefix; lo < suffix; ) {
+        const size_t mid = lo + (suffix - lo) / 2;
 
-                if (do_shift || should_shift_post(rule, tokens, &token_idx)) {
-                    SHIFT_OR_NOMEM(&tokens[token_idx++]);
-                    printf(CYAN("Shift: ")), print_stack();
-                }
+        const struct token *const token = first_token(root.children[mid]);
 
-                goto try_reduce_again;
-            }
-        } while (++rule != grammar + GRAMMAR_SIZE);
+        if (token->beg - old_input >= damage.old_end) {
+            suffix = mid;
+        } else {
+            lo = mid + 1;
+        }
     }
 
-    #undef SHIFT_OR_NOMEM
-    #undef REDUCE_OR_NOMEM
+    const size_t tokens_beg = prefix > 1 ? find_token(tokens,
+        last_token(root.children[prefix - 1])->beg - old_input +
+        last_token(root.children[prefix - 1])->len) : 1;
 
-    const int accepted = stack.size == 1 &&
-        stack.nodes[0].nchildren && stack.nodes[0].nt == NT_Unit;
+    const size_t tokens_end = suffix < last ? find_token(tokens,
+        first_token(root.children[suffix])->beg - old_input + delta) :
+        tokens->size - 1;
 
-    printf(accepted ? GREEN("ACCEPT ") : RED("REJECT ")), print_stack();
+    /* parse the tokens in between as a Unit of their own */
+    struct tokens middle;
 
-    if (accepted) {
-        const struct node ret = stack.nodes[0];
-        return deallocate_stack(), ret;
+    if (wrap_tokens(tokens, tokens_beg, tokens_end, &middle)) {
+        return destroy_tokens(&middle), destroy_tree(root), err_nomem;
+    }
+
+    const struct node reparsed = parse(&middle);
+    destroy_tokens(&middle);
+
+    if (parse_error(reparsed)) {
+        destroy_tree(root);
+        return parse_error(reparsed) == PARSE_NOMEM ? err_nomem : parse(tokens);
+    }
+
+    /* assemble the new Unit from the kept, reparsed and moved statements */
+    const size_t nreparsed = reparsed.nchildren - 2;
+    const size_t nchildren = prefix + nreparsed + (last - suffix) + 1;
+    struct root *const tree = alloc_root(nchildren);
+
+    if (!tree) {
+        return destroy_tree(reparsed), destroy_tree(root), err_nomem;
+    }
+
+    struct node **const children = tree->children;
+    struct pending pending = {0};
+    int rebase_error = 0;
+    size_t child_idx = 0;
+    *children[child_idx++] = (struct node) { .token = token_at(tokens, 0) };
+
+    for (size_t stmt_idx = 1; stmt_idx < prefix; ++stmt_idx) {
+        *children[child_idx] = *root.children[stmt_idx];
+
+        if (input != old_input) {
+            rebase_error |= rebase_node(children[child_idx], &pending,
+                old_input, input, 0);
+        }
+
+        child_idx++;
+    }
+
+    for (size_t stmt_idx = 1; stmt_idx <= nreparsed; ++stmt_idx) {
+        *children[child_idx++] = *reparsed.children[stmt_idx];
+    }
+
+    for (size_t stmt_idx = suffix; stmt_idx < last; ++stmt_idx) {
+        *children[child_idx] = *root.children[stmt_idx];
+
+        if (input != old_input || delta) {
+            rebase_error |= rebase_node(children[child_idx], &pending,
+                old_input, input, delta);
+        }
+
+        child_idx++;
+    }
+
+    *children[child_idx++] = (struct node) {
+        .token = token_at(tokens, tokens->size - 1),
+    };
+
+    free(pending.nodes);
+
+    if (rebase_error) {
+        free(tree);
+        return destroy_tree(reparsed), destroy_tree(root), err_nomem;
+    }
+
+    /*
+        The statements that were parsed again stay in the old arena until the
+        tree is destroyed, since only the root is allocated on its own.
+    */
+    arena_merge(&tree->arena, &root_of(root)->arena);
+    arena_merge(&tree->arena, &root_of(reparsed)->arena);
+    free(root_of(root));
+    free(root_of(reparsed));
+
+    return (struct node) {
+        .nchildren = nchildren,
+        .nt = NT_Unit,
+        .children = children,
+    };
+}
+
+/* the fewest tokens worth parsing on a thread of their own */
+#define PARSE_SLICE_MIN (1 << 14)
+
+struct parse_slice {
+    const struct tokens *tokens;
+    size_t beg, end;
+    struct node root;
+};
+
+static void *parse_slice(void *const arg)
+{
+    struct parse_slice *const slice = arg;
+    struct tokens wrapped;
+
+    if (wrap_tokens(slice->tokens, slice->beg, slice->end, &wrapped)) {
+        slice->root = err_nomem;
     } else {
-        return destroy_stack(), err_reject;
+        struct stack stack = {0};
+        slice->root = run_parser(&stack, &wrapped, 0, wrapped.size - 1);
     }
+
+    destroy_tokens(&wrapped);
+    return NULL;
 }
 
-void destroy_tree(const struct node root)
+/*
+    Splits the tokens into at most nslices slices of whole top-level
+    statements, and returns the number of slices. A statement ends with a ";"
+    outside of any braces, or with the "}" that closes its outermost braces,
+    unless an "elif", an "else" or the "while" of a do-while loop follows.
+*/
+static size_t split_tokens(const struct tokens *const tokens,
+    struct parse_slice *const slices, const size_t nslices)
+{
+    const size_t last = tokens->size - 1;
+    size_t count = 0, beg = 1, closed = 0;
+    long depth = 0;
+
+    for (size_t token_idx = 1; token_idx < last; ++token_idx) {
+        const tk_t tk = tokens->tk[token_idx];
+
+        if (SKIP_TOKEN(tk)) {
+            continue;
+        }
+
+        /* the statement closed by the previous "}" only ends here, if at all */
+        if (closed && tk != TK_ELIF && tk != TK_ELSE && tk != TK_WHIL &&
+            closed >= (count + 1) * last / nslices &&
+            count + 1 < nslices) {
+
+            slices[count++] = (struct parse_slice) {
+                .tokens = tokens,
+                .beg = beg,
+                .end = closed,
+            };
+
+            beg = closed;
+        }
+
+        closed = 0;
+
+        if (tk == TK_LBRC) {
+            ++depth;
+        } else if (tk == TK_RBRC) {
+            closed = --depth == 0 ? token_idx + 1 : 0;
+        } else if (tk == TK_SCOL && !depth &&
+            token_idx + 1 >= (count + 1) * last / nslices &&
+            count + 1 < nslices) {
+
+            slices[count++] = (struct parse_slice) {
+                .tokens = tokens,
+                .beg = beg,
+                .end = token_idx + 1,
+            };
+
+            beg = token_idx + 1;
+        }
+    }
+
+    slices[count++] = (struct parse_slice) {
+        .tokens = tokens,
+        .beg = beg,
+        .end = last,
+    };
+
+    return count;
+}
+
+struct node parse_parallel(const struct tokens *const tokens,
+    const size_t nthreads)
 {
-    destroy_node(&root);
+    /* the parser events are recorded in order, so tracing parses in one go */
+    if (nthreads < 2 || tokens->size < nthreads * PARSE_SLICE_MIN ||
+        trace.events || trace.level >= TRACE_FULL) {
+
+        return parse(tokens);
+    }
+
+    pthread_once(&lr_once, lr_build);
+
+    struct parse_slice *const slices =
+        calloc(nthreads, sizeof(struct parse_slice));
+    pthread_t *const threads = calloc(nthreads, sizeof(pthread_t));
+    int *const started = calloc(nthreads, sizeof(int));
+
+    if (!slices || !threads || !started) {
+        return free(slices), free(threads), free(started), err_nomem;
+    }
+
+    const size_t nslices = split_tokens(tokens, slices, nthreads);
+
+    for (size_t idx = 1; idx < nslices; ++idx) {
+        started[idx] =
+            !pthread_create(&threads[idx], NULL, parse_slice, &slices[idx]);
+    }
+
+    parse_slice(&slices[0]);
+
+    for (size_t idx = 1; idx < nslices; ++idx) {
+        if (started[idx]) {
+            pthread_join(threads[idx], NULL);
+        } else {
+            parse_slice(&slices[idx]);
+        }
+    }
+
+    size_t nchildren = 2;
+    int error = PARSE_OK;
+
+    for (size_t idx = 0; idx < nslices; ++idx) {
+        if (parse_error(slices[idx].root)) {
+            error = parse_error(slices[idx].root);
+        } else {
+            nchildren += slices[idx].root.nchildren - 2;
+        }
+    }
+
+    struct root *const tree = error ? NULL : alloc_root(nchildren);
+
+    if (!tree) {
+        for (size_t idx = 0; idx < nslices; ++idx) {
+            if (!parse_error(slices[idx].root)) {
+                destroy_tree(slices[idx].root);
+            }
+        }
+
+        free(slices), free(threads), free(started);
+
+        /* a syntax error is found again in one go, to report it the same */
+        return error == PARSE_REJECT ? parse(tokens) : err_nomem;
+    }
+
+    /* the statements stay where they were parsed, in the merged arenas */
+    struct node **const children = tree->children;
+    size_t child_idx = 0;
+    *children[child_idx++] = (struct node) { .token = token_at(tokens, 0) };
+
+    for (size_t idx = 0; idx < nslices; ++idx) {
+        const struct node root = slices[idx].root;
+
+        for (size_t stmt_idx = 1; stmt_idx < root.nchildren - 1; ++stmt_idx) {
+            *children[child_idx++] = *root.children[stmt_idx];
+        }
+
+        arena_merge(&tree->arena, &root_of(root)->arena);
+        free(root_of(root));
+    }
+
+    *children[child_idx++] = (struct node) {
+        .token = token_at(tokens, tokens->size - 1),
+    };
+
+    free(slices), free(threads), free(started);
+
+    return (struct node) {
+        .nchildren = nchildren,
+        .nt = NT_Unit,
+        .children = children,
+    };
 }
@@ -3,6 +3,8 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#include "lex.h"
+
 enum {
     NT_Unit,
     NT_Stmt,
@@ -26,13 +28,14 @@ enum {
 
 typedef uint8_t nt_t;
 
-struct token;
+extern const char *const nt_names[NT_COUNT];
+
 struct node {
     /* use "token" if nchildren == 0, "nt" and "children" otherwise */
     uint32_t nchildren;
 
     union {
-        const struct token *token;
+        struct token token;
 
         struct {
             nt_t nt;
@@ -41,7 +44,7 @@ struct node {
     };
 };
 
-struct node parse(const struct token *, size_t);
+struct node parse(const struct tokens *);
 
 enum {
     PARSE_OK,
@@ -51,7 +54,51 @@ enum {
 
 #define parse_error(root) ({ \
     struct node root_once = (root); \
-    root_once.nchildren ? PARSE_OK : root_once.token->tk; \
+    root_once.nchildren ? PARSE_OK : root_once.token.tk; \
 })
 
 void destroy_tree(struct node);
+
+/* the fewest bytes between the braces of a block that a lazy parse skips */
+#define PARSE_LAZY_MIN 256
+
+/* the tokens of a lazily parsed input, with the "}" that matches each "{" */
+struct lazy {
+    struct tokens tokens;
+    uint32_t *match;
+};
+
+/*
+    Same as parse(), but the blocks whose braces are at least PARSE_LAZY_MIN
+    bytes apart are left empty, to be parsed by parse_block() once they are
+    needed. All the tokens are checked first, so that a syntax error is still
+    reported just as by parse(). Takes over the tokens, which stay around
+    until destroy_lazy().
+*/
+struct node parse_lazy(struct lazy *, struct tokens *);
+
+/* parses a block that was left empty, given its "{", as a Unit of its own */
+struct node parse_block(const struct lazy *, size_t);
+
+void destroy_lazy(struct lazy *);
+
+/*
+    Same as parse(), but the top-level statements are split into slices which
+    are parsed on the given number of threads. Produces exactly the same tree.
+*/
+struct node parse_parallel(const struct tokens *, size_t);
+
+/*
+    Takes the tokens and the tree of an input, and the input after an edit.
+    Updates the tokens and returns the tree of the edited input, which reuses
+    all top-level statements of the old tree that the edit did not touch. The
+    old tree must not be used afterwards.
+
+    Only the touched statements are parsed again, but the leaves of the others
+    hold pointers into the input: those after the edit are shifted, and all of
+    them are moved if the input is not edited in place, one leaf at a time. So
+    an edit takes time linear in the size of the input, though less than
+    lexing and parsing it all again does, as the edit bench measures.
+*/
+struct node reparse(struct tokens *, struct node, const uint8_t *, size_t,
+    const struct edit *);
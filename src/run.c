@@ -1,61 +1,928 @@
 #include "lex.h"
-#include "parse.h"
+#include "lower.h"
+#include "code.h"
+#include "jit.h"
+#include "run.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <limits.h>
+
+/*
+    Every variable of the program, indexed as resolved by the lowering. The
+    first element, which is what a plain name reads, is kept in the entry
+    itself, so a variable that is never indexed past it needs no allocation.
+    The others are only allocated once they are assigned, and the first of
+    the allocated elements is left unused so that they keep their indices.
+*/
+static struct {
+    size_t size;
+
+    struct var {
+        bool defined;
+        int first;
+        size_t array_size;
+        int *values;
+    } *vars;
+
+    /* the temporaries that reused values are saved into */
+    int *temps;
+} varstore;
+
+/* the program being run */
+static const struct ast_node *nodes;
+static const uint8_t *input;
+
+/* makes room for the given number of variables, returns 0 on success */
+static int reserve_vars(const size_t nvars)
+{
+    if (nvars <= varstore.size) {
+        return 0;
+    }
+
+    struct var *const tmp = realloc(varstore.vars, nvars * sizeof(struct var));
+
+    if (!tmp) {
+        return -1;
+    }
+
+    memset(&tmp[varstore.size], 0,
+        (nvars - varstore.size) * sizeof(struct var));
+    varstore.vars = tmp;
+    varstore.size = nvars;
+    return 0;
+}
+
+/* makes room for the temporaries of the program, returns 0 on success */
+static int reserve_temps(const size_t ntemps)
+{
+    free(varstore.temps);
+    varstore.temps = calloc(ntemps ?: 1, sizeof(int));
+    return varstore.temps ? 0 : -1;
+}
+
+/*
+    Returns the element that an assignment to the target stores into, or NULL
+    if the assignment has no effect. A new variable is set up right away, but
+    only defined (by the caller, with "created" set) once the value has been
+    evaluated, which cannot see the variable yet. The element stays where it
+    is until the next statement, as no expression assigns or adds variables.
+*/
+static int *find_slot(const uint32_t var_idx, const int array_idx,
+    bool *const created)
+{
+    struct var *const var = &varstore.vars[var_idx];
+    *created = false;
+
+    if (var->defined) {
+        if (!var->array_size) {
+            fprintf(stderr, "warn: a previous reallocation has failed, "
+                "assignment has no effect\n");
+
+            return NULL;
+        }
+
+        if (array_idx >= 0 && array_idx < var->array_size) {
+            return array_idx ? &var->values[array_idx] : &var->first;
+        } else if (array_idx >= 0) {
+            const size_t new_size = (array_idx + 1) * 2;
+            int *const tmp = realloc(var->values, new_size * sizeof(int));
+
+            if (!tmp) {
+                free(var->values);
+                var->first = 0;
+                var->array_size = 0;
+                var->values = NULL;
+                perror("realloc");
+                return NULL;
+            }
+
+            var->values = tmp;
+            var->array_size = new_size;
+            return &var->values[array_idx];
+        } else {
+            fprintf(stderr, "warn: negative array offset\n");
+            return NULL;
+        }
+    }
+
+    if (array_idx < 0) {
+        fprintf(stderr, "warn: negative array offset\n");
+        return NULL;
+    }
+
+    if (!array_idx) {
+        var->array_size = 1;
+        *created = true;
+        return &var->first;
+    }
+
+    var->values = malloc((array_idx + 1) * sizeof(int));
+
+    if (!var->values) {
+        perror("malloc");
+        return NULL;
+    }
+
+    var->first = 0;
+    var->array_size = array_idx + 1;
+    *created = true;
+    return &var->values[array_idx];
+}
+
+static void print_value(const struct ast_node *const prnt, const int value)
+{
+    if (prnt->aux & AST_PRINT_STRING) {
+        const uint8_t *const beg = input + prnt->b;
+        const ptrdiff_t len = prnt->c;
+
+        printf("%.*s%d\n", (int) len, beg, value);
+    } else {
+        printf("%d\n", value);
+    }
+}
+
+static int eval_var(const uint32_t var_idx)
+{
+    const struct var *const entry = &varstore.vars[var_idx];
+
+    if (!entry->defined) {
+        return fprintf(stderr, "warn: access to undefined variable\n"), 0;
+    }
+
+    return entry->first;
+}
+
+static int index_value(const uint32_t var_idx, const int array_idx)
+{
+    const struct var *const entry = &varstore.vars[var_idx];
+
+    if (array_idx < 0) {
+        return fprintf(stderr, "warn: negative array offset\n"), 0;
+    }
+
+    if (!entry->defined) {
+        return fprintf(stderr, "warn: access to undefined array\n"), 0;
+    }
+
+    if (array_idx < entry->array_size) {
+        return array_idx ? entry->values[array_idx] : entry->first;
+    } else {
+        return fprintf(stderr, "warn: out of bounds array access\n"), 0;
+    }
+}
+
+/* the element of a variable whose bounds were checked, with no checks */
+static inline int *element(const uint32_t var_idx, const int array_idx)
+{
+    struct var *const entry = &varstore.vars[var_idx];
+    return array_idx ? &entry->values[array_idx] : &entry->first;
+}
+
+/*
+    Whether every element of the variable of the Bounds node, from the first
+    index to the last one, is there to be accessed without checks. With
+    AST_BOUNDS_GROW, it is grown first, like the stores into every step-th
+    element from the first would grow it one after the other. It is not
+    grown at all if any of them would fail, which leaves them to the loop
+    that checks its bounds. Nothing is accessed if the first is past the
+    last, so that always holds.
+*/
+static int bounds_hold(const uint32_t node_idx, const int first,
+    const int last)
+{
+    const struct ast_node *const node = &nodes[node_idx];
+    struct var *const var = &varstore.vars[node->a];
+
+    if (first > last) {
+        return 1;
+    } else if (first < 0) {
+        return 0;
+    } else if (!(node->op & AST_BOUNDS_GROW)) {
+        return var->defined && (size_t) last < var->array_size;
+    } else if ((var->defined && !var->array_size) || first >= INT_MAX / 2) {
+        return 0;
+    }
+
+    /* the first store creates the variable with room for just its element */
+    const size_t step = node->aux;
+    size_t size = var->defined ? var->array_size : (size_t) first + 1;
+    size_t idx = var->defined ? (size_t) first : first + step;
+
+    while (idx <= (size_t) last) {
+        if (idx < size) {
+            idx += (size - idx + step - 1) / step * step;
+        } else if (idx >= INT_MAX / 2) {
+            return 0;
+        } else {
+            size = (idx + 1) * 2;
+        }
+    }
+
+    if (var->defined) {
+        if (size > var->array_size) {
+            int *const tmp = realloc(var->values, size * sizeof(int));
+
+            if (!tmp) {
+                return 0;
+            }
+
+            var->values = tmp;
+            var->array_size = size;
+        }
+
+        return 1;
+    }
+
+    /* only the elements past the first are allocated, as in find_slot() */
+    if (size > 1 && !(var->values = malloc(size * sizeof(int)))) {
+        return 0;
+    }
+
+    var->first = first ? 0 : var->first;
+    var->defined = true;
+    var->array_size = size;
+    return 1;
+}
+
+/*
+    Steps the counter of a Count node, as its assignment would, and returns
+    it. The counter is defined, so only an earlier failure to grow it can
+    keep it from being assigned.
+*/
+static int step_counter(const uint32_t var_idx, const int step)
+{
+    struct var *const var = &varstore.vars[var_idx];
+
+    if (var->array_size) {
+        var->first += step;
+    } else {
+        fprintf(stderr, "warn: a previous reallocation has failed, "
+            "assignment has no effect\n");
+    }
+
+    return var->first;
+}
+
+/* steps the counter of the Count node, and compares it with the bound */
+static int count_holds(const struct ast_node *const count)
+{
+    const int counter = step_counter(count->a, count->c);
+    const struct ast_node *const bound = &nodes[count->b];
+    const int limit = bound->kind == AST_CONST ?
+        (int) bound->a : eval_var(bound->a);
+
+    return count->op == TK_LTHN ? counter < limit : counter <= limit;
+}
+
+/* applies any binary operator other than && and || */
+static int apply_binop(const tk_t op, const int left, const int right)
+{
+    switch (op) {
+    case TK_PLUS:
+        return left + right;
+
+    case TK_MINS:
+        return left - right;
+
+    case TK_MULT:
+        return left * right;
+
+    case TK_DIVI:
+        if (right) {
+            return left / right;
+        } else {
+            fprintf(stderr, "warn: prevented attempt to divide by zero\n");
+            return 0;
+        }
+
+    case TK_MODU:
+        return left % right;
+
+    case TK_EQUL:
+        return left == right;
+
+    case TK_NEQL:
+        return left != right;
+
+    case TK_LTHN:
+        return left < right;
+
+    case TK_GTHN:
+        return left > right;
+
+    case TK_LTEQ:
+        return left <= right;
+
+    case TK_GTEQ:
+        return left >= right;
+
+    default:
+        abort();
+    }
+}
+
+/* saves the value of the node into its temporary, if it is reused */
+static inline int save(const struct ast_node *const node, const int value)
+{
+    if (node->aux) {
+        varstore.temps[node->aux - 1] = value;
+    }
+
+    return value;
+}
+
+static int apply_unop(const tk_t op, const int operand)
+{
+    switch (op) {
+    case TK_MINS:
+        return -operand;
+
+    case TK_NEGA:
+        return !operand;
+
+    default:
+        abort();
+    }
+}
+
+/*
+    The tree walker promotes the loops that it runs over and over to closures:
+    a tree of small functions, one for every node, each of which is made for
+    its operator and the kinds of its operands, with its variables resolved,
+    so that the rest of the loop runs without stepping through frames. As the
+    closures call each other, only loops that are nested no deeper than this
+    are promoted.
+*/
+#define HOT_LOOP 256
+#define MAX_CLOSURE_DEPTH 100
+
+struct closure {
+    int (*call)(const struct closure *);
+
+    /* the operands, or the children of a statement */
+    struct closure *a, *b, *c;
+
+    /* the variable or counter, or the node of a Print, a Switch or a Bounds */
+    uint32_t var;
+
+    /*
+        The constant operand, the number of statements of a Block, the step
+        of a Count, or whether a loop never reads the counter of its Count.
+    */
+    int value;
+};
+
+#define CALL(closure) ((closure)->call(closure))
+
+struct run_stats run_stats;
+
+static int closure_const(const struct closure *const c)
+{
+    return c->value;
+}
+
+static int closure_var(const struct closure *const c)
+{
+    return eval_var(c->var);
+}
+
+static int closure_temp(const struct closure *const c)
+{
+    return varstore.temps[c->var];
+}
+
+/* wraps the closure of a node whose value is reused */
+static int closure_save(const struct closure *const c)
+{
+    return varstore.temps[c->var] = CALL(c->a);
+}
+
+static int closure_index(const struct closure *const c)
+{
+    return index_value(c->var, CALL(c->a));
+}
+
+static int closure_element(const struct closure *const c)
+{
+    return *element(c->var, CALL(c->a));
+}
+
+static int closure_bounds(const struct closure *const c)
+{
+    const int first = CALL(c->a);
+    return bounds_hold(c->var, first, CALL(c->b));
+}
+
+/* the Count of a loop, whose bound is a Const or a Var closure */
+static int closure_below(const struct closure *const c)
+{
+    const int counter = step_counter(c->var, c->value);
+    return counter < CALL(c->a);
+}
+
+static int closure_upto(const struct closure *const c)
+{
+    const int counter = step_counter(c->var, c->value);
+    return counter <= CALL(c->a);
+}
+
+static int closure_neg(const struct closure *const c)
+{
+    return -CALL(c->a);
+}
+
+static int closure_not(const struct closure *const c)
+{
+    return !CALL(c->a);
+}
+
+static int closure_and(const struct closure *const c)
+{
+    return CALL(c->a) && CALL(c->b);
+}
+
+static int closure_or(const struct closure *const c)
+{
+    return CALL(c->a) || CALL(c->b);
+}
+
+static int closure_ternary(const struct closure *const c)
+{
+    return CALL(c->a) ? CALL(c->b) : CALL(c->c);
+}
+
+/*
+    The closures of a binary operator, for each kind of operands: any two
+    expressions, an expression and a constant, a variable and an expression,
+    and a variable and a constant. The left operand always goes first.
+*/
+#define BINOP_CLOSURES(name, expr) \
+    static int closure_##name(const struct closure *const c) \
+    { \
+        const int left = CALL(c->a), right = CALL(c->b); \
+        return expr; \
+    } \
+    \
+    static int closure_##name##_const(const struct closure *const c) \
+    { \
+        const int left = CALL(c->a), right = c->value; \
+        return expr; \
+    } \
+    \
+    static int closure_var_##name(const struct closure *const c) \
+    { \
+        const int left = eval_var(c->var), right = CALL(c->b); \
+        return expr; \
+    } \
+    \
+    static int closure_var_##name##_const(const struct closure *const c) \
+    { \
+        const int left = eval_var(c->var), right = c->value; \
+        return expr; \
+    }
+
+BINOP_CLOSURES(add, left + right)
+BINOP_CLOSURES(sub, left - right)
+BINOP_CLOSURES(mul, left * right)
+BINOP_CLOSURES(div, apply_binop(TK_DIVI, left, right))
+BINOP_CLOSURES(mod, left % right)
+BINOP_CLOSURES(eq, left == right)
+BINOP_CLOSURES(ne, left != right)
+BINOP_CLOSURES(lt, left < right)
+BINOP_CLOSURES(gt, left > right)
+BINOP_CLOSURES(le, left <= right)
+BINOP_CLOSURES(ge, left >= right)
+
+#define BINOP_ENTRY(tk, name) \
+    [tk] = { \
+        closure_##name, closure_##name##_const, \
+        closure_var_##name, closure_var_##name##_const, \
+    }
+
+/*
+    Indexed by the operator, and then by whether the left operand is a
+    variable (times two) and whether the right one is a constant.
+*/
+static int (*const binop_closures[TK_COUNT][4])(const struct closure *) = {
+    BINOP_ENTRY(TK_PLUS, add),
+    BINOP_ENTRY(TK_MINS, sub),
+    BINOP_ENTRY(TK_MULT, mul),
+    BINOP_ENTRY(TK_DIVI, div),
+    BINOP_ENTRY(TK_MODU, mod),
+    BINOP_ENTRY(TK_EQUL, eq),
+    BINOP_ENTRY(TK_NEQL, ne),
+    BINOP_ENTRY(TK_LTHN, lt),
+    BINOP_ENTRY(TK_GTHN, gt),
+    BINOP_ENTRY(TK_LTEQ, le),
+    BINOP_ENTRY(TK_GTEQ, ge),
+};
+
+static int closure_block(const struct closure *const c)
+{
+    for (int stmt = 0; stmt < c->value; ++stmt) {
+        CALL(&c->a[stmt]);
+    }
+
+    return 0;
+}
+
+/* an assignment to an element, the index of which goes first */
+static int closure_assign(const struct closure *const c)
+{
+    bool created;
+    int *const slot = find_slot(c->var, c->a ? CALL(c->a) : 0, &created);
+
+    if (slot) {
+        const int value = CALL(c->b);
+        varstore.vars[c->var].defined |= created;
+        *slot = value;
+    }
+
+    return 0;
+}
+
+static int closure_assign_element(const struct closure *const c)
+{
+    int *const slot = element(c->var, CALL(c->a));
+    *slot = CALL(c->b);
+    return 0;
+}
+
+/* an assignment to a name, which usually just replaces the first element */
+static int closure_store(const struct closure *const c)
+{
+    struct var *const entry = &varstore.vars[c->var];
+
+    if (entry->defined && entry->array_size) {
+        entry->first = CALL(c->b);
+        return 0;
+    }
+
+    return closure_assign(c);
+}
+
+static int closure_print(const struct closure *const c)
+{
+    print_value(&nodes[c->var], CALL(c->a));
+    return 0;
+}
+
+static int closure_if(const struct closure *const c)
+{
+    if (CALL(c->a)) {
+        CALL(c->b);
+    } else if (c->c) {
+        CALL(c->c);
+    }
+
+    return 0;
+}
+
+/* the Blocks of the Cases, plus the default, are kept in order */
+static int closure_switch(const struct closure *const c)
+{
+    CALL(&c->b[switch_case(nodes, &nodes[c->var], CALL(c->a))]);
+    return 0;
+}
+
+/*
+    Runs the body of a loop for as long as the condition holds, which is
+    checked first. A Count whose counter the loop never reads otherwise is
+    not stepped each time around: the trips left are counted up front, and
+    the counter is stepped past them once they are done, unless it could
+    wrap around on the way.
+*/
+static void repeat(const struct closure *const cond,
+    const struct closure *const body, const bool hidden)
+{
+    struct var *const counter = hidden ? &varstore.vars[cond->var] : NULL;
+
+    if (counter && counter->array_size) {
+        const long long first = counter->first, step = cond->value;
+        const long long last = CALL(cond->a) - (cond->call == closure_below);
+
+        if ((first > last ? first : last) + step <= INT_MAX) {
+            const long long trips = first < last ? (last - first) / step : 0;
+
+            for (long long trip = 0; trip < trips; ++trip) {
+                CALL(body);
+            }
+
+            counter->first = first + (trips + 1) * step;
+            return;
+        }
+    }
+
+    while (CALL(cond)) {
+        CALL(body);
+    }
+}
+
+static int closure_while(const struct closure *const c)
+{
+    while (CALL(c->a)) {
+        CALL(c->b);
+    }
+
+    return 0;
+}
+
+/* a While whose trips are counted, by its Count in c after the first */
+static int closure_counted(const struct closure *const c)
+{
+    if (CALL(c->a)) {
+        CALL(c->b);
+        repeat(c->c, c->b, c->value);
+    }
+
+    return 0;
+}
+
+static int closure_dowhile(const struct closure *const c)
+{
+    CALL(c->a);
+    repeat(c->b, c->a, c->value);
+    return 0;
+}
+
+/*
+    Returns the number of closures that the node needs, at most, or 0 if it
+    cannot be promoted, because it is too deep or has blocks that are still
+    to be lowered, in which case "lazy" is set.
+*/
+static uint32_t count_closures(const uint32_t idx, const uint32_t depth,
+    bool *const lazy)
+{
+    const struct ast_node *const node = &nodes[idx];
+    uint32_t children[3], nchildren = 0, count = 1;
+
+    if (node->kind == AST_LAZY) {
+        return *lazy = true, 0;
+    } else if (depth > MAX_CLOSURE_DEPTH) {
+        return 0;
+    }
+
+    if ((node->kind == AST_UNOP || node->kind == AST_BINOP) && node->aux) {
+        count++;
+    }
+
+    switch (node->kind) {
+    case AST_BLOCK:
+        for (uint32_t stmt = 0; stmt < node->b; ++stmt) {
+            const uint32_t sub = count_closures(node->a + stmt, depth + 1,
+                lazy);
+
+            if (!sub) {
+                return 0;
+            }
+
+            count += sub;
+        }
+        return count;
+
+    case AST_ASSIGN:
+        if (nodes[node->a].kind == AST_INDEX) {
+            children[nchildren++] = nodes[node->a].c;
+        }
+
+        children[nchildren++] = node->b;
+        break;
+
+    case AST_IF:
+        children[nchildren++] = node->a;
+        children[nchildren++] = node->b;
+
+        if (node->c) {
+            children[nchildren++] = node->c;
+        }
+        break;
+
+    case AST_SWITCH:
+        children[nchildren++] = node->a;
+        count += node->c + 1;
+
+        for (uint32_t arm = 0; arm <= node->c; ++arm) {
+            const uint32_t block = nodes[node->b + arm].b;
+            const uint32_t sub = block ?
+                count_closures(block, depth + 1, lazy) : 1;
+
+            if (!sub) {
+                return 0;
+            }
+
+            count += sub;
+        }
+        break;
+
+    case AST_TERNARY:
+    case AST_WHILE:
+        if (node->c) {
+            children[nchildren++] = node->c;
+        }
+        /* fallthrough */
+
+    case AST_DOWHILE:
+    case AST_BINOP:
+        children[nchildren++] = node->b;
+        /* fallthrough */
+
+    case AST_PRINT:
+    case AST_UNOP:
+        children[nchildren++] = node->a;
+        break;
+
+    case AST_INDEX:
+        children[nchildren++] = node->c;
+        break;
+
+    case AST_BOUNDS:
+        children[nchildren++] = node->b;
+        children[nchildren++] = node->c;
+        break;
+
+    case AST_COUNT:
+        children[nchildren++] = node->b;
+        break;
+    }
+
+    for (uint32_t child = 0; child < nchildren; ++child) {
+        const uint32_t sub = count_closures(children[child], depth + 1, lazy);
+
+        if (!sub) {
+            return 0;
+        }
+
+        count += sub;
+    }
+
+    return count;
+}
+
+/* the closures of the loop being promoted are taken from here */
+static struct closure *next_closure;
+
+static struct closure *build_closure(uint32_t);
+
+/* builds the closure of the node in place, with its children taken */
+static void build_into(const uint32_t idx, struct closure *const c)
+{
+    const struct ast_node *const node = &nodes[idx];
+    *c = (struct closure) {0};
+
+    switch (node->kind) {
+    case AST_BLOCK:
+        /* the statements are kept together, to be run in a loop */
+        c->call = closure_block;
+        c->a = next_closure;
+        c->value = node->b;
+        next_closure += node->b;
+
+        for (uint32_t stmt = 0; stmt < node->b; ++stmt) {
+            build_into(node->a + stmt, &c->a[stmt]);
+        }
+        break;
 
-static void run_stmt(const struct node *const);
-static void run_assn(const struct node *const);
-static void run_prnt(const struct node *const);
-static void run_ctrl(const struct node *const);
-static int eval_atom(const struct node *const);
-static int eval_expr(const struct node *const);
-static int eval_pexp(const struct node *const);
-static int eval_bexp(const struct node *const);
-static int eval_uexp(const struct node *const);
-static int eval_texp(const struct node *const);
-static int eval_aexp(const struct node *const);
+    case AST_ASSIGN:
+        c->var = nodes[node->a].a;
 
-#define VARSTORE_CAPACITY 128
+        if (nodes[node->a].kind == AST_INDEX) {
+            c->call = nodes[node->a].aux & AST_INDEX_UNCHECKED ?
+                closure_assign_element : closure_assign;
+            c->a = build_closure(nodes[node->a].c);
+        } else {
+            c->call = closure_store;
+        }
 
-static struct {
-    size_t size;
+        c->b = build_closure(node->b);
+        break;
 
-    struct {
-        const uint8_t *beg;
-        ptrdiff_t len;
-        size_t array_size;
-        int *values;
-    } vars[VARSTORE_CAPACITY];
-} varstore;
+    case AST_PRINT:
+        c->call = closure_print;
+        c->var = idx;
+        c->a = build_closure(node->a);
+        break;
 
-void run(const struct node *const unit)
-{
-    for (size_t stmt_idx = 1; stmt_idx < unit->nchildren - 1; ++stmt_idx) {
-        run_stmt(unit->children[stmt_idx]);
-    }
+    case AST_IF:
+        c->call = closure_if;
+        c->a = build_closure(node->a);
+        c->b = build_closure(node->b);
+        c->c = node->c ? build_closure(node->c) : NULL;
+        break;
 
-    for (size_t var_idx = 0; var_idx < varstore.size; ++var_idx) {
-        free(varstore.vars[var_idx].values);
-    }
+    case AST_SWITCH:
+        c->call = closure_switch;
+        c->var = idx;
+        c->a = build_closure(node->a);
+        c->b = next_closure;
+        next_closure += node->c + 1;
 
-    varstore.size = 0;
-}
+        /* an arm with no Block runs an empty one */
+        for (uint32_t arm = 0; arm <= node->c; ++arm) {
+            const uint32_t block = nodes[node->b + arm].b;
 
-static void run_stmt(const struct node *const stmt)
-{
-    switch (stmt->children[0]->nt) {
-    case NT_Assn:
-        run_assn(stmt->children[0]);
+            if (block) {
+                build_into(block, &c->b[arm]);
+            } else {
+                c->b[arm] = (struct closure) { .call = closure_block };
+            }
+        }
+        break;
+
+    case AST_WHILE:
+        c->call = node->c ? closure_counted : closure_while;
+        c->a = build_closure(node->a);
+        c->b = build_closure(node->b);
+
+        if (node->c) {
+            c->c = build_closure(node->c);
+            c->value = nodes[node->c].aux & AST_COUNT_HIDDEN;
+        }
+        break;
+
+    case AST_DOWHILE:
+        c->call = closure_dowhile;
+        c->a = build_closure(node->a);
+        c->b = build_closure(node->b);
+        c->value = nodes[node->b].kind == AST_COUNT &&
+            nodes[node->b].aux & AST_COUNT_HIDDEN;
+        break;
+
+    case AST_COUNT:
+        c->call = node->op == TK_LTHN ? closure_below : closure_upto;
+        c->var = node->a;
+        c->value = node->c;
+        c->a = build_closure(node->b);
         break;
 
-    case NT_Prnt:
-        run_prnt(stmt->children[0]);
+    case AST_CONST:
+        c->call = closure_const;
+        c->value = node->a;
         break;
 
-    case NT_Ctrl:
-        run_ctrl(stmt->children[0]);
+    case AST_VAR:
+        c->call = closure_var;
+        c->var = node->a;
+        break;
+
+    case AST_TEMP:
+        c->call = closure_temp;
+        c->var = node->a;
+        break;
+
+    case AST_INDEX:
+        c->call = node->aux & AST_INDEX_UNCHECKED ?
+            closure_element : closure_index;
+        c->var = node->a;
+        c->a = build_closure(node->c);
+        break;
+
+    case AST_BOUNDS:
+        c->call = closure_bounds;
+        c->var = idx;
+        c->a = build_closure(node->b);
+        c->b = build_closure(node->c);
+        break;
+
+    case AST_UNOP:
+        c->call = node->op == TK_MINS ? closure_neg : closure_not;
+        c->a = build_closure(node->a);
+        break;
+
+    case AST_BINOP: {
+        if (node->op == TK_CONJ || node->op == TK_DISJ) {
+            c->call = node->op == TK_CONJ ? closure_and : closure_or;
+            c->a = build_closure(node->a);
+            c->b = build_closure(node->b);
+            break;
+        }
+
+        const bool left_var = nodes[node->a].kind == AST_VAR;
+        const bool right_const = nodes[node->b].kind == AST_CONST;
+
+        c->call = binop_closures[node->op][left_var * 2 + right_const];
+
+        if (left_var) {
+            c->var = nodes[node->a].a;
+        } else {
+            c->a = build_closure(node->a);
+        }
+
+        if (right_const) {
+            c->value = nodes[node->b].a;
+        } else {
+            c->b = build_closure(node->b);
+        }
+    } break;
+
+    case AST_TERNARY:
+        c->call = closure_ternary;
+        c->a = build_closure(node->a);
+        c->b = build_closure(node->b);
+        c->c = build_closure(node->c);
         break;
 
     default:
@@ -63,347 +930,1071 @@ static void run_stmt(const struct node *const stmt)
     }
 }
 
-static void run_assn(const struct node *const assn)
+static struct closure *build_closure(const uint32_t idx)
 {
-    const int lhs_is_aexp = assn->children[0]->nchildren;
+    const struct ast_node *const node = &nodes[idx];
+    struct closure *const c = next_closure++;
+    build_into(idx, c);
 
-    const int array_idx = lhs_is_aexp ?
-        eval_expr(assn->children[0]->children[2]) : 0;
+    if ((node->kind != AST_UNOP && node->kind != AST_BINOP) || !node->aux) {
+        return c;
+    }
 
-    const uint8_t *const beg = lhs_is_aexp ?
-        assn->children[0]->children[0]->token->beg :
-        assn->children[0]->token->beg;
+    struct closure *const saved = next_closure++;
 
-    const ptrdiff_t len = lhs_is_aexp ?
-        assn->children[0]->children[0]->token->end - beg :
-        assn->children[0]->token->end - beg;
+    *saved = (struct closure) {
+        .call = closure_save,
+        .a = c,
+        .var = node->aux - 1,
+    };
 
-    size_t var_idx;
+    return saved;
+}
 
-    for (var_idx = 0; var_idx < varstore.size; ++var_idx) {
-        if (varstore.vars[var_idx].len == len &&
-            !memcmp(varstore.vars[var_idx].beg, beg, len)) {
+/*
+    How often each loop has been run, by node, until it is hot. A hot loop
+    counts on from HOT_LOOP, so that the count is the index of its closures
+    plus HOT_LOOP, and a loop that cannot be promoted stops at NOT_PROMOTED.
+*/
+#define NOT_PROMOTED UINT32_MAX
 
-            const size_t array_size = varstore.vars[var_idx].array_size;
+static struct {
+    uint32_t *heat;
+    size_t size;
 
-            if (!array_size) {
-                fprintf(stderr, "warn: a previous reallocation has failed, "
-                    "assignment has no effect\n");
+    struct closure **loops;
+    uint32_t nloops, allocated;
+} tiers;
 
-                return;
-            }
+/* makes room for counting the loops of the given number of nodes */
+static int reserve_heat(const size_t size)
+{
+    if (size <= tiers.size) {
+        return 0;
+    }
 
-            if (array_idx >= 0 && array_idx < array_size) {
-                varstore.vars[var_idx].values[array_idx] =
-                    eval_expr(assn->children[2]);
+    uint32_t *const tmp = realloc(tiers.heat, size * sizeof(uint32_t));
 
-                return;
-            } else if (array_idx >= 0) {
-                const size_t new_size = (array_idx + 1) * 2;
+    if (!tmp) {
+        return -1;
+    }
 
-                int *const tmp = realloc(
-                    varstore.vars[var_idx].values, new_size * sizeof(int));
+    memset(&tmp[tiers.size], 0, (size - tiers.size) * sizeof(uint32_t));
+    tiers.heat = tmp;
+    tiers.size = size;
+    return 0;
+}
 
-                if (!tmp) {
-                    free(varstore.vars[var_idx].values);
-                    varstore.vars[var_idx].array_size = 0;
-                    varstore.vars[var_idx].values = NULL;
-                    perror("realloc");
-                    return;
-                }
+/* returns the closures of the loop, or NULL if it cannot be promoted yet */
+static struct closure *promote(const uint32_t loop)
+{
+    bool lazy = false;
+    const uint32_t count = count_closures(loop, 0, &lazy);
 
-                varstore.vars[var_idx].values = tmp;
-                varstore.vars[var_idx].array_size = new_size;
-                varstore.vars[var_idx].values[array_idx] =
-                    eval_expr(assn->children[2]);
+    /* the blocks are lowered once they run, and the loop can be tried again */
+    tiers.heat[loop] = lazy ? 0 : NOT_PROMOTED;
 
-                return;
-            } else {
-                fprintf(stderr, "warn: negative array offset\n");
-                return;
-            }
-        }
+    if (!count) {
+        return NULL;
     }
 
-    if (var_idx < VARSTORE_CAPACITY) {
-        if (array_idx < 0) {
-            fprintf(stderr, "warn: negative array offset\n");
-            return;
-        }
+    if (tiers.nloops == tiers.allocated) {
+        const uint32_t allocated = tiers.allocated ? tiers.allocated * 2 : 16;
 
-        varstore.vars[var_idx].beg = beg;
-        varstore.vars[var_idx].len = len;
-        varstore.vars[var_idx].values = malloc((array_idx + 1) * sizeof(int));
-        varstore.vars[var_idx].array_size = 0;
+        struct closure **const tmp = realloc(tiers.loops,
+            allocated * sizeof(struct closure *));
 
-        if (!varstore.vars[var_idx].values) {
-            perror("malloc");
-            return;
+        if (!tmp) {
+            return NULL;
         }
 
-        varstore.vars[var_idx].array_size = array_idx + 1;
-        varstore.vars[var_idx].values[array_idx] = eval_expr(assn->children[2]);
-        varstore.size++;
-    } else {
-        fprintf(stderr, "warn: varstore exhausted, assignment has no effect\n");
+        tiers.loops = tmp;
+        tiers.allocated = allocated;
+    }
+
+    struct closure *const closures = malloc(count * sizeof(struct closure));
+
+    if (!closures) {
+        return NULL;
+    }
+
+    next_closure = closures;
+    build_closure(loop);
+
+    tiers.heat[loop] = HOT_LOOP + tiers.nloops;
+    tiers.loops[tiers.nloops++] = closures;
+    run_stats.promoted++;
+    return closures;
+}
+
+/* counts a run of the loop, and returns its closures once it is hot */
+static inline struct closure *hot_loop(const uint32_t loop)
+{
+    const uint32_t heat = tiers.heat[loop];
+
+    if (heat < HOT_LOOP - 1) {
+        tiers.heat[loop]++;
+        return NULL;
+    } else if (heat == NOT_PROMOTED) {
+        return NULL;
     }
+
+    struct closure *const closures = heat >= HOT_LOOP ?
+        tiers.loops[heat - HOT_LOOP] : promote(loop);
+
+    run_stats.entered += closures != NULL;
+    return closures;
 }
 
-static void run_prnt(const struct node *const prnt)
+static void free_tiers(void)
 {
-    if (prnt->nchildren == 3) {
-        printf("%d\n", eval_expr(prnt->children[1]));
-    } else if (prnt->nchildren == 4) {
-        const struct node *const strl = prnt->children[1];
+    for (uint32_t loop = 0; loop < tiers.nloops; ++loop) {
+        free(tiers.loops[loop]);
+    }
+
+    free(tiers.loops);
+    free(tiers.heat);
+    tiers.loops = NULL;
+    tiers.heat = NULL;
+    tiers.size = 0;
+    tiers.nloops = 0;
+    tiers.allocated = 0;
+}
 
-        const uint8_t *const beg = strl->token->beg + 1;
-        const uint8_t *const end = strl->token->end - 1;
-        const ptrdiff_t len = end - beg;
+/*
+    The interpreter keeps a frame for every node that it is in the middle of,
+    instead of recursing. Each frame is at one of the following steps, which
+    start at the first step of its kind of node, and the value of the last
+    expression that was finished is passed on to the frame below it.
+*/
+enum {
+    STEP_BLOCK,
+    STEP_ASSIGN,
+    STEP_ASSIGN_INDEX,
+    STEP_ASSIGN_NEW,
+    STEP_ASSIGN_VALUE,
+    STEP_PRINT,
+    STEP_PRINT_VALUE,
+    STEP_IF,
+    STEP_IF_COND,
+    STEP_SWITCH,
+    STEP_SWITCH_VALUE,
+    STEP_WHILE,
+    STEP_WHILE_COUNT,
+    STEP_WHILE_COND,
+    STEP_DOWHILE,
+    STEP_DOWHILE_BODY,
+    STEP_DOWHILE_COND,
+    STEP_CONST,
+    STEP_VAR,
+    STEP_TEMP,
+    STEP_INDEX,
+    STEP_INDEX_VALUE,
+    STEP_UNOP,
+    STEP_UNOP_VALUE,
+    STEP_BINOP,
+    STEP_BINOP_LEFT,
+    STEP_BINOP_RIGHT,
+    STEP_BINOP_BOOL,
+    STEP_TERNARY,
+    STEP_TERNARY_COND,
+    STEP_BOUNDS,
+    STEP_BOUNDS_FIRST,
+    STEP_BOUNDS_LAST,
+    STEP_COUNT,
+    STEP_LAZY,
+};
+
+static const uint8_t first_step[] = {
+    [AST_BLOCK] = STEP_BLOCK,
+    [AST_ASSIGN] = STEP_ASSIGN,
+    [AST_PRINT] = STEP_PRINT,
+    [AST_IF] = STEP_IF,
+    [AST_SWITCH] = STEP_SWITCH,
+    [AST_WHILE] = STEP_WHILE,
+    [AST_DOWHILE] = STEP_DOWHILE,
+    [AST_CONST] = STEP_CONST,
+    [AST_VAR] = STEP_VAR,
+    [AST_TEMP] = STEP_TEMP,
+    [AST_INDEX] = STEP_INDEX,
+    [AST_UNOP] = STEP_UNOP,
+    [AST_BINOP] = STEP_BINOP,
+    [AST_TERNARY] = STEP_TERNARY,
+    [AST_BOUNDS] = STEP_BOUNDS,
+    [AST_COUNT] = STEP_COUNT,
+    [AST_LAZY] = STEP_LAZY,
+};
+
+struct frame {
+    uint32_t node;
+    uint32_t step;
+
+    union {
+        uint32_t next;      /* the next statement of a block */
+        int left;           /* the left operand, or the first index */
+        int *slot;          /* the element that an assignment stores into */
+    };
+};
+
+static inline void enter(struct frame *const frame, const uint32_t node)
+{
+    *frame = (struct frame) {
+        .node = node,
+        .step = first_step[nodes[node].kind],
+    };
+}
 
-        printf("%.*s%d\n", (int) len, beg, eval_expr(prnt->children[2]));
+/*
+    Continues the frame at the given step once the expression is evaluated.
+    Constants, variables and temporaries are evaluated right away, and other
+    expressions get a frame of their own, which is returned as the new top of
+    the stack.
+*/
+static inline struct frame *descend(struct frame *const top,
+    const uint32_t expr, const uint32_t step, int *const value)
+{
+    const struct ast_node *const node = &nodes[expr];
+    top->step = step;
+
+    if (node->kind == AST_CONST) {
+        return *value = node->a, top;
+    } else if (node->kind == AST_VAR) {
+        return *value = eval_var(node->a), top;
+    } else if (node->kind == AST_TEMP) {
+        return *value = varstore.temps[node->a], top;
     }
+
+    enter(top + 1, expr);
+    return top + 1;
 }
 
-static void run_ctrl(const struct node *const ctrl)
+static int execute(struct ast *const ast)
 {
-    switch (ctrl->children[0]->nt) {
-    case NT_Cond: {
-        const struct node *const cond = ctrl->children[0];
+    size_t nframes = ast->depth;
+    struct frame *frames = malloc(nframes * sizeof(struct frame)), *top;
+    int value = 0, error = RUN_OK;
 
-        if (eval_expr(cond->children[1])) {
-            const struct node *stmt = cond->children[3];
+    if (!frames) {
+        return RUN_NOMEM;
+    }
+
+    enter(top = frames, ast->root);
 
-            while (stmt->nchildren) {
-                run_stmt(stmt++);
+    for (;;) {
+        const struct ast_node *const node = &nodes[top->node];
+
+        switch (top->step) {
+        case STEP_BLOCK:
+            if (top->next < node->b) {
+                enter(top + 1, node->a + top->next++);
+                ++top;
+                continue;
             }
-        } else if (ctrl->nchildren >= 2) {
-            size_t child_idx = 1;
+            break;
 
-            do {
-                if (ctrl->children[child_idx]->nt == NT_Elif) {
-                    const struct node *const elif = ctrl->children[child_idx];
+        case STEP_ASSIGN:
+            if (nodes[node->a].kind == AST_INDEX) {
+                top = descend(top, nodes[node->a].c, STEP_ASSIGN_INDEX, &value);
+                continue;
+            }
 
-                    if (eval_expr(elif->children[1])) {
-                        const struct node *stmt = elif->children[3];
+            value = 0;
+            /* fallthrough */
 
-                        while (stmt->nchildren) {
-                            run_stmt(stmt++);
-                        }
+        case STEP_ASSIGN_INDEX: {
+            bool created;
 
-                        break;
-                    }
-                } else {
-                    const struct node *const els = ctrl->children[child_idx];
-                    const struct node *stmt = els->children[2];
+            if (nodes[node->a].aux & AST_INDEX_UNCHECKED) {
+                top->slot = element(nodes[node->a].a, value);
+                top = descend(top, node->b, STEP_ASSIGN_VALUE, &value);
+                continue;
+            }
 
-                    while (stmt->nchildren) {
-                        run_stmt(stmt++);
-                    }
-                }
-            } while (++child_idx < ctrl->nchildren);
-        }
-    } break;
+            if (!(top->slot = find_slot(nodes[node->a].a, value, &created))) {
+                break;
+            }
+
+            top = descend(top, node->b,
+                created ? STEP_ASSIGN_NEW : STEP_ASSIGN_VALUE, &value);
+        } continue;
+
+        case STEP_ASSIGN_NEW:
+            varstore.vars[nodes[node->a].a].defined = true;
+            /* fallthrough */
+
+        case STEP_ASSIGN_VALUE:
+            *top->slot = value;
+            break;
+
+        case STEP_PRINT:
+            top = descend(top, node->a, STEP_PRINT_VALUE, &value);
+            continue;
+
+        case STEP_PRINT_VALUE:
+            print_value(node, value);
+            break;
+
+        case STEP_IF:
+            top = descend(top, node->a, STEP_IF_COND, &value);
+            continue;
+
+        case STEP_IF_COND:
+            /* the block or the next arm takes the place of the If */
+            if (value) {
+                enter(top, node->b);
+                continue;
+            } else if (node->c) {
+                enter(top, node->c);
+                continue;
+            }
+            break;
 
-    case NT_Dowh: {
-        const struct node *const dowh = ctrl->children[0];
-        const struct node *const expr = dowh->children[dowh->nchildren - 2];
+        case STEP_SWITCH:
+            top = descend(top, node->a, STEP_SWITCH_VALUE, &value);
+            continue;
 
-        do {
-            const struct node *stmt = dowh->children[2];
+        case STEP_SWITCH_VALUE: {
+            const uint32_t block =
+                nodes[node->b + switch_case(nodes, node, value)].b;
 
-            while (stmt->nchildren) {
-                run_stmt(stmt++);
+            if (block) {
+                enter(top, block);
+                continue;
+            }
+        } break;
+
+        case STEP_WHILE: {
+            /* a hot loop runs to its end on its closures */
+            const struct closure *const closures = hot_loop(top->node);
+
+            if (closures) {
+                CALL(closures);
+                break;
             }
-        } while (eval_expr(expr));
-    } break;
 
-    case NT_Whil: {
-        const struct node *const whil = ctrl->children[0];
+            top = descend(top, node->a, STEP_WHILE_COND, &value);
+        } continue;
 
-        while (eval_expr(whil->children[1])) {
-            const struct node *stmt = whil->children[3];
+        case STEP_WHILE_COUNT: {
+            /* after the first trip, the Count is the condition */
+            const struct closure *const closures = hot_loop(top->node);
 
-            while (stmt->nchildren) {
-                run_stmt(stmt++);
+            if (closures) {
+                repeat(closures->c, closures->b, closures->value);
+                break;
             }
-        }
-    } break;
 
-    default:
-        abort();
-    }
-}
+            top = descend(top, node->c, STEP_WHILE_COND, &value);
+        } continue;
 
-static int eval_atom(const struct node *const atom)
-{
-    switch (atom->children[0]->token->tk) {
-    case TK_NAME: {
-        const uint8_t *const beg = atom->children[0]->token->beg;
-        const ptrdiff_t len = atom->children[0]->token->end - beg;
+        case STEP_WHILE_COND:
+            if (value) {
+                top->step = node->c ? STEP_WHILE_COUNT : STEP_WHILE;
+                enter(++top, node->b);
+                continue;
+            }
+            break;
+
+        case STEP_DOWHILE_COND:
+            if (!value) {
+                break;
+            }
+            /* fallthrough */
+
+        case STEP_DOWHILE:
+            top->step = STEP_DOWHILE_BODY;
+            enter(++top, node->a);
+            continue;
+
+        case STEP_DOWHILE_BODY: {
+            /* the condition is next, so the rest is like a While */
+            const struct closure *const closures = hot_loop(top->node);
+
+            if (closures) {
+                repeat(closures->b, closures->a, closures->value);
+                break;
+            }
+
+            top = descend(top, node->b, STEP_DOWHILE_COND, &value);
+        } continue;
+
+        case STEP_CONST:
+            value = node->a;
+            break;
+
+        case STEP_VAR:
+            value = eval_var(node->a);
+            break;
+
+        case STEP_TEMP:
+            value = varstore.temps[node->a];
+            break;
+
+        case STEP_INDEX:
+            top = descend(top, node->c, STEP_INDEX_VALUE, &value);
+            continue;
+
+        case STEP_INDEX_VALUE:
+            value = node->aux & AST_INDEX_UNCHECKED ?
+                *element(node->a, value) : index_value(node->a, value);
+            break;
+
+        case STEP_UNOP:
+            top = descend(top, node->a, STEP_UNOP_VALUE, &value);
+            continue;
+
+        case STEP_UNOP_VALUE:
+            value = save(node, apply_unop(node->op, value));
+            break;
+
+        case STEP_BINOP:
+            top = descend(top, node->a, STEP_BINOP_LEFT, &value);
+            continue;
+
+        case STEP_BINOP_LEFT:
+            /* the operands go left to right, as do their warnings */
+            if (node->op == TK_CONJ && !value) {
+                value = save(node, 0);
+                break;
+            } else if (node->op == TK_DISJ && value) {
+                value = save(node, 1);
+                break;
+            } else if (node->op == TK_CONJ || node->op == TK_DISJ) {
+                top = descend(top, node->b, STEP_BINOP_BOOL, &value);
+            } else {
+                top->left = value;
+                top = descend(top, node->b, STEP_BINOP_RIGHT, &value);
+            }
+            continue;
+
+        case STEP_BINOP_RIGHT:
+            value = save(node, apply_binop(node->op, top->left, value));
+            break;
+
+        case STEP_BINOP_BOOL:
+            value = save(node, !!value);
+            break;
+
+        case STEP_TERNARY:
+            top = descend(top, node->a, STEP_TERNARY_COND, &value);
+            continue;
 
-        for (size_t idx = 0; idx < varstore.size; ++idx) {
-            if (varstore.vars[idx].len == len &&
-                !memcmp(varstore.vars[idx].beg, beg, len)) {
+        case STEP_TERNARY_COND:
+            enter(top, value ? node->b : node->c);
+            continue;
 
-                if (varstore.vars[idx].array_size) {
-                    return varstore.vars[idx].values[0];
-                } else {
-                    return 0;
+        case STEP_BOUNDS:
+            top = descend(top, node->b, STEP_BOUNDS_FIRST, &value);
+            continue;
+
+        case STEP_BOUNDS_FIRST:
+            top->left = value;
+            top = descend(top, node->c, STEP_BOUNDS_LAST, &value);
+            continue;
+
+        case STEP_BOUNDS_LAST:
+            value = bounds_hold(top->node, top->left, value);
+            break;
+
+        case STEP_COUNT:
+            value = count_holds(node);
+            break;
+
+        case STEP_LAZY: {
+            /* the block is lowered the first time it is run, in its place */
+            const int lower_error = lower_lazy(ast, top->node);
+
+            if (lower_error) {
+                error = lower_error == LOWER_NOMEM ? RUN_NOMEM : RUN_TOO_DEEP;
+                goto out;
+            }
+
+            nodes = ast->nodes;
+
+            if (reserve_vars(ast->nvars) || reserve_heat(ast->size)) {
+                error = RUN_NOMEM;
+                goto out;
+            }
+
+            if (ast->depth > nframes) {
+                const ptrdiff_t at = top - frames;
+
+                struct frame *const tmp = realloc(frames,
+                    ast->depth * sizeof(struct frame));
+
+                if (!tmp) {
+                    error = RUN_NOMEM;
+                    goto out;
                 }
+
+                frames = tmp;
+                top = frames + at;
+                nframes = ast->depth;
             }
-        }
 
-        return fprintf(stderr, "warn: access to undefined variable\n"), 0;
-    }
+            enter(top, top->node);
+        } continue;
 
-    case TK_NMBR: {
-        const uint8_t *const beg = atom->children[0]->token->beg;
-        const uint8_t *const end = atom->children[0]->token->end;
-        int result = 0, mult = 1;
+        default:
+            abort();
+        }
 
-        for (ssize_t idx = end - beg - 1; idx >= 0; --idx, mult *= 10) {
-            result += mult * (beg[idx] - '0');
+        /* the frame is done, and its value, if any, is in "value" */
+        if (top-- == frames) {
+            break;
         }
+    }
+
+    out:
+    free(frames);
+    return error;
+}
 
-        return result;
+static void free_varstore(void)
+{
+    for (size_t var_idx = 0; var_idx < varstore.size; ++var_idx) {
+        free(varstore.vars[var_idx].values);
     }
 
-    default:
-        abort();
+    free(varstore.vars);
+    free(varstore.temps);
+    varstore.vars = NULL;
+    varstore.temps = NULL;
+    varstore.size = 0;
+}
+
+int run(struct ast *const ast)
+{
+    nodes = ast->nodes;
+    input = ast->input;
+    run_stats = (struct run_stats) {0};
+
+    if (reserve_vars(ast->nvars) || reserve_temps(ast->ntemps) ||
+        reserve_heat(ast->size)) {
+
+        return free_varstore(), free_tiers(), RUN_NOMEM;
     }
+
+    const int error = execute(ast);
+    free_varstore();
+    free_tiers();
+    return error;
 }
 
-static int eval_expr(const struct node *const expr)
+/* dispatches with computed gotos where the compiler has them */
+#if defined(__GNUC__) && !defined(VM_SWITCH)
+#define VM_THREADED
+#endif
+
+/*
+    Runs the bytecode on a stack of values, which is no deeper than the
+    program is nested. Each instruction jumps straight to the next one, or is
+    a case of a switch in a loop without computed gotos.
+*/
+static int execute_code(struct ast *const ast, struct code *const code)
 {
-    switch (expr->children[0]->nt) {
-    case NT_Atom:
-        return eval_atom(expr->children[0]);
+    size_t nvalues = ast->depth;
+    int *stack = malloc(nvalues * sizeof(int)), *sp = stack;
+    const struct insn *insns = code->insns, *pc = insns;
+    int error = RUN_OK;
+
+    /* the element that the assignment being run stores into */
+    int *slot = NULL;
+    uint32_t slot_var = 0;
+    bool created = false;
+
+    if (!stack) {
+        return RUN_NOMEM;
+    }
+
+    #ifdef VM_THREADED
+    #define CASE(op) L_##op
+    #define NEXT goto *labels[pc->op]
+
+    static const void *const labels[] = {
+        [OP_HALT] = &&L_OP_HALT,
+        [OP_CONST] = &&L_OP_CONST,
+        [OP_VAR] = &&L_OP_VAR,
+        [OP_TEMP] = &&L_OP_TEMP,
+        [OP_INDEX] = &&L_OP_INDEX,
+        [OP_ELEMENT] = &&L_OP_ELEMENT,
+        [OP_NEG] = &&L_OP_NEG,
+        [OP_NOT] = &&L_OP_NOT,
+        [OP_ADD] = &&L_OP_ADD,
+        [OP_SUB] = &&L_OP_SUB,
+        [OP_MUL] = &&L_OP_MUL,
+        [OP_DIV] = &&L_OP_DIV,
+        [OP_MOD] = &&L_OP_MOD,
+        [OP_EQ] = &&L_OP_EQ,
+        [OP_NE] = &&L_OP_NE,
+        [OP_LT] = &&L_OP_LT,
+        [OP_GT] = &&L_OP_GT,
+        [OP_LE] = &&L_OP_LE,
+        [OP_GE] = &&L_OP_GE,
+        [OP_BOOL] = &&L_OP_BOOL,
+        [OP_SAVE] = &&L_OP_SAVE,
+        [OP_BOUNDS] = &&L_OP_BOUNDS,
+        [OP_JUMP] = &&L_OP_JUMP,
+        [OP_JUMP_IF] = &&L_OP_JUMP_IF,
+        [OP_JUMP_UNLESS] = &&L_OP_JUMP_UNLESS,
+        [OP_AND] = &&L_OP_AND,
+        [OP_OR] = &&L_OP_OR,
+        [OP_SWITCH] = &&L_OP_SWITCH,
+        [OP_SWITCH_DENSE] = &&L_OP_SWITCH_DENSE,
+        [OP_SLOT] = &&L_OP_SLOT,
+        [OP_SLOT_INDEX] = &&L_OP_SLOT_INDEX,
+        [OP_SLOT_ELEMENT] = &&L_OP_SLOT_ELEMENT,
+        [OP_STORE] = &&L_OP_STORE,
+        [OP_PRINT] = &&L_OP_PRINT,
+        [OP_COUNT] = &&L_OP_COUNT,
+        [OP_COUNT_CONST] = &&L_OP_COUNT_CONST,
+        [OP_LAZY] = &&L_OP_LAZY,
+    };
+
+    NEXT;
+    #else
+    #define CASE(op) case op
+    #define NEXT continue
+
+    for (;;) switch (pc->op) {
+    #endif
+
+    CASE(OP_CONST):
+        *sp++ = pc++->arg;
+        NEXT;
+
+    CASE(OP_VAR):
+        *sp++ = eval_var(pc++->arg);
+        NEXT;
+
+    CASE(OP_TEMP):
+        *sp++ = varstore.temps[pc++->arg];
+        NEXT;
+
+    CASE(OP_INDEX):
+        sp[-1] = index_value(pc++->arg, sp[-1]);
+        NEXT;
+
+    CASE(OP_ELEMENT):
+        sp[-1] = *element(pc++->arg, sp[-1]);
+        NEXT;
+
+    CASE(OP_NEG):
+        sp[-1] = -sp[-1];
+        ++pc;
+        NEXT;
+
+    CASE(OP_NOT):
+        sp[-1] = !sp[-1];
+        ++pc;
+        NEXT;
+
+    #define BINOP(op, expr) \
+        CASE(op): \
+            --sp; \
+            sp[-1] = (expr); \
+            ++pc; \
+            NEXT;
+
+    BINOP(OP_ADD, sp[-1] + sp[0])
+    BINOP(OP_SUB, sp[-1] - sp[0])
+    BINOP(OP_MUL, sp[-1] * sp[0])
+    BINOP(OP_DIV, apply_binop(TK_DIVI, sp[-1], sp[0]))
+    BINOP(OP_MOD, sp[-1] % sp[0])
+    BINOP(OP_EQ, sp[-1] == sp[0])
+    BINOP(OP_NE, sp[-1] != sp[0])
+    BINOP(OP_LT, sp[-1] < sp[0])
+    BINOP(OP_GT, sp[-1] > sp[0])
+    BINOP(OP_LE, sp[-1] <= sp[0])
+    BINOP(OP_GE, sp[-1] >= sp[0])
+    #undef BINOP
+
+    CASE(OP_BOOL):
+        sp[-1] = !!sp[-1];
+        ++pc;
+        NEXT;
+
+    CASE(OP_SAVE):
+        varstore.temps[pc++->arg] = sp[-1];
+        NEXT;
+
+    CASE(OP_BOUNDS):
+        --sp;
+        sp[-1] = bounds_hold(pc++->arg, sp[-1], sp[0]);
+        NEXT;
+
+    CASE(OP_JUMP):
+        pc = insns + pc->arg;
+        NEXT;
+
+    CASE(OP_JUMP_IF):
+        pc = *--sp ? insns + pc->arg : pc + 1;
+        NEXT;
+
+    CASE(OP_JUMP_UNLESS):
+        pc = *--sp ? pc + 1 : insns + pc->arg;
+        NEXT;
+
+    CASE(OP_AND):
+        pc = sp[-1] ? (--sp, pc + 1) : insns + pc->arg;
+        NEXT;
+
+    CASE(OP_OR):
+        pc = sp[-1] ? (sp[-1] = 1, insns + pc->arg) : (--sp, pc + 1);
+        NEXT;
+
+    CASE(OP_SWITCH): {
+        /* a binary search of the table for the first constant not below */
+        const int key = *--sp;
+        const struct insn *low = pc + 1, *high = pc + 1 + pc->arg;
+
+        while (low < high) {
+            const struct insn *const middle = low + (high - low) / 2;
+
+            if ((int) middle->op < key) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+
+        const struct insn *const last = pc + 1 + pc->arg;
+        pc = insns + (low < last && (int) low->op == key ? low : last)->arg;
+    } NEXT;
+
+    CASE(OP_SWITCH_DENSE): {
+        const uint32_t offset = (uint32_t) *--sp - pc[1].op;
+        pc = insns + pc[1 + (offset < pc->arg ? offset : pc->arg)].arg;
+    } NEXT;
+
+    CASE(OP_SLOT):
+        slot = find_slot(slot_var = pc->arg, 0, &created);
+        pc = slot ? pc + 2 : insns + pc[1].arg;
+        NEXT;
+
+    CASE(OP_SLOT_INDEX):
+        slot = find_slot(slot_var = pc->arg, *--sp, &created);
+        pc = slot ? pc + 2 : insns + pc[1].arg;
+        NEXT;
+
+    CASE(OP_SLOT_ELEMENT):
+        slot = element(slot_var = pc++->arg, *--sp);
+        created = false;
+        NEXT;
+
+    CASE(OP_STORE):
+        *slot = *--sp;
+
+        if (created) {
+            varstore.vars[slot_var].defined = true;
+        }
+
+        ++pc;
+        NEXT;
+
+    CASE(OP_PRINT):
+        print_value(&nodes[pc++->arg], *--sp);
+        NEXT;
+
+    /* the counter is defined, and so is a variable that bounds it */
+    #define COUNT(name, bound) \
+        CASE(name): { \
+            const int counter = step_counter(pc->arg, pc[1].op); \
+            const int limit = (bound); \
+            \
+            pc = (pc[2].op == OP_LT ? counter < limit : counter <= limit) ? \
+                insns + pc[1].arg : pc + 3; \
+        } NEXT;
+
+    COUNT(OP_COUNT, varstore.vars[pc[2].arg].first)
+    COUNT(OP_COUNT_CONST, (int) pc[2].arg)
+    #undef COUNT
+
+    CASE(OP_LAZY): {
+        /* the block is compiled where the code ends, and jumped to instead */
+        const uint32_t at = pc - insns;
+        const int lower_error = lower_lazy(ast, pc->arg);
+        uint32_t start;
+
+        if (lower_error) {
+            error = lower_error == LOWER_NOMEM ? RUN_NOMEM : RUN_TOO_DEEP;
+            goto out;
+        }
 
-    case NT_Pexp:
-        return eval_pexp(expr->children[0]);
+        nodes = ast->nodes;
 
-    case NT_Bexp:
-        return eval_bexp(expr->children[0]);
+        if (reserve_vars(ast->nvars) ||
+            compile_block(ast, pc->arg, at + 1, code, &start)) {
 
-    case NT_Uexp:
-        return eval_uexp(expr->children[0]);
+            error = RUN_NOMEM;
+            goto out;
+        }
+
+        /* no statement leaves anything on the stack */
+        if (ast->depth > nvalues) {
+            int *const tmp = realloc(stack, ast->depth * sizeof(int));
+
+            if (!tmp) {
+                error = RUN_NOMEM;
+                goto out;
+            }
 
-    case NT_Texp:
-        return eval_texp(expr->children[0]);
+            sp = stack = tmp;
+            nvalues = ast->depth;
+        }
+
+        insns = code->insns;
+        code->insns[at] = (struct insn) { .op = OP_JUMP, .arg = start };
+        pc = insns + start;
+    } NEXT;
 
-    case NT_Aexp:
-        return eval_aexp(expr->children[0]);
+    CASE(OP_HALT):
+        goto out;
 
+    #ifndef VM_THREADED
     default:
         abort();
     }
+    #endif
+
+    #undef CASE
+    #undef NEXT
+
+    out:
+    free(stack);
+    return error;
 }
 
-static int eval_pexp(const struct node *const pexp)
+int run_code(struct ast *const ast, struct code *const code)
 {
-    return eval_expr(pexp->children[1]);
+    nodes = ast->nodes;
+    input = ast->input;
+
+    if (reserve_vars(ast->nvars) || reserve_temps(ast->ntemps)) {
+        return free_varstore(), RUN_NOMEM;
+    }
+
+    const int error = execute_code(ast, code);
+    free_varstore();
+    return error;
 }
 
-static int eval_bexp(const struct node *const bexp)
+/* what the machine code calls to print and divide, as the interpreter does */
+static void print_node(const uint32_t prnt, const int value)
 {
-    switch (bexp->children[1]->token->tk) {
-    case TK_PLUS:
-        return eval_expr(bexp->children[0]) + eval_expr(bexp->children[2]);
-
-    case TK_MINS:
-        return eval_expr(bexp->children[0]) - eval_expr(bexp->children[2]);
+    print_value(&nodes[prnt], value);
+}
 
-    case TK_MULT:
-        return eval_expr(bexp->children[0]) * eval_expr(bexp->children[2]);
+static int divide(const int left, const int right)
+{
+    return apply_binop(TK_DIVI, left, right);
+}
 
-    case TK_DIVI: {
-        const int dividend = eval_expr(bexp->children[0]);
-        const int divisor = eval_expr(bexp->children[2]);
+int run_jit(struct ast *const ast, const struct code *const code)
+{
+    nodes = ast->nodes;
+    input = ast->input;
 
-        if (divisor) {
-            return dividend / divisor;
-        } else {
-            fprintf(stderr, "warn: prevented attempt to divide by zero\n");
-            return 0;
-        }
+    if (reserve_vars(ast->nvars) || reserve_temps(ast->ntemps)) {
+        return free_varstore(), RUN_NOMEM;
     }
 
-    case TK_MODU:
-        return eval_expr(bexp->children[0]) % eval_expr(bexp->children[2]);
-
-    case TK_EQUL:
-        return eval_expr(bexp->children[0]) == eval_expr(bexp->children[2]);
+    const struct jit_env env = {
+        .vars = varstore.vars,
+        .var_size = sizeof(struct var),
+        .defined_offset = offsetof(struct var, defined),
+        .first_offset = offsetof(struct var, first),
+        .array_size_offset = offsetof(struct var, array_size),
+        .values_offset = offsetof(struct var, values),
+        .temps = varstore.temps,
+        .eval_var = eval_var,
+        .index_value = index_value,
+        .find_slot = find_slot,
+        .bounds = bounds_hold,
+        .count = step_counter,
+        .divide = divide,
+        .print = print_node,
+    };
+
+    _Static_assert(sizeof(((struct var *) 0)->defined) == 1 &&
+        sizeof(((struct var *) 0)->array_size) == 8,
+        "the machine code compares a byte and a quadword");
+
+    struct jit jit;
+    int *const values = malloc(ast->depth * sizeof(int));
+    const int jit_error = values ? jit_compile(code, &env, &jit) : JIT_NOMEM;
+
+    if (!jit_error) {
+        jit.entry(values);
+        jit_free(&jit);
+    }
 
-    case TK_NEQL:
-        return eval_expr(bexp->children[0]) != eval_expr(bexp->children[2]);
+    free(values);
+    free_varstore();
 
-    case TK_LTHN:
-        return eval_expr(bexp->children[0]) < eval_expr(bexp->children[2]);
+    return jit_error == JIT_UNSUPPORTED ? RUN_UNSUPPORTED :
+        jit_error == JIT_NOMEM ? RUN_NOMEM : RUN_OK;
+}
 
-    case TK_GTHN:
-        return eval_expr(bexp->children[0]) > eval_expr(bexp->children[2]);
+/*
+    The interpreter as it was before it kept frames of its own, which recurses
+    for every nested node. It is kept to compare against, and only built into
+    the bench.
+*/
+#ifdef RUN_RECURSIVE
+static void run_block(uint32_t);
+static int eval_expr(uint32_t);
 
-    case TK_LTEQ:
-        return eval_expr(bexp->children[0]) <= eval_expr(bexp->children[2]);
+static void run_assn(const struct ast_node *const assn)
+{
+    const struct ast_node *const target = &nodes[assn->a];
+    const int lhs_is_index = target->kind == AST_INDEX;
+    const int array_idx = lhs_is_index ? eval_expr(target->c) : 0;
 
-    case TK_GTEQ:
-        return eval_expr(bexp->children[0]) >= eval_expr(bexp->children[2]);
+    bool created;
+    int *const slot = find_slot(target->a, array_idx, &created);
 
-    case TK_CONJ:
-        return eval_expr(bexp->children[0]) && eval_expr(bexp->children[2]);
+    if (slot) {
+        *slot = eval_expr(assn->b);
+        varstore.vars[target->a].defined |= created;
+    }
+}
 
-    case TK_DISJ:
-        return eval_expr(bexp->children[0]) || eval_expr(bexp->children[2]);
+static void run_cond(const struct ast_node *cond)
+{
+    for (;;) {
+        if (eval_expr(cond->a)) {
+            run_block(cond->b);
+            return;
+        } else if (!cond->c) {
+            return;
+        } else if (nodes[cond->c].kind == AST_BLOCK) {
+            run_block(cond->c);
+            return;
+        }
 
-    default:
-        abort();
+        cond = &nodes[cond->c];
     }
 }
 
-static int eval_uexp(const struct node *const uexp)
+static void run_block(const uint32_t block)
 {
-    switch (uexp->children[0]->token->tk) {
-    case TK_PLUS:
-        return eval_expr(uexp->children[1]);
+    const struct ast_node *stmt = &nodes[nodes[block].a];
+    const struct ast_node *const end = stmt + nodes[block].b;
 
-    case TK_MINS:
-        return -eval_expr(uexp->children[1]);
+    for (; stmt != end; ++stmt) {
+        switch (stmt->kind) {
+        case AST_ASSIGN:
+            run_assn(stmt);
+            break;
 
-    case TK_NEGA:
-        return !eval_expr(uexp->children[1]);
+        case AST_PRINT:
+            print_value(stmt, eval_expr(stmt->a));
+            break;
 
-    default:
-        abort();
+        case AST_IF:
+            run_cond(stmt);
+            break;
+
+        case AST_SWITCH: {
+            const uint32_t arm = nodes[stmt->b +
+                switch_case(nodes, stmt, eval_expr(stmt->a))].b;
+
+            if (arm) {
+                run_block(arm);
+            }
+        } break;
+
+        case AST_WHILE:
+            /* a Count takes the place of the condition after the first trip */
+            for (uint32_t cond = stmt->a; eval_expr(cond);
+                cond = stmt->c ?: stmt->a) {
+
+                run_block(stmt->b);
+            }
+            break;
+
+        case AST_DOWHILE:
+            do {
+                run_block(stmt->a);
+            } while (eval_expr(stmt->b));
+            break;
+
+        case AST_BLOCK:
+            run_block(stmt - nodes);
+            break;
+
+        default:
+            abort();
+        }
     }
 }
 
-static int eval_texp(const struct node *const texp)
+static int eval_binop(const struct ast_node *const binop)
 {
-    return eval_expr(texp->children[0]) ?
-        eval_expr(texp->children[2]) : eval_expr(texp->children[4]);
+    /* the operands are evaluated left to right, as are their warnings */
+    if (binop->op == TK_CONJ) {
+        return save(binop, eval_expr(binop->a) && eval_expr(binop->b));
+    } else if (binop->op == TK_DISJ) {
+        return save(binop, eval_expr(binop->a) || eval_expr(binop->b));
+    }
+
+    const int left = eval_expr(binop->a);
+    const int right = eval_expr(binop->b);
+    return save(binop, apply_binop(binop->op, left, right));
 }
 
-static int eval_aexp(const struct node *const aexp)
+static int eval_expr(const uint32_t idx)
 {
-    const uint8_t *const beg = aexp->children[0]->token->beg;
-    const ptrdiff_t len = aexp->children[0]->token->end - beg;
-    const int array_idx = eval_expr(aexp->children[2]);
+    const struct ast_node *const expr = &nodes[idx];
 
-    if (array_idx < 0) {
-        return fprintf(stderr, "warn: negative array offset\n"), 0;
+    switch (expr->kind) {
+    case AST_CONST:
+        return expr->a;
+
+    case AST_VAR:
+        return eval_var(expr->a);
+
+    case AST_INDEX:
+        return index_value(expr->a, eval_expr(expr->c));
+
+    case AST_TEMP:
+        return varstore.temps[expr->a];
+
+    case AST_UNOP:
+        return save(expr, apply_unop(expr->op, eval_expr(expr->a)));
+
+    case AST_BINOP:
+        return eval_binop(expr);
+
+    case AST_TERNARY:
+        return eval_expr(expr->a) ? eval_expr(expr->b) : eval_expr(expr->c);
+
+    case AST_BOUNDS: {
+        const int first = eval_expr(expr->b);
+        return bounds_hold(idx, first, eval_expr(expr->c));
     }
 
-    for (size_t idx = 0; idx < varstore.size; ++idx) {
-        if (varstore.vars[idx].len == len &&
-            !memcmp(varstore.vars[idx].beg, beg, len)) {
+    case AST_COUNT:
+        return count_holds(expr);
 
-            if (array_idx < varstore.vars[idx].array_size) {
-                return varstore.vars[idx].values[array_idx];
-            } else {
-                return fprintf(stderr, "warn: out of bounds array access\n"), 0;
-            }
-        }
+    default:
+        abort();
+    }
+}
+
+void run_recursive(const struct ast *const ast)
+{
+    nodes = ast->nodes;
+    input = ast->input;
+
+    if (reserve_vars(ast->nvars) || reserve_temps(ast->ntemps)) {
+        perror("realloc");
+        free_varstore();
+        return;
     }
 
-    return fprintf(stderr, "warn: access to undefined array\n"), 0;
+    run_block(ast->root);
+    free_varstore();
 }
+#endif
@@ -1,5 +1,51 @@
 #pragma once
 
-struct node;
+#include <stdint.h>
 
-void run(const struct node *);
+struct ast;
+
+/*
+    Runs a lowered program, on a stack of frames that is as deep as the
+    program is nested, instead of recursing. The blocks that were left to be
+    lowered later are lowered into the program when they are first run. Loops
+    that have run a few hundred times are promoted to closures, which run the
+    rest of them.
+*/
+int run(struct ast *);
+
+/* how many loops run() promoted, and how often it ran them on the closures */
+extern struct run_stats {
+    uint32_t promoted;
+    uint64_t entered;
+} run_stats;
+
+enum {
+    RUN_OK,
+    RUN_NOMEM,
+    RUN_TOO_DEEP,
+    RUN_UNSUPPORTED,
+};
+
+#ifdef RUN_RECURSIVE
+/*
+    Runs a lowered program by recursing for every nested node. The program
+    must have been lowered as a whole, without LOWER_LAZY. Only the bench is
+    built with it.
+*/
+void run_recursive(const struct ast *);
+#endif
+
+struct code;
+
+/*
+    Runs the bytecode of a lowered program, compiled with compile_code(). The
+    blocks that were left to be lowered later are lowered and compiled into
+    the code when they are first run.
+*/
+int run_code(struct ast *, struct code *);
+
+/*
+    Translates the bytecode to machine code and runs that instead, unless
+    the program or the machine is not supported, which leaves it unrun.
+*/
+int run_jit(struct ast *, const struct code *);
@@ -0,0 +1,136 @@
+#include "trace.h"
+#include "lex.h"
+#include "parse.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+
+/*
+    The trace is formatted into one large buffer, which is written out only
+    when it fills up or when something else is about to be output, instead of
+    going through a printf for every piece of the parse stack.
+*/
+#define TRACE_BUFFER_SIZE (1024 * 1024)
+
+struct trace trace;
+
+static struct {
+    FILE *sink;
+    size_t used;
+    char data[TRACE_BUFFER_SIZE];
+} buffer;
+
+int trace_open(const int level, FILE *const sink, const size_t ring_size)
+{
+    trace_flush();
+    trace.level = level;
+    buffer.sink = sink;
+
+    free(trace.events);
+    trace.events = NULL;
+    trace.size = trace.count = 0;
+
+    if (ring_size) {
+        if (!(trace.events = malloc(ring_size * sizeof(struct trace_event)))) {
+            return -1;
+        }
+
+        trace.size = ring_size;
+    }
+
+    return 0;
+}
+
+void trace_close(void)
+{
+    trace_flush();
+    free(trace.events);
+    trace.events = NULL;
+    trace.size = trace.count = 0;
+}
+
+void trace_flush(void)
+{
+    FILE *const sink = buffer.sink ?: stdout;
+
+    if (buffer.used) {
+        fwrite(buffer.data, 1, buffer.used, sink);
+        buffer.used = 0;
+    }
+
+    fflush(sink);
+}
+
+void trace_printf(const char *const fmt, ...)
+{
+    va_list args;
+
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        const size_t left = TRACE_BUFFER_SIZE - buffer.used;
+
+        va_start(args, fmt);
+        const int len = vsnprintf(&buffer.data[buffer.used], left, fmt, args);
+        va_end(args);
+
+        if (len < 0) {
+            return;
+        } else if ((size_t) len < left) {
+            buffer.used += len;
+            return;
+        }
+
+        trace_flush();
+    }
+
+    /* does not fit even into an empty buffer */
+    va_start(args, fmt);
+    vfprintf(buffer.sink ?: stdout, fmt, args);
+    va_end(args);
+}
+
+void trace_dump(const uint8_t *const input)
+{
+    const uint64_t first = trace.count > trace.size ?
+        trace.count - trace.size : 0;
+
+    trace_printf(WHITE("Last %llu parser events:") "\n",
+        (unsigned long long) (trace.count - first));
+
+    for (uint64_t idx = first; idx < trace.count; ++idx) {
+        const struct trace_event *const event =
+            &trace.events[idx % trace.size];
+
+        const int len = event->len;
+        const char *const text = (const char *) input + event->offset;
+
+        switch (event->kind) {
+        case TRACE_SHIFT:
+        case TRACE_REJECT: {
+            const char *const what = event->kind == TRACE_SHIFT ?
+                CYAN("  shift  ") : RED("  reject ");
+
+            if (event->symbol == TK_FBEG) {
+                trace_printf("%s^", what);
+            } else if (event->symbol == TK_FEND) {
+                trace_printf("%s$", what);
+            } else if (event->symbol == TK_COUNT) {
+                trace_printf("%s(end of input)", what);
+            } else {
+                trace_printf("%s%.*s" GRAY(" at byte %u"),
+                    what, len, text, event->offset);
+            }
+        } break;
+
+        case TRACE_REDUCE:
+            trace_printf(ORANGE("  Red%02u  ") "%s",
+                event->rule, nt_names[event->symbol]);
+            break;
+
+        case TRACE_ACCEPT:
+            trace_printf(GREEN("  accept"));
+            break;
+        }
+
+        trace_printf(GRAY(", depth %u") "\n", event->depth);
+    }
+}
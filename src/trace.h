@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* each level includes the output of the levels before it */
+enum {
+    TRACE_OFF,      /* errors and the output of the program only */
+    TRACE_PHASES,   /* a header for each phase */
+    TRACE_TOKENS,   /* the lexed tokens, including comments and whitespace */
+    TRACE_FULL,     /* the parse stack after every shift and reduction */
+};
+
+/* the parser events which are kept in the ring buffer */
+enum {
+    TRACE_SHIFT,
+    TRACE_REDUCE,
+    TRACE_ACCEPT,
+    TRACE_REJECT,
+};
+
+struct trace_event {
+    uint8_t kind;
+
+    /* the token shifted or ahead, or the left-hand side of the reduction */
+    uint8_t symbol;
+
+    /* the number of the grammar rule of a reduction */
+    uint16_t rule;
+
+    /* the token shifted or ahead, as an offset into the input */
+    uint32_t offset, len;
+
+    /* the size of the parse stack after the event */
+    uint32_t depth;
+};
+
+extern struct trace {
+    int level;
+
+    /* the last "size" parser events, or NULL if they are not kept */
+    struct trace_event *events;
+    size_t size;
+    uint64_t count;
+} trace;
+
+/*
+    Sets the trace level and the stream that the trace is written to, and
+    allocates a ring buffer for the given number of parser events (none if 0).
+    Returns 0 on success, and -1 if the ring buffer could not be allocated.
+*/
+int trace_open(int level, FILE *sink, size_t ring_size);
+
+/* flushes the trace and frees the ring buffer */
+void trace_close(void);
+
+/* appends to the trace buffer, regardless of the trace level */
+void trace_printf(const char *, ...) __attribute__((format(printf, 1, 2)));
+
+/* writes out the trace buffer, to be called before anything else is output */
+void trace_flush(void);
+
+/* writes out the parser events in the ring buffer, oldest first */
+void trace_dump(const uint8_t *input);
+
+static inline void trace_event(const uint8_t kind, const uint8_t symbol,
+    const uint16_t rule, const uint32_t offset, const uint32_t len,
+    const uint32_t depth)
+{
+    if (trace.events) {
+        trace.events[trace.count++ % trace.size] = (struct trace_event) {
+            .kind = kind,
+            .symbol = symbol,
+            .rule = rule,
+            .offset = offset,
+            .len = len,
+            .depth = depth,
+        };
+    }
+}
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Checks that every program in tests/, written as C with --emit-c and built
+# with cc -O2, prints the same output and warnings, and exits the same way,
+# as the interpreter does. Run from the top of the tree, after make.
+
+INTERP=${INTERP:-./interp}
+CC=${CC:-cc}
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+
+failed=0
+
+for program in tests/*.txt; do
+    name=$(basename "$program" .txt)
+
+    "$INTERP" "$program" > "$TMP/interp.out" 2> "$TMP/interp.err"
+    interp_status=$?
+
+    if ! "$INTERP" --emit-c "$program" > "$TMP/$name.c"; then
+        echo "FAIL $name: --emit-c failed"
+        failed=1
+        continue
+    fi
+
+    if ! "$CC" -O2 -w -o "$TMP/$name" "$TMP/$name.c"; then
+        echo "FAIL $name: the emitted C does not build"
+        failed=1
+        continue
+    fi
+
+    "$TMP/$name" > "$TMP/emit.out" 2> "$TMP/emit.err"
+    emit_status=$?
+
+    if [ "$interp_status" != "$emit_status" ]; then
+        echo "FAIL $name: exit status $emit_status, expected $interp_status"
+        failed=1
+    elif ! cmp -s "$TMP/interp.out" "$TMP/emit.out"; then
+        echo "FAIL $name: standard output differs"
+        failed=1
+    elif ! cmp -s "$TMP/interp.err" "$TMP/emit.err"; then
+        echo "FAIL $name: standard error differs"
+        failed=1
+    else
+        echo "ok   $name"
+    fi
+done
+
+exit $failed
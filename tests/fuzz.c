@@ -0,0 +1,395 @@
+/*
+    Writes a random program to standard output, the same one for the same
+    seed, for tests/optimize.sh to run with and without the optimizer. The
+    programs are made of what the optimizer looks for: constant operands,
+    operators that are computed again, loops that step counters and index
+    arrays at them, and chains of elifs that compare one value to constants.
+
+    The elements that an array grows by are left as they were in memory, so
+    a program never reads one that it has not stored: p and q are filled up
+    front and only ever stored into below their size, r is only read, and g
+    is only stored into, however far.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/* nesting of statements, and of the operators of an expression */
+#define MAX_DEPTH 3
+#define MAX_EXPR_DEPTH 3
+
+static uint64_t state;
+
+/* xorshift64*, so that a seed makes the same program everywhere */
+static uint32_t next(void)
+{
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return (state * 0x2545f4914f6cdd1dull) >> 32;
+}
+
+static uint32_t below(const uint32_t bound)
+{
+    return next() % bound;
+}
+
+/* a percentage */
+static int chance(const uint32_t percent)
+{
+    return below(100) < percent;
+}
+
+#define PICK(array) (array)[below(sizeof(array) / sizeof(*(array)))]
+
+static const char *const constants[] = {
+    "0", "1", "2", "3", "5", "7", "-1", "-2", "2147483647",
+};
+
+/* scalars that the statements assign, and bounds that only loops step */
+static const char *const scalars[] = { "a", "b", "c", "x", "y" };
+static const char *const bounds[] = { "n", "m" };
+static const char *const arrays[] = { "p", "q", "r" };
+static const char *const stores[] = { "p", "q", "g" };
+
+/* what p and q are filled up to, past any counter that is not wide */
+#define FILLED 200
+
+static const char *const offsets[] = { "0", "1", "2", "3", "5", "12" };
+
+static const char *const binops[] = {
+    "+", "-", "*", "/", "%", "==", "!=", "<", ">", "<=", ">=", "&&", "||",
+};
+
+/*
+    The counters of the loops that the statement is in, innermost last, and
+    whether they get close to the largest int.
+*/
+static const char *counters[MAX_DEPTH + 1];
+static int wide[MAX_DEPTH + 1];
+static int ncounters;
+
+static void expr(int depth);
+
+/*
+    An index, most often at the innermost counter, and below FILLED unless
+    it may be far.
+*/
+static void index_at(const int far)
+{
+    const char *const counter = ncounters &&
+        (far || !wide[ncounters - 1]) ? counters[ncounters - 1] : NULL;
+    const uint32_t kind = below(counter ? far ? 10 : 9 : 2);
+
+    switch (kind) {
+    case 0:
+        fputs(PICK(offsets), stdout);
+        break;
+
+    case 1:
+        printf("%s %% 4", PICK(scalars));
+        break;
+
+    case 2:
+    case 3:
+    case 4:
+        fputs(counter, stdout);
+        break;
+
+    case 5:
+        printf("%s + %u", counter, below(4));
+        break;
+
+    case 6:
+        printf("%s - %u", counter, 1 + below(3));
+        break;
+
+    case 7:
+        printf("%u + %s", 1 + below(2), counter);
+        break;
+
+    case 8:
+        printf("%s * 2", counter);
+        break;
+
+    default:
+        printf("%s + 70000", counter);
+        break;
+    }
+}
+
+static void leaf(void)
+{
+    const uint32_t kind = below(10);
+
+    if (kind < 3) {
+        fputs(PICK(constants), stdout);
+    } else if (kind < 6 || (kind < 8 && !ncounters)) {
+        fputs(PICK(scalars), stdout);
+    } else if (kind < 8) {
+        fputs(counters[below(ncounters)], stdout);
+    } else if (kind < 9) {
+        fputs(PICK(bounds), stdout);
+    } else {
+        printf("%s[", PICK(arrays));
+        index_at(1);
+        putchar(']');
+    }
+}
+
+static void expr(const int depth)
+{
+    const uint32_t kind = below(20);
+
+    if (depth >= MAX_EXPR_DEPTH || kind < 7) {
+        leaf();
+    } else if (kind < 9) {
+        fputs(below(2) ? "-(" : "!(", stdout);
+        expr(depth + 1);
+        putchar(')');
+    } else if (kind < 10) {
+        putchar('(');
+        expr(depth + 1);
+        fputs(" ? ", stdout);
+        expr(depth + 1);
+        fputs(" : ", stdout);
+        expr(depth + 1);
+        putchar(')');
+    } else {
+        const char *const op = PICK(binops);
+        putchar('(');
+        expr(depth + 1);
+        printf(" %s ", op);
+
+        /*
+            Mostly constant divisors, which can be folded or multiplied. A
+            remainder by zero traps, which would cut the program short, so
+            it is rare.
+        */
+        if (*op == '/' && chance(70)) {
+            static const char *const divisors[] = {
+                "3", "5", "7", "-1", "0", "16",
+            };
+
+            fputs(PICK(divisors), stdout);
+        } else if (*op == '%' && !chance(2)) {
+            static const char *const divisors[] = {
+                "3", "5", "7", "-1", "16", "-6",
+            };
+
+            fputs(PICK(divisors), stdout);
+        } else {
+            expr(depth + 1);
+        }
+
+        putchar(')');
+    }
+}
+
+static void indent(const int depth)
+{
+    printf("%*s", depth * 4, "");
+}
+
+static void block(int depth, int size);
+
+/* an if with elifs that compare one value to constants, like a switch */
+static void chain(const int depth)
+{
+    const char *const value = ncounters && chance(30) ?
+        counters[ncounters - 1] : PICK(scalars);
+    const int arms = 2 + below(5);
+    int constant = below(3) - 1;
+
+    for (int arm = 0; arm < arms; ++arm) {
+        printf("%s (%s == %d) {\n", arm ? " elif" : "if", value, constant);
+        block(depth + 1, 1 + below(2));
+        indent(depth);
+        putchar('}');
+
+        /* close together most of the time, for a table */
+        constant += chance(80) ? 1 + below(2) : 50 + below(1000);
+    }
+
+    if (chance(60)) {
+        puts(" else {");
+        block(depth + 1, 1 + below(2));
+        indent(depth);
+        putchar('}');
+    }
+
+    putchar('\n');
+}
+
+/*
+    A loop that steps a counter up by a constant, for as long as it is below
+    a bound. The step goes anywhere in the body, and the body may move the
+    bound down, or read the counter after the step.
+*/
+static void loop(const int depth)
+{
+    static const char *const names[] = { "i", "j", "k", "l" };
+    static const char *const starts[] = {
+        "0", "0", "1", "2", "-1", "-3", "x % 8", "5",
+    };
+    static const char *const limits[] = {
+        "n", "n", "m", "8", "10", "0", "-5",
+    };
+
+    const char *const counter = names[ncounters];
+    const char *const limit = PICK(limits);
+    const int step = chance(60) ? 1 : 2 + below(2);
+    const int dowhile = chance(30);
+    const int near_max = chance(5);
+    char cond[64];
+
+    switch (below(4)) {
+    case 0:
+        snprintf(cond, sizeof(cond), "%s < %s", counter, limit);
+        break;
+
+    case 1:
+        snprintf(cond, sizeof(cond), "%s <= %s", counter, limit);
+        break;
+
+    case 2:
+        snprintf(cond, sizeof(cond), "%s > %s", limit, counter);
+        break;
+
+    default:
+        snprintf(cond, sizeof(cond), "%s >= %s", limit, counter);
+        break;
+    }
+
+    /* a counter that gets close to the largest int, without wrapping */
+    if (near_max) {
+        snprintf(cond, sizeof(cond), "%s <= %d", counter, 2147483647 - step);
+    }
+
+    indent(depth);
+    printf("%s = %s;\n", counter, near_max ? "2147483630" : PICK(starts));
+    indent(depth);
+    printf(dowhile ? "do {\n" : "while (%s) {\n", cond);
+
+    wide[ncounters] = near_max;
+    counters[ncounters++] = counter;
+    const int size = 1 + below(4);
+    const int at = below(size + 1);
+
+    for (int stmt = 0; stmt <= size; ++stmt) {
+        if (stmt == at && chance(80)) {
+            indent(depth + 1);
+            printf("%s = %s + %d;\n", counter, counter, step);
+            continue;
+        } else if (stmt == at) {
+            indent(depth + 1);
+            printf("%s = %d + %s;\n", counter, step, counter);
+            continue;
+        }
+
+        block(depth + 1, 0);
+    }
+
+    if (chance(10)) {
+        const char *const bound = PICK(bounds);
+        indent(depth + 1);
+        printf("%s = %s - 1;\n", bound, bound);
+    }
+
+    --ncounters;
+    indent(depth);
+    printf(dowhile ? "} while (%s);\n" : "}\n", cond);
+}
+
+/* a single statement, or size of them */
+static void block(const int depth, const int size)
+{
+    for (int stmt = 0; stmt < (size ?: 1); ++stmt) {
+        const uint32_t kind = below(100);
+
+        if (kind < 30 || depth >= MAX_DEPTH) {
+            indent(depth);
+            printf("%s = ", PICK(scalars));
+            expr(0);
+            puts(";");
+        } else if (kind < 50) {
+            const char *const array = PICK(stores);
+            indent(depth);
+            printf("%s[", array);
+            index_at(*array == 'g');
+            fputs("] = ", stdout);
+            expr(0);
+            puts(";");
+        } else if (kind < 60) {
+            indent(depth);
+            fputs("print ", stdout);
+            expr(0);
+            puts(";");
+        } else if (kind < 70) {
+            indent(depth);
+            fputs("if (", stdout);
+            expr(0);
+            puts(") {");
+            block(depth + 1, 1 + below(3));
+            indent(depth);
+            puts("}");
+        } else if (kind < 78) {
+            indent(depth);
+            chain(depth);
+        } else if (ncounters < MAX_DEPTH) {
+            loop(depth);
+        } else {
+            indent(depth);
+            printf("y = y + %s[", PICK(arrays));
+            index_at(1);
+            puts("];");
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s SEED\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    state = strtoull(argv[1], NULL, 10) * 0x9e3779b97f4a7c15ull + 1;
+
+    /* most variables are defined, and some arrays are too */
+    for (size_t var = 0; var < sizeof(scalars) / sizeof(*scalars); ++var) {
+        if (chance(85)) {
+            printf("%s = %s;\n", scalars[var], PICK(constants));
+        }
+    }
+
+    for (size_t var = 0; var < sizeof(bounds) / sizeof(*bounds); ++var) {
+        static const char *const sizes[] = {
+            "0", "3", "5", "12", "20", "-4", "1", "30",
+        };
+
+        if (chance(85)) {
+            printf("%s = %s;\n", bounds[var], PICK(sizes));
+        }
+    }
+
+    printf("t = 0;\nwhile (t < %d) {\n    p[t] = t %% 7;\n"
+        "    q[t] = t * 3;\n    t = t + 1;\n}\n", FILLED);
+
+    if (chance(40)) {
+        puts("r[0] = 7;");
+    } else if (chance(40)) {
+        puts("r = 4;");
+    }
+
+    block(0, 4 + below(6));
+
+    for (size_t var = 0; var < sizeof(scalars) / sizeof(*scalars); ++var) {
+        printf("print \"%s: \" %s;\n", scalars[var], scalars[var]);
+    }
+
+    printf("print p[%u];\nprint q[%u];\nprint r[%u];\n", below(30),
+        below(30), below(2));
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,83 @@
+#!/bin/sh
+# Checks that the optimizer changes nothing that a program does: runs the
+# programs that tests/fuzz writes for the seeds FIRST to LAST (1 to 1000) on
+# every engine, and compares their output, warnings and exit status with
+# an unoptimized run on the VM, and then a program with loops nested 20000
+# deep. Run from the top of the tree, after make and make tests/fuzz. A
+# failing program is written again with `tests/fuzz SEED`.
+
+INTERP=${INTERP:-./interp}
+FUZZ=${FUZZ:-./tests/fuzz}
+FIRST=${1:-1}
+LAST=${2:-1000}
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+
+failed=0
+passed=0
+skipped=0
+seed=$FIRST
+
+# compares the program on every engine with an unoptimized run on the VM
+check() {
+    # the programs may loop for too long, which is only ever skipped
+    timeout 5 "$INTERP" -O0 "$1" > "$TMP/expected.out" 2> "$TMP/expected.err"
+    expected=$?
+
+    if [ "$expected" = 124 ]; then
+        return 2
+    fi
+
+    for engine in vm tree jit; do
+        timeout 5 "$INTERP" --engine=$engine "$1" > "$TMP/actual.out" \
+            2> "$TMP/actual.err"
+        actual=$?
+
+        if [ "$expected" != "$actual" ] ||
+            ! cmp -s "$TMP/expected.out" "$TMP/actual.out" ||
+            ! cmp -s "$TMP/expected.err" "$TMP/actual.err"; then
+
+            echo "FAIL $2 on $engine"
+            return 1
+        fi
+    done
+}
+
+while [ "$seed" -le "$LAST" ]; do
+    if ! "$FUZZ" "$seed" > "$TMP/program.txt"; then
+        echo "FAIL $FUZZ could not write a program"
+        exit 1
+    fi
+
+    check "$TMP/program.txt" "seed $seed"
+
+    case $? in
+    0) passed=$((passed + 1)) ;;
+    1) failed=$((failed + 1)) ;;
+    *) skipped=$((skipped + 1)) ;;
+    esac
+
+    seed=$((seed + 1))
+done
+
+# loops nested deep, which the optimizer must get through in linear time
+awk 'BEGIN {
+    print "x = 0; y = 3;"
+    for (level = 0; level < 20000; ++level) {
+        print "i = 0;\nwhile (i < 1) {\n    a[i] = y * 7 + i;"
+    }
+    print "x = x + 1;"
+    for (level = 0; level < 20000; ++level) {
+        print "    i = i + 1;\n}"
+    }
+    print "print x;"
+}' > "$TMP/deep.txt"
+
+if check "$TMP/deep.txt" "deep loops"; then
+    passed=$((passed + 1))
+else
+    failed=$((failed + 1))
+fi
+
+echo "$passed passed, $failed failed, $skipped skipped for taking too long"
+[ "$failed" = 0 ]